@@ -19,6 +19,31 @@ HIPRT_HOST_DEVICE HIPRT_INLINE float get_pixel_confidence_interval(const HIPRTRe
     return 1.96f * sqrtf(pixel_variance) / sqrtf(pixel_sample_count + 1);
 }
 
+/**
+ * Whether the adaptive sampling is done with the given pixel: it was deactivated (negative sample count) or
+ * it has more than adaptive_sampling_min_samples samples and has reached adaptive_sampling_noise_threshold
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE bool adaptive_sampling_converged(const HIPRTRenderData& render_data, int pixel_index)
+{
+    const HIPRTRenderSettings& render_settings = render_data.render_settings;
+
+    int pixel_sample_count = render_data.aux_buffers.pixel_sample_count[pixel_index];
+    if (pixel_sample_count < 0)
+        return true;
+
+    if (pixel_sample_count > render_settings.adaptive_sampling_min_samples)
+    {
+        float average_luminance;
+        float confidence_interval = get_pixel_confidence_interval(render_data, pixel_index, pixel_sample_count, average_luminance);
+
+        bool pixel_needs_sampling = confidence_interval > render_settings.adaptive_sampling_noise_threshold * average_luminance;
+
+        return !pixel_needs_sampling;
+    }
+
+    return false;
+}
+
 /**
  * stop_noise_threshold_converged is set to true if the givel pixel has reached
  * the noise threshold given in render_data.render_settings.stop_noise_threshold.
@@ -57,26 +82,14 @@ HIPRT_HOST_DEVICE HIPRT_INLINE bool adaptive_sampling(const HIPRTRenderData& ren
     }
     else
     {
-        int pixel_sample_count = aux_buffers.pixel_sample_count[pixel_index];
-        if (pixel_sample_count < 0)
-            // Pixel is deactivated
-            return false;
-
-        if (pixel_sample_count > render_settings.adaptive_sampling_min_samples)
+        if (adaptive_sampling_converged(render_data, pixel_index))
         {
-            bool pixel_needs_sampling;
-            float average_luminance;
-            float confidence_interval;
-            confidence_interval = get_pixel_confidence_interval(render_data, pixel_index, pixel_sample_count, average_luminance);
-
-            pixel_needs_sampling = confidence_interval > render_settings.adaptive_sampling_noise_threshold * average_luminance;
-            if (!pixel_needs_sampling)
-            {
-                // Indicates no need to sample anymore by setting the sample count to negative
+            // Indicates no need to sample anymore by setting the sample count to negative
+            int pixel_sample_count = aux_buffers.pixel_sample_count[pixel_index];
+            if (pixel_sample_count > 0)
                 aux_buffers.pixel_sample_count[pixel_index] = -pixel_sample_count;
 
-                return false;
-            }
+            return false;
         }
 
         return true;
@@ -66,7 +66,7 @@ HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB cook_torrance_brdf(const RendererMateria
     return brdf_color;
 }
 
-HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB cook_torrance_brdf_importance_sample(const RendererMaterial& material, const float3& view_direction, const float3& surface_normal, float3& output_direction, float& pdf, Xorshift32Generator& random_number_generator)
+HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB cook_torrance_brdf_importance_sample(const RendererMaterial& material, const float3& view_direction, const float3& surface_normal, float3& output_direction, float& pdf, Sampler& random_number_generator)
 {
     pdf = 0.0f;
 
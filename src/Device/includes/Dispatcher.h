@@ -9,12 +9,23 @@
 #include "Device/includes/Disney.h"
 #include "Device/includes/RayPayload.h"
 
+/**
+ * Result of bsdf_dispatcher_sample() for a hit whose BSDF
+ * was sampled before it was shaded (see shade_hit())
+ */
+struct BSDFSample
+{
+    ColorRGB color;
+    float3 direction = { 0.0f, 0.0f, 1.0f };
+    float pdf = 0.0f;
+};
+
 HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB bsdf_dispatcher_eval(const RendererMaterial* materials_buffer, const RendererMaterial& material, RayVolumeState& ray_volume_state, const float3& view_direction, const float3& surface_normal, const float3& to_light_direction, float& pdf)
 {
     return disney_eval(materials_buffer, material, ray_volume_state, view_direction, surface_normal, to_light_direction, pdf);
 }
 
-HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB bsdf_dispatcher_sample(const RendererMaterial* materials_buffer, const RendererMaterial& material, RayVolumeState& ray_volume_state, const float3& view_direction, const float3& surface_normal, const float3& geometric_normal, float3& bounce_direction, float& brdf_pdf, Xorshift32Generator& random_number_generator)
+HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB bsdf_dispatcher_sample(const RendererMaterial* materials_buffer, const RendererMaterial& material, RayVolumeState& ray_volume_state, const float3& view_direction, const float3& surface_normal, const float3& geometric_normal, float3& bounce_direction, float& brdf_pdf, Sampler& random_number_generator)
 {
     return disney_sample(materials_buffer, material, ray_volume_state, view_direction, surface_normal, geometric_normal, bounce_direction, brdf_pdf, random_number_generator);
 }
@@ -8,12 +8,14 @@
 
 #include "Device/includes/Dispatcher.h"
 #include "Device/includes/FixIntellisense.h"
+#include "Device/includes/Intersect.h"
 #include "Device/includes/Sampling.h"
 #include "Device/includes/Texture.h"
+#include "HostDeviceCommon/AliasTable.h"
 #include "HostDeviceCommon/Color.h"
 #include "HostDeviceCommon/HitInfo.h"
 #include "HostDeviceCommon/RenderData.h"
-#include "HostDeviceCommon/Xorshift.h"
+#include "HostDeviceCommon/Sampler.h"
 
 HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_environment_map_from_direction(const WorldSettings& world_settings, const float3& direction)
 {
@@ -27,68 +29,64 @@ HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_environment_map_from_direction(co
     return sample_environment_map_texture(world_settings, make_float2(u, 1.0f - v));
 }
 
-HIPRT_HOST_DEVICE HIPRT_INLINE void env_map_cdf_search(const WorldSettings& world_settings, float value, int& x, int& y)
+/**
+ * Probability, in solid angle measure, of sample_environment_map_alias_table() sampling the direction.
+ * 'rotated_direction' is the direction in the space of the envmap (rotated by envmap_rotation_matrix)
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE float envmap_direction_pdf(const WorldSettings& world_settings, const float3& rotated_direction)
 {
-    //First searching a line to sample
-    unsigned int lower = 0;
-    int upper = world_settings.envmap_height - 1;
-
-    int x_index = world_settings.envmap_width - 1;
-    while (lower < upper)
-    {
-        int y_index = (lower + upper) / 2;
-        int env_map_index = y_index * world_settings.envmap_width + x_index;
+    float sin_theta = sqrt(hippt::max(0.0f, 1.0f - rotated_direction.y * rotated_direction.y));
+    if (sin_theta <= 0.0f)
+        return 0.0f;
 
-        if (value < world_settings.envmap_cdf[env_map_index])
-            upper = y_index;
-        else
-            lower = y_index + 1;
-    }
-    y = hippt::max(hippt::min(lower, world_settings.envmap_height), 0u);
-
-    //Then sampling the line itself
-    lower = 0;
-    upper = world_settings.envmap_width - 1;
+    // Same mapping as sample_environment_map_from_direction()
+    float u = 0.5f + atan2(rotated_direction.z, rotated_direction.x) / (2.0f * M_PI);
+    float v = 0.5f + asin(rotated_direction.y) / M_PI;
+    int x = hippt::max(hippt::min(static_cast<int>(u * world_settings.envmap_width), static_cast<int>(world_settings.envmap_width) - 1), 0);
+    int y = hippt::max(hippt::min(static_cast<int>(v * world_settings.envmap_height), static_cast<int>(world_settings.envmap_height) - 1), 0);
 
-    int y_index = y;
-    while (lower < upper)
-    {
-        int x_index = (lower + upper) / 2;
-        int env_map_index = y_index * world_settings.envmap_width + x_index;
+    // The pixel covers 2.0f * M_PI * M_PI * sin_theta / (width * height) steradians
+    float pixel_probability = world_settings.envmap_pixel_probabilities[y * world_settings.envmap_width + x];
 
-        if (value < world_settings.envmap_cdf[env_map_index])
-            upper = x_index;
-        else
-            lower = x_index + 1;
-    }
-    x = hippt::max(hippt::min(lower, world_settings.envmap_width), 0u);
+    return pixel_probability * world_settings.envmap_width * world_settings.envmap_height / (2.0f * M_PI * M_PI * sin_theta);
 }
 
-HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_environment_map_cdf(const HIPRTRenderData& render_data, const RendererMaterial& material, HitInfo& closest_hit_info, const float3& view_direction, Xorshift32Generator& random_number_generator)
+/**
+ * Samples a direction of the envmap in O(1) with its alias tables: a row of the envmap is picked
+ * with the marginal table, a pixel of that row with the conditional table of the row and the
+ * direction uniformly in the pixel
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_environment_map_alias_table(const HIPRTRenderData& render_data, const RendererMaterial& material, HitInfo& closest_hit_info, const float3& view_direction, float selection_probability, Sampler& random_number_generator, DeferredShadowRays* deferred_shadow_rays = nullptr)
 {
     const WorldSettings& world_settings = render_data.world_settings;
+    int width = world_settings.envmap_width;
+    int height = world_settings.envmap_height;
+
+    int y = sample_alias_table(world_settings.envmap_marginal_alias_probabilities, world_settings.envmap_marginal_aliases, height, random_number_generator);
+    int x = sample_alias_table(world_settings.envmap_conditional_alias_probabilities + y * width, world_settings.envmap_conditional_aliases + y * width, width, random_number_generator);
+    float pixel_probability = world_settings.envmap_pixel_probabilities[y * width + x];
+    if (pixel_probability <= 0.0f)
+        // Black envmap
+        return ColorRGB(0.0f);
 
-    int x, y;
-    unsigned int cdf_size = world_settings.envmap_width * world_settings.envmap_height;
-    float env_map_total_sum = world_settings.envmap_cdf[cdf_size - 1];
-    env_map_cdf_search(world_settings, random_number_generator() * env_map_total_sum, x, y);
-
-    float u = (float)x / world_settings.envmap_width;
-    float v = (float)y / world_settings.envmap_height;
+    float u = (x + random_number_generator()) / width;
+    float v = (y + random_number_generator()) / height;
     float phi = u * 2.0f * M_PI;
-    // Clamping because a theta of 0.0f would mean straight up which means singularity
-    // which means not good for numerical stability
-    float theta = hippt::max(1.0e-5f, v * M_PI);
+    float theta = v * M_PI;
 
-    ColorRGB env_sample;
     float sin_theta = sin(theta);
     float cos_theta = cos(theta);
+    if (sin_theta <= 0.0f)
+        // Exactly on a pole
+        return ColorRGB(0.0f);
 
     // Convert to cartesian coordinates
     float3 sampled_direction = make_float3(-sin_theta * cos(phi), -cos_theta, -sin_theta * sin(phi));
-    // Taking envmap rotation into account
-    sampled_direction = matrix_X_vec(world_settings.envmap_rotation_matrix, sampled_direction);
+    // From the space of the envmap to world space: sample_environment_map_from_direction()
+    // goes the other way around with the rotation matrix
+    sampled_direction = matrix_transpose_X_vec(world_settings.envmap_rotation_matrix, sampled_direction);
 
+    ColorRGB env_sample;
     float cosine_term = hippt::dot(closest_hit_info.shading_normal, sampled_direction);
     if (cosine_term > 0.0f)
     {
@@ -96,88 +94,104 @@ HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_environment_map_cdf(const HIPRTRe
         shadow_ray.origin = closest_hit_info.inter_point + closest_hit_info.shading_normal * 1.0e-4f;
         shadow_ray.direction = sampled_direction;
 
-        bool in_shadow = evaluate_shadow_ray(render_data, shadow_ray, 1.0e38f);
-        if (!in_shadow)
+        if (is_light_visible_or_deferred(render_data, shadow_ray, 1.0e38f, deferred_shadow_rays))
         {
-            ColorRGB env_map_radiance;
-            float env_map_pdf;
-
-            env_map_radiance = sample_environment_map_texture(world_settings, make_float2(u, 1.0f - v));
-            env_map_pdf = luminance(env_map_radiance) / (env_map_total_sum * render_data.world_settings.envmap_intensity);
-            env_map_pdf = (env_map_pdf * world_settings.envmap_width * world_settings.envmap_height) / (2.0f * M_PI * M_PI * sin_theta);
-
-            if (env_map_pdf > 0.0f)
-            {
-                float bsdf_pdf;
-                float mis_weight;
-
-                RayVolumeState trash_state;
-                ColorRGB bsdf_color = bsdf_dispatcher_eval(render_data.buffers.materials_buffer, material, trash_state, view_direction, closest_hit_info.shading_normal, sampled_direction, bsdf_pdf);
-
-                mis_weight = power_heuristic(env_map_pdf, bsdf_pdf);
-                env_sample = bsdf_color * cosine_term * mis_weight * env_map_radiance / env_map_pdf;
-            }
-        }
-    }
-
-    float brdf_sample_pdf;
-    float3 brdf_sampled_dir;
-    RayVolumeState trash_state;
-    ColorRGB brdf_imp_sampling = bsdf_dispatcher_sample(render_data.buffers.materials_buffer, material, trash_state, view_direction, closest_hit_info.shading_normal, closest_hit_info.geometric_normal, brdf_sampled_dir, brdf_sample_pdf, random_number_generator);
+            ColorRGB env_map_radiance = sample_environment_map_texture(world_settings, make_float2(u, 1.0f - v));
+            float env_map_pdf = pixel_probability * width * height / (2.0f * M_PI * M_PI * sin_theta) * selection_probability;
 
-    cosine_term = hippt::clamp(0.0f, 1.0f, hippt::dot(closest_hit_info.shading_normal, brdf_sampled_dir));
-    ColorRGB brdf_sample;
-    if (brdf_sample_pdf != 0.0f && cosine_term > 0.0f)
-    {
-        hiprtRay shadow_ray;
-        shadow_ray.origin = closest_hit_info.inter_point + closest_hit_info.shading_normal * 1.0e-5f;
-        shadow_ray.direction = brdf_sampled_dir;
+            float bsdf_pdf;
+            RayVolumeState trash_state;
+            ColorRGB bsdf_color = bsdf_dispatcher_eval(render_data.buffers.materials_buffer, material, trash_state, view_direction, closest_hit_info.shading_normal, sampled_direction, bsdf_pdf);
 
-        bool in_shadow = evaluate_shadow_ray(render_data, shadow_ray, 1.0e38f);
-        if (!in_shadow)
-        {
-            ColorRGB skysphere_color = sample_environment_map_from_direction(world_settings, brdf_sampled_dir);
-            float theta_brdf_dir = acos(brdf_sampled_dir.z);
-            float sin_theta_bdrf_dir = sin(theta_brdf_dir);
-            float env_map_pdf = skysphere_color.luminance() / (env_map_total_sum * render_data.world_settings.envmap_intensity);
-            if (env_map_pdf > 0.0f)
-            {
-                float mis_weight;
-
-                env_map_pdf *= world_settings.envmap_width * world_settings.envmap_height;
-                env_map_pdf /= (2.0f * M_PI * M_PI * sin_theta_bdrf_dir);
-
-                mis_weight = power_heuristic(brdf_sample_pdf, env_map_pdf);
-                brdf_sample = skysphere_color * mis_weight * cosine_term * brdf_imp_sampling / brdf_sample_pdf;
-            }
+            float mis_weight = power_heuristic(env_map_pdf, bsdf_pdf);
+            env_sample = defer_light_radiance(shadow_ray, 1.0e38f, bsdf_color * cosine_term * mis_weight * env_map_radiance / env_map_pdf, deferred_shadow_rays);
         }
     }
 
-    return brdf_sample + env_sample;
+    // The BSDF sample of the MIS is the ray the path continues with: the envmap
+    // radiance it finds if it misses the scene is weighted by envmap_mis_weight()
+    return env_sample;
 }
 
-HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_environment_map(const HIPRTRenderData& render_data, const RendererMaterial& material, HitInfo& closest_hit_info, const float3& view_direction, Xorshift32Generator& random_number_generator)
+/**
+ * Whether sample_environment_map() samples the envmap at a hit with the given material
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE bool is_envmap_sampled(const HIPRTRenderData& render_data, const RendererMaterial& material)
 {
+#if EnvmapSamplingStrategy == ESS_NO_SAMPLING
+    return false;
+#else
     const WorldSettings& world_settings = render_data.world_settings;
 
     if (world_settings.ambient_light_type != AmbientLightType::ENVMAP)
         // Not using the envmap
-        return ColorRGB(0.0f);
+        return false;
 
     if (material.is_emissive())
         // We're not sampling direct lighting if we're already on an
         // emissive surface
-        return ColorRGB(0.0f);
+        return false;
 
     if (world_settings.envmap_intensity <= 0.0f)
         // No need to sample the envmap if the user has set the intensity to 0
+        return false;
+
+    return true;
+#endif
+}
+
+/**
+ * Probability that the direct lighting at a hit samples the envmap rather than the emissive
+ * triangles when both can be sampled (DLS_POWER), proportional to estimates of their power:
+ * the power of the double sided lambertian emissive triangles and, as in PBRT, the power of
+ * the envmap through a disk of the radius of the bounding sphere of the scene
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE float envmap_selection_probability(const HIPRTRenderData& render_data)
+{
+    const WorldSettings& world_settings = render_data.world_settings;
+
+    float emissive_triangles_power = 2.0f * M_PI * render_data.buffers.emissive_triangles_power_sum;
+    float envmap_power = M_PI * world_settings.scene_bounding_radius * world_settings.scene_bounding_radius * world_settings.envmap_luminance_integral * world_settings.envmap_intensity;
+    if (envmap_power + emissive_triangles_power <= 0.0f)
+        return 0.5f;
+
+    return envmap_power / (envmap_power + emissive_triangles_power);
+}
+
+/**
+ * Same deferral of the shadow rays as sample_one_light(). 'selection_probability' is the
+ * probability that the direct lighting at this hit samples the envmap
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_environment_map(const HIPRTRenderData& render_data, const RendererMaterial& material, HitInfo& closest_hit_info, const float3& view_direction, float selection_probability, Sampler& random_number_generator, DeferredShadowRays* deferred_shadow_rays = nullptr)
+{
+    if (!is_envmap_sampled(render_data, material))
         return ColorRGB(0.0f);
 
-#if EnvmapSamplingStrategy == ESS_BINARY_SEARCH
-    return sample_environment_map_cdf(render_data, material, closest_hit_info, view_direction, random_number_generator);
-#elif EnvmapSamplingStrategy == ESS_NO_SAMPLING
+#if EnvmapSamplingStrategy == ESS_ALIAS_TABLE
+    return sample_environment_map_alias_table(render_data, material, closest_hit_info, view_direction, selection_probability, random_number_generator, deferred_shadow_rays);
+#else
     return ColorRGB(0.0f);
 #endif
 }
 
+/**
+ * Weight of the envmap radiance found by a ray that missed the scene and whose previous hit was
+ * at bounce - 1, given whether the direct lighting at that previous hit sampled the envmap.
+ * Same handling of the last ray of the path as emission_mis_weight()
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE float envmap_mis_weight(const HIPRTRenderData& render_data, const float3& ray_direction, const RayMISState& mis_state, int bounce)
+{
+    bool last_ray = bounce == render_data.render_settings.nb_bounces;
+    if (!mis_state.envmap_sampled)
+        return last_ray ? 0.0f : 1.0f;
+
+    const WorldSettings& world_settings = render_data.world_settings;
+
+    // PDF of sample_environment_map_alias_table() sampling that direction
+    float env_map_pdf = envmap_direction_pdf(world_settings, matrix_X_vec(world_settings.envmap_rotation_matrix, ray_direction));
+    env_map_pdf *= mis_state.envmap_selection_probability;
+
+    return power_heuristic(mis_state.bsdf_pdf, env_map_pdf);
+}
+
 #endif
@@ -12,11 +12,39 @@
 #include "HostDeviceCommon/HitInfo.h"
 #include "HostDeviceCommon/RenderData.h"
 
+/**
+ * Brings a point / vector / normal of the given instance from object space
+ * to world space. Identity if the geometry of the scene isn't instanced
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE float3 instance_point_to_world(const HIPRTRenderData& render_data, int instance_index, const float3& point)
+{
+    if (render_data.buffers.instance_transforms == nullptr || instance_index < 0)
+        return point;
+
+    return matrix_X_point(render_data.buffers.instance_transforms[instance_index], point);
+}
+
+HIPRT_HOST_DEVICE HIPRT_INLINE float3 instance_vector_to_world(const HIPRTRenderData& render_data, int instance_index, const float3& vector)
+{
+    if (render_data.buffers.instance_transforms == nullptr || instance_index < 0)
+        return vector;
+
+    return matrix_X_vec(render_data.buffers.instance_transforms[instance_index], vector);
+}
+
+HIPRT_HOST_DEVICE HIPRT_INLINE float3 instance_normal_to_world(const HIPRTRenderData& render_data, int instance_index, const float3& normal)
+{
+    if (render_data.buffers.instance_normal_transforms == nullptr || instance_index < 0)
+        return normal;
+
+    return matrix_X_vec(render_data.buffers.instance_normal_transforms[instance_index], normal);
+}
+
 /* References:
  * 
  * [1] [Foundations of Game Engine Development: Rendering - Tangent/Bitangent calculation] http://foundationsofgameenginedev.com/#fged2
  */
-HIPRT_HOST_DEVICE HIPRT_INLINE float3 normal_mapping(const HIPRTRenderData& render_data, int normal_map_texture_index, int primitive_index, const float2& interpolated_texcoords, const float3& surface_normal)
+HIPRT_HOST_DEVICE HIPRT_INLINE float3 normal_mapping(const HIPRTRenderData& render_data, int normal_map_texture_index, int primitive_index, int instance_index, const float2& interpolated_texcoords, const float3& surface_normal)
 {
     int vertex_A_index = render_data.buffers.triangles_indices[primitive_index * 3 + 0];
     int vertex_B_index = render_data.buffers.triangles_indices[primitive_index * 3 + 1];
@@ -41,6 +69,9 @@ HIPRT_HOST_DEVICE HIPRT_INLINE float3 normal_mapping(const HIPRTRenderData& rend
 
     float3 T = (edge_P0P1 * delta_P2P0_texcoords.y - edge_P0P2 * delta_P1P0_texcoords.y) * det_inverse;
     float3 B = (edge_P0P2 * delta_P1P0_texcoords.x - edge_P0P1 * delta_P2P0_texcoords.x) * det_inverse;
+    // The vertices are in object space, the tangents follow the instance transform
+    T = instance_vector_to_world(render_data, instance_index, T);
+    B = instance_vector_to_world(render_data, instance_index, B);
 
     ColorRGB normal = sample_texture_rgb(render_data.buffers.material_textures, normal_map_texture_index, render_data.buffers.textures_dims[normal_map_texture_index], /* is_srgb */ false, interpolated_texcoords);
     // Bringing the normal in [-x, x]. x doesn't really matter since we normalize the result anyway
@@ -51,7 +82,7 @@ HIPRT_HOST_DEVICE HIPRT_INLINE float3 normal_mapping(const HIPRTRenderData& rend
     return local_to_world_frame(hippt::normalize(T), hippt::normalize(B), surface_normal, normal_tangent_space);
 }
 
-HIPRT_HOST_DEVICE HIPRT_INLINE float3 get_shading_normal(const HIPRTRenderData& render_data, const float3& geometric_normal, int primitive_index, const float2& uv, const float2& interpolated_texcoords)
+HIPRT_HOST_DEVICE HIPRT_INLINE float3 get_shading_normal(const HIPRTRenderData& render_data, const float3& geometric_normal, int primitive_index, int instance_index, const float2& uv, const float2& interpolated_texcoords)
 {
     int mat_index = render_data.buffers.material_indices[primitive_index];
     RendererMaterial& material = render_data.buffers.materials_buffer[mat_index];
@@ -61,28 +92,45 @@ HIPRT_HOST_DEVICE HIPRT_INLINE float3 get_shading_normal(const HIPRTRenderData&
     int vertex_A_index = render_data.buffers.triangles_indices[primitive_index * 3 + 0];
     if (render_data.buffers.has_vertex_normals[vertex_A_index])
         // Smooth normal available for the triangle
-        surface_normal = hippt::normalize(uv_interpolate(render_data.buffers.triangles_indices, primitive_index, render_data.buffers.vertex_normals, uv));
+        surface_normal = hippt::normalize(instance_normal_to_world(render_data, instance_index, uv_interpolate(render_data.buffers.triangles_indices, primitive_index, render_data.buffers.vertex_normals, uv)));
     else
         surface_normal = geometric_normal;
 
     // Do normal mapping if we have a normal map
     if (material.normal_map_texture_index != -1)
-        surface_normal = normal_mapping(render_data, material.normal_map_texture_index, primitive_index, interpolated_texcoords, surface_normal);
+        surface_normal = normal_mapping(render_data, material.normal_map_texture_index, primitive_index, instance_index, interpolated_texcoords, surface_normal);
 
     return surface_normal;
 }
 
 #ifndef __KERNELCC__
-#include "Renderer/BVH.h"
+#include "Renderer/TopLevelBVH.h"
+/**
+ * Filter of the CPU BVH traversal that skips the alpha-transparent hits. nullptr if
+ * there is no transparency in the scene so that the traversal doesn't pay for it
+ */
+inline BVHHitFilter make_alpha_test_filter(const HIPRTRenderData& render_data)
+{
+    if (render_data.buffers.triangle_opacities == nullptr)
+        return nullptr;
+
+    return [&render_data](int primitive_index, const float2& uv)
+    {
+        return is_hit_opaque(render_data, primitive_index, uv);
+    };
+}
+
 HIPRT_HOST_DEVICE HIPRT_INLINE hiprtHit intersect_scene_cpu(const HIPRTRenderData& render_data, const hiprtRay& ray)
 {
     hiprtHit hiprtHit;
     HitInfo closest_hit_info;
     closest_hit_info.t = -1.0f;
 
-    if (render_data.cpu_only.bvh->intersect(ray, closest_hit_info))
+    // The alpha-transparent triangles are skipped during the traversal
+    if (render_data.cpu_only.bvh->intersect(ray, closest_hit_info, make_alpha_test_filter(render_data)))
     {
         hiprtHit.primID = closest_hit_info.primitive_index;
+        hiprtHit.instanceID = closest_hit_info.instance_index;
         hiprtHit.normal = closest_hit_info.geometric_normal;
         hiprtHit.t = closest_hit_info.t;
         hiprtHit.uv = closest_hit_info.uv;
@@ -90,12 +138,40 @@ HIPRT_HOST_DEVICE HIPRT_INLINE hiprtHit intersect_scene_cpu(const HIPRTRenderDat
 
     return hiprtHit;
 }
+
+/**
+ * Same as intersect_scene_cpu() for all the rays of a packet at once (TopLevelBVH::intersect_packet()).
+ * The hit of each ray of the packet is written in 'hits'
+ */
+inline void intersect_scene_cpu_packet(const HIPRTRenderData& render_data, const RayPacket& packet, hiprtHit* hits)
+{
+    HitInfo hit_infos[BVHConstants::RAY_PACKET_SIZE];
+    unsigned int hit_mask = render_data.cpu_only.bvh->intersect_packet(packet, hit_infos, make_alpha_test_filter(render_data));
+
+    for (int ray_index = 0; ray_index < packet.count; ray_index++)
+    {
+        hits[ray_index] = hiprtHit();
+        if (!(hit_mask & (1u << ray_index)))
+            continue;
+
+        hits[ray_index].primID = hit_infos[ray_index].primitive_index;
+        hits[ray_index].instanceID = hit_infos[ray_index].instance_index;
+        hits[ray_index].normal = hit_infos[ray_index].geometric_normal;
+        hits[ray_index].t = hit_infos[ray_index].t;
+        hits[ray_index].uv = hit_infos[ray_index].uv;
+    }
+}
 #endif
 
+/**
+ * 'first_hit' (CPU only) is the closest hit of the ray if it was already found, by
+ * a packet traversal for example. The scene is then only traversed again if the ray
+ * has to go through that hit (volume boundary)
+ */
 #ifdef __KERNELCC__
 HIPRT_HOST_DEVICE HIPRT_INLINE bool trace_ray(const HIPRTRenderData& render_data, hiprtRay ray, RayPayload& ray_payload, HitInfo& hit_info)
 #else
-HIPRT_HOST_DEVICE HIPRT_INLINE bool trace_ray(const HIPRTRenderData& render_data, hiprtRay ray, RayPayload& ray_payload, HitInfo& hit_info)
+HIPRT_HOST_DEVICE HIPRT_INLINE bool trace_ray(const HIPRTRenderData& render_data, hiprtRay ray, RayPayload& ray_payload, HitInfo& hit_info, const hiprtHit* first_hit = nullptr)
 #endif
 {
     hiprtHit hit;
@@ -107,19 +183,40 @@ HIPRT_HOST_DEVICE HIPRT_INLINE bool trace_ray(const HIPRTRenderData& render_data
         hiprtGeomTraversalClosest tr(render_data.geom, ray);
         hit = tr.getNextHit();
     #else
-        hit = intersect_scene_cpu(render_data, ray);
+        if (first_hit != nullptr)
+        {
+            hit = *first_hit;
+            first_hit = nullptr;
+        }
+        else
+            hit = intersect_scene_cpu(render_data, ray);
     #endif
 
         if (!hit.hasHit())
             return false;
 
+    #ifdef __KERNELCC__
+        // The CPU traversal already skipped the alpha-transparent hits. On the
+        // GPU, the ray has to be traced again from past the transparent hit
+        skipping_intersection = !is_hit_opaque(render_data, hit.primID, hit.uv);
+        if (skipping_intersection)
+        {
+            if (ray_payload.is_inside_volume())
+                ray_payload.volume_state.distance_in_volume += hit.t;
+            ray.origin = ray.origin + ray.direction * (hit.t + 3.0e-3f);
+
+            continue;
+        }
+    #endif
+
         hit_info.inter_point = ray.origin + hit.t * ray.direction;
         hit_info.primitive_index = hit.primID;
+        hit_info.instance_index = render_data.buffers.instance_transforms == nullptr ? -1 : static_cast<int>(hit.instanceID);
         hit_info.texcoords = uv_interpolate(render_data.buffers.triangles_indices, hit_info.primitive_index, render_data.buffers.texcoords, hit.uv);
-        // hit.normal is in object space, this simple approach will not work if using
-        // multiple-levels BVH (TLAS/BLAS)
+        // The CPU TLAS already returns the normal in world space. On the GPU,
+        // hit.normal is in object space but the geometry isn't instanced
         hit_info.geometric_normal = hippt::normalize(hit.normal);
-        hit_info.shading_normal = get_shading_normal(render_data, hit_info.geometric_normal, hit_info.primitive_index, hit.uv, hit_info.texcoords);
+        hit_info.shading_normal = get_shading_normal(render_data, hit_info.geometric_normal, hit_info.primitive_index, hit_info.instance_index, hit.uv, hit_info.texcoords);
 
         hit_info.t = hit.t;
         hit_info.uv = hit.uv;
@@ -127,19 +224,10 @@ HIPRT_HOST_DEVICE HIPRT_INLINE bool trace_ray(const HIPRTRenderData& render_data
         if (ray_payload.is_inside_volume())
             ray_payload.volume_state.distance_in_volume += hit.t;
 
+        // The alpha of the base color was already taken into account by is_hit_opaque()
         float base_color_alpha;
-        int material_index;
-        
-        material_index = render_data.buffers.material_indices[hit.primID];
+        int material_index = render_data.buffers.material_indices[hit.primID];
         ray_payload.material = get_intersection_material(render_data, material_index, hit_info.texcoords, base_color_alpha);
-        skipping_intersection = base_color_alpha < 1.0f;
-        if (skipping_intersection)
-        {
-            // Skipping the intersection now and not doing the volume stack handling
-            ray.origin = hit_info.inter_point + ray.direction * 3.0e-3f;
-
-            continue;
-        }
 
         if (!ray_payload.is_inside_volume() || ray_payload.material.specular_transmission == 0.0f)
         {
@@ -178,7 +266,7 @@ HIPRT_HOST_DEVICE HIPRT_INLINE bool evaluate_shadow_ray(const HIPRTRenderData& r
     ray.maxT = t_max - 1.0e-4f;
 
     hiprtHit shadow_ray_hit;
-    float alpha;
+    bool opaque_hit;
 
     do
     {
@@ -187,43 +275,132 @@ HIPRT_HOST_DEVICE HIPRT_INLINE bool evaluate_shadow_ray(const HIPRTRenderData& r
         if (!shadow_ray_hit.hasHit())
             return false;
 
-        alpha = get_hit_base_color_alpha(render_data, shadow_ray_hit);
+        opaque_hit = is_hit_opaque(render_data, shadow_ray_hit.primID, shadow_ray_hit.uv);
 
         float3 inter_point = ray.origin + ray.direction * shadow_ray_hit.t;
         ray.origin = inter_point + ray.direction * 3.0e-3f;
         ray.maxT -= shadow_ray_hit.t;
-    } while (alpha < 1.0f);
+    } while (!opaque_hit);
 
     // If we're here, this means that we found a hit that is not
     // alpha-transparent with a distance < t_max so that's a hit and we're shadowed.
     return true;
 #else
-    float alpha = 1.0f;
-    // The total distance of our ray. Incremented after each hit
-    // (we may find multiple hits if we hit transparent texture
-    // and keep intersecting the scene)
-    float cumulative_t = 0.0f;
+    // Alpha-transparent surfaces are skipped by the filter during the traversal
+    // so a single any-hit query is enough, even with transparent textures
+    return render_data.cpu_only.bvh->occluded(ray, t_max - 1.0e-4f, make_alpha_test_filter(render_data));
+#endif // __KERNELCC__
+}
 
-    hiprtHit hit;
-    do
-    {
-        // We should use ray tracing fitler functions here instead of re-tracing new rays
-        hit = intersect_scene_cpu(render_data, ray);
-        if (!hit.hasHit())
-            return false;
+#ifndef __KERNELCC__
+/**
+ * Same as evaluate_shadow_ray() for all the rays of a packet at once, the t_max of the rays
+ * of the packet are the distances to their light. Returns the mask of the rays in shadow
+ */
+inline unsigned int evaluate_shadow_ray_packet(const HIPRTRenderData& render_data, RayPacket packet)
+{
+    for (int ray_index = 0; ray_index < packet.count; ray_index++)
+        packet.t_max[ray_index] -= 1.0e-4f;
 
-        alpha = get_hit_base_color_alpha(render_data, hit);
+    return render_data.cpu_only.bvh->occluded_packet(packet, make_alpha_test_filter(render_data));
+}
+#endif
 
-        float3 inter_point = ray.origin + ray.direction * hit.t;
-        ray.origin = inter_point + ray.direction * 3.0e-3f;
-        cumulative_t += hit.t;
+/**
+ * Shadow rays of the light sampling functions whose visibility test is left to the
+ * caller: the CPU wavefront path tracer traces all the shadow rays of a batch of
+ * paths in a separate pass. Each ray carries the radiance that it brings
+ * to the path if it isn't occluded
+ */
+struct DeferredShadowRays
+{
+    // The light sampling and the environment map sampling trace one shadow ray each
+    static constexpr int MAX_SHADOW_RAY_COUNT = 1;
 
-        // We keep going as long as the alpha is < 1.0f meaning that we hit texture transparency
-    } while (alpha < 1.0f && cumulative_t < t_max - 1.0e-4f);
+    hiprtRay rays[MAX_SHADOW_RAY_COUNT];
+    float t_max[MAX_SHADOW_RAY_COUNT];
+    ColorRGB radiance[MAX_SHADOW_RAY_COUNT];
+    int count = 0;
+};
 
-    // If we found a hit and that it is close enough
-    return hit.hasHit() && cumulative_t < t_max - 1.0e-4f;
-#endif // __KERNELCC__
+/**
+ * Returns true if the given shadow ray isn't occluded. Always true
+ * if the test is deferred (deferred_shadow_rays not null)
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE bool is_light_visible_or_deferred(const HIPRTRenderData& render_data, const hiprtRay& shadow_ray, float t_max, DeferredShadowRays* deferred_shadow_rays)
+{
+    if (deferred_shadow_rays != nullptr)
+        return true;
+
+    return !evaluate_shadow_ray(render_data, shadow_ray, t_max);
+}
+
+/**
+ * Returns the radiance brought by a visible light sample. If the visibility test
+ * is deferred, the shadow ray and the radiance are stored in deferred_shadow_rays
+ * instead and no radiance is returned
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB defer_light_radiance(const hiprtRay& shadow_ray, float t_max, const ColorRGB& radiance, DeferredShadowRays* deferred_shadow_rays)
+{
+    if (deferred_shadow_rays == nullptr)
+        return radiance;
+
+    if (radiance.r == 0.0f && radiance.g == 0.0f && radiance.b == 0.0f)
+        // No need to trace a shadow ray that doesn't bring anything
+        return ColorRGB(0.0f);
+
+    int ray_index = deferred_shadow_rays->count++;
+    deferred_shadow_rays->rays[ray_index] = shadow_ray;
+    deferred_shadow_rays->t_max[ray_index] = t_max;
+    deferred_shadow_rays->radiance[ray_index] = radiance;
+
+    return ColorRGB(0.0f);
 }
 
+#ifndef __KERNELCC__
+/**
+ * Gathers the deferred shadow rays of neighbouring paths to trace them in packets
+ * (evaluate_shadow_ray_packet()) on the CPU. The radiance of each shadow ray that
+ * isn't occluded is added to the color given with the ray once the packet is traced.
+ *
+ * The shadow rays towards the lights and towards the envmap should be gathered in
+ * different batches: the latter are not coherent and would break the packets of the former
+ */
+struct ShadowRayPacketBatch
+{
+    void add(const HIPRTRenderData& render_data, const DeferredShadowRays& shadow_rays, ColorRGB* visible_radiance)
+    {
+        for (int i = 0; i < shadow_rays.count; i++)
+        {
+            if (packet.count == BVHConstants::RAY_PACKET_SIZE)
+                flush(render_data);
+
+            radiances[packet.count] = shadow_rays.radiance[i];
+            visible_radiances[packet.count] = visible_radiance;
+            packet.add_ray(shadow_rays.rays[i], shadow_rays.t_max[i]);
+        }
+    }
+
+    /**
+     * Traces the rays gathered so far
+     */
+    void flush(const HIPRTRenderData& render_data)
+    {
+        if (packet.count == 0)
+            return;
+
+        unsigned int shadowed_mask = evaluate_shadow_ray_packet(render_data, packet);
+        for (int ray_index = 0; ray_index < packet.count; ray_index++)
+            if (!(shadowed_mask & (1u << ray_index)))
+                *visible_radiances[ray_index] += radiances[ray_index];
+
+        packet.count = 0;
+    }
+
+    RayPacket packet;
+    ColorRGB radiances[BVHConstants::RAY_PACKET_SIZE];
+    ColorRGB* visible_radiances[BVHConstants::RAY_PACKET_SIZE];
+};
+#endif
+
 #endif
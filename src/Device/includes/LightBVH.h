@@ -0,0 +1,223 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#ifndef DEVICE_LIGHT_BVH_H
+#define DEVICE_LIGHT_BVH_H
+
+#include "HostDeviceCommon/LightBVHNode.h"
+#include "HostDeviceCommon/RenderData.h"
+#include "HostDeviceCommon/Sampler.h"
+
+/**
+ * cos(max(0, theta_a - theta_b)) and sin(max(0, theta_a - theta_b))
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE float light_bvh_cos_sub_clamped(float sin_theta_a, float cos_theta_a, float sin_theta_b, float cos_theta_b)
+{
+    if (cos_theta_a > cos_theta_b)
+        return 1.0f;
+
+    return cos_theta_a * cos_theta_b + sin_theta_a * sin_theta_b;
+}
+
+HIPRT_HOST_DEVICE HIPRT_INLINE float light_bvh_sin_sub_clamped(float sin_theta_a, float cos_theta_a, float sin_theta_b, float cos_theta_b)
+{
+    if (cos_theta_a > cos_theta_b)
+        return 0.0f;
+
+    return sin_theta_a * cos_theta_b - cos_theta_a * sin_theta_b;
+}
+
+/**
+ * Upper bound of the light that the emissive triangles of the node may bring to the
+ * shading point, from the upper hemisphere of its normal ("Importance Sampling of Many
+ * Lights with Adaptive Tree Splitting", Conty & Kulla, 2018 and PBRT v4, 12.6.3):
+ * power of the node over the squared distance to the node, times an upper bound of the
+ * cosine at the emissive triangles and of the cosine at the shading point
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE float light_bvh_node_importance(const LightBVHNode& node, const float3& point, const float3& normal)
+{
+    float3 center_to_point = point - node.center;
+    float squared_distance_to_center = hippt::dot(center_to_point, center_to_point);
+    float distance_to_center = sqrt(squared_distance_to_center);
+    float3 to_point = distance_to_center > 0.0f ? center_to_point / distance_to_center : normal;
+    // Clamping the squared distance for the points inside or close to the node (to half the
+    // length of the diagonal of the bounds of the node, which is the radius, as in PBRT)
+    float squared_distance = hippt::max(squared_distance_to_center, node.radius);
+
+    // Angle between the axis of the cone and the direction to the shading point. The emissive
+    // triangles are double sided, the opposite cone emits towards the point too
+    float cos_theta_w = hippt::abs(hippt::dot(node.cone_axis, to_point));
+    float sin_theta_w = sqrt(hippt::max(0.0f, 1.0f - cos_theta_w * cos_theta_w));
+
+    // Angle subtended by the bounding sphere of the node as seen from the shading point
+    float cos_theta_b = -1.0f;
+    float sin_theta_b = 0.0f;
+    if (distance_to_center >= node.radius)
+    {
+        sin_theta_b = distance_to_center > 0.0f ? node.radius / distance_to_center : 0.0f;
+        cos_theta_b = sqrt(hippt::max(0.0f, 1.0f - sin_theta_b * sin_theta_b));
+    }
+
+    // Smallest angle between the normals of the emissive triangles and the directions to the shading point
+    float cos_theta_x = light_bvh_cos_sub_clamped(sin_theta_w, cos_theta_w, node.sin_theta_o, node.cos_theta_o);
+    float sin_theta_x = light_bvh_sin_sub_clamped(sin_theta_w, cos_theta_w, node.sin_theta_o, node.cos_theta_o);
+    float cos_theta_p = light_bvh_cos_sub_clamped(sin_theta_x, cos_theta_x, sin_theta_b, cos_theta_b);
+    if (cos_theta_p <= 0.0f)
+        // The emissive triangles don't emit beyond their hemisphere
+        return 0.0f;
+
+    // Smallest angle between the normal at the shading point and the directions to the node
+    float cos_theta_i = -hippt::dot(normal, to_point);
+    float sin_theta_i = sqrt(hippt::max(0.0f, 1.0f - cos_theta_i * cos_theta_i));
+    float cos_theta_i_bound = light_bvh_cos_sub_clamped(sin_theta_i, cos_theta_i, sin_theta_b, cos_theta_b);
+    if (cos_theta_i_bound <= 0.0f)
+        // The node is below the surface
+        return 0.0f;
+
+    return node.power * cos_theta_p * cos_theta_i_bound / squared_distance;
+}
+
+/**
+ * Power of the emissive triangle, used to pick one of the emissive triangles of a leaf
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE float light_bvh_emissive_power(const HIPRTRenderData& render_data, int emissive_index)
+{
+    const EmissiveTriangle& triangle = render_data.buffers.emissive_triangles[emissive_index];
+
+    return render_data.buffers.materials_buffer[triangle.material_index].emission.luminance() * triangle.area;
+}
+
+/**
+ * Picks an emissive triangle for the shading point by traversing the light BVH from the root, the
+ * children being chosen proportionally to their importance. Returns the index of the emissive
+ * triangle (in the emissive triangles buffer) or -1 if no emissive triangle can light the point.
+ *
+ * 'probability' is the probability of picking that emissive triangle
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE int light_bvh_sample(const HIPRTRenderData& render_data, const float3& point, const float3& normal, Sampler& random_number_generator, float& probability)
+{
+    probability = 0.0f;
+    if (render_data.buffers.light_bvh_nodes == nullptr)
+        return -1;
+
+    float node_probability = 1.0f;
+    int node_index = 0;
+    while (render_data.buffers.light_bvh_nodes[node_index].emissive_count == 0)
+    {
+        int first_child_index = node_index + 1;
+        int second_child_index = render_data.buffers.light_bvh_nodes[node_index].second_child_or_first_emissive;
+
+        float first_importance = light_bvh_node_importance(render_data.buffers.light_bvh_nodes[first_child_index], point, normal);
+        float second_importance = light_bvh_node_importance(render_data.buffers.light_bvh_nodes[second_child_index], point, normal);
+        float importance_sum = first_importance + second_importance;
+        if (importance_sum == 0.0f)
+            return -1;
+
+        float first_probability = first_importance / importance_sum;
+        if (random_number_generator() < first_probability)
+        {
+            node_index = first_child_index;
+            node_probability *= first_probability;
+        }
+        else
+        {
+            node_index = second_child_index;
+            node_probability *= 1.0f - first_probability;
+        }
+    }
+
+    // Picking one of the emissive triangles of the leaf proportionally to its power
+    const LightBVHNode& leaf = render_data.buffers.light_bvh_nodes[node_index];
+    int emissive_index = render_data.buffers.light_bvh_emissive_indices[leaf.second_child_or_first_emissive];
+    float emissive_power = light_bvh_emissive_power(render_data, emissive_index);
+    if (leaf.emissive_count > 1)
+    {
+        float random_power = random_number_generator() * leaf.power;
+        for (int i = 0; i < leaf.emissive_count; i++)
+        {
+            emissive_index = render_data.buffers.light_bvh_emissive_indices[leaf.second_child_or_first_emissive + i];
+            emissive_power = light_bvh_emissive_power(render_data, emissive_index);
+            random_power -= emissive_power;
+            if (random_power < 0.0f)
+                break;
+        }
+    }
+
+    probability = node_probability * emissive_power / leaf.power;
+
+    return emissive_index;
+}
+
+/**
+ * Probability of light_bvh_sample() picking the emissive triangle for the shading point
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE float light_bvh_pdf(const HIPRTRenderData& render_data, const float3& point, const float3& normal, int emissive_index)
+{
+    if (render_data.buffers.light_bvh_nodes == nullptr)
+        return 0.0f;
+
+    unsigned long long trail = render_data.buffers.light_bvh_trails[emissive_index];
+
+    float probability = 1.0f;
+    int node_index = 0;
+    int depth = 0;
+    while (render_data.buffers.light_bvh_nodes[node_index].emissive_count == 0)
+    {
+        int first_child_index = node_index + 1;
+        int second_child_index = render_data.buffers.light_bvh_nodes[node_index].second_child_or_first_emissive;
+
+        float first_importance = light_bvh_node_importance(render_data.buffers.light_bvh_nodes[first_child_index], point, normal);
+        float second_importance = light_bvh_node_importance(render_data.buffers.light_bvh_nodes[second_child_index], point, normal);
+        float importance_sum = first_importance + second_importance;
+        if (importance_sum == 0.0f)
+            return 0.0f;
+
+        if (trail & (1ull << depth))
+        {
+            node_index = second_child_index;
+            probability *= 1.0f - first_importance / importance_sum;
+        }
+        else
+        {
+            node_index = first_child_index;
+            probability *= first_importance / importance_sum;
+        }
+
+        depth++;
+    }
+
+    return probability * light_bvh_emissive_power(render_data, emissive_index) / render_data.buffers.light_bvh_nodes[node_index].power;
+}
+
+/**
+ * Index in the emissive triangles buffer of the given triangle of the scene, -1 if it
+ * isn't an emissive triangle of the light BVH. Used for the emissive triangles hit by rays
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE int light_bvh_find_emissive_index(const HIPRTRenderData& render_data, int triangle_index, int instance_index)
+{
+    if (render_data.buffers.emissive_triangles_instances == nullptr)
+        instance_index = -1;
+
+    unsigned long long key = emissive_triangle_key(triangle_index, instance_index);
+
+    // Binary search of the key
+    int low = 0;
+    int high = render_data.buffers.light_bvh_light_count - 1;
+    while (low <= high)
+    {
+        int middle = (low + high) / 2;
+        unsigned long long middle_key = render_data.buffers.light_bvh_sorted_keys[middle];
+        if (middle_key == key)
+            return render_data.buffers.light_bvh_sorted_emissive_indices[middle];
+        else if (middle_key < key)
+            low = middle + 1;
+        else
+            high = middle - 1;
+    }
+
+    return -1;
+}
+
+#endif
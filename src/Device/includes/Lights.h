@@ -10,19 +10,63 @@
 #include "Device/includes/Dispatcher.h"
 #include "Device/includes/FixIntellisense.h"
 #include "Device/includes/Intersect.h"
+#include "Device/includes/LightBVH.h"
 #include "Device/includes/Sampling.h"
 #include "HostDeviceCommon/HitInfo.h"
 #include "HostDeviceCommon/RenderData.h"
-#include "HostDeviceCommon/Xorshift.h"
+#include "HostDeviceCommon/Reservoir.h"
+#include "HostDeviceCommon/Sampler.h"
+
+/**
+ * PDF, in area measure, of sample_one_emissive_triangle() sampling a point on an emissive triangle
+ * of the given emission with ETS_POWER: the triangle is picked with a probability of its power
+ * (luminance of its emission times its area) over the power of all the emissive triangles and the
+ * point uniformly on the triangle, the area cancels out
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE float emissive_triangle_area_pdf(const HIPRTRenderData& render_data, const ColorRGB& emission)
+{
+    return emission.luminance() / render_data.buffers.emissive_triangles_power_sum;
+}
 
-HIPRT_HOST_DEVICE HIPRT_INLINE float3 sample_one_emissive_triangle(const HIPRTRenderData& render_data, Xorshift32Generator& random_number_generator, float& pdf, LightSourceInformation& light_info)
+/**
+ * PDF, in area measure, of sample_one_emissive_triangle() sampling the point of an emissive
+ * triangle hit by a ray, for the given shading point and normal
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE float emissive_triangle_hit_area_pdf(const HIPRTRenderData& render_data, const float3& shading_point, const float3& shading_normal, const HitInfo& light_hit_info)
 {
-    int random_index = random_number_generator.random_index(render_data.buffers.emissive_triangles_count);
-    int triangle_index = render_data.buffers.emissive_triangles_indices[random_index];
+#if EmissiveTriangleSamplingStrategy == ETS_LIGHT_BVH
+    int emissive_index = light_bvh_find_emissive_index(render_data, light_hit_info.primitive_index, light_hit_info.instance_index);
+    if (emissive_index == -1)
+        // Emissive triangle that cannot be sampled
+        return 0.0f;
+
+    return light_bvh_pdf(render_data, shading_point, shading_normal, emissive_index) / render_data.buffers.emissive_triangles[emissive_index].area;
+#else
+    return emissive_triangle_area_pdf(render_data, render_data.buffers.materials_buffer[render_data.buffers.material_indices[light_hit_info.primitive_index]].emission);
+#endif
+}
 
-    float3 vertex_A = render_data.buffers.vertices_positions[render_data.buffers.triangles_indices[triangle_index * 3 + 0]];
-    float3 vertex_B = render_data.buffers.vertices_positions[render_data.buffers.triangles_indices[triangle_index * 3 + 1]];
-    float3 vertex_C = render_data.buffers.vertices_positions[render_data.buffers.triangles_indices[triangle_index * 3 + 2]];
+/**
+ * Samples a point on an emissive triangle picked for the given shading point and normal (see
+ * EmissiveTriangleSamplingStrategy). 'pdf' is the probability of that point in area measure,
+ * 0 if no emissive triangle could be picked
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE float3 sample_one_emissive_triangle(const HIPRTRenderData& render_data, const float3& shading_point, const float3& shading_normal, Sampler& random_number_generator, float& pdf, LightSourceInformation& light_info)
+{
+#if EmissiveTriangleSamplingStrategy == ETS_LIGHT_BVH
+    float selection_probability;
+    int emissive_index = light_bvh_sample(render_data, shading_point, shading_normal, random_number_generator, selection_probability);
+    if (emissive_index == -1)
+    {
+        // No emissive triangle can light the shading point
+        pdf = 0.0f;
+
+        return shading_point;
+    }
+#else
+    int emissive_index = sample_alias_table(render_data.buffers.emissive_triangles_alias_probabilities, render_data.buffers.emissive_triangles_aliases, render_data.buffers.emissive_triangles_count, random_number_generator);
+#endif
+    const EmissiveTriangle& triangle = render_data.buffers.emissive_triangles[emissive_index];
 
     float rand_1 = random_number_generator();
     float rand_2 = random_number_generator();
@@ -31,53 +75,33 @@ HIPRT_HOST_DEVICE HIPRT_INLINE float3 sample_one_emissive_triangle(const HIPRTRe
     float u = 1.0f - sqrt_r1;
     float v = (1.0f - rand_2) * sqrt_r1;
 
-    float3 AB = vertex_B - vertex_A;
-    float3 AC = vertex_C - vertex_A;
-
-    float3 random_point_on_triangle = vertex_A + AB * u + AC * v;
-
-    float3 normal = hippt::cross(AB, AC);
-    float length_normal = hippt::length(normal);
-    if (length_normal <= 1.0e-6f)
-    {
-        // Can happen with very small triangles
-        pdf = 0.0f;
+    float3 random_point_on_triangle = triangle.vertex_A + triangle.edge_AB * u + triangle.edge_AC * v;
 
-        return make_float3(0, 0, 0);
-    }
+    light_info.emissive_triangle_index = render_data.buffers.emissive_triangles_indices[emissive_index];
+    light_info.emissive_instance_index = render_data.buffers.emissive_triangles_instances == nullptr ? -1 : render_data.buffers.emissive_triangles_instances[emissive_index];
+    light_info.light_source_normal = triangle.normal;
+    light_info.light_area = triangle.area;
+    light_info.emission = render_data.buffers.materials_buffer[triangle.material_index].emission;
 
-
-    light_info.emissive_triangle_index = triangle_index;
-    light_info.light_source_normal = normal / length_normal; // Normalization
-    light_info.light_area = length_normal * 0.5f;
-    light_info.emission = render_data.buffers.materials_buffer[render_data.buffers.material_indices[triangle_index]].emission;
-
-    pdf = 1.0f / light_info.light_area;
+#if EmissiveTriangleSamplingStrategy == ETS_LIGHT_BVH
+    pdf = selection_probability / triangle.area;
+#else
+    pdf = emissive_triangle_area_pdf(render_data, light_info.emission);
+#endif
 
     return random_point_on_triangle;
 }
 
-HIPRT_HOST_DEVICE HIPRT_INLINE float triangle_area(const HIPRTRenderData& render_data, int triangle_index)
-{
-    float3 vertex_A = render_data.buffers.vertices_positions[render_data.buffers.triangles_indices[triangle_index * 3 + 0]];
-    float3 vertex_B = render_data.buffers.vertices_positions[render_data.buffers.triangles_indices[triangle_index * 3 + 1]];
-    float3 vertex_C = render_data.buffers.vertices_positions[render_data.buffers.triangles_indices[triangle_index * 3 + 2]];
-
-    float3 AB = vertex_B - vertex_A;
-    float3 AC = vertex_C - vertex_A;
-
-    return hippt::length(hippt::cross(AB, AC)) / 2.0f;
-}
-
-HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_one_light_no_MIS(const HIPRTRenderData& render_data, const RendererMaterial& material, const HitInfo closest_hit_info, const float3& view_direction, Xorshift32Generator& random_number_generator)
+HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_one_light_no_MIS(const HIPRTRenderData& render_data, const RendererMaterial& material, const HitInfo closest_hit_info, const float3& view_direction, float selection_probability, Sampler& random_number_generator, DeferredShadowRays* deferred_shadow_rays = nullptr)
 {
     float light_sample_pdf;
     LightSourceInformation light_source_info;
     ColorRGB light_source_radiance;
-    float3 random_light_point = sample_one_emissive_triangle(render_data, random_number_generator, light_sample_pdf, light_source_info);
+    float3 random_light_point = sample_one_emissive_triangle(render_data, closest_hit_info.inter_point, closest_hit_info.shading_normal, random_number_generator, light_sample_pdf, light_source_info);
     if (!(light_sample_pdf > 0.0f))
         // Can happen for very small triangles
         return ColorRGB(0.0f);
+    light_sample_pdf *= selection_probability;
 
     float3 shadow_ray_origin = closest_hit_info.inter_point + closest_hit_info.shading_normal * 1.0e-4f;
     float3 shadow_ray_direction = random_light_point - shadow_ray_origin;
@@ -92,14 +116,11 @@ HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_one_light_no_MIS(const HIPRTRende
     float dot_light_source = hippt::abs(hippt::dot(light_source_info.light_source_normal, -shadow_ray.direction));
     if (dot_light_source > 0.0f)
     {
-        bool in_shadow = evaluate_shadow_ray(render_data, shadow_ray, distance_to_light);
-
-        if (!in_shadow)
+        if (is_light_visible_or_deferred(render_data, shadow_ray, distance_to_light, deferred_shadow_rays))
         {
             // Conversion to solid angle from surface area measure
             light_sample_pdf *= distance_to_light * distance_to_light;
             light_sample_pdf /= dot_light_source;
-            light_sample_pdf /= render_data.buffers.emissive_triangles_count;
 
             float brdf_pdf;
             RayVolumeState trash_volume_state;
@@ -107,7 +128,7 @@ HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_one_light_no_MIS(const HIPRTRende
             if (brdf_pdf != 0.0f)
             {
                 float cosine_term = hippt::max(hippt::dot(closest_hit_info.shading_normal, shadow_ray.direction), 0.0f);
-                light_source_radiance = light_source_info.emission * cosine_term * bsdf_color / light_sample_pdf;
+                light_source_radiance = defer_light_radiance(shadow_ray, distance_to_light, light_source_info.emission * cosine_term * bsdf_color / light_sample_pdf, deferred_shadow_rays);
             }
         }
     }
@@ -115,45 +136,40 @@ HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_one_light_no_MIS(const HIPRTRende
     return light_source_radiance;
 }
 
-HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_one_light_bsdf(const HIPRTRenderData& render_data, const RendererMaterial& material, const HitInfo closest_hit_info, const float3& view_direction, Xorshift32Generator& random_number_generator)
+/**
+ * The BSDF sample that the path continues with after the current hit. The direct
+ * lighting strategies that need a BSDF sample reuse it instead of sampling and
+ * tracing a BSDF ray of their own
+ */
+struct PathContinuation
 {
-    ColorRGB bsdf_radiance;
-
-    float3 sampled_brdf_direction;
-    float direction_pdf;
-    RayVolumeState trash_volume_state;
-    ColorRGB bsdf_color = bsdf_dispatcher_sample(render_data.buffers.materials_buffer, material, trash_volume_state, view_direction, closest_hit_info.shading_normal, closest_hit_info.geometric_normal, sampled_brdf_direction, direction_pdf, random_number_generator);
-    if (direction_pdf > 0.0f)
-    {
-        hiprtRay new_ray;
-        new_ray.origin = closest_hit_info.inter_point + closest_hit_info.shading_normal * 1.0e-4f;
-        new_ray.direction = sampled_brdf_direction;
-
-        HitInfo new_ray_hit_info;
-        RayPayload bsdf_ray_payload;
-        bool inter_found = trace_ray(render_data, new_ray, bsdf_ray_payload, new_ray_hit_info);
-
-        // Checking that we did hit something and if we hit something,
-        // it needs to be the light that we're currently sampling
-        if (inter_found && bsdf_ray_payload.material.is_emissive())
-        {
-            float cosine_term = hippt::max(0.0f, hippt::dot(closest_hit_info.shading_normal, sampled_brdf_direction));
-            bsdf_radiance = bsdf_color * cosine_term * bsdf_ray_payload.material.emission / direction_pdf;
-        }
-    }
-
-    return bsdf_radiance;
-}
+    hiprtRay ray;
+    ColorRGB bsdf_color;
+    float bsdf_pdf = 0.0f;
+
+    // Set if the direct lighting traced 'ray'. Its closest hit is then in hit_info
+    // and its material and volume state in ray_payload. The volume state of
+    // ray_payload must be the one of the path when 'ray' is traced
+    bool traced = false;
+    bool hit_found = false;
+    HitInfo hit_info;
+    RayPayload ray_payload;
+};
 
-HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_one_light_MIS(const HIPRTRenderData& render_data, const RendererMaterial& material, const HitInfo closest_hit_info, const float3& view_direction, Xorshift32Generator& random_number_generator)
+/**
+ * Light sample of the MIS between the light sampling and the BSDF sampling. The BSDF sample is the
+ * ray that the path continues with, its MIS weighted emission is added at the next hit of the path
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_one_light_MIS(const HIPRTRenderData& render_data, const RendererMaterial& material, const HitInfo closest_hit_info, const float3& view_direction, float selection_probability, Sampler& random_number_generator, DeferredShadowRays* deferred_shadow_rays = nullptr)
 {
     float light_sample_pdf;
     ColorRGB light_source_radiance_mis;
     LightSourceInformation light_source_info;
-    float3 random_light_point = sample_one_emissive_triangle(render_data, random_number_generator, light_sample_pdf, light_source_info);
+    float3 random_light_point = sample_one_emissive_triangle(render_data, closest_hit_info.inter_point, closest_hit_info.shading_normal, random_number_generator, light_sample_pdf, light_source_info);
     if (light_sample_pdf <= 0.0f)
         // Can happen for very small triangles
         return ColorRGB(0.0f);
+    light_sample_pdf *= selection_probability;
 
     float3 shadow_ray_origin = closest_hit_info.inter_point + closest_hit_info.shading_normal * 1.0e-4f;
     float3 shadow_ray_direction = random_light_point - shadow_ray_origin;
@@ -168,9 +184,7 @@ HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_one_light_MIS(const HIPRTRenderDa
     float dot_light_source = hippt::abs(hippt::dot(light_source_info.light_source_normal, -shadow_ray.direction));
     if (dot_light_source > 0.0f)
     {
-        bool in_shadow = evaluate_shadow_ray(render_data, shadow_ray, distance_to_light);
-
-        if (!in_shadow)
+        if (is_light_visible_or_deferred(render_data, shadow_ray, distance_to_light, deferred_shadow_rays))
         {
             // Conversion to solid angle from surface area measure
             light_sample_pdf *= distance_to_light * distance_to_light;
@@ -184,89 +198,21 @@ HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_one_light_MIS(const HIPRTRenderDa
                 float mis_weight = power_heuristic(light_sample_pdf, bsdf_pdf);
 
                 float cosine_term = hippt::max(hippt::dot(closest_hit_info.shading_normal, shadow_ray.direction), 0.0f);
-                light_source_radiance_mis = bsdf_color * cosine_term * light_source_info.emission * mis_weight / light_sample_pdf;
+                light_source_radiance_mis = defer_light_radiance(shadow_ray, distance_to_light, bsdf_color * cosine_term * light_source_info.emission * mis_weight / light_sample_pdf, deferred_shadow_rays);
             }
         }
     }
 
-    ColorRGB bsdf_radiance_mis;
-
-    float3 sampled_brdf_direction;
-    float direction_pdf;
-    RayVolumeState trash_volume_state;
-    ColorRGB bsdf_color = bsdf_dispatcher_sample(render_data.buffers.materials_buffer, material, trash_volume_state, view_direction, closest_hit_info.shading_normal, closest_hit_info.geometric_normal, sampled_brdf_direction, direction_pdf, random_number_generator);
-    if (direction_pdf > 0)
-    {
-        hiprtRay new_ray;
-        new_ray.origin = closest_hit_info.inter_point + closest_hit_info.shading_normal * 1.0e-4f;
-        new_ray.direction = sampled_brdf_direction;
-
-        HitInfo new_ray_hit_info;
-        RayPayload trash_payload;
-        bool inter_found = trace_ray(render_data, new_ray, trash_payload, new_ray_hit_info);
-
-        // Checking that we did hit something and if we hit something,
-        // it needs to be the light that we're currently sampling
-        if (inter_found && new_ray_hit_info.primitive_index == light_source_info.emissive_triangle_index)
-        {
-            // abs() here to allow double sided emissive geometry.
-            // Without abs() here:
-            //  - We could be hitting the back of an emissive triangle 
-            //  --> triangle normal not facing the same way 
-            //  --> cos_angle negative
-            float cos_angle_light = hippt::abs(hippt::dot(new_ray_hit_info.shading_normal, -sampled_brdf_direction));
-
-            float distance_squared = new_ray_hit_info.t * new_ray_hit_info.t;
-            float light_pdf = distance_squared / (light_source_info.light_area * cos_angle_light);
-            float mis_weight = power_heuristic(direction_pdf, light_pdf);
-
-            float cosine_term = hippt::max(0.0f, hippt::dot(closest_hit_info.shading_normal, sampled_brdf_direction));
-            bsdf_radiance_mis = bsdf_color * cosine_term * light_source_info.emission * mis_weight / direction_pdf;
-        }
-    }
-
-    // Because we're sampling only 1 light out of all the lights of the
-    // scene, the probability of having chosen that light is: 1 / numberOfLights
-    // This must be factored in the PDF of sampling that light which means that we must
-    // divide by 1 / numberOfLights => multiply by numberOfLights
-    return (light_source_radiance_mis + bsdf_radiance_mis) * render_data.buffers.emissive_triangles_count;
+    // The BSDF sample of the MIS is the ray the path continues with: the emission
+    // it finds is weighted at the next hit by emission_mis_weight()
+    return light_source_radiance_mis;
 }
 
-struct ReservoirSample
-{
-    // Light sample
-    float3 point_on_light_source = { 0, 0, 0 };
-    ColorRGB emission = { 0.0f, 0.0f, 0.0f };
-};
-
-struct Reservoir
-{
-    HIPRT_HOST_DEVICE void update(ReservoirSample new_sample, float weight, Xorshift32Generator& random_number_generator)
-    {
-        M++;
-        weight_sum += weight;
-
-        if (random_number_generator() < weight / weight_sum)
-            sample = new_sample;
-    }
-
-    /*HIPRT_HOST_DEVICE float get_W()
-    {
-        return 1.0f / sample.target_function_weight * weight_sum;
-    }*/
-
-    HIPRT_HOST_DEVICE ReservoirSample get_sample()
-    {
-        return sample;
-    }
-
-    unsigned int M = 0;
-    float weight_sum = 0.0f;
-
-    ReservoirSample sample;
-};
-
-HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_bsdf_and_lights_RIS(const HIPRTRenderData& render_data, const RendererMaterial& material, const HitInfo closest_hit_info, const float3& view_direction, Xorshift32Generator& random_number_generator)
+/**
+ * The first BSDF candidate of the RIS is the BSDF sample that the path continues with: its ray
+ * is traced here and its closest hit is stored in 'continuation' for the next bounce of the path
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_bsdf_and_lights_RIS(const HIPRTRenderData& render_data, const RendererMaterial& material, const HitInfo closest_hit_info, const float3& view_direction, PathContinuation& continuation, float selection_probability, Sampler& random_number_generator, DeferredShadowRays* deferred_shadow_rays = nullptr)
 {
     float3 evaluated_point = closest_hit_info.inter_point + closest_hit_info.shading_normal * 1.0e-4f;
 
@@ -284,7 +230,7 @@ HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_bsdf_and_lights_RIS(const HIPRTRe
         ColorRGB bsdf_color;
         float target_function = 0.0f;
         float candidate_weight = 0.0f;
-        float3 random_light_point = sample_one_emissive_triangle(render_data, random_number_generator, light_sample_pdf, light_source_info);
+        float3 random_light_point = sample_one_emissive_triangle(render_data, closest_hit_info.inter_point, closest_hit_info.shading_normal, random_number_generator, light_sample_pdf, light_source_info);
         if (light_sample_pdf > 0.0f)
         {
             // It can happen that the light PDF returned by the emissive triangle
@@ -299,7 +245,8 @@ HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_bsdf_and_lights_RIS(const HIPRTRe
             to_light_direction = to_light_direction / distance_to_light; // Normalization
             cosine_at_light_source = hippt::abs(hippt::dot(light_source_info.light_source_normal, -to_light_direction));
             cosine_at_evaluated_point = hippt::max(0.0f, hippt::dot(closest_hit_info.shading_normal, to_light_direction));
-            if (cosine_at_evaluated_point > 0.0f)
+            // A grazing light sample would have an infinite PDF in solid angle measure
+            if (cosine_at_evaluated_point > 0.0f && cosine_at_light_source > 0.0f)
             {
                 bsdf_color = bsdf_dispatcher_eval(render_data.buffers.materials_buffer, material, trash_ray_volume_state, view_direction, closest_hit_info.shading_normal, to_light_direction, bsdf_pdf);
                 // Converting the PDF from area measure to solid angle measure requires dividing by
@@ -307,8 +254,7 @@ HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_bsdf_and_lights_RIS(const HIPRTRe
                 // which is what we're doing here
                 light_sample_pdf *= distance_to_light * distance_to_light;
                 light_sample_pdf /= cosine_at_light_source;
-                light_sample_pdf /= render_data.buffers.emissive_triangles_count;
-
+    
                 float geometry_term = 1.0f / (distance_to_light * distance_to_light) * cosine_at_light_source * cosine_at_evaluated_point;
                 target_function = bsdf_color.length() * light_source_info.emission.length() * cosine_at_evaluated_point;
 
@@ -329,6 +275,7 @@ HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_bsdf_and_lights_RIS(const HIPRTRe
 
         ReservoirSample sample;
         sample.point_on_light_source = random_light_point;
+        sample.light_source_normal = light_source_info.light_source_normal;
         sample.emission = light_source_info.emission;
 
         reservoir.update(sample, candidate_weight, random_number_generator);
@@ -345,19 +292,41 @@ HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_bsdf_and_lights_RIS(const HIPRTRe
         ColorRGB bsdf_color;
         RayVolumeState trash_ray_volume_state;
 
-        bsdf_color = bsdf_dispatcher_sample(render_data.buffers.materials_buffer, material, trash_ray_volume_state, view_direction, closest_hit_info.shading_normal, closest_hit_info.geometric_normal, sampled_direction, bsdf_sample_pdf, random_number_generator);
+        if (i == 0)
+        {
+            sampled_direction = continuation.ray.direction;
+            bsdf_color = continuation.bsdf_color;
+            bsdf_sample_pdf = continuation.bsdf_pdf;
+        }
+        else
+            bsdf_color = bsdf_dispatcher_sample(render_data.buffers.materials_buffer, material, trash_ray_volume_state, view_direction, closest_hit_info.shading_normal, closest_hit_info.geometric_normal, sampled_direction, bsdf_sample_pdf, random_number_generator);
         cosine_at_evaluated_point = hippt::dot(closest_hit_info.shading_normal, sampled_direction);
 
         ReservoirSample new_sample;
         if (bsdf_sample_pdf > 0.0f && cosine_at_evaluated_point > 0.0f)
         { 
-            hiprtRay bsdf_ray;
-            bsdf_ray.origin = evaluated_point;
-            bsdf_ray.direction = sampled_direction;
+            HitInfo candidate_hit_info;
+            RayPayload candidate_ray_payload;
+            HitInfo& bsdf_ray_hit_info = i == 0 ? continuation.hit_info : candidate_hit_info;
+            RayPayload& ray_payload = i == 0 ? continuation.ray_payload : candidate_ray_payload;
+
+            bool hit_found;
+            if (i == 0)
+            {
+                hit_found = trace_ray(render_data, continuation.ray, ray_payload, bsdf_ray_hit_info);
+
+                continuation.traced = true;
+                continuation.hit_found = hit_found;
+            }
+            else
+            {
+                hiprtRay bsdf_ray;
+                bsdf_ray.origin = evaluated_point;
+                bsdf_ray.direction = sampled_direction;
+
+                hit_found = trace_ray(render_data, bsdf_ray, ray_payload, bsdf_ray_hit_info);
+            }
 
-            HitInfo bsdf_ray_hit_info;
-            RayPayload ray_payload;
-            bool hit_found = trace_ray(render_data, bsdf_ray, ray_payload, bsdf_ray_hit_info);
             if (hit_found && ray_payload.material.is_emissive())
             {
                 // If we intersected an emissive material, compute the weight. 
@@ -368,16 +337,15 @@ HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_bsdf_and_lights_RIS(const HIPRTRe
                 //float geometry_term = 1.0f / (bsdf_ray_hit_info.t * bsdf_ray_hit_info.t) * cosine_at_evaluated_point * cosine_light_source;
                 target_function = bsdf_color.length() * ray_payload.material.emission.length() * cosine_at_evaluated_point;
 
-                float light_area = triangle_area(render_data, bsdf_ray_hit_info.primitive_index);
                 float light_pdf = bsdf_ray_hit_info.t * bsdf_ray_hit_info.t / cosine_light_source;
-                light_pdf /= light_area;
-                light_pdf /= render_data.buffers.emissive_triangles_count;
+                light_pdf *= emissive_triangle_hit_area_pdf(render_data, closest_hit_info.inter_point, closest_hit_info.shading_normal, bsdf_ray_hit_info);
 
                 float mis_weight = balance_heuristic(bsdf_sample_pdf, render_data.render_settings.ris_number_of_bsdf_candidates, light_pdf, render_data.render_settings.ris_number_of_light_candidates);
                 candidate_weight = mis_weight * target_function / bsdf_sample_pdf;
 
                 new_sample.emission = ray_payload.material.emission;
                 new_sample.point_on_light_source = bsdf_ray_hit_info.inter_point;
+                new_sample.light_source_normal = bsdf_ray_hit_info.geometric_normal;
             }
         }
 
@@ -400,8 +368,7 @@ HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_bsdf_and_lights_RIS(const HIPRTRe
     shadow_ray.origin = evaluated_point;
     shadow_ray.direction = shadow_ray_direction_normalized;
 
-    bool in_shadow = evaluate_shadow_ray(render_data, shadow_ray, distance_to_light);
-    if (!in_shadow)
+    if (is_light_visible_or_deferred(render_data, shadow_ray, distance_to_light, deferred_shadow_rays))
     {
         float brdf_pdf;
         float cosine_at_evaluated_point;
@@ -410,29 +377,38 @@ HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_bsdf_and_lights_RIS(const HIPRTRe
 
         bsdf_color = bsdf_dispatcher_eval(render_data.buffers.materials_buffer, material, trash_volume_state, view_direction, closest_hit_info.shading_normal, shadow_ray.direction, brdf_pdf);
         cosine_at_evaluated_point = hippt::max(0.0f, hippt::dot(closest_hit_info.shading_normal, shadow_ray_direction_normalized));
-        if (cosine_at_evaluated_point > 0.0f)
+        // Visibility of the target function is already included because we can only be here it the light wasn't occluded
+        float target_function = bsdf_color.length() * sample.emission.length() * cosine_at_evaluated_point;
+        // The target function of a BSDF candidate was computed with the sampled BSDF value, which
+        // the evaluation of the BSDF doesn't always give back: it can be 0 here
+        if (target_function > 0.0f)
         {
-            // Visibility of the target function is already included because we can only be here it the light wasn't occluded
-            float target_function = bsdf_color.length() * sample.emission.length() * cosine_at_evaluated_point;
-            float UCW = 1.0f / target_function * reservoir.weight_sum;
+            float UCW = 1.0f / target_function * reservoir.weight_sum / selection_probability;
 
-            final_color = bsdf_color * UCW * sample.emission * cosine_at_evaluated_point;
+            final_color = defer_light_radiance(shadow_ray, distance_to_light, bsdf_color * UCW * sample.emission * cosine_at_evaluated_point, deferred_shadow_rays);
         }
     }
 
     return final_color;
 }
 
-HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_one_light(const HIPRTRenderData& render_data, const RendererMaterial& material, const HitInfo closest_hit_info, const float3& view_direction, Xorshift32Generator& random_number_generator)
+/**
+ * Whether sample_one_light() samples the emissive triangles at this hit
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE bool is_emissive_triangles_sampled(const HIPRTRenderData& render_data, const RendererMaterial& material, const HitInfo& closest_hit_info, const float3& view_direction)
 {
-    if (render_data.buffers.emissive_triangles_count == 0)
+#if DirectLightSamplingStrategy == LSS_NO_DIRECT_LIGHT_SAMPLING || DirectLightSamplingStrategy == LSS_BSDF
+    // With LSS_BSDF, the lights are only found by the BSDF sampled rays of the path
+    return false;
+#else
+    if (render_data.buffers.emissive_triangles_count == 0 || render_data.buffers.emissive_triangles_power_sum == 0.0f)
         // No emmisive geometry in the scene to sample
-        return ColorRGB(0.0f);
+        return false;
 
     if (material.emission.r != 0.0f || material.emission.g != 0.0f || material.emission.b != 0.0f)
         // We're not sampling direct lighting if we're already on an
         // emissive surface
-        return ColorRGB(0.0f);
+        return false;
 
     if (hippt::dot(view_direction, closest_hit_info.geometric_normal) < 0.0f)
         // We're not direct sampling if we're inside a surface
@@ -440,18 +416,69 @@ HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_one_light(const HIPRTRenderData&
         // We're using the geometric normal here because using the shading normal could lead
         // to false positive because of the black fringes when using smooth normals / normal mapping
         // + microfacet BRDFs
+        return false;
+
+    return true;
+#endif
+}
+
+/**
+ * If deferred_shadow_rays isn't null, the shadow rays of the light samples aren't traced.
+ * They are returned in deferred_shadow_rays along with their radiance, which is not included
+ * in the returned radiance.
+ *
+ * 'continuation' is the BSDF sample the path continues with after this hit.
+ * 'selection_probability' is the probability that the direct lighting at this hit
+ * samples the emissive triangles (see DirectLightSelectionStrategy)
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB sample_one_light(const HIPRTRenderData& render_data, const RendererMaterial& material, const HitInfo closest_hit_info, const float3& view_direction, PathContinuation& continuation, float selection_probability, Sampler& random_number_generator, DeferredShadowRays* deferred_shadow_rays = nullptr)
+{
+    if (!is_emissive_triangles_sampled(render_data, material, closest_hit_info, view_direction))
         return ColorRGB(0.0f);
 
-#if DirectLightSamplingStrategy == LSS_NO_DIRECT_LIGHT_SAMPLING
-    return ColorRGB(0.0f);
-#elif DirectLightSamplingStrategy == LSS_UNIFORM_ONE_LIGHT
-    return sample_one_light_no_MIS(render_data, material, closest_hit_info, view_direction, random_number_generator);
-#elif DirectLightSamplingStrategy == LSS_BSDF
-    return sample_one_light_bsdf(render_data, material, closest_hit_info, view_direction, random_number_generator);
+#if DirectLightSamplingStrategy == LSS_UNIFORM_ONE_LIGHT
+    return sample_one_light_no_MIS(render_data, material, closest_hit_info, view_direction, selection_probability, random_number_generator, deferred_shadow_rays);
 #elif DirectLightSamplingStrategy == LSS_MIS_LIGHT_BSDF
-    return sample_one_light_MIS(render_data, material, closest_hit_info, view_direction, random_number_generator);
-#elif DirectLightSamplingStrategy == LSS_RIS_BSDF_AND_LIGHT
-    return sample_bsdf_and_lights_RIS(render_data, material, closest_hit_info, view_direction, random_number_generator);
+    return sample_one_light_MIS(render_data, material, closest_hit_info, view_direction, selection_probability, random_number_generator, deferred_shadow_rays);
+#elif DirectLightSamplingStrategy == LSS_RIS_BSDF_AND_LIGHT || DirectLightSamplingStrategy == LSS_RESTIR_DI
+    // The ReSTIR DI only resamples the direct lighting at the primary hits, see restir_di_shade()
+    return sample_bsdf_and_lights_RIS(render_data, material, closest_hit_info, view_direction, continuation, selection_probability, random_number_generator, deferred_shadow_rays);
+#else
+    return ColorRGB(0.0f);
+#endif
+}
+
+/**
+ * Weight of the emission found at the hit of a ray whose previous hit was at bounce - 1,
+ * given how the direct lighting at that previous hit sampled the emissive triangles.
+ *
+ * The last ray of a path (bounce == nb_bounces) is only traced for the part of the direct
+ * lighting at the last hit that the MIS leaves to the BSDF sample
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE float emission_mis_weight(const HIPRTRenderData& render_data, const float3& ray_direction, const HitInfo& closest_hit_info, const RayMISState& mis_state, int bounce)
+{
+    bool last_ray = bounce == render_data.render_settings.nb_bounces;
+    if (!mis_state.emissive_triangles_sampled)
+        // Nothing sampled that emission at the previous hit, except for the camera rays
+        // and the last rays whose emission is only the BSDF part of a MIS
+        return last_ray ? 0.0f : 1.0f;
+
+#if DirectLightSamplingStrategy == LSS_MIS_LIGHT_BSDF
+    // abs() here to allow double sided emissive geometry
+    float cosine_at_light_source = hippt::abs(hippt::dot(closest_hit_info.geometric_normal, -ray_direction));
+    if (cosine_at_light_source <= 0.0f)
+        // sample_one_light_MIS() cannot sample this point
+        return 1.0f;
+
+    // PDF of sample_one_light_MIS() sampling that point, in solid angle measure
+    float light_pdf = closest_hit_info.t * closest_hit_info.t / cosine_at_light_source;
+    light_pdf *= emissive_triangle_hit_area_pdf(render_data, mis_state.previous_point, mis_state.previous_normal, closest_hit_info);
+    light_pdf *= mis_state.emissive_triangles_selection_probability;
+
+    return power_heuristic(mis_state.bsdf_pdf, light_pdf);
+#else
+    // The direct lighting at the previous hit already accounted for the emission in the direction of the ray
+    return 0.0f;
 #endif
 }
 
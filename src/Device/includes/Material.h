@@ -19,19 +19,32 @@ HIPRT_HOST_DEVICE HIPRT_INLINE void get_material_property(const HIPRTRenderData&
 HIPRT_HOST_DEVICE HIPRT_INLINE void get_metallic_roughness(const HIPRTRenderData& render_data, float& metallic, float& roughness, const float2& texcoords, int metallic_texture_index, int roughness_texture_index, int metallic_roughness_texture_index);
 HIPRT_HOST_DEVICE HIPRT_INLINE void get_base_color(const HIPRTRenderData& render_data, ColorRGB& base_color, float& out_alpha, const float2& texcoords, int base_color_texture_index);
 
-HIPRT_HOST_DEVICE HIPRT_INLINE float get_hit_base_color_alpha(const HIPRTRenderData& render_data, hiprtHit hit)
+/**
+ * Returns false if the base color of the triangle is alpha-transparent at the
+ * given barycentric coordinates, in which case rays go through the triangle.
+ *
+ * Only the precomputed opacity of the triangle is read and, for the partly
+ * transparent triangles, one bit of the alpha mask of their base color texture
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE bool is_hit_opaque(const HIPRTRenderData& render_data, int primitive_index, float2 uv)
 {
-    float2 texcoords = uv_interpolate(render_data.buffers.triangles_indices, hit.primID, render_data.buffers.texcoords, hit.uv);
+    if (render_data.buffers.triangle_opacities == nullptr)
+        // All the triangles of the scene are opaque
+        return true;
+
+    unsigned char opacity = render_data.buffers.triangle_opacities[primitive_index];
+    if (opacity != TRIANGLE_MASKED)
+        return opacity == TRIANGLE_OPAQUE;
+
+    float2 texcoords = uv_interpolate(render_data.buffers.triangles_indices, primitive_index, render_data.buffers.texcoords, uv);
 
-    int material_index = render_data.buffers.material_indices[hit.primID];
-    RendererMaterial material = render_data.buffers.materials_buffer[material_index];
+    int material_index = render_data.buffers.material_indices[primitive_index];
+    int texture_index = render_data.buffers.materials_buffer[material_index].base_color_texture_index;
+    int2 texture_dims = render_data.buffers.textures_dims[texture_index];
 
-    // Getting the alpha for transparency check to see if we need to pass the ray through or not
-    float alpha;
-    ColorRGB base_color;
-    get_base_color(render_data, base_color, alpha, texcoords, material.base_color_texture_index);
+    int2 texel = texel_from_uv(texcoords, texture_dims);
 
-    return alpha;
+    return read_alpha_mask(render_data.buffers.alpha_mask_bits + render_data.buffers.alpha_mask_offsets[texture_index], texel.x + texel.y * texture_dims.x);
 }
 
 HIPRT_HOST_DEVICE HIPRT_INLINE RendererMaterial get_intersection_material(const HIPRTRenderData& render_data, int material_index, float2 texcoords, float& out_base_color_alpha)
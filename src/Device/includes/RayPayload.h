@@ -27,6 +27,29 @@ struct RayVolumeState
 	bool leaving_mat = false;
 };
 
+/**
+ * What the next hit (or miss) of a path needs to know about the direct lighting at
+ * the previous hit to weight the emission it finds (see shade_hit() and shade_miss())
+ */
+struct RayMISState
+{
+	// PDF (solid angle measure) of the BSDF sample that gave the ray
+	float bsdf_pdf = 0.0f;
+	// Whether the direct lighting at the previous hit sampled the
+	// emissive triangles / the envmap in the direction of the ray
+	bool emissive_triangles_sampled = false;
+	bool envmap_sampled = false;
+	// Probabilities that the direct lighting at the previous hit picked the
+	// emissive triangles / the envmap (see DirectLightSelectionStrategy)
+	float emissive_triangles_selection_probability = 1.0f;
+	float envmap_selection_probability = 1.0f;
+
+	// Shading point and normal of the previous hit, for the probability of the
+	// light sampling picking the emissive triangle found by the ray (ETS_LIGHT_BVH)
+	float3 previous_point = { 0.0f, 0.0f, 0.0f };
+	float3 previous_normal = { 0.0f, 0.0f, 1.0f };
+};
+
 struct RayPayload
 {
 	// Energy left in the ray after it bounces around the scene
@@ -43,6 +66,18 @@ struct RayPayload
 
 	RayVolumeState volume_state;
 
+	RayMISState mis_state;
+
+	// Set by shade_hit() when the ray of the next bounce was already traced by the direct
+	// lighting (BSDF candidate of the RIS). The closest hit is then in the HitInfo given
+	// to shade_hit() and its material and volume state are in this payload
+	bool next_ray_traced = false;
+	bool next_ray_hit_found = false;
+
+	// Pixel whose ReSTIR DI reservoir gives the direct lighting at the next hit of the
+	// ray, -1 if none (see restir_di_pixel_index()). Only set for the camera rays
+	int restir_di_pixel_index = -1;
+
 	HIPRT_HOST_DEVICE bool is_inside_volume() const
 	{
 		return volume_state.interior_stack.stack_position > 0;
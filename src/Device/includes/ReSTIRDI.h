@@ -0,0 +1,305 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#ifndef DEVICE_RESTIR_DI_H
+#define DEVICE_RESTIR_DI_H
+
+#include "Device/includes/Dispatcher.h"
+#include "Device/includes/FixIntellisense.h"
+#include "Device/includes/Intersect.h"
+#include "Device/includes/Lights.h"
+#include "Device/includes/Material.h"
+#include "HostDeviceCommon/Camera.h"
+#include "HostDeviceCommon/RenderData.h"
+#include "HostDeviceCommon/Reservoir.h"
+#include "HostDeviceCommon/Sampler.h"
+
+// Maximum number of neighbouring pixels whose reservoirs are resampled by the spatial reuse
+#define RESTIR_DI_MAX_SPATIAL_NEIGHBOUR_COUNT 8
+
+/**
+ * ReSTIR DI ("Spatiotemporal reservoir resampling for real-time ray tracing with dynamic direct
+ * lighting", Bitterli et al., 2020) with the resampling weights of "Generalized Resampled
+ * Importance Sampling", Lin et al., 2022.
+ *
+ * Each frame, the reservoir of each pixel is resampled for the first hit of its first camera ray
+ * from light candidates (as the RIS of sample_bsdf_and_lights_RIS() without the BSDF candidates),
+ * then with the reservoir of the previous frame at the same surface (temporal reuse) and with the
+ * reservoirs of neighbouring pixels (spatial reuse). The direct lighting at that hit is then the
+ * light sample of the reservoir (restir_di_shade())
+ */
+
+/**
+ * Target function of the reservoirs: unshadowed contribution of the light sample at the surface,
+ * in area measure so that the samples of other pixels can be reused without a change of variables
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE float restir_di_target_function(const HIPRTRenderData& render_data, const RendererMaterial& material, const ReSTIRDISurface& surface, const ReservoirSample& sample)
+{
+    float3 evaluated_point = surface.inter_point + surface.shading_normal * 1.0e-4f;
+    float3 to_light_direction = sample.point_on_light_source - evaluated_point;
+    float distance_to_light = hippt::length(to_light_direction);
+    if (distance_to_light <= 0.0f)
+        return 0.0f;
+    to_light_direction = to_light_direction / distance_to_light;
+
+    // abs() here to allow backfacing light sources
+    float cosine_at_light_source = hippt::abs(hippt::dot(sample.light_source_normal, -to_light_direction));
+    float cosine_at_evaluated_point = hippt::dot(surface.shading_normal, to_light_direction);
+    if (cosine_at_light_source <= 0.0f || cosine_at_evaluated_point <= 0.0f)
+        return 0.0f;
+
+    float bsdf_pdf;
+    RayVolumeState trash_volume_state;
+    ColorRGB bsdf_color = bsdf_dispatcher_eval(render_data.buffers.materials_buffer, material, trash_volume_state, surface.view_direction, surface.shading_normal, to_light_direction, bsdf_pdf);
+
+    return bsdf_color.length() * sample.emission.length() * cosine_at_evaluated_point * cosine_at_light_source / (distance_to_light * distance_to_light);
+}
+
+HIPRT_HOST_DEVICE HIPRT_INLINE RendererMaterial restir_di_surface_material(const HIPRTRenderData& render_data, const ReSTIRDISurface& surface)
+{
+    float trash_alpha;
+
+    return get_intersection_material(render_data, surface.material_index, surface.texcoords, trash_alpha);
+}
+
+/**
+ * Whether the reservoir of 'other' can be resampled for 'surface': both must be oriented alike and
+ * at about the same depth. 'surface_camera_distance' is the distance of 'surface' to the camera
+ * that 'other' was seen from (the camera of the previous frame for the temporal reuse)
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE bool restir_di_is_surface_similar(const ReSTIRDISurface& surface, float surface_camera_distance, const ReSTIRDISurface& other)
+{
+    if (other.material_index == -1)
+        return false;
+
+    if (hippt::dot(surface.shading_normal, other.shading_normal) < 0.9f)
+        return false;
+
+    return hippt::abs(other.camera_distance - surface_camera_distance) <= 0.1f * surface_camera_distance;
+}
+
+/**
+ * Sets the unbiased contribution weight of the sample of the reservoir, resampled for the surface
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE void restir_di_finalize_reservoir(const HIPRTRenderData& render_data, const RendererMaterial& material, const ReSTIRDISurface& surface, Reservoir& reservoir)
+{
+    reservoir.UCW = 0.0f;
+    if (reservoir.weight_sum <= 0.0f)
+        return;
+
+    float target_function = restir_di_target_function(render_data, material, surface, reservoir.sample);
+    if (target_function > 0.0f)
+        reservoir.UCW = reservoir.weight_sum / target_function;
+}
+
+/**
+ * Resamples ris_number_of_light_candidates light candidates for the surface
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE Reservoir restir_di_sample_initial_candidates(const HIPRTRenderData& render_data, const RendererMaterial& material, const ReSTIRDISurface& surface, Sampler& random_number_generator)
+{
+    int candidate_count = render_data.render_settings.ris_number_of_light_candidates;
+
+    Reservoir reservoir;
+    for (int i = 0; i < candidate_count; i++)
+    {
+        float light_sample_pdf;
+        LightSourceInformation light_source_info;
+        float3 random_light_point = sample_one_emissive_triangle(render_data, surface.inter_point, surface.shading_normal, random_number_generator, light_sample_pdf, light_source_info);
+
+        ReservoirSample sample;
+        sample.point_on_light_source = random_light_point;
+        sample.light_source_normal = light_source_info.light_source_normal;
+        sample.emission = light_source_info.emission;
+
+        float candidate_weight = 0.0f;
+        if (light_sample_pdf > 0.0f)
+            candidate_weight = restir_di_target_function(render_data, material, surface, sample) / (candidate_count * light_sample_pdf);
+
+        reservoir.update(sample, candidate_weight, random_number_generator);
+    }
+
+    restir_di_finalize_reservoir(render_data, material, surface, reservoir);
+
+    return reservoir;
+}
+
+/**
+ * Resamples the reservoirs, each resampled for the corresponding surface, into one reservoir for
+ * surfaces[0]. reservoirs[0] is the canonical reservoir (its light candidates were sampled for
+ * surfaces[0]), which makes the result unbiased with restir_di_use_unbiased_mis
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE Reservoir restir_di_resample_reservoirs(const HIPRTRenderData& render_data, const Reservoir* reservoirs, const ReSTIRDISurface* surfaces, int reservoir_count, Sampler& random_number_generator)
+{
+    RendererMaterial materials[RESTIR_DI_MAX_SPATIAL_NEIGHBOUR_COUNT + 1];
+    float M_sum = 0.0f;
+    for (int i = 0; i < reservoir_count; i++)
+    {
+        materials[i] = restir_di_surface_material(render_data, surfaces[i]);
+        M_sum += reservoirs[i].M;
+    }
+
+    Reservoir output_reservoir;
+    for (int i = 0; i < reservoir_count; i++)
+    {
+        const Reservoir& reservoir = reservoirs[i];
+
+        float resampling_weight = 0.0f;
+        if (reservoir.UCW > 0.0f)
+        {
+            float target_function = restir_di_target_function(render_data, materials[0], surfaces[0], reservoir.sample);
+
+            float mis_weight;
+            if (render_data.render_settings.restir_di_use_unbiased_mis)
+            {
+                // Generalized balance heuristic over the target functions of the surfaces
+                // that the reservoirs were resampled for, weighted by their candidates
+                float mis_weight_denominator = 0.0f;
+                float mis_weight_numerator = 0.0f;
+                for (int j = 0; j < reservoir_count; j++)
+                {
+                    float target_function_j = j == 0 ? target_function : restir_di_target_function(render_data, materials[j], surfaces[j], reservoir.sample);
+                    float weighted_target_function = reservoirs[j].M * target_function_j;
+
+                    mis_weight_denominator += weighted_target_function;
+                    if (j == i)
+                        mis_weight_numerator = weighted_target_function;
+                }
+
+                mis_weight = mis_weight_denominator > 0.0f ? mis_weight_numerator / mis_weight_denominator : 0.0f;
+            }
+            else
+                mis_weight = reservoir.M / M_sum;
+
+            resampling_weight = mis_weight * target_function * reservoir.UCW;
+        }
+
+        output_reservoir.combine(reservoir, resampling_weight, random_number_generator);
+    }
+
+    restir_di_finalize_reservoir(render_data, materials[0], surfaces[0], output_reservoir);
+
+    return output_reservoir;
+}
+
+/**
+ * Resamples the reservoir of the pixel for the hit of its camera ray from light candidates
+ * and from the reservoir of the previous frame at the same surface, if any
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE void restir_di_initial_candidates_and_temporal_reuse(const HIPRTRenderData& render_data, const HIPRTCamera& previous_camera, const int2& res, uint32_t pixel_index,
+                                                                                   const ReSTIRDISurface& surface, Sampler& random_number_generator)
+{
+    Reservoir reservoir;
+    if (surface.material_index != -1)
+    {
+        RendererMaterial material = restir_di_surface_material(render_data, surface);
+        reservoir = restir_di_sample_initial_candidates(render_data, material, surface, random_number_generator);
+
+        // The reservoirs and the surfaces of the previous frame are only there after the first frame
+        int2 previous_pixel;
+        if (render_data.render_settings.restir_di_do_temporal_reuse && render_data.render_settings.sample_number > 0 && previous_camera.get_pixel_of_point(surface.inter_point, res, previous_pixel))
+        {
+            int previous_pixel_index = previous_pixel.x + previous_pixel.y * res.x;
+
+            const ReSTIRDISurface& previous_surface = render_data.aux_buffers.restir_di_previous_surfaces[previous_pixel_index];
+            if (restir_di_is_surface_similar(surface, hippt::length(surface.inter_point - previous_camera.position), previous_surface))
+            {
+                Reservoir reservoirs[2] = { reservoir, render_data.aux_buffers.restir_di_final_reservoirs[previous_pixel_index] };
+                ReSTIRDISurface surfaces[2] = { surface, previous_surface };
+
+                // Capping the confidence of the previous frame for the
+                // reservoirs to adapt to the changes of the lighting
+                reservoirs[1].M = hippt::min(reservoirs[1].M, reservoir.M * render_data.render_settings.restir_di_temporal_m_cap);
+
+                reservoir = restir_di_resample_reservoirs(render_data, reservoirs, surfaces, 2, random_number_generator);
+            }
+        }
+    }
+
+    render_data.aux_buffers.restir_di_temporal_reservoirs[pixel_index] = reservoir;
+}
+
+/**
+ * Resamples the reservoir of the pixel with the reservoirs of random neighbouring pixels at similar surfaces
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE void restir_di_spatial_reuse(const HIPRTRenderData& render_data, const int2& res, int x, int y, Sampler& random_number_generator)
+{
+    uint32_t pixel_index = x + y * res.x;
+
+    Reservoir reservoirs[RESTIR_DI_MAX_SPATIAL_NEIGHBOUR_COUNT + 1];
+    ReSTIRDISurface surfaces[RESTIR_DI_MAX_SPATIAL_NEIGHBOUR_COUNT + 1];
+    reservoirs[0] = render_data.aux_buffers.restir_di_temporal_reservoirs[pixel_index];
+    surfaces[0] = render_data.aux_buffers.restir_di_surfaces[pixel_index];
+
+    int reservoir_count = 1;
+    if (surfaces[0].material_index != -1 && render_data.render_settings.restir_di_do_spatial_reuse)
+    {
+        int neighbour_count = hippt::min(render_data.render_settings.restir_di_spatial_neighbour_count, RESTIR_DI_MAX_SPATIAL_NEIGHBOUR_COUNT);
+        for (int i = 0; i < neighbour_count; i++)
+        {
+            // Uniformly in the disk of radius restir_di_spatial_radius around the pixel
+            float radius = render_data.render_settings.restir_di_spatial_radius * sqrt(random_number_generator());
+            float angle = 2.0f * M_PI * random_number_generator();
+            int neighbour_x = x + static_cast<int>(floorf(radius * cos(angle) + 0.5f));
+            int neighbour_y = y + static_cast<int>(floorf(radius * sin(angle) + 0.5f));
+            if (neighbour_x < 0 || neighbour_x >= res.x || neighbour_y < 0 || neighbour_y >= res.y || (neighbour_x == x && neighbour_y == y))
+                continue;
+
+            int neighbour_index = neighbour_x + neighbour_y * res.x;
+            const ReSTIRDISurface& neighbour_surface = render_data.aux_buffers.restir_di_surfaces[neighbour_index];
+            if (!restir_di_is_surface_similar(surfaces[0], surfaces[0].camera_distance, neighbour_surface))
+                continue;
+
+            reservoirs[reservoir_count] = render_data.aux_buffers.restir_di_temporal_reservoirs[neighbour_index];
+            surfaces[reservoir_count] = neighbour_surface;
+            reservoir_count++;
+        }
+    }
+
+    if (reservoir_count == 1)
+        render_data.aux_buffers.restir_di_final_reservoirs[pixel_index] = reservoirs[0];
+    else
+        render_data.aux_buffers.restir_di_final_reservoirs[pixel_index] = restir_di_resample_reservoirs(render_data, reservoirs, surfaces, reservoir_count, random_number_generator);
+}
+
+/**
+ * Direct lighting of the emissive triangles at the hit that the reservoir was resampled for:
+ * the light sample of the reservoir, weighted by its unbiased contribution weight.
+ * 'selection_probability' and 'deferred_shadow_rays' are as for sample_one_light()
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB restir_di_shade(const HIPRTRenderData& render_data, const RendererMaterial& material, const HitInfo& closest_hit_info, const float3& view_direction, const Reservoir& reservoir, float selection_probability, DeferredShadowRays* deferred_shadow_rays = nullptr)
+{
+    if (reservoir.UCW <= 0.0f)
+        return ColorRGB(0.0f);
+
+    const ReservoirSample& sample = reservoir.sample;
+
+    float3 evaluated_point = closest_hit_info.inter_point + closest_hit_info.shading_normal * 1.0e-4f;
+    float3 shadow_ray_direction = sample.point_on_light_source - evaluated_point;
+    float distance_to_light = hippt::length(shadow_ray_direction);
+    float3 shadow_ray_direction_normalized = shadow_ray_direction / distance_to_light;
+
+    float cosine_at_light_source = hippt::abs(hippt::dot(sample.light_source_normal, -shadow_ray_direction_normalized));
+    float cosine_at_evaluated_point = hippt::dot(closest_hit_info.shading_normal, shadow_ray_direction_normalized);
+    if (cosine_at_light_source <= 0.0f || cosine_at_evaluated_point <= 0.0f)
+        return ColorRGB(0.0f);
+
+    hiprtRay shadow_ray;
+    shadow_ray.origin = evaluated_point;
+    shadow_ray.direction = shadow_ray_direction_normalized;
+
+    if (!is_light_visible_or_deferred(render_data, shadow_ray, distance_to_light, deferred_shadow_rays))
+        return ColorRGB(0.0f);
+
+    float bsdf_pdf;
+    RayVolumeState trash_volume_state;
+    ColorRGB bsdf_color = bsdf_dispatcher_eval(render_data.buffers.materials_buffer, material, trash_volume_state, view_direction, closest_hit_info.shading_normal, shadow_ray.direction, bsdf_pdf);
+
+    // The UCW is in area measure, as the target function
+    float geometry_term = cosine_at_evaluated_point * cosine_at_light_source / (distance_to_light * distance_to_light);
+
+    return defer_light_radiance(shadow_ray, distance_to_light, bsdf_color * sample.emission * geometry_term * reservoir.UCW / selection_probability, deferred_shadow_rays);
+}
+
+#endif
@@ -0,0 +1,57 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#ifndef DEVICE_RUSSIAN_ROULETTE_H
+#define DEVICE_RUSSIAN_ROULETTE_H
+
+#include "HostDeviceCommon/Color.h"
+#include "HostDeviceCommon/RenderData.h"
+#include "HostDeviceCommon/Sampler.h"
+
+// Maximum number of paths a path is split into, see path_split_count()
+#define RUSSIAN_ROULETTE_MAX_SPLIT_COUNT 4
+
+/**
+ * Russian roulette on the luminance of the throughput of a path at the given bounce.
+ * Returns false if the path must be terminated. The throughput of a surviving path
+ * is divided by its survival probability so that the estimator stays unbiased.
+ *
+ * No random number is consumed if the path survives with certainty
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE bool russian_roulette(const HIPRTRenderData& render_data, ColorRGB& throughput, int bounce, Sampler& random_number_generator)
+{
+    const HIPRTRenderSettings& render_settings = render_data.render_settings;
+    if (!render_settings.do_russian_roulette || bounce < render_settings.russian_roulette_min_bounce)
+        return true;
+
+    float survival_probability = hippt::clamp(render_settings.russian_roulette_min_survival_probability, 1.0f, throughput.luminance());
+    if (survival_probability >= 1.0f)
+        return true;
+
+    if (random_number_generator() >= survival_probability)
+        return false;
+
+    throughput /= survival_probability;
+
+    return true;
+}
+
+/**
+ * Number of paths that a path arriving at a hit of the given bounce with the given throughput is
+ * split into (each of them with 1 / split count of the throughput). 1 if the path isn't split
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE int path_split_count(const HIPRTRenderData& render_data, const ColorRGB& throughput, int bounce)
+{
+    const HIPRTRenderSettings& render_settings = render_data.render_settings;
+    if (!render_settings.do_russian_roulette || render_settings.russian_roulette_split_threshold <= 0.0f || bounce < render_settings.russian_roulette_min_bounce)
+        return 1;
+
+    int split_count = static_cast<int>(throughput.luminance() / render_settings.russian_roulette_split_threshold);
+
+    // hippt::clamp() is float only on the GPU
+    return split_count < 1 ? 1 : (split_count > RUSSIAN_ROULETTE_MAX_SPLIT_COUNT ? RUSSIAN_ROULETTE_MAX_SPLIT_COUNT : split_count);
+}
+
+#endif
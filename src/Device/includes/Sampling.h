@@ -9,7 +9,7 @@
 #include "Device/includes/ONB.h"
 #include "HostDeviceCommon/Color.h"
 #include "HostDeviceCommon/Material.h"
-#include "HostDeviceCommon/Xorshift.h"
+#include "HostDeviceCommon/Sampler.h"
 
 /**
  * Power heuristic with a hardcoded Beta exponent of 2 and two sampling strategies only
@@ -96,7 +96,7 @@ HIPRT_HOST_DEVICE HIPRT_INLINE bool refract_ray(const float3& ray_direction, con
  * 
  * The sampled direction is returned in world space
  */
-HIPRT_HOST_DEVICE HIPRT_INLINE float3 cosine_weighted_sample(const float3& normal, Xorshift32Generator& random_number_generator)
+HIPRT_HOST_DEVICE HIPRT_INLINE float3 cosine_weighted_sample(const float3& normal, Sampler& random_number_generator)
 {
     float rand_1 = random_number_generator();
     float rand_2 = 2.0f * random_number_generator() - 1.0f;
@@ -188,7 +188,7 @@ HIPRT_HOST_DEVICE HIPRT_INLINE float G1(float alpha_x, float alpha_y, const floa
     return 1.0f / (1.0f + lambda);
 }
 
-HIPRT_HOST_DEVICE HIPRT_INLINE float3 GGXVNDF_sample(const float3& local_view_direction, float alpha_x, float alpha_y, Xorshift32Generator& random_number_generator)
+HIPRT_HOST_DEVICE HIPRT_INLINE float3 GGXVNDF_sample(const float3& local_view_direction, float alpha_x, float alpha_y, Sampler& random_number_generator)
 {
     float r1 = random_number_generator();
     float r2 = random_number_generator();
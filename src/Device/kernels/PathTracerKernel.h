@@ -9,9 +9,11 @@
 #include "Device/includes/Envmap.h"
 #include "Device/includes/Material.h"
 #include "Device/includes/RayPayload.h"
+#include "Device/includes/ReSTIRDI.h"
+#include "Device/includes/RussianRoulette.h"
 #include "Device/includes/Sampling.h"
 #include "HostDeviceCommon/Camera.h"
-#include "HostDeviceCommon/Xorshift.h"
+#include "HostDeviceCommon/Sampler.h"
 
 HIPRT_HOST_DEVICE HIPRT_INLINE unsigned int wang_hash(unsigned int seed)
 {
@@ -61,11 +63,11 @@ HIPRT_HOST_DEVICE HIPRT_INLINE bool check_for_nan(ColorRGB ray_color, int x, int
 #ifndef __KERNELCC__
 #include "Utils/Utils.h" // For debugbreak in sanity_check()
 #endif
-HIPRT_HOST_DEVICE HIPRT_INLINE bool sanity_check(const HIPRTRenderData& render_data, RayPayload& ray_payload, int x, int y, int2& res, int sample)
+HIPRT_HOST_DEVICE HIPRT_INLINE bool sanity_check(const HIPRTRenderData& render_data, const ColorRGB& ray_color, int x, int y, const int2& res, int sample)
 {
     bool invalid = false;
-    invalid |= check_for_negative_color(ray_payload.ray_color, x, y, sample);
-    invalid |= check_for_nan(ray_payload.ray_color, x, y, sample);
+    invalid |= check_for_negative_color(ray_color, x, y, sample);
+    invalid |= check_for_nan(ray_color, x, y, sample);
 
     if (invalid)
     {
@@ -81,36 +83,12 @@ HIPRT_HOST_DEVICE HIPRT_INLINE bool sanity_check(const HIPRTRenderData& render_d
     return !invalid;
 }
 
-#ifdef __KERNELCC__
-GLOBAL_KERNEL_SIGNATURE(void) PathTracerKernel(HIPRTRenderData render_data, int2 res, HIPRTCamera camera)
-#else
-GLOBAL_KERNEL_SIGNATURE(void) inline PathTracerKernel(HIPRTRenderData render_data, int2 res, HIPRTCamera camera, int x, int y)
-#endif
+/**
+ * Resets the buffers of the pixel on the first frame and decides, with the adaptive sampling,
+ * whether the pixel needs more samples. Returns false if the pixel has converged
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE bool prepare_pixel_sampling(const HIPRTRenderData& render_data, uint32_t pixel_index)
 {
-#ifdef __KERNELCC__
-    const uint32_t x = blockIdx.x * blockDim.x + threadIdx.x;
-    const uint32_t y = blockIdx.y * blockDim.y + threadIdx.y;
-#endif
-    uint32_t pixel_index = (x + y * res.x);
-    if (pixel_index >= res.x * res.y)
-        return;
-
-    // 'Render low resolution' means that the user is moving the camera for example
-    // so we're going to reduce the quality of the render for increased framerates
-    // while moving
-    if (render_data.render_settings.render_low_resolution)
-    {
-        // Reducing the number of bounces to 3
-        render_data.render_settings.nb_bounces = 3;
-        render_data.render_settings.samples_per_frame = 1;
-        int res_scaling = render_data.render_settings.render_low_resolution_scaling;
-        pixel_index /= res_scaling;
-
-        // If rendering at low resolution, only one pixel out of res_scaling^2 will be rendered
-        if (x % res_scaling != 0 || y % res_scaling != 0)
-            return;
-    }
-
     if (render_data.render_settings.sample_number == 0)
     {
         // Resetting all buffers on the first frame
@@ -145,165 +123,273 @@ GLOBAL_KERNEL_SIGNATURE(void) inline PathTracerKernel(HIPRTRenderData render_dat
         // We're rescaling the color of the pixels that stopped sampling here for correct display
         render_data.buffers.pixels[pixel_index] = render_data.buffers.pixels[pixel_index] / render_data.render_settings.sample_number * (render_data.render_settings.sample_number + render_data.render_settings.samples_per_frame);
 
-        return;
+        return false;
     }
 
+    return true;
+}
+
+/**
+ * Sampler of the pixel (x, y), to be started with start_pixel_sample() before each sample.
+ * The sampler of a pixel is the same every frame, the samples of the successive frames
+ * being the successive points of the sequence of the pixel
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE Sampler get_pixel_sampler(const HIPRTRenderData& render_data, int x, int y, uint32_t pixel_index)
+{
+    return Sampler(render_data.render_settings.sampler_type, wang_hash(pixel_index + 1), x, y, render_data.buffers.blue_noise_mask);
+}
+
+/**
+ * Independent numbers (SAMPLER_INDEPENDENT) of the pixel for the passes that aren't part of its paths
+ * (the ReSTIR DI resampling), to be started with start_pixel_sample(). 'stream' separates the numbers
+ * of the different passes from each other
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE Sampler get_pixel_independent_sampler(uint32_t pixel_index, unsigned int stream)
+{
+    return Sampler(SAMPLER_INDEPENDENT, sampler_hash_combine(wang_hash(pixel_index + 1), sampler_hash(stream)), 0, 0, nullptr);
+}
 
-    unsigned int seed;
+/**
+ * Starts the sample 'sample' of the frame in the sampler of a pixel: the sample
+ * first_sample_index + sample_number + sample of the sequence of the pixel
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE void start_pixel_sample(const HIPRTRenderData& render_data, int sample, Sampler& sampler)
+{
     if (render_data.render_settings.freeze_random)
-        seed = wang_hash(pixel_index + 1);
+        sampler.start_sample(render_data.render_settings.first_sample_index + sample);
     else
-        seed = wang_hash((pixel_index + 1) * (render_data.render_settings.sample_number + 1));
-    Xorshift32Generator random_number_generator(seed);
+        sampler.start_sample(render_data.render_settings.first_sample_index + render_data.render_settings.sample_number + sample);
+}
 
-    float squared_luminance_of_samples = 0.0f;
-    ColorRGB final_color = ColorRGB(0.0f, 0.0f, 0.0f);
-    ColorRGB denoiser_albedo = ColorRGB(0.0f, 0.0f, 0.0f);
-    float3 denoiser_normal = make_float3(0.0f, 0.0f, 0.0f);
-    for (int sample = 0; sample < render_data.render_settings.samples_per_frame; sample++)
-    {
-        //Jittered around the center
-        float x_jittered = (x + 0.5f) + random_number_generator() - 1.0f;
-        float y_jittered = (y + 0.5f) + random_number_generator() - 1.0f;
+/**
+ * Clamps the direct lighting brought by the light sampling
+ * and the envmap sampling at the given bounce
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE ColorRGB clamp_direct_lighting(const HIPRTRenderData& render_data, int bounce, ColorRGB light_sample_radiance, ColorRGB envmap_radiance)
+{
+    ColorRGB direct_lighting_clamp(render_data.render_settings.direct_contribution_clamp > 0.0f ? render_data.render_settings.direct_contribution_clamp : 1.0e35f);
+    ColorRGB envmap_lighting_clamp(render_data.render_settings.envmap_contribution_clamp > 0.0f ? render_data.render_settings.envmap_contribution_clamp : 1.0e35f);
 
-        hiprtRay ray = camera.get_camera_ray(x_jittered, y_jittered, res);
-        RayPayload ray_payload;
+    if (bounce == 0)
+        // Clamping only on the primary rays
+        light_sample_radiance = ColorRGB::min(direct_lighting_clamp, light_sample_radiance);
+    envmap_radiance = ColorRGB::min(envmap_lighting_clamp, envmap_radiance);
 
-        // Whether or not we've already written to the denoiser's buffers
-        bool denoiser_AOVs_set = false;
-        float denoiser_blend = 1.0f;
+    return light_sample_radiance + envmap_radiance;
+}
 
-        for (int bounce = 0; bounce < render_data.render_settings.nb_bounces; bounce++)
-        {
-            if (ray_payload.next_ray_state == RayState::BOUNCE)
-            {
-                HitInfo closest_hit_info;
-                bool intersection_found = trace_ray(render_data, ray, ray_payload, closest_hit_info);
+/**
+ * Whether the last ray of a path (the BSDF sample at its last hit, at bounce nb_bounces - 1) must be
+ * traced: it only is for the emission of the lights that the direct lighting at the last hit sampled
+ * with MIS, the BSDF sample of the MIS being that ray
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE bool is_last_ray_needed(const RayMISState& mis_state)
+{
+#if DirectLightSamplingStrategy == LSS_MIS_LIGHT_BSDF
+    if (mis_state.emissive_triangles_sampled)
+        return true;
+#endif
 
-                if (intersection_found)
-                {
-                    if (bounce == 0)
-                    {
-                        denoiser_normal += closest_hit_info.shading_normal;
-                        denoiser_albedo += ray_payload.material.base_color;
-                    }
+    return mis_state.envmap_sampled;
+}
 
-                    // For the BRDF calculations, bounces, ... to be correct, we need the normal to be in the same hemisphere as
-                    // the view direction. One thing that can go wrong is when we have an emissive triangle (typical area light)
-                    // and a ray hits the back of the triangle. The normal will not be facing the view direction in this
-                    // case and this will cause issues later in the BRDF.
-                    // Because we want to allow backfacing emissive geometry (making the emissive geometry double sided
-                    // and emitting light in both directions of the surface), we're negating the normal to make
-                    // it face the view direction (but only for emissive geometry)
-                    
-                    if (ray_payload.material.is_emissive() && hippt::dot(-ray.direction, closest_hit_info.geometric_normal) < 0)
-                    {
-                        closest_hit_info.geometric_normal = -closest_hit_info.geometric_normal;
-                        closest_hit_info.shading_normal = -closest_hit_info.shading_normal;
-                    }
+/**
+ * For the BRDF calculations, bounces, ... to be correct, we need the normal to be in the same hemisphere as
+ * the view direction. One thing that can go wrong is when we have an emissive triangle (typical area light)
+ * and a ray hits the back of the triangle. The normal will not be facing the view direction in this
+ * case and this will cause issues later in the BRDF.
+ * Because we want to allow backfacing emissive geometry (making the emissive geometry double sided
+ * and emitting light in both directions of the surface), we're negating the normal to make
+ * it face the view direction (but only for emissive geometry)
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE void face_emissive_hit_normals(const hiprtRay& ray, const RendererMaterial& material, HitInfo& closest_hit_info)
+{
+    if (material.is_emissive() && hippt::dot(-ray.direction, closest_hit_info.geometric_normal) < 0)
+    {
+        closest_hit_info.geometric_normal = -closest_hit_info.geometric_normal;
+        closest_hit_info.shading_normal = -closest_hit_info.shading_normal;
+    }
+}
 
-                    // --------------------------------------------------- //
-                    // ----------------- Direct lighting ----------------- //
-                    // --------------------------------------------------- //
+/**
+ * Adds the emission and the direct lighting at the hit point to the path and samples
+ * the BSDF for the next bounce: 'ray' becomes the ray of the next bounce.
+ * Returns false if the path must be terminated (bad BSDF sample, Russian roulette or last bounce).
+ *
+ * The BSDF sample of the next bounce is also the BSDF sample of the MIS / RIS of the direct
+ * lighting: the emission that the next ray finds is weighted accordingly at the next hit (or
+ * miss) of the path. After the last bounce, the next ray of the path is still traced (with bounce
+ * == nb_bounces) if the MIS needs its emission, see is_last_ray_needed()
+ *
+ * If the RIS traced the ray of the next bounce, ray_payload.next_ray_traced is set: closest_hit_info,
+ * the material and the volume state of ray_payload are then the ones of the next hit of the path.
+ *
+ * If light_shadow_rays and envmap_shadow_rays are not null, the shadow rays
+ * of the direct lighting aren't traced and the direct lighting isn't added to the path:
+ * the caller traces the shadow rays and adds their radiance (clamped with
+ * clamp_direct_lighting()) times the throughput the path had before this call,
+ * whether the path continues or not
+ *
+ * If bsdf_sample is not null, it is used instead of sampling the BSDF of the hit. It must have been
+ * sampled after face_emissive_hit_normals(), with the first random numbers of random_number_generator
+ * for this hit. The volume state of ray_payload is then the one after the sampling
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE bool shade_hit(const HIPRTRenderData& render_data, hiprtRay& ray, RayPayload& ray_payload, HitInfo& closest_hit_info, int bounce, Sampler& random_number_generator,
+                                              DeferredShadowRays* light_shadow_rays = nullptr, DeferredShadowRays* envmap_shadow_rays = nullptr, const BSDFSample* bsdf_sample = nullptr)
+{
+    face_emissive_hit_normals(ray, ray_payload.material, closest_hit_info);
 
-                    ColorRGB light_sample_radiance = sample_one_light(render_data, ray_payload.material, closest_hit_info, -ray.direction, random_number_generator);
-                    ColorRGB envmap_radiance = sample_environment_map(render_data, ray_payload.material, closest_hit_info, -ray.direction, random_number_generator);
+    if (ray_payload.material.is_emissive())
+        ray_payload.ray_color += ray_payload.material.emission * ray_payload.throughput * emission_mis_weight(render_data, ray.direction, closest_hit_info, ray_payload.mis_state, bounce);
 
-                    ColorRGB direct_lighting_clamp(render_data.render_settings.direct_contribution_clamp > 0.0f ? render_data.render_settings.direct_contribution_clamp : 1.0e35f);
-                    ColorRGB envmap_lighting_clamp(render_data.render_settings.envmap_contribution_clamp > 0.0f ? render_data.render_settings.envmap_contribution_clamp : 1.0e35f);
+    if (bounce == render_data.render_settings.nb_bounces)
+        // Last ray of the path, only traced for its emission
+        return false;
 
-                    if (bounce == 0)
-                        // Clamping only on the primary rays
-                        light_sample_radiance = ColorRGB::min(direct_lighting_clamp, light_sample_radiance);
-                    envmap_radiance = ColorRGB::min(envmap_lighting_clamp, envmap_radiance);
+    // --------------------------------------- //
+    // ---------- Indirect lighting ---------- //
+    // --------------------------------------- //
 
-                    // --------------------------------------- //
-                    // ---------- Indirect lighting ---------- //
-                    // --------------------------------------- //
+    float brdf_pdf;
+    float3 bounce_direction;
+    ColorRGB bsdf_color;
+    if (bsdf_sample != nullptr)
+    {
+        bsdf_color = bsdf_sample->color;
+        bounce_direction = bsdf_sample->direction;
+        brdf_pdf = bsdf_sample->pdf;
+    }
+    else
+        bsdf_color = bsdf_dispatcher_sample(render_data.buffers.materials_buffer, ray_payload.material, ray_payload.volume_state, -ray.direction, closest_hit_info.shading_normal, closest_hit_info.geometric_normal, bounce_direction, brdf_pdf, random_number_generator);
 
-                    float brdf_pdf;
-                    float3 bounce_direction;
-                    ColorRGB bsdf_color = bsdf_dispatcher_sample(render_data.buffers.materials_buffer, ray_payload.material, ray_payload.volume_state, -ray.direction, closest_hit_info.shading_normal, closest_hit_info.geometric_normal, bounce_direction, brdf_pdf, random_number_generator);
+    // Terminate ray if bad sampling
+    if (brdf_pdf <= 0.0f)
+        return false;
 
-                    // Terminate ray if bad sampling
-                    if (brdf_pdf <= 0.0f)
-                        break;
+    int outside_surface = hippt::dot(bounce_direction, closest_hit_info.shading_normal) < 0 ? -1.0f : 1.0;
 
-#if DirectLightSamplingStrategy == LSS_NO_DIRECT_LIGHT_SAMPLING // No direct light sampling
-                    ray_payload.ray_color += ray_payload.material.emission * ray_payload.throughput;
-#else
-                    if (bounce == 0)
-                    // If we do have emissive geometry sampling, we only want to take
-                    // it into account on the first bounce, otherwise we would be
-                    // accounting for direct light sampling twice (bounce on emissive
-                    // geometry + direct light sampling). Otherwise, we don't check for bounce == 0
-                        ray_payload.ray_color += ray_payload.material.emission * ray_payload.throughput;
+    PathContinuation continuation;
+    continuation.ray.origin = closest_hit_info.inter_point + closest_hit_info.shading_normal * 3.0e-3f * outside_surface;
+    continuation.ray.direction = bounce_direction;
+    continuation.bsdf_color = bsdf_color;
+    continuation.bsdf_pdf = brdf_pdf;
+#if DirectLightSamplingStrategy == LSS_RIS_BSDF_AND_LIGHT || DirectLightSamplingStrategy == LSS_RESTIR_DI
+    continuation.ray_payload.volume_state = ray_payload.volume_state;
 #endif
 
-                    ray_payload.ray_color += (light_sample_radiance + envmap_radiance) * ray_payload.throughput;
+    // --------------------------------------------------- //
+    // ----------------- Direct lighting ----------------- //
+    // --------------------------------------------------- //
 
-                    ColorRGB indirect_clamp(render_data.render_settings.indirect_contribution_clamp > 0.0f ? render_data.render_settings.indirect_contribution_clamp : 1.0e35f);
-                    ray_payload.throughput *= bsdf_color * hippt::abs(hippt::dot(bounce_direction, closest_hit_info.shading_normal)) / brdf_pdf;
-                    ray_payload.throughput = ColorRGB::min(indirect_clamp, ray_payload.throughput);
+    bool emissive_triangles_sampled = is_emissive_triangles_sampled(render_data, ray_payload.material, closest_hit_info, -ray.direction);
+    bool envmap_sampled = is_envmap_sampled(render_data, ray_payload.material);
 
-                    int outside_surface = hippt::dot(bounce_direction, closest_hit_info.shading_normal) < 0 ? -1.0f : 1.0;
-                    ray.origin = closest_hit_info.inter_point + closest_hit_info.shading_normal * 3.0e-3f * outside_surface;
-                    ray.direction = bounce_direction;
+    bool sample_emissive_triangles = true;
+    bool sample_envmap = true;
+    float emissive_triangles_selection_probability = 1.0f;
+    float envmap_probability = 1.0f;
+#if DirectLightSelectionStrategy == DLS_POWER
+    if (emissive_triangles_sampled && envmap_sampled)
+    {
+        // Only one of them is sampled, the MIS weights account for the probability of picking it
+        envmap_probability = envmap_selection_probability(render_data);
+        emissive_triangles_selection_probability = 1.0f - envmap_probability;
 
-                    ray_payload.next_ray_state = RayState::BOUNCE;
-                }
-                else
-                {
-                    ColorRGB skysphere_color;
-                    if (render_data.world_settings.ambient_light_type == AmbientLightType::UNIFORM)
-                        skysphere_color = render_data.world_settings.uniform_light_color;
-#if EnvmapSamplingStrategy != ESS_NO_SAMPLING
-                    // Only checking that it is the first bounce if we're importance sampling the envmap.
-                    // Said otherwise, we're always going to take the envmap radiance into account on a
-                    // ray miss if we're not importance sampling the envmap
-                    else if (render_data.world_settings.ambient_light_type == AmbientLightType::ENVMAP && bounce == 0)
+        sample_envmap = random_number_generator() < envmap_probability;
+        sample_emissive_triangles = !sample_envmap;
+    }
 #endif
-                    {
-                        // We're only getting the skysphere radiance for the first rays because the
-                        // syksphere is importance sampled.
-                        // 
-                        // We're also getting the skysphere radiance for perfectly specular BRDF since those
-                        // are not importance sampled.
-
-                        skysphere_color = sample_environment_map_from_direction(render_data.world_settings, ray.direction);
-
-#if EnvmapSamplingStrategy == ESS_NO_SAMPLING
-                        // If we don't have envmap sampling, we're only going to unscale on
-                        // bounce 0 (which is when a ray misses directly --> background color).
-                        // Otherwise, if not bounce 2, we do want to take the scaling into
-                        // account so this if will fail and the envmap color will never be unscaled
-                        if (!render_data.world_settings.envmap_scale_background_intensity && bounce == 0)
-#else
-                        if (!render_data.world_settings.envmap_scale_background_intensity)
+
+    ColorRGB light_sample_radiance;
+    ColorRGB envmap_radiance;
+    if (sample_emissive_triangles)
+    {
+#if DirectLightSamplingStrategy == LSS_RESTIR_DI
+        if (ray_payload.restir_di_pixel_index != -1)
+            // The reservoir of the pixel was resampled for this hit
+            light_sample_radiance = restir_di_shade(render_data, ray_payload.material, closest_hit_info, -ray.direction, render_data.aux_buffers.restir_di_final_reservoirs[ray_payload.restir_di_pixel_index], emissive_triangles_selection_probability, light_shadow_rays);
+        else
 #endif
-                            // Un-scaling the envmap if the user doesn't want to scale the background
-                            skysphere_color /= render_data.world_settings.envmap_intensity;
-                    }
+            light_sample_radiance = sample_one_light(render_data, ray_payload.material, closest_hit_info, -ray.direction, continuation, emissive_triangles_selection_probability, random_number_generator, light_shadow_rays);
+    }
+    ray_payload.restir_di_pixel_index = -1;
+    if (sample_envmap)
+        envmap_radiance = sample_environment_map(render_data, ray_payload.material, closest_hit_info, -ray.direction, envmap_probability, random_number_generator, envmap_shadow_rays);
 
-                    ColorRGB skysphere_clamp(render_data.render_settings.envmap_contribution_clamp > 0.0f ? render_data.render_settings.envmap_contribution_clamp : 1.0e35f);
-                    skysphere_color = ColorRGB::min(skysphere_clamp, skysphere_color);
+    ray_payload.ray_color += clamp_direct_lighting(render_data, bounce, light_sample_radiance, envmap_radiance) * ray_payload.throughput;
 
-                    ray_payload.ray_color += skysphere_color * ray_payload.throughput;
-                    ray_payload.next_ray_state = RayState::MISSED;
-                }
-            }
-            else if (ray_payload.next_ray_state == RayState::MISSED)
-                break;
-        }
+    // The light and envmap samplings only sample directions above the surface
+    bool reflected = outside_surface > 0;
+    ray_payload.mis_state.bsdf_pdf = brdf_pdf;
+    ray_payload.mis_state.emissive_triangles_sampled = reflected && emissive_triangles_sampled;
+    ray_payload.mis_state.envmap_sampled = reflected && envmap_sampled;
+    ray_payload.mis_state.emissive_triangles_selection_probability = emissive_triangles_selection_probability;
+    ray_payload.mis_state.envmap_selection_probability = envmap_probability;
+    ray_payload.mis_state.previous_point = closest_hit_info.inter_point;
+    ray_payload.mis_state.previous_normal = closest_hit_info.shading_normal;
 
-        // Checking for NaNs / negative value samples. Output 
-        if (!sanity_check(render_data, ray_payload, x, y, res, sample))
-            return;
+    ColorRGB indirect_clamp(render_data.render_settings.indirect_contribution_clamp > 0.0f ? render_data.render_settings.indirect_contribution_clamp : 1.0e35f);
+    ray_payload.throughput *= bsdf_color * hippt::abs(hippt::dot(bounce_direction, closest_hit_info.shading_normal)) / brdf_pdf;
+    ray_payload.throughput = ColorRGB::min(indirect_clamp, ray_payload.throughput);
+
+    if (!russian_roulette(render_data, ray_payload.throughput, bounce, random_number_generator))
+        return false;
+
+    ray = continuation.ray;
+    ray_payload.next_ray_state = RayState::BOUNCE;
+
+    if (continuation.traced)
+    {
+        closest_hit_info = continuation.hit_info;
+        ray_payload.material = continuation.ray_payload.material;
+        ray_payload.volume_state = continuation.ray_payload.volume_state;
+        ray_payload.next_ray_traced = true;
+        ray_payload.next_ray_hit_found = continuation.hit_found;
+    }
+
+    if (bounce == render_data.render_settings.nb_bounces - 1)
+        return is_last_ray_needed(ray_payload.mis_state);
+
+    return true;
+}
+
+/**
+ * Adds the radiance of the sky to a path whose ray didn't hit anything
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE void shade_miss(const HIPRTRenderData& render_data, const hiprtRay& ray, RayPayload& ray_payload, int bounce)
+{
+    ColorRGB skysphere_color;
+    if (render_data.world_settings.ambient_light_type == AmbientLightType::UNIFORM)
+    {
+        // The uniform ambient light isn't sampled by the direct lighting, the
+        // last ray of the path (only traced for the MIS) doesn't bring it
+        if (bounce < render_data.render_settings.nb_bounces)
+            skysphere_color = render_data.world_settings.uniform_light_color;
+    }
+    else if (render_data.world_settings.ambient_light_type == AmbientLightType::ENVMAP)
+    {
+        skysphere_color = sample_environment_map_from_direction(render_data.world_settings, ray.direction);
+        // Weighted against the importance sampling of the envmap at the previous hit, if any
+        skysphere_color *= envmap_mis_weight(render_data, ray.direction, ray_payload.mis_state, bounce);
 
-        squared_luminance_of_samples += ray_payload.ray_color.luminance() * ray_payload.ray_color.luminance();
-        final_color += ray_payload.ray_color;
+        if (!render_data.world_settings.envmap_scale_background_intensity && bounce == 0)
+            // Un-scaling the envmap if the user doesn't want to scale the background
+            skysphere_color /= render_data.world_settings.envmap_intensity;
     }
 
+    ColorRGB skysphere_clamp(render_data.render_settings.envmap_contribution_clamp > 0.0f ? render_data.render_settings.envmap_contribution_clamp : 1.0e35f);
+    skysphere_color = ColorRGB::min(skysphere_clamp, skysphere_color);
+
+    ray_payload.ray_color += skysphere_color * ray_payload.throughput;
+    ray_payload.next_ray_state = RayState::MISSED;
+}
+
+/**
+ * Accumulates the samples of this frame in the framebuffer, the adaptive
+ * sampling buffers and the AOVs of the denoiser
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE void accumulate_pixel_samples(const HIPRTRenderData& render_data, uint32_t pixel_index, const ColorRGB& final_color, float squared_luminance_of_samples, ColorRGB denoiser_albedo, float3 denoiser_normal)
+{
     // If we got here, this means that we still have at least one ray active
     render_data.aux_buffers.still_one_ray_active[0] = 1;
 
@@ -326,4 +412,432 @@ GLOBAL_KERNEL_SIGNATURE(void) inline PathTracerKernel(HIPRTRenderData render_dat
     if (normal_length != 0.0f)
         // Checking that it is non-zero otherwise we would accumulate a persistent NaN in the buffer when normalizing by the 0-length
         render_data.aux_buffers.denoiser_normals[pixel_index] = accumulated_normal / normal_length;
-}
\ No newline at end of file
+}
+
+/**
+ * RayPayload::restir_di_pixel_index of the camera ray of the given sample of the pixel: the
+ * reservoir of the pixel was resampled for the hit of its first camera ray (see ReSTIRDIInitialCandidatesKernel)
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE int restir_di_pixel_index(const HIPRTRenderData& render_data, uint32_t pixel_index, int sample)
+{
+#if DirectLightSamplingStrategy == LSS_RESTIR_DI
+    if (sample == 0 && render_data.aux_buffers.restir_di_final_reservoirs != nullptr && !render_data.render_settings.render_low_resolution)
+        return pixel_index;
+#endif
+
+    return -1;
+}
+
+/**
+ * Camera ray through a random point of the pixel (x, y)
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE hiprtRay get_jittered_camera_ray(HIPRTCamera& camera, int x, int y, const int2& res, Sampler& random_number_generator)
+{
+    //Jittered around the center
+    float x_jittered = (x + 0.5f) + random_number_generator() - 1.0f;
+    float y_jittered = (y + 0.5f) + random_number_generator() - 1.0f;
+
+    return camera.get_camera_ray(x_jittered, y_jittered, res);
+}
+
+/**
+ * Traces the bounces of a path, starting at 'first_bounce' with 'ray'.
+ * The color of the path is accumulated in ray_payload. closest_hit_info is the
+ * hit of 'ray' if ray_payload.next_ray_traced is set (see shade_hit()).
+ *
+ * If the path is split (see path_split_count()), its copies are traced one after
+ * the other once the path is terminated and their color is added to ray_payload
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE void trace_path(const HIPRTRenderData& render_data, hiprtRay& ray, RayPayload& ray_payload, HitInfo& closest_hit_info, int first_bounce, Sampler& random_number_generator, ColorRGB& denoiser_albedo, float3& denoiser_normal)
+{
+    // A copy of the path, resuming at the shading of the hit where the path was split
+    struct PathSplit
+    {
+        hiprtRay ray;
+        RayPayload ray_payload;
+        HitInfo closest_hit_info;
+        int bounce;
+    };
+
+    PathSplit path_splits[RUSSIAN_ROULETTE_MAX_SPLIT_COUNT - 1];
+    int pending_split_count = 0;
+    bool path_split = false;
+
+    int bounce = first_bounce;
+    while (true)
+    {
+        // The bounce nb_bounces is the last ray of the path, see is_last_ray_needed()
+        for (; bounce <= render_data.render_settings.nb_bounces; bounce++)
+        {
+            if (ray_payload.next_ray_state == RayState::BOUNCE)
+            {
+                bool intersection_found;
+                if (ray_payload.next_ray_traced)
+                {
+                    intersection_found = ray_payload.next_ray_hit_found;
+                    ray_payload.next_ray_traced = false;
+                }
+                else
+                    intersection_found = trace_ray(render_data, ray, ray_payload, closest_hit_info);
+
+                if (intersection_found)
+                {
+                    if (bounce == 0)
+                    {
+                        denoiser_normal += closest_hit_info.shading_normal;
+                        denoiser_albedo += ray_payload.material.base_color;
+                    }
+
+                    // Not splitting at the first hit, the copies would add to the denoiser AOVs again
+                    int split_count = path_split || bounce == 0 ? 1 : path_split_count(render_data, ray_payload.throughput, bounce);
+                    if (split_count > 1)
+                    {
+                        // The path is only split once: the copies don't split again
+                        path_split = true;
+                        ray_payload.throughput /= static_cast<float>(split_count);
+
+                        for (int i = 1; i < split_count; i++)
+                        {
+                            PathSplit& split = path_splits[pending_split_count++];
+                            split.ray = ray;
+                            split.ray_payload = ray_payload;
+                            split.ray_payload.next_ray_traced = true;
+                            split.ray_payload.next_ray_hit_found = true;
+                            split.closest_hit_info = closest_hit_info;
+                            split.bounce = bounce;
+                        }
+                    }
+
+                    if (!shade_hit(render_data, ray, ray_payload, closest_hit_info, bounce, random_number_generator))
+                        break;
+                }
+                else
+                    shade_miss(render_data, ray, ray_payload, bounce);
+            }
+            else if (ray_payload.next_ray_state == RayState::MISSED)
+                break;
+        }
+
+        if (pending_split_count == 0)
+            break;
+
+        // Continuing with the next copy of the path, which
+        // adds its radiance to the color of the path so far
+        ColorRGB path_color = ray_payload.ray_color;
+        const PathSplit& split = path_splits[--pending_split_count];
+        ray = split.ray;
+        ray_payload = split.ray_payload;
+        ray_payload.ray_color = path_color;
+        closest_hit_info = split.closest_hit_info;
+        bounce = split.bounce;
+    }
+}
+
+/**
+ * Adds the color of a finished path to the samples of the pixel.
+ * Returns false if the sample is invalid (NaN or negative)
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE bool add_pixel_sample(const HIPRTRenderData& render_data, const ColorRGB& ray_color, int x, int y, const int2& res, int sample, ColorRGB& final_color, float& squared_luminance_of_samples)
+{
+    // Checking for NaNs / negative value samples. Output 
+    if (!sanity_check(render_data, ray_color, x, y, res, sample))
+        return false;
+
+    squared_luminance_of_samples += ray_color.luminance() * ray_color.luminance();
+    final_color += ray_color;
+
+    return true;
+}
+
+/**
+ * Traces the samples [first_sample, samples_per_frame[ of the pixel.
+ * Returns false if one of them is invalid
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE bool trace_pixel_samples(const HIPRTRenderData& render_data, HIPRTCamera& camera, int x, int y, const int2& res, int first_sample, Sampler& random_number_generator,
+                                                        ColorRGB& final_color, float& squared_luminance_of_samples, ColorRGB& denoiser_albedo, float3& denoiser_normal)
+{
+    for (int sample = first_sample; sample < render_data.render_settings.samples_per_frame; sample++)
+    {
+        start_pixel_sample(render_data, sample, random_number_generator);
+        hiprtRay ray = get_jittered_camera_ray(camera, x, y, res, random_number_generator);
+        RayPayload ray_payload;
+        ray_payload.restir_di_pixel_index = restir_di_pixel_index(render_data, x + y * res.x, sample);
+        HitInfo closest_hit_info;
+
+        trace_path(render_data, ray, ray_payload, closest_hit_info, 0, random_number_generator, denoiser_albedo, denoiser_normal);
+
+        if (!add_pixel_sample(render_data, ray_payload.ray_color, x, y, res, sample, final_color, squared_luminance_of_samples))
+            return false;
+    }
+
+    return true;
+}
+
+#ifdef __KERNELCC__
+GLOBAL_KERNEL_SIGNATURE(void) PathTracerKernel(HIPRTRenderData render_data, int2 res, HIPRTCamera camera)
+#else
+GLOBAL_KERNEL_SIGNATURE(void) inline PathTracerKernel(HIPRTRenderData render_data, int2 res, HIPRTCamera camera, int x, int y)
+#endif
+{
+#ifdef __KERNELCC__
+    const uint32_t x = blockIdx.x * blockDim.x + threadIdx.x;
+    const uint32_t y = blockIdx.y * blockDim.y + threadIdx.y;
+#endif
+    uint32_t pixel_index = (x + y * res.x);
+    if (pixel_index >= res.x * res.y)
+        return;
+
+    // 'Render low resolution' means that the user is moving the camera for example
+    // so we're going to reduce the quality of the render for increased framerates
+    // while moving
+    if (render_data.render_settings.render_low_resolution)
+    {
+        // Reducing the number of bounces to 3
+        render_data.render_settings.nb_bounces = 3;
+        render_data.render_settings.samples_per_frame = 1;
+        int res_scaling = render_data.render_settings.render_low_resolution_scaling;
+        pixel_index /= res_scaling;
+
+        // If rendering at low resolution, only one pixel out of res_scaling^2 will be rendered
+        if (x % res_scaling != 0 || y % res_scaling != 0)
+            return;
+    }
+
+    if (!prepare_pixel_sampling(render_data, pixel_index))
+        return;
+
+    Sampler random_number_generator = get_pixel_sampler(render_data, x, y, pixel_index);
+
+    float squared_luminance_of_samples = 0.0f;
+    ColorRGB final_color = ColorRGB(0.0f, 0.0f, 0.0f);
+    ColorRGB denoiser_albedo = ColorRGB(0.0f, 0.0f, 0.0f);
+    float3 denoiser_normal = make_float3(0.0f, 0.0f, 0.0f);
+    if (!trace_pixel_samples(render_data, camera, x, y, res, 0, random_number_generator, final_color, squared_luminance_of_samples, denoiser_albedo, denoiser_normal))
+        return;
+
+    accumulate_pixel_samples(render_data, pixel_index, final_color, squared_luminance_of_samples, denoiser_albedo, denoiser_normal);
+}
+
+/**
+ * First pass of the ReSTIR DI (LSS_RESTIR_DI), before PathTracerKernel: traces the first camera ray of
+ * the pixel (the same as PathTracerKernel) and resamples the reservoir of the pixel for its hit from light
+ * candidates and from the reservoir of the previous frame. 'previous_camera' is the camera of the previous frame
+ */
+#ifdef __KERNELCC__
+GLOBAL_KERNEL_SIGNATURE(void) ReSTIRDIInitialCandidatesKernel(HIPRTRenderData render_data, int2 res, HIPRTCamera camera, HIPRTCamera previous_camera)
+#else
+GLOBAL_KERNEL_SIGNATURE(void) inline ReSTIRDIInitialCandidatesKernel(HIPRTRenderData render_data, int2 res, HIPRTCamera camera, HIPRTCamera previous_camera, int x, int y)
+#endif
+{
+#ifdef __KERNELCC__
+    const uint32_t x = blockIdx.x * blockDim.x + threadIdx.x;
+    const uint32_t y = blockIdx.y * blockDim.y + threadIdx.y;
+#endif
+    uint32_t pixel_index = (x + y * res.x);
+    if (pixel_index >= res.x * res.y)
+        return;
+
+    Sampler camera_ray_sampler = get_pixel_sampler(render_data, x, y, pixel_index);
+    start_pixel_sample(render_data, 0, camera_ray_sampler);
+    hiprtRay ray = get_jittered_camera_ray(camera, x, y, res, camera_ray_sampler);
+
+    RayPayload ray_payload;
+    HitInfo closest_hit_info;
+    ReSTIRDISurface surface;
+    if (trace_ray(render_data, ray, ray_payload, closest_hit_info) && is_emissive_triangles_sampled(render_data, ray_payload.material, closest_hit_info, -ray.direction))
+    {
+        surface.inter_point = closest_hit_info.inter_point;
+        surface.shading_normal = closest_hit_info.shading_normal;
+        surface.view_direction = -ray.direction;
+        surface.texcoords = closest_hit_info.texcoords;
+        surface.camera_distance = hippt::length(closest_hit_info.inter_point - camera.position);
+        surface.material_index = render_data.buffers.material_indices[closest_hit_info.primitive_index];
+    }
+    render_data.aux_buffers.restir_di_surfaces[pixel_index] = surface;
+
+    // Random numbers of their own for the candidates, independent of the ones of the path of the pixel
+    Sampler random_number_generator = get_pixel_independent_sampler(pixel_index, 0);
+    start_pixel_sample(render_data, 0, random_number_generator);
+    restir_di_initial_candidates_and_temporal_reuse(render_data, previous_camera, res, pixel_index, surface, random_number_generator);
+}
+
+/**
+ * Second pass of the ReSTIR DI, after ReSTIRDIInitialCandidatesKernel for all the
+ * pixels: resamples the reservoir of the pixel with the ones of neighbouring pixels
+ */
+#ifdef __KERNELCC__
+GLOBAL_KERNEL_SIGNATURE(void) ReSTIRDISpatialReuseKernel(HIPRTRenderData render_data, int2 res)
+#else
+GLOBAL_KERNEL_SIGNATURE(void) inline ReSTIRDISpatialReuseKernel(HIPRTRenderData render_data, int2 res, int x, int y)
+#endif
+{
+#ifdef __KERNELCC__
+    const uint32_t x = blockIdx.x * blockDim.x + threadIdx.x;
+    const uint32_t y = blockIdx.y * blockDim.y + threadIdx.y;
+#endif
+    uint32_t pixel_index = (x + y * res.x);
+    if (pixel_index >= res.x * res.y)
+        return;
+
+    Sampler random_number_generator = get_pixel_independent_sampler(pixel_index, 1);
+    start_pixel_sample(render_data, 0, random_number_generator);
+    restir_di_spatial_reuse(render_data, res, x, y, random_number_generator);
+}
+
+#ifndef __KERNELCC__
+/**
+ * Convergence flags (AuxiliaryBuffers::still_one_ray_active and stop_noise_threshold_count) of the
+ * pixels rendered by one CPU thread during a frame. The kernels called by the thread with the render
+ * data of get_render_data() write to them instead of the flags shared by all the threads, whose cache
+ * line would otherwise bounce between the cores for each pixel. The thread adds them to the
+ * shared flags with reduce() once it's done with the frame
+ */
+struct ThreadConvergenceFlags
+{
+    /**
+     * Copy of 'render_data' whose convergence flags are the ones of this thread
+     */
+    HIPRTRenderData get_render_data(const HIPRTRenderData& render_data)
+    {
+        HIPRTRenderData thread_render_data = render_data;
+        thread_render_data.aux_buffers.still_one_ray_active = &still_one_ray_active;
+        thread_render_data.aux_buffers.stop_noise_threshold_count = &stop_noise_threshold_count;
+
+        return thread_render_data;
+    }
+
+    void reduce(const HIPRTRenderData& render_data)
+    {
+        if (still_one_ray_active)
+            render_data.aux_buffers.still_one_ray_active[0] = 1;
+        if (stop_noise_threshold_count > 0)
+            hippt::atomic_add(render_data.aux_buffers.stop_noise_threshold_count, static_cast<unsigned int>(stop_noise_threshold_count));
+    }
+
+    unsigned char still_one_ray_active = false;
+    AtomicType<unsigned int> stop_noise_threshold_count = 0;
+};
+
+/**
+ * CPU version of PathTracerKernel for a block of up to BVHConstants::RAY_PACKET_SIZE pixels
+ * (block_size.x * block_size.y), with the same results as one call of PathTracerKernel per pixel.
+ *
+ * The camera rays of the first sample of the pixels are coherent: they are traced as a packet.
+ * The shadow rays of the direct lighting at their hits are deferred and traced in packets as well,
+ * the rest of the paths and the other samples are traced pixel by pixel.
+ *
+ * Doesn't handle the low resolution rendering (RenderSettings::render_low_resolution), the pixels
+ * must then be rendered with PathTracerKernel
+ */
+inline void PathTracerPacketKernel(const HIPRTRenderData& render_data, int2 res, HIPRTCamera camera, int2 block_origin, int2 block_size)
+{
+    constexpr int MAX_PIXEL_COUNT = BVHConstants::RAY_PACKET_SIZE;
+
+    struct PixelPath
+    {
+        int x, y;
+        uint32_t pixel_index;
+
+        Sampler random_number_generator;
+        hiprtRay ray;
+        RayPayload ray_payload;
+        HitInfo closest_hit_info;
+        bool path_continues;
+
+        // Throughput of the path at its first hit and the shadow rays of that hit
+        ColorRGB shading_throughput;
+        DeferredShadowRays light_shadow_rays;
+        DeferredShadowRays envmap_shadow_rays;
+        ColorRGB light_sample_radiance;
+        ColorRGB envmap_radiance;
+
+        ColorRGB denoiser_albedo;
+        float3 denoiser_normal;
+    };
+
+    PixelPath paths[MAX_PIXEL_COUNT];
+    int path_count = 0;
+
+    RayPacket camera_rays;
+    for (int y = block_origin.y; y < block_origin.y + block_size.y; y++)
+    {
+        for (int x = block_origin.x; x < block_origin.x + block_size.x; x++)
+        {
+            uint32_t pixel_index = x + y * res.x;
+            if (pixel_index >= res.x * res.y || !prepare_pixel_sampling(render_data, pixel_index))
+                continue;
+
+            PixelPath& path = paths[path_count++];
+            path.x = x;
+            path.y = y;
+            path.pixel_index = pixel_index;
+            path.random_number_generator = get_pixel_sampler(render_data, x, y, pixel_index);
+            start_pixel_sample(render_data, 0, path.random_number_generator);
+            path.ray = get_jittered_camera_ray(camera, x, y, res, path.random_number_generator);
+            path.ray_payload.restir_di_pixel_index = restir_di_pixel_index(render_data, pixel_index, 0);
+            path.denoiser_albedo = ColorRGB(0.0f, 0.0f, 0.0f);
+            path.denoiser_normal = make_float3(0.0f, 0.0f, 0.0f);
+
+            camera_rays.add_ray(path.ray);
+        }
+    }
+
+    if (path_count == 0)
+        return;
+
+    hiprtHit camera_ray_hits[MAX_PIXEL_COUNT];
+    intersect_scene_cpu_packet(render_data, camera_rays, camera_ray_hits);
+
+    // First bounce of the first sample of each pixel, the shadow
+    // rays of the direct lighting are gathered in batches
+    ShadowRayPacketBatch light_shadow_ray_batch;
+    ShadowRayPacketBatch envmap_shadow_ray_batch;
+    for (int path_index = 0; path_index < path_count; path_index++)
+    {
+        PixelPath& path = paths[path_index];
+        path.light_shadow_rays.count = 0;
+        path.envmap_shadow_rays.count = 0;
+        path.light_sample_radiance = ColorRGB(0.0f);
+        path.envmap_radiance = ColorRGB(0.0f);
+        path.path_continues = false;
+
+        if (render_data.render_settings.nb_bounces == 0)
+            continue;
+
+        if (!trace_ray(render_data, path.ray, path.ray_payload, path.closest_hit_info, &camera_ray_hits[path_index]))
+        {
+            shade_miss(render_data, path.ray, path.ray_payload, 0);
+
+            continue;
+        }
+
+        path.denoiser_normal += path.closest_hit_info.shading_normal;
+        path.denoiser_albedo += path.ray_payload.material.base_color;
+
+        path.shading_throughput = path.ray_payload.throughput;
+        path.path_continues = shade_hit(render_data, path.ray, path.ray_payload, path.closest_hit_info, 0, path.random_number_generator, &path.light_shadow_rays, &path.envmap_shadow_rays);
+
+        light_shadow_ray_batch.add(render_data, path.light_shadow_rays, &path.light_sample_radiance);
+        envmap_shadow_ray_batch.add(render_data, path.envmap_shadow_rays, &path.envmap_radiance);
+    }
+    light_shadow_ray_batch.flush(render_data);
+    envmap_shadow_ray_batch.flush(render_data);
+
+    for (int path_index = 0; path_index < path_count; path_index++)
+    {
+        PixelPath& path = paths[path_index];
+        path.ray_payload.ray_color += clamp_direct_lighting(render_data, 0, path.light_sample_radiance, path.envmap_radiance) * path.shading_throughput;
+        if (path.path_continues)
+            trace_path(render_data, path.ray, path.ray_payload, path.closest_hit_info, 1, path.random_number_generator, path.denoiser_albedo, path.denoiser_normal);
+
+        float squared_luminance_of_samples = 0.0f;
+        ColorRGB final_color = ColorRGB(0.0f, 0.0f, 0.0f);
+        if (!add_pixel_sample(render_data, path.ray_payload.ray_color, path.x, path.y, res, 0, final_color, squared_luminance_of_samples))
+            continue;
+        if (!trace_pixel_samples(render_data, camera, path.x, path.y, res, 1, path.random_number_generator, final_color, squared_luminance_of_samples, path.denoiser_albedo, path.denoiser_normal))
+            continue;
+
+        accumulate_pixel_samples(render_data, path.pixel_index, final_color, squared_luminance_of_samples, path.denoiser_albedo, path.denoiser_normal);
+    }
+}
+#endif
@@ -7,6 +7,8 @@
 #define HIPRT_SCENE_H
 
 #include "HIPRT-Orochi/HIPRTOrochiUtils.h"
+#include "HostDeviceCommon/EmissiveTriangle.h"
+#include "HostDeviceCommon/LightBVHNode.h"
 #include "HostDeviceCommon/Material.h"
 
 #include "hiprt/hiprt.h"
@@ -105,10 +107,28 @@ struct HIPRTScene
 
 	int emissive_triangles_count = 0;
 	OrochiBuffer<int> emissive_triangles_indices;
+	OrochiBuffer<EmissiveTriangle> emissive_triangles;
+	OrochiBuffer<float> emissive_triangles_alias_probabilities;
+	OrochiBuffer<int> emissive_triangles_aliases;
+	float emissive_triangles_power_sum = 0.0f;
+
+	// Light BVH over the emissive triangles (see LightBVH), not allocated
+	// if no emissive triangle has any power
+	int light_bvh_light_count = 0;
+	OrochiBuffer<LightBVHNode> light_bvh_nodes;
+	OrochiBuffer<int> light_bvh_emissive_indices;
+	OrochiBuffer<unsigned long long> light_bvh_trails;
+	OrochiBuffer<unsigned long long> light_bvh_sorted_keys;
+	OrochiBuffer<int> light_bvh_sorted_emissive_indices;
 
 	OrochiBuffer<oroTextureObject_t> materials_textures;
 	OrochiBuffer<int2> textures_dims;
 	OrochiBuffer<float2> texcoords_buffer;
+
+	// Empty if all the triangles of the scene are opaque
+	OrochiBuffer<unsigned char> triangle_opacities;
+	OrochiBuffer<unsigned int> alpha_mask_bits;
+	OrochiBuffer<int> alpha_mask_offsets;
 };
 
 #endif
@@ -7,19 +7,29 @@
 
 OrochiEnvmap::OrochiEnvmap(ImageRGBA& image) : OrochiTexture(image)
 {
-	compute_cdf(image);
+	upload_sampling_tables(image);
 }
 
 OrochiEnvmap::OrochiEnvmap(OrochiEnvmap&& other) : OrochiTexture(std::move(other))
 {
-	m_cdf = std::move(other.m_cdf);
+	m_marginal_alias_probabilities = std::move(other.m_marginal_alias_probabilities);
+	m_marginal_aliases = std::move(other.m_marginal_aliases);
+	m_conditional_alias_probabilities = std::move(other.m_conditional_alias_probabilities);
+	m_conditional_aliases = std::move(other.m_conditional_aliases);
+	m_pixel_probabilities = std::move(other.m_pixel_probabilities);
+	m_luminance_integral = other.m_luminance_integral;
 }
 
 void OrochiEnvmap::operator=(OrochiEnvmap&& other)
 {
 	OrochiTexture::operator=(std::move(other));
 
-	m_cdf = std::move(other.m_cdf);
+	m_marginal_alias_probabilities = std::move(other.m_marginal_alias_probabilities);
+	m_marginal_aliases = std::move(other.m_marginal_aliases);
+	m_conditional_alias_probabilities = std::move(other.m_conditional_alias_probabilities);
+	m_conditional_aliases = std::move(other.m_conditional_aliases);
+	m_pixel_probabilities = std::move(other.m_pixel_probabilities);
+	m_luminance_integral = other.m_luminance_integral;
 }
 
 void OrochiEnvmap::init_from_image(const ImageRGBA& image)
@@ -27,23 +37,32 @@ void OrochiEnvmap::init_from_image(const ImageRGBA& image)
 	OrochiTexture::init_from_image(image);
 }
 
-void OrochiEnvmap::compute_cdf(ImageRGBA& image)
+void OrochiEnvmap::upload_sampling_tables(ImageRGBA& image)
 {
-	std::vector<float> cdf = image.compute_get_cdf();
+	const EnvmapSamplingTables& sampling_tables = image.get_envmap_sampling_tables();
 
-	m_cdf.resize(width * height);
-	m_cdf.upload_data(cdf.data());
+	m_marginal_alias_probabilities.resize(height);
+	m_marginal_alias_probabilities.upload_data(sampling_tables.marginal_alias_probabilities.data());
+	m_marginal_aliases.resize(height);
+	m_marginal_aliases.upload_data(sampling_tables.marginal_aliases.data());
+	m_conditional_alias_probabilities.resize(width * height);
+	m_conditional_alias_probabilities.upload_data(sampling_tables.conditional_alias_probabilities.data());
+	m_conditional_aliases.resize(width * height);
+	m_conditional_aliases.upload_data(sampling_tables.conditional_aliases.data());
+	m_pixel_probabilities.resize(width * height);
+	m_pixel_probabilities.upload_data(sampling_tables.pixel_probabilities.data());
+	m_luminance_integral = sampling_tables.luminance_integral;
 }
 
-OrochiBuffer<float>& OrochiEnvmap::get_cdf_buffer()
+void OrochiEnvmap::fill_world_settings_sampling_tables(WorldSettings& world_settings)
 {
-	return m_cdf;
-}
-
-float* OrochiEnvmap::get_cdf_device_pointer()
-{
-	if (m_cdf.get_element_count() == 0)
-		std::cerr << "Trying to get the CDF of an OrochiEnvmap whose CDF wasn't computed in the first place..." << std::endl;
+	if (m_pixel_probabilities.get_element_count() == 0)
+		std::cerr << "Trying to get the sampling tables of an OrochiEnvmap whose tables weren't uploaded in the first place..." << std::endl;
 
-	return m_cdf.get_device_pointer();
+	world_settings.envmap_marginal_alias_probabilities = m_marginal_alias_probabilities.get_device_pointer();
+	world_settings.envmap_marginal_aliases = m_marginal_aliases.get_device_pointer();
+	world_settings.envmap_conditional_alias_probabilities = m_conditional_alias_probabilities.get_device_pointer();
+	world_settings.envmap_conditional_aliases = m_conditional_aliases.get_device_pointer();
+	world_settings.envmap_pixel_probabilities = m_pixel_probabilities.get_device_pointer();
+	world_settings.envmap_luminance_integral = m_luminance_integral;
 }
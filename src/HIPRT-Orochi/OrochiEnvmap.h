@@ -7,6 +7,7 @@
 #define OROCHI_ENVMAP_H
 
 #include "HIPRT-Orochi/OrochiTexture.h"
+#include "HostDeviceCommon/RenderData.h"
 
 class OrochiEnvmap : public OrochiTexture
 {
@@ -21,12 +22,18 @@ public:
 	void operator=(OrochiEnvmap&& other);
 
 	void init_from_image(const ImageRGBA& image);
-	void compute_cdf(ImageRGBA& image);
-	OrochiBuffer<float>& get_cdf_buffer();
-	float* get_cdf_device_pointer();
+	void upload_sampling_tables(ImageRGBA& image);
+	// Sets the pointers to the sampling tables of the envmap in the world settings
+	void fill_world_settings_sampling_tables(WorldSettings& world_settings);
 
 private:
-	OrochiBuffer<float> m_cdf;
+	// Alias tables for importance sampling the envmap, see EnvmapSamplingTables
+	OrochiBuffer<float> m_marginal_alias_probabilities;
+	OrochiBuffer<int> m_marginal_aliases;
+	OrochiBuffer<float> m_conditional_alias_probabilities;
+	OrochiBuffer<int> m_conditional_aliases;
+	OrochiBuffer<float> m_pixel_probabilities;
+	float m_luminance_integral = 0.0f;
 };
 
 #endif
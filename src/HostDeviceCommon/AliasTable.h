@@ -0,0 +1,95 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#ifndef HOST_DEVICE_COMMON_ALIAS_TABLE_H
+#define HOST_DEVICE_COMMON_ALIAS_TABLE_H
+
+#include <hiprt/hiprt_device.h>
+
+#include "HostDeviceCommon/Math.h"
+#include "HostDeviceCommon/Sampler.h"
+
+#ifndef __KERNELCC__
+#include <vector>
+#endif
+
+/**
+ * Samples an element of an alias table of 'count' elements in O(1): the element i is
+ * picked with a probability proportional to the weight it was given in build_alias_table().
+ *
+ * An element is first picked uniformly and is kept with the probability probabilities[i].
+ * Its alias, aliases[i], is returned otherwise
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE int sample_alias_table(const float* probabilities, const int* aliases, int count, Sampler& random_number_generator)
+{
+    int index = random_number_generator.random_index(count);
+    if (random_number_generator() < probabilities[index])
+        return index;
+    else
+        return aliases[index];
+}
+
+#ifndef __KERNELCC__
+/**
+ * Builds the alias table (Vose's method) of the given weights for sample_alias_table().
+ * The weights must be >= 0 with a sum > 0. Elements with a weight of 0 are never sampled
+ */
+inline void build_alias_table(const std::vector<float>& weights, std::vector<float>& probabilities, std::vector<int>& aliases)
+{
+    int count = weights.size();
+
+    double weight_sum = 0.0;
+    for (float weight : weights)
+        weight_sum += weight;
+
+    probabilities.resize(count);
+    aliases.resize(count);
+
+    // Weights scaled so that their average is 1. The elements below 1 are the 'small'
+    // ones that give the rest of their probability to one 'large' element, their alias
+    std::vector<double> scaled_weights(count);
+    std::vector<int> small_elements;
+    std::vector<int> large_elements;
+    for (int i = 0; i < count; i++)
+    {
+        scaled_weights[i] = weights[i] * count / weight_sum;
+        if (scaled_weights[i] < 1.0)
+            small_elements.push_back(i);
+        else
+            large_elements.push_back(i);
+    }
+
+    while (!small_elements.empty() && !large_elements.empty())
+    {
+        int small_element = small_elements.back();
+        int large_element = large_elements.back();
+        small_elements.pop_back();
+
+        probabilities[small_element] = scaled_weights[small_element];
+        aliases[small_element] = large_element;
+
+        scaled_weights[large_element] -= 1.0 - scaled_weights[small_element];
+        if (scaled_weights[large_element] < 1.0)
+        {
+            large_elements.pop_back();
+            small_elements.push_back(large_element);
+        }
+    }
+
+    // Only rounding errors are left in these, they keep all their probability
+    for (int large_element : large_elements)
+    {
+        probabilities[large_element] = 1.0f;
+        aliases[large_element] = large_element;
+    }
+    for (int small_element : small_elements)
+    {
+        probabilities[small_element] = 1.0f;
+        aliases[small_element] = small_element;
+    }
+}
+#endif
+
+#endif
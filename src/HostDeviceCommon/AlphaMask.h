@@ -0,0 +1,54 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#ifndef HOST_DEVICE_COMMON_ALPHA_MASK_H
+#define HOST_DEVICE_COMMON_ALPHA_MASK_H
+
+#include <hiprt/hiprt_device.h>
+
+#include "HostDeviceCommon/Math.h"
+
+/**
+ * Opacity of the base color of a triangle, computed once when
+ * the scene is loaded (Scene::compute_triangle_opacities())
+ */
+enum TriangleOpacity
+{
+    // Alpha of 1 everywhere on the triangle, or no base color texture
+    TRIANGLE_OPAQUE,
+    // Alpha < 1 everywhere on the triangle, rays always go through it
+    TRIANGLE_TRANSPARENT,
+    // Partly transparent, the alpha mask of the base
+    // color texture tells which parts of the triangle are
+    TRIANGLE_MASKED
+};
+
+/**
+ * Texel of a texture of the given dimensions that is read at the given UV
+ * coordinates. Same addressing (repeat, nearest, [0, 0] bottom-left) as ImageBase::sample()
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE int2 texel_from_uv(float2 uv, int2 texture_dims)
+{
+    // Keeping the fractional part, -0.1f behaves as 0.9f
+    float u = uv.x - (int)uv.x;
+    float v = uv.y - (int)uv.y;
+    u = u < 0 ? 1.0f + u : u;
+    v = v < 0 ? 1.0f + v : v;
+
+    v = 1.0f - v;
+
+    return make_int2(static_cast<int>(u * (texture_dims.x - 1)), static_cast<int>(v * (texture_dims.y - 1)));
+}
+
+/**
+ * Alpha masks store one bit per texel, packed in 32-bit words. The bit is
+ * set for the texels that are opaque (alpha of 1)
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE bool read_alpha_mask(const unsigned int* alpha_mask, int texel_index)
+{
+    return (alpha_mask[texel_index / 32] >> (texel_index % 32)) & 1u;
+}
+
+#endif
@@ -13,6 +13,8 @@ struct HIPRTCamera
 {
     float4x4 inverse_view;
     float4x4 inverse_projection;
+    // Projection * view, for reprojecting points into the image (see get_pixel_of_point())
+    float4x4 view_projection;
     float3 position;
 
     HIPRT_HOST_DEVICE hiprtRay get_camera_ray(float x, float y, int2 res)
@@ -37,6 +39,30 @@ struct HIPRTCamera
 
         return ray;
     }
+
+    /**
+     * Inverse of get_camera_ray(): the pixel whose camera rays go through the point.
+     * Returns false if the point is behind the camera or outside of the image
+     */
+    HIPRT_HOST_DEVICE bool get_pixel_of_point(const float3& point, int2 res, int2& pixel) const
+    {
+        float x_clip = view_projection.m[0][0] * point.x + view_projection.m[1][0] * point.y + view_projection.m[2][0] * point.z + view_projection.m[3][0];
+        float y_clip = view_projection.m[0][1] * point.x + view_projection.m[1][1] * point.y + view_projection.m[2][1] * point.z + view_projection.m[3][1];
+        float w_clip = view_projection.m[0][3] * point.x + view_projection.m[1][3] * point.y + view_projection.m[2][3] * point.z + view_projection.m[3][3];
+        if (w_clip <= 0.0f)
+            return false;
+
+        // The camera rays of the pixel x go through [x - 0.5, x + 0.5]
+        float x = (x_clip / w_clip + 1.0f) * 0.5f * res.x + 0.5f;
+        float y = (y_clip / w_clip + 1.0f) * 0.5f * res.y + 0.5f;
+        if (!(x >= 0.0f && x < res.x && y >= 0.0f && y < res.y))
+            return false;
+
+        pixel.x = static_cast<int>(x);
+        pixel.y = static_cast<int>(y);
+
+        return true;
+    }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,94 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#ifndef HOST_DEVICE_COMMON_EMISSIVE_TRIANGLE_H
+#define HOST_DEVICE_COMMON_EMISSIVE_TRIANGLE_H
+
+#include <hiprt/hiprt_device.h>
+
+#include "HostDeviceCommon/AliasTable.h"
+#include "HostDeviceCommon/Material.h"
+#include "HostDeviceCommon/Math.h"
+
+#ifndef __KERNELCC__
+#include <vector>
+#endif
+
+/**
+ * World space geometry of an emissive triangle, computed once when the scene is
+ * loaded (Scene::compute_emissive_triangles()) so that the light sampling doesn't
+ * have to fetch the vertices of the triangles it samples
+ */
+struct EmissiveTriangle
+{
+    float3 vertex_A;
+    float3 edge_AB;
+    float3 edge_AC;
+    float3 normal;
+    // 0 for the triangles that are too small for their
+    // normal to be computed, they are never sampled
+    float area = 0.0f;
+
+    int material_index = 0;
+};
+
+HIPRT_HOST_DEVICE HIPRT_INLINE EmissiveTriangle make_emissive_triangle(const float3& vertex_A, const float3& vertex_B, const float3& vertex_C, int material_index)
+{
+    EmissiveTriangle triangle;
+    triangle.vertex_A = vertex_A;
+    triangle.edge_AB = vertex_B - vertex_A;
+    triangle.edge_AC = vertex_C - vertex_A;
+    triangle.material_index = material_index;
+
+    float3 normal = hippt::cross(triangle.edge_AB, triangle.edge_AC);
+    float length_normal = hippt::length(normal);
+    if (length_normal <= 1.0e-6f)
+    {
+        // Can happen with very small triangles
+        triangle.normal = make_float3(0.0f, 0.0f, 1.0f);
+
+        return triangle;
+    }
+
+    triangle.normal = normal / length_normal;
+    triangle.area = length_normal * 0.5f;
+
+    return triangle;
+}
+
+#ifndef __KERNELCC__
+/**
+ * Builds the alias table that samples the emissive triangles proportionally to their power
+ * (luminance of their emission times their area) and returns the sum of their powers.
+ * Must be rebuilt when the emission of the materials changes
+ */
+inline float build_emissive_triangles_alias_table(const std::vector<EmissiveTriangle>& emissive_triangles, const std::vector<RendererMaterial>& materials, std::vector<float>& alias_probabilities, std::vector<int>& aliases)
+{
+    int emissive_triangle_count = emissive_triangles.size();
+
+    float power_sum = 0.0f;
+    std::vector<float> powers(emissive_triangle_count);
+    for (int i = 0; i < emissive_triangle_count; i++)
+    {
+        powers[i] = materials[emissive_triangles[i].material_index].emission.luminance() * emissive_triangles[i].area;
+        power_sum += powers[i];
+    }
+
+    if (power_sum > 0.0f)
+        build_alias_table(powers, alias_probabilities, aliases);
+    else
+    {
+        // Nothing that can be sampled, the table is never used
+        alias_probabilities.assign(emissive_triangle_count, 1.0f);
+        aliases.resize(emissive_triangle_count);
+        for (int i = 0; i < emissive_triangle_count; i++)
+            aliases[i] = i;
+    }
+
+    return power_sum;
+}
+#endif
+
+#endif
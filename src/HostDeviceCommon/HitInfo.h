@@ -12,6 +12,8 @@
 struct LightSourceInformation
 {
     int emissive_triangle_index = -1;
+    // Instance of the emissive triangle, -1 if the geometry is not instanced
+    int emissive_instance_index = -1;
     float3 light_source_normal = { 0.0f, 1.0f, 0.0f };
     float light_area = 1.0f;
     ColorRGB emission;
@@ -28,6 +30,8 @@ struct HitInfo
     float t = -1.0f; // Distance along ray
 
     int primitive_index = -1;
+    // Instance of the primitive hit, -1 if the geometry is not instanced
+    int instance_index = -1;
 };
 
 #endif
\ No newline at end of file
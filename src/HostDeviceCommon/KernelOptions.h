@@ -40,9 +40,16 @@
 #define LSS_BSDF 2
 #define LSS_MIS_LIGHT_BSDF 3
 #define LSS_RIS_BSDF_AND_LIGHT 4
+#define LSS_RESTIR_DI 5
+
+#define ETS_POWER 0
+#define ETS_LIGHT_BVH 1
+
+#define DLS_EMISSIVE_AND_ENVMAP 0
+#define DLS_POWER 1
 
 #define ESS_NO_SAMPLING 0
-#define ESS_BINARY_SEARCH 1
+#define ESS_ALIAS_TABLE 1
 
 #define RIS_USE_VISIBILITY_FALSE 0
 #define RIS_USE_VISIBILITY_TRUE 1
@@ -84,9 +91,42 @@
  * 
  *	- LSS_RIS_ONLY_LIGHT_CANDIDATES
  *		Sample render_settings.RIS_number_candidates lights in the scene with RIS
+ * 
+ *	- LSS_RESTIR_DI
+ *		At the primary hits, ReSTIR DI: the RIS reservoirs of the pixels are reused from the previous
+ *		frame and from the neighbouring pixels (see Device/includes/ReSTIRDI.h). RIS at the other hits.
+ *		CPU renderer only, the GPU renderer falls back to LSS_RIS_BSDF_AND_LIGHT
  */
 #define DirectLightSamplingStrategy LSS_RIS_BSDF_AND_LIGHT
 
+/**
+ * How the direct lighting picks the emissive triangle it samples
+ * 
+ * Possible values (the prefix ETS stands for "Emissive Triangle Sampling"):
+ * 
+ *	- ETS_POWER
+ *		Picks the emissive triangles proportionally to their power with an alias table
+ * 
+ *	- ETS_LIGHT_BVH
+ *		Picks the emissive triangles by traversing a light BVH, according to how much they
+ *		may light the shading point given its position and normal. Better with many lights
+ */
+#define EmissiveTriangleSamplingStrategy ETS_POWER
+
+/**
+ * What the direct lighting samples at a hit when both the emissive triangles and the envmap can be sampled
+ * 
+ * Possible values (the prefix DLS stands for "Direct Light Selection"):
+ * 
+ *	- DLS_EMISSIVE_AND_ENVMAP
+ *		Samples both the emissive triangles and the envmap: two shadow rays per hit
+ * 
+ *	- DLS_POWER
+ *		Samples either the emissive triangles or the envmap, picked proportionally to
+ *		an estimate of their power: one shadow ray per hit
+ */
+#define DirectLightSelectionStrategy DLS_EMISSIVE_AND_ENVMAP
+
 /**
  * What envmap sampling strategy to use
  * 
@@ -95,10 +135,11 @@
  *	- ESS_NO_SAMPLING
  *		No importance sampling of the envmap
  * 
- *	- ESS_BINARY_SEARCH
- *		Importance samples the environment map using a binary search on the CDF distributions of the envmap
+ *	- ESS_ALIAS_TABLE
+ *		Importance samples the environment map in O(1) with the marginal / conditional alias tables
+ *		of the luminance of its pixels times sin(theta)
  */
-#define EnvmapSamplingStrategy ESS_BINARY_SEARCH
+#define EnvmapSamplingStrategy ESS_ALIAS_TABLE
 
 /**
  * Whether or not to use a visiblity term in the target function whose PDF we're approximating with RIS.
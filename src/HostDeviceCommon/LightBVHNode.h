@@ -0,0 +1,51 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#ifndef HOST_DEVICE_COMMON_LIGHT_BVH_NODE_H
+#define HOST_DEVICE_COMMON_LIGHT_BVH_NODE_H
+
+#include <hiprt/hiprt_device.h>
+
+#include "HostDeviceCommon/Math.h"
+
+/**
+ * Node of the light BVH over the emissive triangles (built by LightBVH on the CPU,
+ * traversed by light_bvh_sample() / light_bvh_pdf()).
+ *
+ * The nodes are stored in depth-first order: the first child of an inner node
+ * is the node that follows it
+ */
+struct LightBVHNode
+{
+    // Bounding sphere of the bounding box of the emissive triangles of the node
+    float3 center;
+    float radius = 0.0f;
+
+    // Cone bounding the normals of the emissive triangles of the node: the normals are within
+    // acos(cos_theta_o) of cone_axis. The emissive triangles are double sided, they emit in
+    // the hemisphere around their normal and the opposite one
+    float3 cone_axis;
+    float cos_theta_o = 1.0f;
+    float sin_theta_o = 0.0f;
+
+    // Sum of the power of the emissive triangles of the node
+    float power = 0.0f;
+
+    // Index of the second child for the inner nodes. Index of the first emissive
+    // triangle of the leaf in LightBVH::emissive_indices for the leaves
+    int second_child_or_first_emissive = 0;
+    // 0 for the inner nodes
+    int emissive_count = 0;
+};
+
+/**
+ * Key of an emissive triangle in LightBVH::sorted_keys. instance_index is -1 if the geometry isn't instanced
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE unsigned long long emissive_triangle_key(int triangle_index, int instance_index)
+{
+    return (static_cast<unsigned long long>(instance_index + 1) << 32) | static_cast<unsigned int>(triangle_index);
+}
+
+#endif
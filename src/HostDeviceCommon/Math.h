@@ -146,4 +146,17 @@ HIPRT_HOST_DEVICE HIPRT_INLINE float3 matrix_X_vec(const float4x4& m, const floa
 	return make_float3(xt * inv_w, yt * inv_w, zt * inv_w);
 }
 
+/**
+ * Multiplies the vector by the transpose of the upper 3x3 part of the
+ * matrix: inverse of matrix_X_vec() for a rotation matrix
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE float3 matrix_transpose_X_vec(const float4x4& m, const float3& u)
+{
+	float xt = m.m[0][0] * u.x + m.m[0][1] * u.y + m.m[0][2] * u.z;
+	float yt = m.m[1][0] * u.x + m.m[1][1] * u.y + m.m[1][2] * u.z;
+	float zt = m.m[2][0] * u.x + m.m[2][1] * u.y + m.m[2][2] * u.z;
+
+	return make_float3(xt, yt, zt);
+}
+
 #endif
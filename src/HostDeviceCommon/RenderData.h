@@ -7,8 +7,13 @@
 #define HIPRT_SCENE_DATA_H
 
 #include "HostDeviceCommon/AlignMacro.h"
+#include "HostDeviceCommon/AlphaMask.h"
+#include "HostDeviceCommon/EmissiveTriangle.h"
+#include "HostDeviceCommon/LightBVHNode.h"
 #include "HostDeviceCommon/Material.h"
 #include "HostDeviceCommon/Math.h"
+#include "HostDeviceCommon/Reservoir.h"
+#include "HostDeviceCommon/Sampler.h"
 
 #include <hiprt/hiprt_device.h>
 #include <Orochi/Orochi.h>
@@ -42,6 +47,14 @@ struct ALIGN(8) HIPRTRenderSettings
 	// same path every frame, allowing for more stable benchmarking.
 	int freeze_random = false;
 
+	// Where the random numbers of the paths come from: SAMPLER_INDEPENDENT,
+	// SAMPLER_SOBOL or SAMPLER_BLUE_NOISE (see HostDeviceCommon/Sampler.h)
+	int sampler_type = SAMPLER_SOBOL;
+	// Index of the first sample of the render in the sequences of the pixels. The random numbers
+	// of a sample only depend on its pixel and its index: renders of disjoint ranges of samples
+	// of the same scene can be merged into the render of all the samples
+	int first_sample_index = 0;
+
 	// If true, NaNs encountered during rendering will be rendered as very bright pink. 
 	// Useful for debugging only.
 	bool display_NaNs = false;
@@ -76,11 +89,38 @@ struct ALIGN(8) HIPRTRenderSettings
 	// Clamp indirect lighting contribution to reduce fireflies
 	float indirect_contribution_clamp = 0.0f;
 
+	// Russian roulette on the luminance of the throughput of the paths: after the
+	// bounce russian_roulette_min_bounce, a path survives with a probability
+	// equal to the luminance of its throughput and is terminated otherwise
+	int do_russian_roulette = true;
+	int russian_roulette_min_bounce = 3;
+	// The paths survive the Russian roulette with at least this probability
+	float russian_roulette_min_survival_probability = 0.05f;
+	// If > 0.0f, a path is split into 'throughput luminance / threshold' paths (at most
+	// RUSSIAN_ROULETTE_MAX_SPLIT_COUNT, once per path) at its first hit after the bounce
+	// russian_roulette_min_bounce. The splitting is only done by the megakernel
+	float russian_roulette_split_threshold = 0.0f;
+
 	// How many candidate lights to sample for RIS (Resampled Importance Sampling)
 	int ris_number_of_light_candidates = 8;
 	// How many candidates samples from the BSDF to use in combination
 	// with the light candidates for RIS
 	int ris_number_of_bsdf_candidates = 1;
+
+	// ReSTIR DI (LSS_RESTIR_DI): the reservoir of each pixel starts from ris_number_of_light_candidates
+	// light candidates and is then resampled with the reservoir of the previous frame at the same surface
+	// and with the reservoirs of restir_di_spatial_neighbour_count random pixels within restir_di_spatial_radius pixels
+	int restir_di_do_temporal_reuse = true;
+	int restir_di_do_spatial_reuse = true;
+	int restir_di_spatial_neighbour_count = 3;
+	int restir_di_spatial_radius = 16;
+	// The reservoir of the previous frame counts for at most
+	// that many times the candidates of the reservoir of the frame
+	int restir_di_temporal_m_cap = 20;
+	// If true, the reservoirs are resampled with the MIS weights of the generalized balance heuristic
+	// (unbiased). Otherwise, they're weighted by their number of candidates only, which darkens
+	// the edges of the objects but needs fewer evaluations of the target function
+	int restir_di_use_unbiased_mis = true;
 };
 
 struct RenderBuffers
@@ -112,6 +152,48 @@ struct RenderBuffers
 	RendererMaterial* materials_buffer = nullptr;
 	int emissive_triangles_count = 0;
 	int* emissive_triangles_indices = nullptr;
+	// Instance of each emissive triangle of emissive_triangles_indices.
+	// nullptr if the geometry is not instanced
+	int* emissive_triangles_instances = nullptr;
+	// World space geometry of each emissive triangle of emissive_triangles_indices
+	EmissiveTriangle* emissive_triangles = nullptr;
+	// Alias table of the emissive triangles, proportional to their
+	// power (see sample_alias_table()), and the sum of their powers
+	float* emissive_triangles_alias_probabilities = nullptr;
+	int* emissive_triangles_aliases = nullptr;
+	float emissive_triangles_power_sum = 0.0f;
+
+	// Light BVH over the emissive triangles (see LightBVH), used by the
+	// ETS_LIGHT_BVH emissive triangle sampling strategy. nullptr if not built
+	LightBVHNode* light_bvh_nodes = nullptr;
+	int* light_bvh_emissive_indices = nullptr;
+	unsigned long long* light_bvh_trails = nullptr;
+	unsigned long long* light_bvh_sorted_keys = nullptr;
+	int* light_bvh_sorted_emissive_indices = nullptr;
+	// Number of emissive triangles in the light BVH
+	int light_bvh_light_count = 0;
+
+	// Object to world transform of each instance of the scene and the inverse
+	// transpose of that transform for the normals.
+	// 
+	// If these are nullptr, the vertices are already in world space (the
+	// GPU renderer, which doesn't support instancing yet) and the instance
+	// index of the hits are ignored
+	float4x4* instance_transforms = nullptr;
+	float4x4* instance_normal_transforms = nullptr;
+
+	// TriangleOpacity of the base color of each triangle of the scene.
+	// nullptr if all the triangles of the scene are opaque
+	unsigned char* triangle_opacities = nullptr;
+	// Alpha masks of the base color textures that have transparent texels, one bit per
+	// texel (see read_alpha_mask()). alpha_mask_offsets gives the index of the first word
+	// of the mask of each texture in alpha_mask_bits, -1 for the textures without a mask
+	unsigned int* alpha_mask_bits = nullptr;
+	int* alpha_mask_offsets = nullptr;
+
+	// Blue noise mask of SAMPLER_BLUE_NOISE, BLUE_NOISE_MASK_SIZE * BLUE_NOISE_MASK_SIZE
+	// values (see generate_blue_noise_mask()). SAMPLER_SOBOL is used instead if nullptr
+	float* blue_noise_mask = nullptr;
 
 	// A pointer either to a list of ImageRGBA or to a list of
 	// oroTextureObject_t whether if CPU or GPU renderer respectively
@@ -151,6 +233,15 @@ struct AuxiliaryBuffers
 	// noise threshold. If this value is equal to the number of pixels of the
 	// framebuffer, then all pixels have converged.
 	AtomicType<unsigned int>* stop_noise_threshold_count = nullptr;
+
+	// Per pixel reservoirs of the ReSTIR DI (LSS_RESTIR_DI): after the temporal reuse and
+	// after the spatial reuse. The reservoirs after the spatial reuse are used for shading and
+	// kept for the temporal reuse of the next frame. nullptr if the ReSTIR DI isn't used
+	Reservoir* restir_di_temporal_reservoirs = nullptr;
+	Reservoir* restir_di_final_reservoirs = nullptr;
+	// Per pixel primary hits that the reservoirs of this frame and of the previous frame were resampled for
+	ReSTIRDISurface* restir_di_surfaces = nullptr;
+	ReSTIRDISurface* restir_di_previous_surfaces = nullptr;
 };
 
 enum AmbientLightType
@@ -179,9 +270,18 @@ struct WorldSettings
 	// or a oroTextureObject_t for the GPU.
 	// Proper reinterpreting of the pointer is done in the kernel.
 	void* envmap = nullptr;
-	// Cumulative distribution function. 1D float array of length width * height for
-	// importance sampling the envmap
-	float* envmap_cdf = nullptr;
+	// Alias tables for importance sampling the envmap (see EnvmapSamplingTables):
+	// the marginal one has envmap_height entries and the conditional one
+	// envmap_width * envmap_height, as the probabilities of the pixels
+	float* envmap_marginal_alias_probabilities = nullptr;
+	int* envmap_marginal_aliases = nullptr;
+	float* envmap_conditional_alias_probabilities = nullptr;
+	int* envmap_conditional_aliases = nullptr;
+	float* envmap_pixel_probabilities = nullptr;
+	// Integral of the luminance of the envmap over the sphere of directions (without envmap_intensity)
+	// and radius of the bounding sphere of the scene, for estimating the power of the envmap
+	float envmap_luminance_integral = 0.0f;
+	float scene_bounding_radius = 1.0f;
 	// Rotation matrix for rotating the envmap around
 	float4x4 envmap_rotation_matrix = float4x4{ { {1.0f, 0.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 1.0f, 0.0f}, {0.0f, 0.0f, 0.0f, 1.0f } } };
 };
@@ -191,10 +291,10 @@ struct WorldSettings
  * (the CPU BVH for example) which is stored in this structure
  */
 
-class BVH;
+class TopLevelBVH;
 struct CPUData
 {
-	BVH* bvh = nullptr;
+	TopLevelBVH* bvh = nullptr;
 };
 
 /*
@@ -0,0 +1,77 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#ifndef HOST_DEVICE_COMMON_RESERVOIR_H
+#define HOST_DEVICE_COMMON_RESERVOIR_H
+
+#include "HostDeviceCommon/Color.h"
+#include "HostDeviceCommon/Math.h"
+#include "HostDeviceCommon/Sampler.h"
+
+struct ReservoirSample
+{
+    // Light sample
+    float3 point_on_light_source = { 0, 0, 0 };
+    float3 light_source_normal = { 0, 0, 1 };
+    ColorRGB emission = { 0.0f, 0.0f, 0.0f };
+};
+
+struct Reservoir
+{
+    HIPRT_HOST_DEVICE void update(ReservoirSample new_sample, float weight, Sampler& random_number_generator)
+    {
+        M++;
+        weight_sum += weight;
+
+        if (random_number_generator() < weight / weight_sum)
+            sample = new_sample;
+    }
+
+    /**
+     * Streams the sample of another reservoir into this one with
+     * the given resampling weight (see restir_di_resample_reservoirs())
+     */
+    HIPRT_HOST_DEVICE void combine(const Reservoir& other, float weight, Sampler& random_number_generator)
+    {
+        M += other.M;
+        weight_sum += weight;
+
+        if (weight > 0.0f && random_number_generator() < weight / weight_sum)
+            sample = other.sample;
+    }
+
+    HIPRT_HOST_DEVICE ReservoirSample get_sample()
+    {
+        return sample;
+    }
+
+    unsigned int M = 0;
+    float weight_sum = 0.0f;
+    // Unbiased contribution weight of the sample, only kept by the
+    // reservoirs of the ReSTIR DI which are reused across pixels and frames
+    float UCW = 0.0f;
+
+    ReservoirSample sample;
+};
+
+/**
+ * Primary hit of a pixel whose ReSTIR DI reservoir (LSS_RESTIR_DI) was resampled for:
+ * the target function of the pixel is evaluated there and the reservoirs of other pixels
+ * (or of the previous frame) are only reused if their surface is similar
+ */
+struct ReSTIRDISurface
+{
+    float3 inter_point = { 0.0f, 0.0f, 0.0f };
+    float3 shading_normal = { 0.0f, 0.0f, 1.0f };
+    float3 view_direction = { 0.0f, 0.0f, 1.0f };
+    float2 texcoords = { 0.0f, 0.0f };
+    // Distance from the camera of the frame to the hit
+    float camera_distance = 0.0f;
+    // -1 if the camera ray of the pixel missed or if the direct
+    // lighting at its hit doesn't sample the emissive triangles
+    int material_index = -1;
+};
+
+#endif
@@ -0,0 +1,393 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#ifndef HOST_DEVICE_COMMON_SAMPLER_H
+#define HOST_DEVICE_COMMON_SAMPLER_H
+
+#include <hiprt/hiprt_device.h>
+
+#include "HostDeviceCommon/Math.h"
+#include "HostDeviceCommon/Xorshift.h"
+
+#ifndef __KERNELCC__
+#include <vector>
+#endif
+
+// Sampler types (render_settings.sampler_type)
+//
+// SAMPLER_INDEPENDENT
+//      Independent uniform random numbers, hashed from the pixel, the index of the sample
+//      and the dimension (counter-based, see counter_based_random())
+// SAMPLER_SOBOL
+//      Sobol sequence, Owen scrambled differently in each pixel ("Practical Hash-based
+//      Owen Scrambling", Burley, 2020). The samples of a pixel are the successive points
+//      of the sequence
+// SAMPLER_BLUE_NOISE
+//      The same Owen scrambled Sobol sequence in all the pixels, offset in each pixel
+//      by the value of a blue noise mask ("Blue-noise Dithered Sampling", Georgiev &
+//      Fajardo, 2016): the error of neighbouring pixels is then negatively correlated
+//      and looks like blue noise at low sample counts instead of white noise
+#define SAMPLER_INDEPENDENT 0
+#define SAMPLER_SOBOL 1
+#define SAMPLER_BLUE_NOISE 2
+// Sequential numbers of a Xorshift32Generator, for the samplers that aren't
+// the sampler of a pixel (Sampler(seed)). Not a render_settings.sampler_type
+#define SAMPLER_XORSHIFT -1
+
+// Width and height of the blue noise mask of SAMPLER_BLUE_NOISE. Must be a power of 2
+#define BLUE_NOISE_MASK_SIZE 64
+// Scrambling of the Sobol sequence shared by all the pixels with SAMPLER_BLUE_NOISE
+#define BLUE_NOISE_SEQUENCE_SEED 0x68bc21ebu
+
+HIPRT_HOST_DEVICE HIPRT_INLINE unsigned int reverse_bits(unsigned int x)
+{
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+    x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+
+    return (x >> 16) | (x << 16);
+}
+
+/**
+ * "lowbias32" integer hash of Chris Wellons
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE unsigned int sampler_hash(unsigned int x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+
+    return x;
+}
+
+HIPRT_HOST_DEVICE HIPRT_INLINE unsigned int sampler_hash_combine(unsigned int seed, unsigned int value)
+{
+    return seed ^ (value + (seed << 6) + (seed >> 2));
+}
+
+/**
+ * 3D hash "pcg3d" of Jarzynski & Olano ("Hash Functions for GPU Rendering", 2020), returns
+ * the first of its outputs in [0, 1[. Gives the number of SAMPLER_INDEPENDENT for the dimension
+ * 'dimension' of the sample 'sample_index' of the pixel 'key' without any state: any number of any
+ * sample can be computed on its own, whatever the samples computed before it
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE float counter_based_random(unsigned int key, unsigned int sample_index, unsigned int dimension)
+{
+    unsigned int x = key * 1664525u + 1013904223u;
+    unsigned int y = sample_index * 1664525u + 1013904223u;
+    unsigned int z = dimension * 1664525u + 1013904223u;
+
+    x += y * z;
+    y += z * x;
+    z += x * y;
+
+    x ^= x >> 16;
+    y ^= y >> 16;
+    z ^= z >> 16;
+
+    x += y * z;
+
+    // 24 bits so that the float is < 1.0f
+    return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+/**
+ * Random permutation of x in which each bit only depends on the bits below it
+ * (Laine & Karras, 2011, with the constants of Burley, 2020)
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE unsigned int laine_karras_permutation(unsigned int x, unsigned int seed)
+{
+    x ^= x * 0x3d20adeau;
+    x += seed;
+    x *= (seed >> 16) | 1u;
+    x ^= x * 0x05526c56u;
+    x ^= x * 0x53a22864u;
+
+    return x;
+}
+
+/**
+ * Owen scrambling of x: each bit is flipped depending on the bits above it
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE unsigned int nested_uniform_scramble(unsigned int x, unsigned int seed)
+{
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+/**
+ * Coordinate 'dimension' (0 or 1) of the point 'index' of the 2D Sobol sequence, in 0.32 fixed
+ * point with the bits in reverse order.
+ *
+ * The first dimension is the van der Corput sequence: the bit reversed index. The generator matrix
+ * of the second one is Pascal's triangle modulo 2: the reversed bit j of the coordinate is the XOR
+ * of the bits k of the index such that k contains all the bits of j
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE unsigned int sobol_reversed(unsigned int index, unsigned int dimension)
+{
+    if (dimension == 0)
+        return index;
+
+    index ^= (index >> 1) & 0x55555555u;
+    index ^= (index >> 2) & 0x33333333u;
+    index ^= (index >> 4) & 0x0F0F0F0Fu;
+    index ^= (index >> 8) & 0x00FF00FFu;
+    index ^= (index >> 16) & 0x0000FFFFu;
+
+    return index;
+}
+
+/**
+ * Coordinates 2 * pair and 2 * pair + 1 of the point 'index' of the Owen scrambled Sobol sequence, in [0, 1[.
+ *
+ * The dimensions are taken 2 by 2 from the 2D Sobol sequence, which is a (0, 2)-sequence: the first
+ * 2^k points of each pair of dimensions are stratified over all the 2^k grids of 2^k cells of the
+ * unit square. The index is shuffled differently for each pair of dimensions so that the pairs
+ * are independent of each other ("padding")
+ */
+HIPRT_HOST_DEVICE HIPRT_INLINE float2 owen_scrambled_sobol(unsigned int index, unsigned int pair, unsigned int seed)
+{
+    unsigned int pair_seed = sampler_hash_combine(seed, sampler_hash(pair));
+    unsigned int shuffled_index = nested_uniform_scramble(index, pair_seed);
+
+    // nested_uniform_scramble() of the coordinates, whose bits are already reversed
+    unsigned int x = reverse_bits(laine_karras_permutation(sobol_reversed(shuffled_index, 0), sampler_hash_combine(pair_seed, 1)));
+    unsigned int y = reverse_bits(laine_karras_permutation(sobol_reversed(shuffled_index, 1), sampler_hash_combine(pair_seed, 2)));
+
+    // 24 bits so that the floats are < 1.0f
+    return make_float2((x >> 8) * (1.0f / 16777216.0f), (y >> 8) * (1.0f / 16777216.0f));
+}
+
+/**
+ * Gives the random numbers of a path. With SAMPLER_SOBOL and SAMPLER_BLUE_NOISE, each call to
+ * operator()() returns the next dimension of the current sample of the pixel (see start_sample()):
+ * the first two dimensions are the jitter of the camera ray and the next ones are taken in the
+ * order in which the path uses them. Two samples of a pixel that go through the same decisions
+ * (BSDF lobe, light, ...) thus draw them from the same dimensions and are stratified together.
+ *
+ * SAMPLER_INDEPENDENT draws the dimensions of the samples independently (counter_based_random()).
+ *
+ * The numbers of a sample only depend on the pixel, the index of the sample and the dimension: the
+ * image doesn't depend on the number of threads, on the order of the tiles or on how the samples
+ * are split in frames. The samplers built with a seed only (Sampler(seed)) are the exception, their
+ * numbers are the sequential numbers of a Xorshift32Generator (SAMPLER_XORSHIFT)
+ */
+struct Sampler
+{
+    HIPRT_HOST_DEVICE explicit Sampler(unsigned int seed = 42) : m_xorshift(seed) {}
+
+    /**
+     * Sampler of the pixel (x, y). 'pixel_seed' is hashed with the indices of the samples and the
+     * dimensions with SAMPLER_INDEPENDENT and scrambles the Sobol sequence of the pixel with
+     * SAMPLER_SOBOL. Falls back to SAMPLER_SOBOL if SAMPLER_BLUE_NOISE is requested without a blue noise mask
+     */
+    HIPRT_HOST_DEVICE Sampler(int sampler_type, unsigned int pixel_seed, int x, int y, const float* blue_noise_mask)
+        : m_xorshift(pixel_seed), m_sampler_type(sampler_type), m_scramble_seed(pixel_seed), m_x(x), m_y(y), m_blue_noise_mask(blue_noise_mask)
+    {
+        if (m_sampler_type == SAMPLER_BLUE_NOISE && m_blue_noise_mask == nullptr)
+            m_sampler_type = SAMPLER_SOBOL;
+        else if (m_sampler_type == SAMPLER_BLUE_NOISE)
+            m_scramble_seed = BLUE_NOISE_SEQUENCE_SEED;
+    }
+
+    /**
+     * The next numbers are the dimensions of the point 'sample_index'
+     * of the sequence of the pixel, starting from the first one
+     */
+    HIPRT_HOST_DEVICE void start_sample(unsigned int sample_index)
+    {
+        m_sample_index = sample_index;
+        m_dimension = 0;
+    }
+
+    /*
+     * Returns a uniform random number between 0 and
+     * array_size - 1 (included)
+     */
+    HIPRT_HOST_DEVICE int random_index(int array_size)
+    {
+        if (m_sampler_type == SAMPLER_XORSHIFT)
+            return m_xorshift.random_index(array_size);
+
+        return hippt::min(static_cast<int>(operator()() * array_size), array_size - 1);
+    }
+
+    /*
+     * Returns a float in [0, 1[
+     */
+    HIPRT_HOST_DEVICE float operator()()
+    {
+        if (m_sampler_type == SAMPLER_XORSHIFT)
+            return m_xorshift();
+        else if (m_sampler_type == SAMPLER_INDEPENDENT)
+            return counter_based_random(m_scramble_seed, m_sample_index, m_dimension++);
+
+        // The dimensions are computed two by two
+        unsigned int dimension = m_dimension++;
+        float sample;
+        if (dimension % 2 == 0)
+        {
+            float2 pair = owen_scrambled_sobol(m_sample_index, dimension / 2, m_scramble_seed);
+
+            sample = pair.x;
+            m_next_sample = pair.y;
+        }
+        else
+            sample = m_next_sample;
+
+        if (m_sampler_type == SAMPLER_SOBOL)
+            return sample;
+
+        // The mask is shifted differently for each dimension so
+        // that the offsets of the dimensions are decorrelated
+        unsigned int mask_offset = sampler_hash(dimension);
+        unsigned int mask_x = (m_x + mask_offset) & (BLUE_NOISE_MASK_SIZE - 1);
+        unsigned int mask_y = (m_y + (mask_offset >> 16)) & (BLUE_NOISE_MASK_SIZE - 1);
+
+        sample += m_blue_noise_mask[mask_x + mask_y * BLUE_NOISE_MASK_SIZE];
+        return sample < 1.0f ? sample : sample - 1.0f;
+    }
+
+    Xorshift32Generator m_xorshift;
+
+    int m_sampler_type = SAMPLER_XORSHIFT;
+    // Seed of the pixel with SAMPLER_INDEPENDENT, scrambling of the Sobol sequence otherwise
+    unsigned int m_scramble_seed = 0;
+    unsigned int m_sample_index = 0;
+    // Next dimension of the sample and its value if it's the second of a pair
+    unsigned int m_dimension = 0;
+    float m_next_sample = 0.0f;
+
+    // Pixel of the sampler and mask of SAMPLER_BLUE_NOISE, BLUE_NOISE_MASK_SIZE * BLUE_NOISE_MASK_SIZE values in [0, 1[
+    int m_x = 0, m_y = 0;
+    const float* m_blue_noise_mask = nullptr;
+};
+
+#ifndef __KERNELCC__
+/**
+ * Builds the blue noise mask of SAMPLER_BLUE_NOISE with the void-and-cluster method (Ulichney, 1993): the pixels
+ * of the mask are ranked by adding them one by one where they're the furthest from the already ranked ones.
+ * Returns BLUE_NOISE_MASK_SIZE * BLUE_NOISE_MASK_SIZE values, uniformly distributed in [0, 1[
+ */
+inline std::vector<float> generate_blue_noise_mask()
+{
+    const int size = BLUE_NOISE_MASK_SIZE;
+    const int pixel_count = size * size;
+
+    // Gaussian energy that a pixel gives to the pixels at each
+    // offset, with wrap around so that the mask tiles
+    std::vector<float> gaussian(pixel_count);
+    for (int y = 0; y < size; y++)
+    {
+        for (int x = 0; x < size; x++)
+        {
+            float dx = static_cast<float>(hippt::min(x, size - x));
+            float dy = static_cast<float>(hippt::min(y, size - y));
+
+            gaussian[x + y * size] = expf(-(dx * dx + dy * dy) / (2.0f * 1.5f * 1.5f));
+        }
+    }
+
+    std::vector<unsigned char> pattern(pixel_count, 0);
+    std::vector<float> energy(pixel_count, 0.0f);
+    auto toggle_pixel = [&](std::vector<unsigned char>& pixels, std::vector<float>& pixels_energy, int pixel)
+    {
+        float sign = pixels[pixel] ? -1.0f : 1.0f;
+        pixels[pixel] = !pixels[pixel];
+
+        int pixel_x = pixel % size;
+        int pixel_y = pixel / size;
+        for (int y = 0; y < size; y++)
+            for (int x = 0; x < size; x++)
+                pixels_energy[x + y * size] += sign * gaussian[((x - pixel_x) & (size - 1)) + ((y - pixel_y) & (size - 1)) * size];
+    };
+    // Pixel with the highest energy among the pixels set to 'value' (tightest cluster if
+    // value is 1) or with the lowest energy (largest void if value is 0)
+    auto find_extremum = [&](const std::vector<unsigned char>& pixels, const std::vector<float>& pixels_energy, unsigned char value)
+    {
+        int best_pixel = -1;
+        for (int pixel = 0; pixel < pixel_count; pixel++)
+        {
+            if (pixels[pixel] != value)
+                continue;
+
+            if (best_pixel == -1 || (value ? pixels_energy[pixel] > pixels_energy[best_pixel] : pixels_energy[pixel] < pixels_energy[best_pixel]))
+                best_pixel = pixel;
+        }
+
+        return best_pixel;
+    };
+
+    // Initial binary pattern: random pixels, then moved from the
+    // tightest clusters to the largest voids until they're evenly spread
+    Xorshift32Generator random_number_generator(42);
+    int initial_pixel_count = pixel_count / 10;
+    for (int i = 0; i < initial_pixel_count; i++)
+    {
+        int pixel;
+        do
+            pixel = random_number_generator.random_index(pixel_count);
+        while (pattern[pixel]);
+
+        toggle_pixel(pattern, energy, pixel);
+    }
+
+    while (true)
+    {
+        int cluster = find_extremum(pattern, energy, 1);
+        toggle_pixel(pattern, energy, cluster);
+        int void_pixel = find_extremum(pattern, energy, 0);
+        toggle_pixel(pattern, energy, void_pixel);
+
+        if (void_pixel == cluster)
+            break;
+    }
+
+    std::vector<int> ranks(pixel_count);
+
+    // Ranks of the pixels of the initial pattern, by removing the tightest clusters first
+    std::vector<unsigned char> pixels = pattern;
+    std::vector<float> pixels_energy = energy;
+    for (int rank = initial_pixel_count - 1; rank >= 0; rank--)
+    {
+        int cluster = find_extremum(pixels, pixels_energy, 1);
+        toggle_pixel(pixels, pixels_energy, cluster);
+        ranks[cluster] = rank;
+    }
+
+    // Up to half of the pixels, by filling the largest voids
+    for (int rank = initial_pixel_count; rank < pixel_count / 2; rank++)
+    {
+        int void_pixel = find_extremum(pattern, energy, 0);
+        toggle_pixel(pattern, energy, void_pixel);
+        ranks[void_pixel] = rank;
+    }
+
+    // The remaining pixels are the minority from there: the energy is now given by the
+    // pixels that are not set and the tightest clusters of them are filled first
+    std::vector<unsigned char> unset_pixels(pixel_count);
+    std::vector<float> unset_energy(pixel_count, 0.0f);
+    for (int pixel = 0; pixel < pixel_count; pixel++)
+        if (!pattern[pixel])
+            toggle_pixel(unset_pixels, unset_energy, pixel);
+
+    for (int rank = pixel_count / 2; rank < pixel_count; rank++)
+    {
+        int cluster = find_extremum(unset_pixels, unset_energy, 1);
+        toggle_pixel(unset_pixels, unset_energy, cluster);
+        ranks[cluster] = rank;
+    }
+
+    std::vector<float> mask(pixel_count);
+    for (int pixel = 0; pixel < pixel_count; pixel++)
+        mask[pixel] = (ranks[pixel] + 0.5f) / pixel_count;
+
+    return mask;
+}
+#endif
+
+#endif
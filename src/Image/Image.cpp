@@ -13,6 +13,8 @@
 
 #include "Utils/Utils.h"
 
+#include <fstream>
+
 Image::Image(const std::string& filepath) : Image(filepath.c_str()) {}
 
 Image::Image(const char* filepath)
@@ -104,6 +106,35 @@ bool Image::write_image_hdr(const char* filename, const bool flipY) const
     return stbi_write_hdr(filename, width, height, 3, reinterpret_cast<const float*>(m_pixel_data.data())) != 0;
 }
 
+bool Image::write_image_pfm(const char* filename, const bool flipY) const
+{
+    if (byte_size() == 0)
+        return false;
+
+    std::ofstream file(filename, std::ios::binary);
+    if (!file)
+        return false;
+
+    // The negative scale marks the floats as little endian
+    file << "PF\n" << width << " " << height << "\n-1.0\n";
+
+    // The rows of a PFM go from the bottom of the image to the top, the
+    // order in which flipY = true gives them to the other writers
+    for (int row = 0; row < height; row++)
+    {
+        int y = flipY ? row : height - 1 - row;
+        for (int x = 0; x < width; x++)
+        {
+            const ColorRGB& pixel = m_pixel_data[x + y * width];
+            float rgb[3] = { pixel.r, pixel.g, pixel.b };
+
+            file.write(reinterpret_cast<const char*>(rgb), sizeof(rgb));
+        }
+    }
+
+    return static_cast<bool>(file);
+}
+
 
 
 
@@ -6,8 +6,11 @@
 #ifndef IMAGE_H
 #define IMAGE_H
 
+#include "HostDeviceCommon/AliasTable.h"
 #include "HostDeviceCommon/Color.h"
 
+#include <cmath>
+#include <numeric>
 #include <string>
 
 struct ImageBin
@@ -16,6 +19,31 @@ struct ImageBin
     int y0, y1;
 };
 
+/**
+ * Alias tables for importance sampling an envmap in O(1), proportionally to the luminance of
+ * its pixels times sin(theta), theta being the polar angle of the row of the pixel: the pixels
+ * of the rows close to the poles cover a smaller solid angle.
+ *
+ * A row is picked with the marginal table and a pixel of that row with the conditional
+ * table of the row (see sample_environment_map_alias_table())
+ */
+struct EnvmapSamplingTables
+{
+    // One entry per row
+    std::vector<float> marginal_alias_probabilities;
+    std::vector<int> marginal_aliases;
+    // One entry per pixel, row by row. The aliases are indices in the row
+    std::vector<float> conditional_alias_probabilities;
+    std::vector<int> conditional_aliases;
+
+    // Probability of sampling each pixel. All 0 if the envmap is black
+    std::vector<float> pixel_probabilities;
+
+    // Integral of the luminance of the envmap over the sphere of directions,
+    // used for estimating the power of the envmap
+    float luminance_integral = 0.0f;
+};
+
 template <typename PixelType>
 class ImageBase
 {
@@ -31,10 +59,14 @@ public:
 
     PixelType sample(float2 uv) const;
 
-    void compute_cdf();
-    std::vector<float> compute_get_cdf();
-    const std::vector<float>& get_cdf() const;
-    std::vector<float>& get_cdf();
+    /**
+     * Builds the tables for importance sampling the image as an envmap, in parallel over the rows
+     */
+    void compute_envmap_sampling_tables();
+    /**
+     * Computes the envmap sampling tables on the first call only
+     */
+    const EnvmapSamplingTables& get_envmap_sampling_tables();
 
     size_t byte_size() const;
 
@@ -49,9 +81,9 @@ public:
 
 protected:
     std::vector<PixelType> m_pixel_data;
-    std::vector<float> m_cdf;
+    EnvmapSamplingTables m_envmap_sampling_tables;
 
-    bool m_cdf_computed = false;
+    bool m_envmap_sampling_tables_computed = false;
 };
 
 template <typename PixelType>
@@ -110,47 +142,77 @@ PixelType ImageBase<PixelType>::sample(float2 uv) const
 }
 
 template <typename PixelType>
-void ImageBase<PixelType>::compute_cdf()
+void ImageBase<PixelType>::compute_envmap_sampling_tables()
 {
-    m_cdf.resize(height * width);
-    m_cdf[0] = 0.0f;
-
+    EnvmapSamplingTables& tables = m_envmap_sampling_tables;
+    tables.conditional_alias_probabilities.resize(width * height);
+    tables.conditional_aliases.resize(width * height);
+    tables.pixel_probabilities.resize(width * height);
+
+    // The rows are independent. Their weights are summed in double
+    // precision, it matters for the large envmaps
+    std::vector<double> row_weights(height);
+#pragma omp parallel for schedule(dynamic)
     for (int y = 0; y < height; y++)
     {
+        // Solid angle covered by the pixels of the row, up to a constant
+        float sin_theta = std::sin((y + 0.5f) / height * M_PI);
+
+        std::vector<float> weights(width);
+        double row_weight = 0.0;
         for (int x = 0; x < width; x++)
         {
-            int index = y * width + x;
+            weights[x] = luminance_of_pixel(x, y) * sin_theta;
+            row_weight += weights[x];
+        }
+        row_weights[y] = row_weight;
 
-            m_cdf[index] = m_cdf[std::max(index - 1, 0)] + luminance_of_pixel(x, y);
+        std::vector<float> probabilities;
+        std::vector<int> aliases;
+        if (row_weight > 0.0)
+            build_alias_table(weights, probabilities, aliases);
+        else
+        {
+            // Black row, never picked by the marginal table
+            probabilities.assign(width, 1.0f);
+            aliases.resize(width);
+            std::iota(aliases.begin(), aliases.end(), 0);
         }
-    }
 
-    m_cdf_computed = true;
-}
+        std::copy(probabilities.begin(), probabilities.end(), tables.conditional_alias_probabilities.begin() + y * width);
+        std::copy(aliases.begin(), aliases.end(), tables.conditional_aliases.begin() + y * width);
+        std::copy(weights.begin(), weights.end(), tables.pixel_probabilities.begin() + y * width);
+    }
 
-template <typename PixelType>
-std::vector<float> ImageBase<PixelType>::compute_get_cdf()
-{
-    compute_cdf();
-    return m_cdf;
-}
+    double total_weight = std::accumulate(row_weights.begin(), row_weights.end(), 0.0);
+    // A pixel covers a solid angle of 2.0f * M_PI * M_PI * sin_theta / (width * height)
+    tables.luminance_integral = static_cast<float>(total_weight * 2.0 * M_PI * M_PI / (width * height));
+    if (total_weight > 0.0)
+    {
+        build_alias_table(std::vector<float>(row_weights.begin(), row_weights.end()), tables.marginal_alias_probabilities, tables.marginal_aliases);
 
-template <typename PixelType>
-const std::vector<float>& ImageBase<PixelType>::get_cdf() const
-{
-    if (!m_cdf_computed)
-        compute_cdf();
+#pragma omp parallel for
+        for (int i = 0; i < width * height; i++)
+            tables.pixel_probabilities[i] = static_cast<float>(tables.pixel_probabilities[i] / total_weight);
+    }
+    else
+    {
+        // Nothing to sample, the pixel probabilities are all 0
+        tables.marginal_alias_probabilities.assign(height, 1.0f);
+        tables.marginal_aliases.resize(height);
+        std::iota(tables.marginal_aliases.begin(), tables.marginal_aliases.end(), 0);
+    }
 
-    return m_cdf;
+    m_envmap_sampling_tables_computed = true;
 }
 
 template <typename PixelType>
-std::vector<float>& ImageBase<PixelType>::get_cdf()
+const EnvmapSamplingTables& ImageBase<PixelType>::get_envmap_sampling_tables()
 {
-    if (!m_cdf_computed)
-        compute_cdf();
+    if (!m_envmap_sampling_tables_computed)
+        compute_envmap_sampling_tables();
 
-    return m_cdf;
+    return m_envmap_sampling_tables;
 }
 
 template <typename PixelType>
@@ -203,6 +265,11 @@ public:
     static Image read_image_hdr(const std::string& filepath, bool flipY);
     bool write_image_png(const char* filename, const bool flipY = true) const;
     bool write_image_hdr(const char* filename, const bool flipY = true) const;
+    /**
+     * Writes the pixels as 32-bit floats (little endian PFM), without the
+     * quantization of the shared exponent of the .hdr (RGBE) format
+     */
+    bool write_image_pfm(const char* filename, const bool flipY = true) const;
 };
 
 class ImageRGBA : public ImageBase<ColorRGBA>
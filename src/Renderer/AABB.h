@@ -0,0 +1,93 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#ifndef AABB_H
+#define AABB_H
+
+#include "Renderer/Triangle.h"
+
+/**
+ * Axis aligned bounding box used by the BVH builder.
+ *
+ * The BVH nodes themselves are bounded by a BoundingVolume (7 planes)
+ * for the traversal but the Surface Area Heuristic needs a volume whose
+ * surface area is cheap to compute, hence this structure
+ */
+struct AABB
+{
+    AABB() : m_min(make_float3(INFINITY, INFINITY, INFINITY)), m_max(make_float3(-INFINITY, -INFINITY, -INFINITY)) {}
+    AABB(const float3& min, const float3& max) : m_min(min), m_max(max) {}
+    AABB(const Triangle& triangle)
+    {
+        m_min = hippt::min(triangle.m_a, hippt::min(triangle.m_b, triangle.m_c));
+        m_max = hippt::max(triangle.m_a, hippt::max(triangle.m_b, triangle.m_c));
+    }
+
+    void extend(const float3& point)
+    {
+        m_min = hippt::min(m_min, point);
+        m_max = hippt::max(m_max, point);
+    }
+
+    void extend(const AABB& other)
+    {
+        m_min = hippt::min(m_min, other.m_min);
+        m_max = hippt::max(m_max, other.m_max);
+    }
+
+    bool is_empty() const
+    {
+        return m_min.x > m_max.x || m_min.y > m_max.y || m_min.z > m_max.z;
+    }
+
+    float3 extent() const
+    {
+        return m_max - m_min;
+    }
+
+    float3 centroid() const
+    {
+        return (m_min + m_max) * 0.5f;
+    }
+
+    /**
+     * Returns 0, 1 or 2 for the X, Y or Z axis respectively,
+     * whichever is the longest for this box
+     */
+    int largest_axis() const
+    {
+        float3 box_extent = extent();
+
+        if (box_extent.x > box_extent.y && box_extent.x > box_extent.z)
+            return 0;
+        else if (box_extent.y > box_extent.z)
+            return 1;
+        else
+            return 2;
+    }
+
+    float surface_area() const
+    {
+        if (is_empty())
+            return 0.0f;
+
+        float3 box_extent = extent();
+
+        return 2.0f * (box_extent.x * box_extent.y + box_extent.y * box_extent.z + box_extent.z * box_extent.x);
+    }
+
+    float3 m_min, m_max;
+};
+
+/**
+ * Helper to access the 'axis' component of a float3 given
+ * the axis index (0, 1 or 2 for X, Y, Z)
+ */
+inline float float3_component(const float3& vec, int axis)
+{
+    return axis == 0 ? vec.x : (axis == 1 ? vec.y : vec.z);
+}
+
+#endif
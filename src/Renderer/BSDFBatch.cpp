@@ -0,0 +1,223 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#include "Renderer/BSDFBatch.h"
+
+#include <algorithm>
+#include <bit>
+
+#if CPU_FEATURES_X86
+#include <immintrin.h>
+#endif
+
+static void eval_batch_scalar(const RendererMaterial* materials_buffer, const BSDFBatch& batch)
+{
+    for (int hit_index = 0; hit_index < batch.count; hit_index++)
+        batch.colors[hit_index] = bsdf_dispatcher_eval(materials_buffer, batch.materials[hit_index], batch.ray_volume_states[hit_index],
+            batch.view_directions[hit_index], batch.shading_normals[hit_index], batch.to_light_directions[hit_index], batch.pdfs[hit_index]);
+}
+
+static void sample_batch_scalar(const RendererMaterial* materials_buffer, const BSDFBatch& batch)
+{
+    for (int hit_index = 0; hit_index < batch.count; hit_index++)
+        batch.colors[hit_index] = bsdf_dispatcher_sample(materials_buffer, batch.materials[hit_index], batch.ray_volume_states[hit_index],
+            batch.view_directions[hit_index], batch.shading_normals[hit_index], batch.geometric_normals[hit_index],
+            batch.to_light_directions[hit_index], batch.pdfs[hit_index], batch.samplers[hit_index]);
+}
+
+#if CPU_FEATURES_X86
+SIMD_TARGET_REGION_AVX2_BEGIN
+namespace BSDFBatchAVX2
+{
+    constexpr int SIMD_WIDTH = 8;
+
+    // The masks are the results of the comparisons: all the bits of a lane are set if it is true
+    struct SIMDMask
+    {
+        __m256 value;
+    };
+
+    struct SIMDFloat
+    {
+        SIMDFloat() = default;
+        SIMDFloat(__m256 v) : value(v) {}
+        SIMDFloat(float f) : value(_mm256_set1_ps(f)) {}
+
+        __m256 value;
+    };
+
+    struct SIMDInt
+    {
+        SIMDInt() = default;
+        SIMDInt(__m256i v) : value(v) {}
+        SIMDInt(int i) : value(_mm256_set1_epi32(i)) {}
+
+        __m256i value;
+    };
+
+    inline SIMDFloat operator+(const SIMDFloat& a, const SIMDFloat& b) { return _mm256_add_ps(a.value, b.value); }
+    inline SIMDFloat operator-(const SIMDFloat& a, const SIMDFloat& b) { return _mm256_sub_ps(a.value, b.value); }
+    inline SIMDFloat operator*(const SIMDFloat& a, const SIMDFloat& b) { return _mm256_mul_ps(a.value, b.value); }
+    inline SIMDFloat operator/(const SIMDFloat& a, const SIMDFloat& b) { return _mm256_div_ps(a.value, b.value); }
+    inline SIMDFloat operator-(const SIMDFloat& a) { return _mm256_xor_ps(a.value, _mm256_set1_ps(-0.0f)); }
+
+    // Ordered comparisons, false if one of the operands is NaN like the scalar operators
+    inline SIMDMask operator<(const SIMDFloat& a, const SIMDFloat& b) { return SIMDMask{ _mm256_cmp_ps(a.value, b.value, _CMP_LT_OQ) }; }
+    inline SIMDMask operator<=(const SIMDFloat& a, const SIMDFloat& b) { return SIMDMask{ _mm256_cmp_ps(a.value, b.value, _CMP_LE_OQ) }; }
+    inline SIMDMask operator>(const SIMDFloat& a, const SIMDFloat& b) { return SIMDMask{ _mm256_cmp_ps(a.value, b.value, _CMP_GT_OQ) }; }
+    inline SIMDMask operator>=(const SIMDFloat& a, const SIMDFloat& b) { return SIMDMask{ _mm256_cmp_ps(a.value, b.value, _CMP_GE_OQ) }; }
+    inline SIMDMask operator==(const SIMDFloat& a, const SIMDFloat& b) { return SIMDMask{ _mm256_cmp_ps(a.value, b.value, _CMP_EQ_OQ) }; }
+
+    inline SIMDMask operator&(const SIMDMask& a, const SIMDMask& b) { return SIMDMask{ _mm256_and_ps(a.value, b.value) }; }
+    inline SIMDMask operator|(const SIMDMask& a, const SIMDMask& b) { return SIMDMask{ _mm256_or_ps(a.value, b.value) }; }
+    inline SIMDMask operator!(const SIMDMask& a) { return SIMDMask{ _mm256_xor_ps(a.value, _mm256_castsi256_ps(_mm256_set1_epi32(-1))) }; }
+    inline bool any(const SIMDMask& mask) { return _mm256_movemask_ps(mask.value) != 0; }
+    inline unsigned int mask_bits(const SIMDMask& mask) { return _mm256_movemask_ps(mask.value); }
+
+    inline SIMDInt operator+(const SIMDInt& a, const SIMDInt& b) { return _mm256_add_epi32(a.value, b.value); }
+    inline SIMDInt operator-(const SIMDInt& a, const SIMDInt& b) { return _mm256_sub_epi32(a.value, b.value); }
+    inline SIMDInt operator&(const SIMDInt& a, const SIMDInt& b) { return _mm256_and_si256(a.value, b.value); }
+    inline SIMDMask operator==(const SIMDInt& a, const SIMDInt& b) { return SIMDMask{ _mm256_castsi256_ps(_mm256_cmpeq_epi32(a.value, b.value)) }; }
+    template <int Shift> inline SIMDInt shift_left(const SIMDInt& a) { return _mm256_slli_epi32(a.value, Shift); }
+
+    inline SIMDFloat load(const float* values) { return _mm256_loadu_ps(values); }
+    inline void store(float* values, const SIMDFloat& a) { _mm256_storeu_ps(values, a.value); }
+
+    // 'a' for the lanes of the mask, 'b' for the others
+    inline SIMDFloat select(const SIMDMask& mask, const SIMDFloat& a, const SIMDFloat& b) { return _mm256_blendv_ps(b.value, a.value, mask.value); }
+
+    inline SIMDFloat min(const SIMDFloat& a, const SIMDFloat& b) { return _mm256_min_ps(a.value, b.value); }
+    inline SIMDFloat max(const SIMDFloat& a, const SIMDFloat& b) { return _mm256_max_ps(a.value, b.value); }
+    inline SIMDFloat sqrt(const SIMDFloat& a) { return _mm256_sqrt_ps(a.value); }
+    inline SIMDFloat abs(const SIMDFloat& a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.value); }
+
+    inline SIMDInt round_to_int(const SIMDFloat& a) { return _mm256_cvtps_epi32(a.value); }
+    inline SIMDFloat to_float(const SIMDInt& a) { return _mm256_cvtepi32_ps(a.value); }
+    inline SIMDFloat as_float(const SIMDInt& a) { return _mm256_castsi256_ps(a.value); }
+    inline SIMDInt as_int(const SIMDFloat& a) { return _mm256_castps_si256(a.value); }
+
+#include "Renderer/BSDFBatchKernels.h"
+}
+SIMD_TARGET_REGION_END
+
+SIMD_TARGET_REGION_AVX512_BEGIN
+namespace BSDFBatchAVX512
+{
+    constexpr int SIMD_WIDTH = 16;
+
+    struct SIMDMask
+    {
+        __mmask16 value;
+    };
+
+    struct SIMDFloat
+    {
+        SIMDFloat() = default;
+        SIMDFloat(__m512 v) : value(v) {}
+        SIMDFloat(float f) : value(_mm512_set1_ps(f)) {}
+
+        __m512 value;
+    };
+
+    struct SIMDInt
+    {
+        SIMDInt() = default;
+        SIMDInt(__m512i v) : value(v) {}
+        SIMDInt(int i) : value(_mm512_set1_epi32(i)) {}
+
+        __m512i value;
+    };
+
+    inline SIMDFloat operator+(const SIMDFloat& a, const SIMDFloat& b) { return _mm512_add_ps(a.value, b.value); }
+    inline SIMDFloat operator-(const SIMDFloat& a, const SIMDFloat& b) { return _mm512_sub_ps(a.value, b.value); }
+    inline SIMDFloat operator*(const SIMDFloat& a, const SIMDFloat& b) { return _mm512_mul_ps(a.value, b.value); }
+    inline SIMDFloat operator/(const SIMDFloat& a, const SIMDFloat& b) { return _mm512_div_ps(a.value, b.value); }
+    // The floating point bitwise operations of AVX-512 need AVX-512 DQ, going through the integers
+    inline SIMDFloat operator-(const SIMDFloat& a) { return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a.value), _mm512_set1_epi32(0x80000000))); }
+
+    inline SIMDMask operator<(const SIMDFloat& a, const SIMDFloat& b) { return SIMDMask{ _mm512_cmp_ps_mask(a.value, b.value, _CMP_LT_OQ) }; }
+    inline SIMDMask operator<=(const SIMDFloat& a, const SIMDFloat& b) { return SIMDMask{ _mm512_cmp_ps_mask(a.value, b.value, _CMP_LE_OQ) }; }
+    inline SIMDMask operator>(const SIMDFloat& a, const SIMDFloat& b) { return SIMDMask{ _mm512_cmp_ps_mask(a.value, b.value, _CMP_GT_OQ) }; }
+    inline SIMDMask operator>=(const SIMDFloat& a, const SIMDFloat& b) { return SIMDMask{ _mm512_cmp_ps_mask(a.value, b.value, _CMP_GE_OQ) }; }
+    inline SIMDMask operator==(const SIMDFloat& a, const SIMDFloat& b) { return SIMDMask{ _mm512_cmp_ps_mask(a.value, b.value, _CMP_EQ_OQ) }; }
+
+    inline SIMDMask operator&(const SIMDMask& a, const SIMDMask& b) { return SIMDMask{ static_cast<__mmask16>(a.value & b.value) }; }
+    inline SIMDMask operator|(const SIMDMask& a, const SIMDMask& b) { return SIMDMask{ static_cast<__mmask16>(a.value | b.value) }; }
+    inline SIMDMask operator!(const SIMDMask& a) { return SIMDMask{ static_cast<__mmask16>(~a.value) }; }
+    inline bool any(const SIMDMask& mask) { return mask.value != 0; }
+    inline unsigned int mask_bits(const SIMDMask& mask) { return mask.value; }
+
+    inline SIMDInt operator+(const SIMDInt& a, const SIMDInt& b) { return _mm512_add_epi32(a.value, b.value); }
+    inline SIMDInt operator-(const SIMDInt& a, const SIMDInt& b) { return _mm512_sub_epi32(a.value, b.value); }
+    inline SIMDInt operator&(const SIMDInt& a, const SIMDInt& b) { return _mm512_and_si512(a.value, b.value); }
+    inline SIMDMask operator==(const SIMDInt& a, const SIMDInt& b) { return SIMDMask{ _mm512_cmpeq_epi32_mask(a.value, b.value) }; }
+    template <int Shift> inline SIMDInt shift_left(const SIMDInt& a) { return _mm512_slli_epi32(a.value, Shift); }
+
+    inline SIMDFloat load(const float* values) { return _mm512_loadu_ps(values); }
+    inline void store(float* values, const SIMDFloat& a) { _mm512_storeu_ps(values, a.value); }
+
+    inline SIMDFloat select(const SIMDMask& mask, const SIMDFloat& a, const SIMDFloat& b) { return _mm512_mask_blend_ps(mask.value, b.value, a.value); }
+
+    inline SIMDFloat min(const SIMDFloat& a, const SIMDFloat& b) { return _mm512_min_ps(a.value, b.value); }
+    inline SIMDFloat max(const SIMDFloat& a, const SIMDFloat& b) { return _mm512_max_ps(a.value, b.value); }
+    inline SIMDFloat sqrt(const SIMDFloat& a) { return _mm512_sqrt_ps(a.value); }
+    inline SIMDFloat abs(const SIMDFloat& a) { return _mm512_abs_ps(a.value); }
+
+    inline SIMDInt round_to_int(const SIMDFloat& a) { return _mm512_cvtps_epi32(a.value); }
+    inline SIMDFloat to_float(const SIMDInt& a) { return _mm512_cvtepi32_ps(a.value); }
+    inline SIMDFloat as_float(const SIMDInt& a) { return _mm512_castsi512_ps(a.value); }
+    inline SIMDInt as_int(const SIMDFloat& a) { return _mm512_castps_si512(a.value); }
+
+#include "Renderer/BSDFBatchKernels.h"
+}
+SIMD_TARGET_REGION_END
+#endif
+
+void bsdf_dispatcher_eval_batch(const RendererMaterial* materials_buffer, const BSDFBatch& batch, SIMDInstructionSet instruction_set)
+{
+    if (!CPUFeatures::supports(instruction_set))
+        instruction_set = CPUFeatures::get_best_simd_instruction_set();
+
+    switch (instruction_set)
+    {
+#if CPU_FEATURES_X86
+    case SIMDInstructionSet::AVX512:
+        BSDFBatchAVX512::eval_batch(materials_buffer, batch);
+        break;
+
+    case SIMDInstructionSet::AVX2:
+        BSDFBatchAVX2::eval_batch(materials_buffer, batch);
+        break;
+#endif
+
+    default:
+        // 4 lanes of SSE are not worth the gathering of the materials
+        eval_batch_scalar(materials_buffer, batch);
+        break;
+    }
+}
+
+void bsdf_dispatcher_sample_batch(const RendererMaterial* materials_buffer, const BSDFBatch& batch, SIMDInstructionSet instruction_set)
+{
+    if (!CPUFeatures::supports(instruction_set))
+        instruction_set = CPUFeatures::get_best_simd_instruction_set();
+
+    switch (instruction_set)
+    {
+#if CPU_FEATURES_X86
+    case SIMDInstructionSet::AVX512:
+        BSDFBatchAVX512::sample_batch(materials_buffer, batch);
+        break;
+
+    case SIMDInstructionSet::AVX2:
+        BSDFBatchAVX2::sample_batch(materials_buffer, batch);
+        break;
+#endif
+
+    default:
+        sample_batch_scalar(materials_buffer, batch);
+        break;
+    }
+}
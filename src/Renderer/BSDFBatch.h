@@ -0,0 +1,59 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#ifndef BSDF_BATCH_H
+#define BSDF_BATCH_H
+
+#include "Device/includes/Dispatcher.h"
+#include "HostDeviceCommon/Color.h"
+#include "HostDeviceCommon/Material.h"
+#include "HostDeviceCommon/Math.h"
+#include "HostDeviceCommon/Sampler.h"
+#include "Renderer/CPUFeatures.h"
+
+/**
+ * A batch of hits whose BSDF is evaluated or sampled together by
+ * bsdf_dispatcher_eval_batch() / bsdf_dispatcher_sample_batch().
+ * All the arrays have one element per hit of the batch
+ */
+struct BSDFBatch
+{
+    int count = 0;
+
+    const RendererMaterial* materials = nullptr;
+    // Modified by the glass lobe, like the ray volume state given to the scalar BSDF
+    RayVolumeState* ray_volume_states = nullptr;
+    const float3* view_directions = nullptr;
+    const float3* shading_normals = nullptr;
+    // Only used by the sampling
+    const float3* geometric_normals = nullptr;
+    // Only used by the sampling. The sampler of each hit, it draws
+    // the same random numbers, in the same order, as the scalar sampling
+    Sampler* samplers = nullptr;
+
+    // Directions towards the light for the evaluation,
+    // written with the sampled directions by the sampling
+    float3* to_light_directions = nullptr;
+
+    // Outputs
+    ColorRGB* colors = nullptr;
+    float* pdfs = nullptr;
+};
+
+/**
+ * Batch versions of bsdf_dispatcher_eval() and bsdf_dispatcher_sample() (Dispatcher.h) for the CPU.
+ *
+ * The hits are processed 16 at a time with AVX-512 and 8 at a time with AVX2: each lane of the
+ * SIMD registers is one hit and the lobes of the Disney BSDF are only computed if at least one
+ * lane needs them. The other instruction sets call the scalar functions for each hit.
+ *
+ * The results match the scalar functions up to the precision of the vectorized sin / cos / exp
+ * (and the order of the floating point operations), the random numbers drawn from the sampler
+ * of each hit are the same
+ */
+void bsdf_dispatcher_eval_batch(const RendererMaterial* materials_buffer, const BSDFBatch& batch, SIMDInstructionSet instruction_set = CPUFeatures::get_best_simd_instruction_set());
+void bsdf_dispatcher_sample_batch(const RendererMaterial* materials_buffer, const BSDFBatch& batch, SIMDInstructionSet instruction_set = CPUFeatures::get_best_simd_instruction_set());
+
+#endif
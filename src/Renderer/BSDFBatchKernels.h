@@ -0,0 +1,888 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+// No include guard: this file is included once per instruction set by BSDFBatch.cpp,
+// inside a SIMD_TARGET_REGION and a namespace that define:
+//
+//  - SIMD_WIDTH, the number of lanes
+//  - SIMDFloat: constructible from a float, arithmetic operators,
+//    comparison operators returning a SIMDMask
+//  - SIMDInt: 32 bit integer lanes, constructible from an int, & + - ==
+//  - SIMDMask: & | !
+//  - load / store / select / min / max / sqrt / abs / any / mask_bits / shift_left<N> /
+//    round_to_int / to_float / as_float / as_int
+//
+// Each lane of the registers is one hit of the batch. The functions mirror the scalar
+// functions of Disney.h / Sampling.h / ONB.h line by line, with the branches replaced
+// by masks. A lobe is only computed if at least one lane needs it
+
+struct SIMDFloat3
+{
+    SIMDFloat x, y, z;
+};
+
+// The colors are stored in SIMDFloat3 too, x, y, z being r, g, b
+inline SIMDFloat3 operator+(const SIMDFloat3& a, const SIMDFloat3& b) { return SIMDFloat3{ a.x + b.x, a.y + b.y, a.z + b.z }; }
+inline SIMDFloat3 operator-(const SIMDFloat3& a, const SIMDFloat3& b) { return SIMDFloat3{ a.x - b.x, a.y - b.y, a.z - b.z }; }
+inline SIMDFloat3 operator-(const SIMDFloat3& a) { return SIMDFloat3{ -a.x, -a.y, -a.z }; }
+inline SIMDFloat3 operator*(const SIMDFloat3& a, const SIMDFloat3& b) { return SIMDFloat3{ a.x * b.x, a.y * b.y, a.z * b.z }; }
+inline SIMDFloat3 operator*(const SIMDFloat3& a, const SIMDFloat& b) { return SIMDFloat3{ a.x * b, a.y * b, a.z * b }; }
+inline SIMDFloat3 operator*(const SIMDFloat& a, const SIMDFloat3& b) { return SIMDFloat3{ a * b.x, a * b.y, a * b.z }; }
+inline SIMDFloat3 operator/(const SIMDFloat3& a, const SIMDFloat& b) { return SIMDFloat3{ a.x / b, a.y / b, a.z / b }; }
+inline SIMDFloat3 select(const SIMDMask& mask, const SIMDFloat3& a, const SIMDFloat3& b) { return SIMDFloat3{ select(mask, a.x, b.x), select(mask, a.y, b.y), select(mask, a.z, b.z) }; }
+inline SIMDFloat3 sqrt(const SIMDFloat3& a) { return SIMDFloat3{ sqrt(a.x), sqrt(a.y), sqrt(a.z) }; }
+
+inline SIMDFloat dot(const SIMDFloat3& a, const SIMDFloat3& b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+inline SIMDFloat3 cross(const SIMDFloat3& a, const SIMDFloat3& b)
+{
+    return SIMDFloat3{ a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x };
+}
+
+inline SIMDFloat3 normalize(const SIMDFloat3& a)
+{
+    return a / sqrt(dot(a, a));
+}
+
+inline SIMDFloat clamp(float min_value, float max_value, const SIMDFloat& value)
+{
+    return min(SIMDFloat(max_value), max(SIMDFloat(min_value), value));
+}
+
+inline SIMDFloat pow_5(const SIMDFloat& value)
+{
+    SIMDFloat value_2 = value * value;
+
+    return value_2 * value_2 * value;
+}
+
+/**
+ * Cephes' sinf() and cosf(): reduction of the angle to [-PI/4, PI/4]
+ * and minimax polynomials. About 1.0e-7 of absolute error
+ */
+inline void sincos(const SIMDFloat& angle, SIMDFloat& sin_angle, SIMDFloat& cos_angle)
+{
+    // Quadrant of the angle and angle relative to the quadrant, PI / 2 is split
+    // in three parts (Cody-Waite) so that the reduction is exact enough
+    SIMDInt quadrant = round_to_int(angle * 0.63661977236758134308f);
+    SIMDFloat quadrant_float = to_float(quadrant);
+    SIMDFloat x = angle - quadrant_float * 1.5703125f;
+    x = x - quadrant_float * 4.837512969970703125e-4f;
+    x = x - quadrant_float * 7.54978995489188216e-8f;
+
+    SIMDFloat x_2 = x * x;
+    SIMDFloat sin_x = x + x * x_2 * (-1.6666654611e-1f + x_2 * (8.3321608736e-3f + x_2 * -1.9515295891e-4f));
+    SIMDFloat cos_x = 1.0f - 0.5f * x_2 + x_2 * x_2 * (4.166664568298827e-2f + x_2 * (-1.388731625493765e-3f + x_2 * 2.443315711809948e-5f));
+
+    // sin(x + k * PI / 2) is sin(x), cos(x), -sin(x) or -cos(x) depending on k % 4
+    SIMDMask swap = (quadrant & 1) == 1;
+    SIMDMask negate_sin = (quadrant & 2) == 2;
+    SIMDMask negate_cos = ((quadrant + 1) & 2) == 2;
+
+    sin_angle = select(swap, cos_x, sin_x);
+    cos_angle = select(swap, sin_x, cos_x);
+    sin_angle = select(negate_sin, -sin_angle, sin_angle);
+    cos_angle = select(negate_cos, -cos_angle, cos_angle);
+}
+
+/**
+ * Cephes' expf(): exp(x) = 2^n * exp(r) with r in [-ln(2) / 2, ln(2) / 2]
+ */
+inline SIMDFloat exp(const SIMDFloat& value)
+{
+    SIMDFloat x = clamp(-87.3f, 88.7f, value);
+
+    SIMDInt n = round_to_int(x * 1.44269504088896341f);
+    SIMDFloat n_float = to_float(n);
+    SIMDFloat r = x - n_float * 0.693359375f;
+    r = r + n_float * 2.12194440e-4f;
+
+    SIMDFloat polynomial = 1.9875691500e-4f;
+    polynomial = polynomial * r + 1.3981999507e-3f;
+    polynomial = polynomial * r + 8.3334519073e-3f;
+    polynomial = polynomial * r + 4.1665795894e-2f;
+    polynomial = polynomial * r + 1.6666665459e-1f;
+    polynomial = polynomial * r + 5.0000001201e-1f;
+    SIMDFloat exp_r = polynomial * r * r + r + 1.0f;
+
+    // 2^n built from its exponent bits
+    return exp_r * as_float(shift_left<23>(n + 127));
+}
+
+/**
+ * Calls 'function(lane)' for each lane of the mask
+ */
+template <typename Function>
+inline void for_each_lane(const SIMDMask& mask, Function&& function)
+{
+    unsigned int bits = mask_bits(mask);
+    while (bits != 0)
+    {
+        int lane = std::countr_zero(bits);
+        bits &= bits - 1;
+
+        function(lane);
+    }
+}
+
+/**
+ * Next random number of the sampler of each lane of 'lanes'. The lanes
+ * that are not in 'lanes' don't draw anything and get 0
+ */
+inline SIMDFloat next_random(Sampler* const* samplers, const SIMDMask& lanes)
+{
+    alignas(64) float values[SIMD_WIDTH] = {};
+    for_each_lane(lanes, [samplers, &values](int lane)
+    {
+        values[lane] = (*samplers[lane])();
+    });
+
+    return load(values);
+}
+
+/**
+ * Loads 'lane_value(hit_index)' in each lane. The lanes after 'lane_count'
+ * repeat the last hit so that they don't produce NaNs
+ */
+template <typename Function>
+inline SIMDFloat gather_lanes(int lane_count, Function&& lane_value)
+{
+    alignas(64) float values[SIMD_WIDTH];
+    for (int lane = 0; lane < SIMD_WIDTH; lane++)
+        values[lane] = lane_value(std::min(lane, lane_count - 1));
+
+    return load(values);
+}
+
+template <typename Function>
+inline SIMDFloat3 gather_lanes_float3(int lane_count, Function&& lane_value)
+{
+    alignas(64) float values[3][SIMD_WIDTH];
+    for (int lane = 0; lane < SIMD_WIDTH; lane++)
+    {
+        float3 value = lane_value(std::min(lane, lane_count - 1));
+        values[0][lane] = value.x;
+        values[1][lane] = value.y;
+        values[2][lane] = value.z;
+    }
+
+    return SIMDFloat3{ load(values[0]), load(values[1]), load(values[2]) };
+}
+
+template <typename Function>
+inline SIMDFloat3 gather_lanes_color(int lane_count, Function&& lane_value)
+{
+    return gather_lanes_float3(lane_count, [&lane_value](int lane)
+    {
+        ColorRGB color = lane_value(lane);
+
+        return make_float3(color.r, color.g, color.b);
+    });
+}
+
+inline void store_lanes_float3(const SIMDFloat3& value, int lane_count, float3* output)
+{
+    alignas(64) float values[3][SIMD_WIDTH];
+    store(values[0], value.x);
+    store(values[1], value.y);
+    store(values[2], value.z);
+    for (int lane = 0; lane < lane_count; lane++)
+        output[lane] = make_float3(values[0][lane], values[1][lane], values[2][lane]);
+}
+
+inline void store_lanes_color(const SIMDFloat3& value, int lane_count, ColorRGB* output)
+{
+    alignas(64) float values[3][SIMD_WIDTH];
+    store(values[0], value.x);
+    store(values[1], value.y);
+    store(values[2], value.z);
+    for (int lane = 0; lane < lane_count; lane++)
+        output[lane] = ColorRGB(values[0][lane], values[1][lane], values[2][lane]);
+}
+
+/**
+ * Mask of the lanes [0, lane_count[
+ */
+inline SIMDMask first_lanes(int lane_count)
+{
+    return gather_lanes(SIMD_WIDTH, [lane_count](int lane) { return lane < lane_count ? 1.0f : 0.0f; }) > 0.0f;
+}
+
+/**
+ * The parameters of the materials of the hits of the lanes
+ */
+struct MaterialLanes
+{
+    SIMDFloat3 base_color, specular_color, sheen_color;
+    SIMDFloat roughness, subsurface, metallic, specular, specular_tint;
+    SIMDFloat alpha_x, alpha_y;
+    SIMDFloat clearcoat, clearcoat_roughness, clearcoat_ior;
+    SIMDFloat sheen, sheen_tint;
+    SIMDFloat ior, specular_transmission;
+
+    // The following are computed per lane with the scalar functions, they only
+    // depend on the material and on the volume state, not on the directions
+
+    // cos() and sin() of the rotation of the anisotropic basis
+    SIMDFloat cos_anisotropic_rotation, sin_anisotropic_rotation;
+    // Relative eta of the glass lobe, eta_t / eta_i
+    SIMDFloat relative_eta;
+};
+
+inline MaterialLanes load_material_lanes(const RendererMaterial* materials_buffer, const BSDFBatch& batch, int first_hit, int lane_count)
+{
+    const RendererMaterial* materials = batch.materials + first_hit;
+    const RayVolumeState* volume_states = batch.ray_volume_states + first_hit;
+
+    MaterialLanes lanes;
+    lanes.base_color = gather_lanes_color(lane_count, [materials](int lane) { return materials[lane].base_color; });
+    lanes.specular_color = gather_lanes_color(lane_count, [materials](int lane) { return materials[lane].specular_color; });
+    lanes.sheen_color = gather_lanes_color(lane_count, [materials](int lane) { return materials[lane].sheen_color; });
+    lanes.roughness = gather_lanes(lane_count, [materials](int lane) { return materials[lane].roughness; });
+    lanes.subsurface = gather_lanes(lane_count, [materials](int lane) { return materials[lane].subsurface; });
+    lanes.metallic = gather_lanes(lane_count, [materials](int lane) { return materials[lane].metallic; });
+    lanes.specular = gather_lanes(lane_count, [materials](int lane) { return materials[lane].specular; });
+    lanes.specular_tint = gather_lanes(lane_count, [materials](int lane) { return materials[lane].specular_tint; });
+    lanes.alpha_x = gather_lanes(lane_count, [materials](int lane) { return materials[lane].alpha_x; });
+    lanes.alpha_y = gather_lanes(lane_count, [materials](int lane) { return materials[lane].alpha_y; });
+    lanes.clearcoat = gather_lanes(lane_count, [materials](int lane) { return materials[lane].clearcoat; });
+    lanes.clearcoat_roughness = gather_lanes(lane_count, [materials](int lane) { return materials[lane].clearcoat_roughness; });
+    lanes.clearcoat_ior = gather_lanes(lane_count, [materials](int lane) { return materials[lane].clearcoat_ior; });
+    lanes.sheen = gather_lanes(lane_count, [materials](int lane) { return materials[lane].sheen; });
+    lanes.sheen_tint = gather_lanes(lane_count, [materials](int lane) { return materials[lane].sheen_tint; });
+    lanes.ior = gather_lanes(lane_count, [materials](int lane) { return materials[lane].ior; });
+    lanes.specular_transmission = gather_lanes(lane_count, [materials](int lane) { return materials[lane].specular_transmission; });
+
+    lanes.cos_anisotropic_rotation = gather_lanes(lane_count, [materials](int lane) { return cos(materials[lane].anisotropic_rotation * M_PI); });
+    lanes.sin_anisotropic_rotation = gather_lanes(lane_count, [materials](int lane) { return sin(materials[lane].anisotropic_rotation * M_PI); });
+    lanes.relative_eta = gather_lanes(lane_count, [materials_buffer, volume_states](int lane)
+    {
+        // Same as disney_glass_eval()
+        const RayVolumeState& ray_volume_state = volume_states[lane];
+        float eta_t = ray_volume_state.outgoing_mat_index == -1 ? 1.0 : materials_buffer[ray_volume_state.outgoing_mat_index].ior;
+        float eta_i = ray_volume_state.incident_mat_index == -1 ? 1.0 : materials_buffer[ray_volume_state.incident_mat_index].ior;
+        float relative_eta = eta_t / eta_i;
+        if (hippt::abs(relative_eta - 1.0f) < 1.0e-5f)
+            relative_eta = 1.0f + 1.0e-5f;
+
+        return relative_eta;
+    });
+
+    return lanes;
+}
+
+inline SIMDFloat3 reflect_ray(const SIMDFloat3& ray_direction, const SIMDFloat3& surface_normal)
+{
+    return -ray_direction + 2.0f * dot(ray_direction, surface_normal) * surface_normal;
+}
+
+inline void build_ONB(const SIMDFloat3& N, SIMDFloat3& T, SIMDFloat3& B)
+{
+    SIMDMask up_z = abs(N.z) < 0.9999999f;
+    SIMDFloat3 up = SIMDFloat3{ select(up_z, SIMDFloat(0.0f), SIMDFloat(1.0f)), SIMDFloat(0.0f), select(up_z, SIMDFloat(1.0f), SIMDFloat(0.0f)) };
+    T = normalize(cross(up, N));
+    B = cross(N, T);
+}
+
+inline void build_rotated_ONB(const SIMDFloat3& N, SIMDFloat3& T, SIMDFloat3& B, const SIMDFloat& cos_rotation, const SIMDFloat& sin_rotation)
+{
+    build_ONB(N, T, B);
+
+    // Rodrigues' rotation
+    T = T * cos_rotation + cross(N, T) * sin_rotation + N * dot(N, T) * (1.0f - cos_rotation);
+    B = cross(N, T);
+}
+
+inline SIMDFloat3 world_to_local_frame(const SIMDFloat3& T, const SIMDFloat3& B, const SIMDFloat3& N, const SIMDFloat3& V)
+{
+    return normalize(SIMDFloat3{ dot(V, T), dot(V, B), dot(V, N) });
+}
+
+inline SIMDFloat3 local_to_world_frame(const SIMDFloat3& T, const SIMDFloat3& B, const SIMDFloat3& N, const SIMDFloat3& V)
+{
+    return normalize(V.x * T + V.y * B + V.z * N);
+}
+
+inline SIMDFloat fresnel_dielectric(const SIMDFloat& cos_theta_i, const SIMDFloat& relative_eta)
+{
+    SIMDFloat sin_theta_i2 = 1.0f - cos_theta_i * cos_theta_i;
+    SIMDFloat sin_theta_t2 = sin_theta_i2 / (relative_eta * relative_eta);
+
+    SIMDFloat cos_theta_t = sqrt(max(SIMDFloat(0.0f), 1.0f - sin_theta_t2));
+    SIMDFloat r_parallel = (relative_eta * cos_theta_i - cos_theta_t) / (relative_eta * cos_theta_i + cos_theta_t);
+    SIMDFloat r_perpendicular = (cos_theta_i - relative_eta * cos_theta_t) / (cos_theta_i + relative_eta * cos_theta_t);
+
+    // Total internal reflection, all reflection
+    return select(sin_theta_t2 >= 1.0f, SIMDFloat(1.0f), (r_parallel * r_parallel + r_perpendicular * r_perpendicular) / 2.0f);
+}
+
+inline SIMDFloat GTR2_anisotropic(const MaterialLanes& material, const SIMDFloat3& local_half_vector)
+{
+    SIMDFloat denom = (local_half_vector.x * local_half_vector.x) / (material.alpha_x * material.alpha_x) +
+        (local_half_vector.y * local_half_vector.y) / (material.alpha_y * material.alpha_y) +
+        (local_half_vector.z * local_half_vector.z);
+
+    return 1.0f / (M_PI * material.alpha_x * material.alpha_y * denom * denom);
+}
+
+inline SIMDFloat G1(const SIMDFloat& alpha_x, const SIMDFloat& alpha_y, const SIMDFloat3& local_direction)
+{
+    SIMDFloat ax = local_direction.x * alpha_x;
+    SIMDFloat ay = local_direction.y * alpha_y;
+
+    SIMDFloat lambda = (sqrt(1.0f + (ax * ax + ay * ay) / (local_direction.z * local_direction.z)) - 1.0f) * 0.5f;
+
+    return 1.0f / (1.0f + lambda);
+}
+
+inline SIMDFloat disney_schlick_weight(const SIMDFloat& f0, const SIMDFloat& abs_cos_angle)
+{
+    return 1.0f + (f0 - 1.0f) * pow_5(1.0f - abs_cos_angle);
+}
+
+inline SIMDFloat3 disney_diffuse_eval(const MaterialLanes& material, const SIMDFloat3& view_direction, const SIMDFloat3& surface_normal, const SIMDFloat3& to_light_direction, SIMDFloat& pdf)
+{
+    SIMDFloat3 half_vector = normalize(to_light_direction + view_direction);
+
+    SIMDFloat LoH = clamp(0.0f, 1.0f, abs(dot(to_light_direction, half_vector)));
+    SIMDFloat NoL = clamp(0.0f, 1.0f, abs(dot(surface_normal, to_light_direction)));
+    SIMDFloat NoV = clamp(0.0f, 1.0f, abs(dot(surface_normal, view_direction)));
+
+    pdf = NoL / M_PI;
+
+    SIMDFloat diffuse_90 = 0.5f + 2.0f * material.roughness * LoH * LoH;
+    SIMDFloat3 diffuse_part = material.base_color / SIMDFloat(M_PI) * (disney_schlick_weight(diffuse_90, NoL) * disney_schlick_weight(diffuse_90, NoV));
+
+    SIMDFloat3 fake_subsurface_part = SIMDFloat3{ 0.0f, 0.0f, 0.0f };
+    SIMDMask subsurface_lanes = material.subsurface > 0.0f;
+    if (any(subsurface_lanes))
+    {
+        SIMDFloat subsurface_90 = material.roughness * LoH * LoH;
+        fake_subsurface_part = 1.25f * material.base_color / SIMDFloat(M_PI) *
+            (disney_schlick_weight(subsurface_90, NoL) * disney_schlick_weight(subsurface_90, NoV) * (1.0f / (NoL + NoV) - 0.5f) + 0.5f);
+        fake_subsurface_part = select(subsurface_lanes, fake_subsurface_part, SIMDFloat3{ 0.0f, 0.0f, 0.0f });
+    }
+
+    return (1.0f - material.subsurface) * diffuse_part + material.subsurface * fake_subsurface_part;
+}
+
+inline SIMDFloat3 disney_metallic_fresnel(const MaterialLanes& material, const SIMDFloat3& local_half_vector, const SIMDFloat3& local_to_light_direction)
+{
+    SIMDFloat3 Ks = SIMDFloat3{ 1.0f - material.specular_tint, 1.0f - material.specular_tint, 1.0f - material.specular_tint } + material.specular_tint * material.specular_color;
+    SIMDFloat R0 = ((material.ior - 1.0f) * (material.ior - 1.0f)) / ((material.ior + 1.0f) * (material.ior + 1.0f));
+    SIMDFloat3 C0 = material.specular * R0 * (1.0f - material.metallic) * Ks + material.metallic * material.base_color;
+
+    SIMDFloat fresnel_weight = pow_5(clamp(0.0f, 1.0f, 1.0f - dot(local_half_vector, local_to_light_direction)));
+
+    return C0 + (SIMDFloat3{ 1.0f, 1.0f, 1.0f } - C0) * fresnel_weight;
+}
+
+inline SIMDFloat3 disney_metallic_eval(const MaterialLanes& material, const SIMDFloat3& local_view_direction, const SIMDFloat3& local_to_light_direction, const SIMDFloat3& local_half_vector, const SIMDFloat3& F, SIMDFloat& pdf)
+{
+    SIMDFloat NoV = max(SIMDFloat(1.0e-8f), abs(local_view_direction.z));
+    SIMDFloat NoL = max(SIMDFloat(1.0e-8f), abs(local_to_light_direction.z));
+
+    SIMDFloat D = GTR2_anisotropic(material, local_half_vector);
+    SIMDFloat G1_V = G1(material.alpha_x, material.alpha_y, local_view_direction);
+    SIMDFloat G1_L = G1(material.alpha_x, material.alpha_y, local_to_light_direction);
+    SIMDFloat G = G1_V * G1_L;
+
+    pdf = D * G1_V / (4.0f * NoV);
+    return F * (D * G / (4.0f * NoL * NoV));
+}
+
+/**
+ * Returns a null color and a null PDF for the lanes where the view and light directions are in different hemispheres
+ */
+inline SIMDFloat3 disney_clearcoat_eval(const MaterialLanes& material, const SIMDFloat3& local_view_direction, const SIMDFloat3& local_to_light_direction, const SIMDFloat3& local_halfway_vector, SIMDFloat& pdf)
+{
+    SIMDFloat num = material.clearcoat_ior - 1.0f;
+    SIMDFloat denom = material.clearcoat_ior + 1.0f;
+    SIMDFloat R0 = (num * num) / (denom * denom);
+
+    SIMDFloat HoL = clamp(1.0e-8f, 1.0f, dot(local_halfway_vector, local_to_light_direction));
+    SIMDFloat clearcoat_gloss = 1.0f - material.clearcoat_roughness;
+    SIMDFloat alpha_g = (1.0f - clearcoat_gloss) * 0.1f + clearcoat_gloss * 0.001f;
+    SIMDFloat alpha_g_2 = alpha_g * alpha_g;
+
+    alignas(64) float alpha_g_2_lanes[SIMD_WIDTH];
+    store(alpha_g_2_lanes, alpha_g_2);
+    for (int lane = 0; lane < SIMD_WIDTH; lane++)
+        alpha_g_2_lanes[lane] = log(alpha_g_2_lanes[lane]);
+    SIMDFloat log_alpha_g_2 = load(alpha_g_2_lanes);
+
+    SIMDFloat F_clearcoat = R0 + (1.0f - R0) * pow_5(1.0f - HoL);
+    SIMDFloat halfway_z = abs(local_halfway_vector.z);
+    SIMDFloat D_clearcoat = (alpha_g_2 - 1.0f) / (M_PI * log_alpha_g_2 * (1.0f + (alpha_g_2 - 1.0f) * halfway_z * halfway_z));
+    SIMDFloat G_clearcoat = G1(SIMDFloat(0.25f), SIMDFloat(0.25f), local_view_direction) * G1(SIMDFloat(0.25f), SIMDFloat(0.25f), local_to_light_direction);
+
+    SIMDMask same_hemisphere = !(local_view_direction.z * local_to_light_direction.z < 0.0f);
+    pdf = select(same_hemisphere, D_clearcoat * halfway_z / (4.0f * HoL), SIMDFloat(0.0f));
+    SIMDFloat color = select(same_hemisphere, F_clearcoat * D_clearcoat * G_clearcoat / (4.0f * local_view_direction.z), SIMDFloat(0.0f));
+
+    return SIMDFloat3{ color, color, color };
+}
+
+/**
+ * 'refracting_lanes' is set to the lanes whose light direction is a
+ * valid refraction, their ray volume state must then be updated
+ */
+inline SIMDFloat3 disney_glass_eval(const MaterialLanes& material, const SIMDFloat3& local_view_direction, const SIMDFloat3& local_to_light_direction, SIMDFloat& pdf, SIMDMask& refracting_lanes)
+{
+    SIMDFloat NoV = local_view_direction.z;
+    SIMDFloat NoL = local_to_light_direction.z;
+    SIMDFloat relative_eta = material.relative_eta;
+
+    // Avoiding the division by 0 later on
+    SIMDMask valid = !(abs(NoL) < 1.0e-8f);
+    SIMDMask reflecting = NoL * NoV > 0.0f;
+
+    SIMDFloat3 local_half_vector = select(reflecting, local_to_light_direction + local_view_direction, local_to_light_direction * relative_eta + local_view_direction);
+    local_half_vector = normalize(local_half_vector);
+    local_half_vector = select(local_half_vector.z < 0.0f, -local_half_vector, local_half_vector);
+
+    SIMDFloat HoL = dot(local_to_light_direction, local_half_vector);
+    SIMDFloat HoV = dot(local_view_direction, local_half_vector);
+
+    // Backfacing microfacets
+    valid = valid & !((HoL * NoL < 0.0f) | (HoV * NoV < 0.0f));
+
+    SIMDFloat F = fresnel_dielectric(dot(local_view_direction, local_half_vector), relative_eta);
+
+    SIMDFloat reflection_pdf;
+    SIMDFloat3 reflection_color = disney_metallic_eval(material, local_view_direction, local_to_light_direction, local_half_vector, SIMDFloat3{ F, F, F }, reflection_pdf);
+    reflection_pdf = reflection_pdf * F;
+
+    SIMDFloat dot_prod = HoL + HoV / relative_eta;
+    SIMDFloat dot_prod2 = dot_prod * dot_prod;
+    SIMDFloat denom = dot_prod2 * NoL * NoV;
+
+    SIMDFloat D = GTR2_anisotropic(material, local_half_vector);
+    SIMDFloat G1_V = G1(material.alpha_x, material.alpha_y, local_view_direction);
+    SIMDFloat G = G1_V * G1(material.alpha_x, material.alpha_y, local_to_light_direction);
+
+    SIMDFloat dwm_dwi = abs(HoL) / dot_prod2;
+    SIMDFloat D_pdf = G1_V / abs(NoV) * D * abs(HoV);
+    SIMDFloat refraction_pdf = dwm_dwi * D_pdf * (1.0f - F);
+    SIMDFloat3 refraction_color = sqrt(material.base_color) * (D * (1.0f - F) * G * abs(HoL * HoV / denom));
+
+    refracting_lanes = valid & !reflecting;
+
+    pdf = select(valid, select(reflecting, reflection_pdf, refraction_pdf), SIMDFloat(0.0f));
+    return select(valid, select(reflecting, reflection_color, refraction_color), SIMDFloat3{ 0.0f, 0.0f, 0.0f });
+}
+
+inline SIMDFloat3 disney_sheen_eval(const MaterialLanes& material, const SIMDFloat3& local_view_direction, const SIMDFloat3& local_to_light_direction, const SIMDFloat3& local_half_vector, SIMDFloat& pdf)
+{
+    SIMDFloat3 sheen_color = SIMDFloat3{ 1.0f - material.sheen_tint, 1.0f - material.sheen_tint, 1.0f - material.sheen_tint } + material.sheen_color * material.sheen_tint;
+
+    SIMDFloat NoL = abs(local_to_light_direction.z);
+    SIMDFloat HoL = clamp(0.0f, 1.0f, dot(local_half_vector, local_to_light_direction));
+
+    pdf = NoL / M_PI;
+
+    return sheen_color * pow_5(1.0f - HoL);
+}
+
+/**
+ * disney_eval() for the lanes of 'active_lanes'. The color and PDF of the other lanes are undefined.
+ *
+ * volume_states[lane] is the ray volume state of the hit of the lane
+ */
+inline SIMDFloat3 disney_eval(const RendererMaterial* materials_buffer, const MaterialLanes& material, RayVolumeState* const* volume_states, const SIMDMask& active_lanes, const SIMDFloat3& view_direction, SIMDFloat3 shading_normal, const SIMDFloat3& to_light_direction, SIMDFloat& pdf)
+{
+    pdf = 0.0f;
+
+    SIMDMask outside_object = dot(view_direction, shading_normal) > 0.0f;
+    shading_normal = select(outside_object, shading_normal, -shading_normal);
+
+    SIMDFloat3 T, B;
+    build_ONB(shading_normal, T, B);
+    SIMDFloat3 local_view_direction = world_to_local_frame(T, B, shading_normal, view_direction);
+    SIMDFloat3 local_to_light_direction = world_to_local_frame(T, B, shading_normal, to_light_direction);
+    SIMDFloat3 local_half_vector = normalize(local_view_direction + local_to_light_direction);
+
+    SIMDFloat3 TR, BR;
+    build_rotated_ONB(shading_normal, TR, BR, material.cos_anisotropic_rotation, material.sin_anisotropic_rotation);
+    SIMDFloat3 local_view_direction_rotated = world_to_local_frame(TR, BR, shading_normal, view_direction);
+    SIMDFloat3 local_to_light_direction_rotated = world_to_local_frame(TR, BR, shading_normal, to_light_direction);
+    SIMDFloat3 local_half_vector_rotated = normalize(local_view_direction_rotated + local_to_light_direction_rotated);
+
+    SIMDFloat outside = select(outside_object, SIMDFloat(1.0f), SIMDFloat(0.0f));
+    SIMDFloat glass_weight = (1.0f - material.metallic) * material.specular_transmission;
+    SIMDFloat diffuse_weight = (1.0f - material.metallic) * (1.0f - material.specular_transmission) * outside;
+    SIMDFloat metal_weight = (1.0f - material.specular_transmission * (1.0f - material.metallic)) * outside;
+    SIMDFloat clearcoat_weight = 0.25f * material.clearcoat * outside;
+    SIMDFloat sheen_weight = (1.0f - material.metallic) * material.sheen * outside;
+
+    SIMDFloat normalize_factor = 1.0f / (diffuse_weight + metal_weight + clearcoat_weight + glass_weight + sheen_weight);
+    SIMDFloat diffuse_proba = diffuse_weight * normalize_factor;
+    SIMDFloat metal_proba = metal_weight * normalize_factor;
+    SIMDFloat clearcoat_proba = clearcoat_weight * normalize_factor;
+    SIMDFloat glass_proba = glass_weight * normalize_factor;
+    SIMDFloat sheen_proba = sheen_weight * normalize_factor;
+
+    SIMDFloat3 zero = SIMDFloat3{ 0.0f, 0.0f, 0.0f };
+    SIMDFloat3 final_color = zero;
+    SIMDFloat tmp_pdf;
+
+    // The PDF of a lobe is 0 for the lanes that don't evaluate it
+    // but it is still multiplied by the probability of the lobe, like the scalar code
+
+    // Diffuse
+    SIMDMask diffuse_lanes = active_lanes & (diffuse_weight > 0.0f) & outside_object;
+    if (any(diffuse_lanes))
+    {
+        SIMDFloat3 diffuse_color = disney_diffuse_eval(material, view_direction, shading_normal, to_light_direction, tmp_pdf);
+        final_color = final_color + select(diffuse_lanes, diffuse_weight * diffuse_color, zero);
+        pdf = pdf + select(diffuse_lanes, tmp_pdf, SIMDFloat(0.0f)) * diffuse_proba;
+    }
+    else
+        pdf = pdf + 0.0f * diffuse_proba;
+
+    // Metallic
+    SIMDFloat metal_lobe_weight = 1.0f - material.specular_transmission * (1.0f - material.metallic);
+    SIMDMask metal_lanes = active_lanes & (metal_lobe_weight > 0.0f) & outside_object;
+    if (any(metal_lanes))
+    {
+        SIMDFloat3 metallic_fresnel = disney_metallic_fresnel(material, local_half_vector, local_to_light_direction);
+        SIMDFloat3 metal_color = disney_metallic_eval(material, local_view_direction_rotated, local_to_light_direction_rotated, local_half_vector_rotated, metallic_fresnel, tmp_pdf);
+        final_color = final_color + select(metal_lanes, metal_lobe_weight * metal_color, zero);
+        pdf = pdf + select(metal_lanes, tmp_pdf, SIMDFloat(0.0f)) * metal_proba;
+    }
+    else
+        pdf = pdf + 0.0f * metal_proba;
+
+    // Clearcoat
+    SIMDMask clearcoat_lanes = active_lanes & (clearcoat_weight > 0.0f) & outside_object;
+    if (any(clearcoat_lanes))
+    {
+        SIMDFloat3 clearcoat_color = disney_clearcoat_eval(material, local_view_direction_rotated, local_to_light_direction_rotated, local_half_vector_rotated, tmp_pdf);
+        final_color = final_color + select(clearcoat_lanes, clearcoat_weight * clearcoat_color, zero);
+        pdf = pdf + select(clearcoat_lanes, tmp_pdf, SIMDFloat(0.0f)) * clearcoat_proba;
+    }
+    else
+        pdf = pdf + 0.0f * clearcoat_proba;
+
+    // Glass
+    SIMDMask glass_lanes = active_lanes & (glass_weight > 0.0f);
+    if (any(glass_lanes))
+    {
+        SIMDMask refracting_lanes;
+        SIMDFloat3 glass_color = disney_glass_eval(material, local_view_direction_rotated, local_to_light_direction_rotated, tmp_pdf, refracting_lanes);
+
+        // The absorption and the interior stack of the lanes that refract
+        // out of a volume are handled one lane at a time, it's a rare case
+        alignas(64) float glass_colors[3][SIMD_WIDTH];
+        store(glass_colors[0], glass_color.x);
+        store(glass_colors[1], glass_color.y);
+        store(glass_colors[2], glass_color.z);
+        for_each_lane(glass_lanes & refracting_lanes, [&](int lane)
+        {
+            RayVolumeState& ray_volume_state = *volume_states[lane];
+            if (ray_volume_state.incident_mat_index == -1)
+                return;
+
+            // Same as disney_glass_eval()
+            const RendererMaterial& incident_material = materials_buffer[ray_volume_state.incident_mat_index];
+            ColorRGB absorption_coefficient = log(incident_material.absorption_color) / incident_material.absorption_at_distance;
+            ColorRGB absorption = exp(absorption_coefficient * ray_volume_state.distance_in_volume);
+            glass_colors[0][lane] *= absorption.r;
+            glass_colors[1][lane] *= absorption.g;
+            glass_colors[2][lane] *= absorption.b;
+
+            ray_volume_state.distance_in_volume = 0.0f;
+            if (ray_volume_state.leaving_mat)
+                ray_volume_state.interior_stack.pop(ray_volume_state.leaving_mat);
+        });
+        glass_color = SIMDFloat3{ load(glass_colors[0]), load(glass_colors[1]), load(glass_colors[2]) };
+
+        final_color = final_color + select(glass_lanes, glass_weight * glass_color, zero);
+        pdf = pdf + select(glass_lanes, tmp_pdf, SIMDFloat(0.0f)) * glass_proba;
+    }
+    else
+        pdf = pdf + 0.0f * glass_proba;
+
+    // Sheen
+    SIMDMask sheen_lanes = active_lanes & (sheen_weight > 0.0f) & outside_object;
+    if (any(sheen_lanes))
+    {
+        SIMDFloat3 sheen_color = disney_sheen_eval(material, local_view_direction, local_to_light_direction, local_half_vector, tmp_pdf);
+        final_color = final_color + select(sheen_lanes, sheen_weight * sheen_color, zero);
+        pdf = pdf + select(sheen_lanes, tmp_pdf, SIMDFloat(0.0f)) * sheen_proba;
+    }
+    else
+        pdf = pdf + 0.0f * sheen_proba;
+
+    return final_color;
+}
+
+inline SIMDFloat3 cosine_weighted_sample(const SIMDFloat3& normal, SIMDFloat rand_1, SIMDFloat rand_2)
+{
+    rand_2 = 2.0f * rand_2 - 1.0f;
+
+    // Slight perturbation when this would result in a singularity, see the scalar version
+    SIMDMask singularity = (rand_1 < 1.0e-8f) & (rand_2 < -0.999999f) & (normal.z > 0.999999f);
+    rand_1 = select(singularity, rand_1 + 1.0e-7f, rand_1);
+    rand_2 = select(singularity, rand_2 + 1.0e-7f, rand_2);
+
+    SIMDFloat sin_theta, cos_theta;
+    sincos(2.0f * M_PI * rand_1, sin_theta, cos_theta);
+
+    SIMDFloat xy_length = sqrt(1.0f - rand_2 * rand_2);
+    SIMDFloat3 sphere_point = SIMDFloat3{ xy_length * cos_theta, xy_length * sin_theta, rand_2 };
+
+    return normalize(normal + sphere_point);
+}
+
+inline SIMDFloat3 GGXVNDF_sample(const SIMDFloat3& local_view_direction, const SIMDFloat& alpha_x, const SIMDFloat& alpha_y, const SIMDFloat& r1, const SIMDFloat& r2)
+{
+    SIMDFloat3 Vh = normalize(SIMDFloat3{ alpha_x * local_view_direction.x, alpha_y * local_view_direction.y, local_view_direction.z });
+
+    SIMDFloat lensq = Vh.x * Vh.x + Vh.y * Vh.y;
+    SIMDFloat length = sqrt(lensq);
+    SIMDMask lensq_positive = lensq > 0.0f;
+    SIMDFloat3 T1 = SIMDFloat3{ select(lensq_positive, -Vh.y / length, SIMDFloat(1.0f)), select(lensq_positive, Vh.x / length, SIMDFloat(0.0f)), SIMDFloat(0.0f) };
+    SIMDFloat3 T2 = cross(Vh, T1);
+
+    SIMDFloat r = sqrt(r1);
+    SIMDFloat sin_phi, cos_phi;
+    sincos(2.0f * M_PI * r2, sin_phi, cos_phi);
+    SIMDFloat t1 = r * cos_phi;
+    SIMDFloat t2 = r * sin_phi;
+    SIMDFloat s = 0.5f * (1.0f + Vh.z);
+    t2 = (1.0f - s) * sqrt(1.0f - t1 * t1) + s * t2;
+
+    SIMDFloat3 Nh = t1 * T1 + t2 * T2 + sqrt(max(SIMDFloat(0.0f), 1.0f - t1 * t1 - t2 * t2)) * Vh;
+
+    return normalize(SIMDFloat3{ alpha_x * Nh.x, alpha_y * Nh.y, max(SIMDFloat(0.0f), Nh.z) });
+}
+
+inline SIMDFloat3 disney_metallic_sample(const MaterialLanes& material, const SIMDFloat3& local_view_direction, const SIMDFloat& r1, const SIMDFloat& r2)
+{
+    // The view direction can sometimes be below the shading normal hemisphere because of normal mapping
+    SIMDFloat below_normal = select(local_view_direction.z < 0.0f, SIMDFloat(-1.0f), SIMDFloat(1.0f));
+    SIMDFloat3 microfacet_normal = GGXVNDF_sample(local_view_direction * below_normal, material.alpha_x, material.alpha_y, r1, r2);
+    SIMDFloat3 sampled_direction = reflect_ray(local_view_direction, microfacet_normal * below_normal);
+
+    return normalize(sampled_direction);
+}
+
+inline SIMDFloat3 disney_clearcoat_sample(const MaterialLanes& material, const SIMDFloat3& local_view_direction, const SIMDFloat& rand_1, const SIMDFloat& rand_2)
+{
+    SIMDFloat clearcoat_gloss = 1.0f - material.clearcoat_roughness;
+    SIMDFloat alpha_g = (1.0f - clearcoat_gloss) * 0.1f + clearcoat_gloss * 0.001f;
+    SIMDFloat alpha_g_2 = alpha_g * alpha_g;
+
+    alignas(64) float log_alpha_g_2[SIMD_WIDTH];
+    store(log_alpha_g_2, alpha_g_2);
+    for (int lane = 0; lane < SIMD_WIDTH; lane++)
+        log_alpha_g_2[lane] = log(log_alpha_g_2[lane]);
+
+    // pow(alpha_g_2, 1.0f - rand_1)
+    SIMDFloat alpha_g_2_pow = exp((1.0f - rand_1) * load(log_alpha_g_2));
+    SIMDFloat cos_theta = sqrt((1.0f - alpha_g_2_pow) / (1.0f - alpha_g_2));
+    SIMDFloat sin_theta = sqrt(1.0f - cos_theta * cos_theta);
+
+    SIMDFloat sin_phi_unused, cos_phi;
+    sincos(2.0f * M_PI * rand_2, sin_phi_unused, cos_phi);
+    SIMDFloat sin_phi = sqrt(1.0f - cos_phi * cos_phi);
+
+    SIMDFloat3 microfacet_normal = normalize(SIMDFloat3{ sin_theta * cos_phi, sin_theta * sin_phi, cos_theta });
+    SIMDFloat3 sampled_direction = reflect_ray(local_view_direction, microfacet_normal);
+
+    return normalize(sampled_direction);
+}
+
+/**
+ * 'reflecting_lanes' is set to the lanes whose sampled direction is a reflection
+ */
+inline SIMDFloat3 disney_glass_sample(const MaterialLanes& material, const SIMDFloat3& local_view_direction, const SIMDFloat& r1, const SIMDFloat& r2, const SIMDFloat& rand_1, SIMDMask& reflecting_lanes)
+{
+    SIMDFloat relative_eta = material.relative_eta;
+
+    SIMDFloat3 microfacet_normal = GGXVNDF_sample(local_view_direction, material.alpha_x, material.alpha_y, r1, r2);
+    microfacet_normal = select(microfacet_normal.z < 0.0f, -microfacet_normal, microfacet_normal);
+
+    SIMDFloat F = fresnel_dielectric(dot(local_view_direction, microfacet_normal), relative_eta);
+    reflecting_lanes = rand_1 < F;
+
+    SIMDFloat3 reflected_direction = reflect_ray(local_view_direction, microfacet_normal);
+
+    SIMDFloat3 refraction_normal = select(dot(microfacet_normal, local_view_direction) < 0.0f, -microfacet_normal, microfacet_normal);
+    SIMDFloat NoI = dot(local_view_direction, refraction_normal);
+    SIMDFloat sin_theta_i_2 = 1.0f - NoI * NoI;
+    SIMDFloat root_term = 1.0f - sin_theta_i_2 / (relative_eta * relative_eta);
+    SIMDFloat cos_theta_t = sqrt(max(SIMDFloat(0.0f), root_term));
+    SIMDFloat3 refracted_direction = -local_view_direction / relative_eta + (NoI / relative_eta - cos_theta_t) * refraction_normal;
+    // The scalar version leaves the direction uninitialized when the refraction fails
+    refracted_direction = select(root_term < 0.0f, SIMDFloat3{ 0.0f, 0.0f, 0.0f }, refracted_direction);
+
+    return select(reflecting_lanes, reflected_direction, refracted_direction);
+}
+
+/**
+ * disney_sample() for the lanes of 'active_lanes'
+ */
+inline SIMDFloat3 disney_sample(const RendererMaterial* materials_buffer, const MaterialLanes& material, RayVolumeState* const* volume_states, const SIMDMask& active_lanes, const SIMDFloat3& view_direction, const SIMDFloat3& shading_normal, const SIMDFloat3& geometric_normal, SIMDFloat3& output_direction, SIMDFloat& pdf, Sampler* const* samplers)
+{
+    SIMDFloat3 normal = shading_normal;
+    SIMDFloat3 flipped_normal = reflect_ray(shading_normal, geometric_normal);
+
+    SIMDFloat glass_weight = (1.0f - material.metallic) * material.specular_transmission;
+    SIMDMask outside_object = dot(view_direction, normal) > 0.0f;
+    // Flipping the normal of the lanes below the hemisphere of the shading normal
+    // because of normal mapping, when the glass lobe isn't sampled. See the scalar version
+    SIMDMask flip_normal = (glass_weight == 0.0f) & !outside_object;
+    normal = select(flip_normal, flipped_normal, normal);
+    outside_object = outside_object | flip_normal;
+
+    SIMDFloat outside = select(outside_object, SIMDFloat(1.0f), SIMDFloat(0.0f));
+    SIMDFloat diffuse_weight = (1.0f - material.metallic) * (1.0f - material.specular_transmission) * outside;
+    SIMDFloat metal_weight = (1.0f - material.specular_transmission * (1.0f - material.metallic)) * outside;
+    SIMDFloat clearcoat_weight = 0.25f * material.clearcoat * outside;
+
+    SIMDFloat normalize_factor = 1.0f / (diffuse_weight + metal_weight + clearcoat_weight + glass_weight);
+    SIMDFloat cdf_0 = diffuse_weight * normalize_factor;
+    SIMDFloat cdf_1 = cdf_0 + metal_weight * normalize_factor;
+    SIMDFloat cdf_2 = cdf_1 + clearcoat_weight * normalize_factor;
+
+    SIMDFloat rand_1 = next_random(samplers, active_lanes);
+
+    // Flipping the normal if the view direction is below the shading normal but not
+    // below the geometric normal when sampling the glass lobe. See the scalar version
+    SIMDMask glass_lobe = rand_1 > cdf_2;
+    SIMDMask fringe = dot(view_direction, shading_normal) * dot(view_direction, geometric_normal) < 0.0f;
+    normal = select(glass_lobe & fringe, flipped_normal, normal);
+
+    // The diffuse, metallic and clearcoat lobes are reflective, poping the stack
+    for_each_lane(active_lanes & (rand_1 < cdf_2), [volume_states](int lane)
+    {
+        volume_states[lane]->interior_stack.pop(false);
+    });
+
+    normal = select(dot(view_direction, normal) < 0.0f, -normal, normal);
+
+    SIMDFloat3 TR, BR;
+    build_rotated_ONB(normal, TR, BR, material.cos_anisotropic_rotation, material.sin_anisotropic_rotation);
+    SIMDFloat3 local_view_direction_rotated = world_to_local_frame(TR, BR, normal, view_direction);
+
+    // All the lobes consume two random numbers, the glass lobe consumes a third one
+    SIMDFloat r1 = next_random(samplers, active_lanes);
+    SIMDFloat r2 = next_random(samplers, active_lanes);
+
+    SIMDMask diffuse_lanes = active_lanes & (rand_1 < cdf_0);
+    SIMDMask metal_lanes = active_lanes & !diffuse_lanes & (rand_1 < cdf_1);
+    SIMDMask clearcoat_lanes = active_lanes & !(rand_1 < cdf_1) & (rand_1 < cdf_2);
+    SIMDMask glass_lanes = active_lanes & !(rand_1 < cdf_2);
+
+    output_direction = SIMDFloat3{ 0.0f, 0.0f, 0.0f };
+    if (any(diffuse_lanes))
+        output_direction = select(diffuse_lanes, cosine_weighted_sample(normal, r1, r2), output_direction);
+    if (any(metal_lanes))
+        output_direction = select(metal_lanes, local_to_world_frame(TR, BR, normal, disney_metallic_sample(material, local_view_direction_rotated, r1, r2)), output_direction);
+    if (any(clearcoat_lanes))
+        output_direction = select(clearcoat_lanes, local_to_world_frame(TR, BR, normal, disney_clearcoat_sample(material, local_view_direction_rotated, r1, r2)), output_direction);
+    if (any(glass_lanes))
+    {
+        SIMDFloat r3 = next_random(samplers, glass_lanes);
+
+        SIMDMask reflecting_lanes;
+        SIMDFloat3 glass_direction = disney_glass_sample(material, local_view_direction_rotated, r1, r2, r3, reflecting_lanes);
+        output_direction = select(glass_lanes, local_to_world_frame(TR, BR, normal, glass_direction), output_direction);
+
+        // Reflecting off the glass, poping the stack
+        for_each_lane(glass_lanes & reflecting_lanes, [volume_states](int lane)
+        {
+            volume_states[lane]->interior_stack.pop(false);
+        });
+    }
+
+    // Directions sampled below the surface by the other lobes than the glass lobe have a null contribution
+    SIMDMask below_surface = (dot(output_direction, shading_normal) < 0.0f) & !glass_lobe;
+    SIMDMask eval_lanes = active_lanes & !below_surface;
+
+    SIMDFloat3 color = SIMDFloat3{ 0.0f, 0.0f, 0.0f };
+    pdf = 0.0f;
+    if (any(eval_lanes))
+    {
+        SIMDFloat eval_pdf;
+        color = select(eval_lanes, disney_eval(materials_buffer, material, volume_states, eval_lanes, view_direction, normal, output_direction, eval_pdf), color);
+        pdf = select(eval_lanes, eval_pdf, pdf);
+    }
+
+    return color;
+}
+
+/**
+ * bsdf_dispatcher_eval_batch() for one instruction set
+ */
+inline void eval_batch(const RendererMaterial* materials_buffer, const BSDFBatch& batch)
+{
+    for (int first_hit = 0; first_hit < batch.count; first_hit += SIMD_WIDTH)
+    {
+        int lane_count = std::min(SIMD_WIDTH, batch.count - first_hit);
+
+        MaterialLanes material = load_material_lanes(materials_buffer, batch, first_hit, lane_count);
+        SIMDFloat3 view_direction = gather_lanes_float3(lane_count, [&](int lane) { return batch.view_directions[first_hit + lane]; });
+        SIMDFloat3 shading_normal = gather_lanes_float3(lane_count, [&](int lane) { return batch.shading_normals[first_hit + lane]; });
+        SIMDFloat3 to_light_direction = gather_lanes_float3(lane_count, [&](int lane) { return batch.to_light_directions[first_hit + lane]; });
+
+        RayVolumeState* volume_states[SIMD_WIDTH];
+        for (int lane = 0; lane < SIMD_WIDTH; lane++)
+            volume_states[lane] = &batch.ray_volume_states[first_hit + std::min(lane, lane_count - 1)];
+        SIMDMask active_lanes = first_lanes(lane_count);
+
+        SIMDFloat pdf;
+        SIMDFloat3 color = disney_eval(materials_buffer, material, volume_states, active_lanes, view_direction, shading_normal, to_light_direction, pdf);
+
+        store_lanes_color(color, lane_count, batch.colors + first_hit);
+        alignas(64) float pdfs[SIMD_WIDTH];
+        store(pdfs, pdf);
+        std::copy(pdfs, pdfs + lane_count, batch.pdfs + first_hit);
+    }
+}
+
+/**
+ * bsdf_dispatcher_sample_batch() for one instruction set
+ */
+inline void sample_batch(const RendererMaterial* materials_buffer, const BSDFBatch& batch)
+{
+    for (int first_hit = 0; first_hit < batch.count; first_hit += SIMD_WIDTH)
+    {
+        int lane_count = std::min(SIMD_WIDTH, batch.count - first_hit);
+
+        MaterialLanes material = load_material_lanes(materials_buffer, batch, first_hit, lane_count);
+        SIMDFloat3 view_direction = gather_lanes_float3(lane_count, [&](int lane) { return batch.view_directions[first_hit + lane]; });
+        SIMDFloat3 shading_normal = gather_lanes_float3(lane_count, [&](int lane) { return batch.shading_normals[first_hit + lane]; });
+        SIMDFloat3 geometric_normal = gather_lanes_float3(lane_count, [&](int lane) { return batch.geometric_normals[first_hit + lane]; });
+
+        // The lanes past the end of the batch are never active, they don't draw random numbers
+        Sampler* samplers[SIMD_WIDTH];
+        for (int lane = 0; lane < SIMD_WIDTH; lane++)
+            samplers[lane] = lane < lane_count ? &batch.samplers[first_hit + lane] : nullptr;
+
+        // The ray volume state of the lanes past the end of the batch are copies so that the
+        // lanes can be computed (and discarded) without modifying the state of the last hit
+        RayVolumeState unused_volume_state;
+        RayVolumeState* volume_states[SIMD_WIDTH];
+        for (int lane = 0; lane < SIMD_WIDTH; lane++)
+            volume_states[lane] = lane < lane_count ? &batch.ray_volume_states[first_hit + lane] : &unused_volume_state;
+        SIMDMask active_lanes = first_lanes(lane_count);
+
+        SIMDFloat3 output_direction;
+        SIMDFloat pdf;
+        SIMDFloat3 color = disney_sample(materials_buffer, material, volume_states, active_lanes, view_direction, shading_normal, geometric_normal, output_direction, pdf, samplers);
+
+        store_lanes_float3(output_direction, lane_count, batch.to_light_directions + first_hit);
+        store_lanes_color(color, lane_count, batch.colors + first_hit);
+        alignas(64) float pdfs[SIMD_WIDTH];
+        store(pdfs, pdf);
+        std::copy(pdfs, pdfs + lane_count, batch.pdfs + first_hit);
+    }
+}
@@ -4,10 +4,16 @@
  */
 
 #include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <numeric>
 #include <vector>
+#include <omp.h>
 
 #include "Renderer/BVH.h"
+#include "Renderer/BVHCache.h"
+#include "Renderer/FlattenedBVH.h"
+#include "Renderer/WideBVH.h"
 
 const float3 BoundingVolume::PLANE_NORMALS[BVHConstants::PLANES_COUNT] = {
 	float3(1, 0, 0),
@@ -19,25 +25,49 @@ const float3 BoundingVolume::PLANE_NORMALS[BVHConstants::PLANES_COUNT] = {
     float3(std::sqrt(3.0f) / 3, -std::sqrt(3.0f) / 3, std::sqrt(3.0f) / 3),
 };
 
+void BVHQualityReport::print() const
+{
+	std::cout << "BVH quality report:" << std::endl;
+	std::cout << "\tSAH cost: " << sah_cost << std::endl;
+	std::cout << "\t" << node_count << " nodes, " << leaf_count << " leaves" << std::endl;
+	std::cout << "\tMax depth: " << max_depth << ", average leaf depth: " << average_leaf_depth << std::endl;
+	std::cout << "\tAverage leaf size: " << average_leaf_size << " triangles" << std::endl;
+	std::cout << "\tLeaf size histogram:" << std::endl;
+	for (int leaf_size = 0; leaf_size < leaf_size_histogram.size(); leaf_size++)
+		if (leaf_size_histogram[leaf_size] > 0)
+			std::cout << "\t\t" << leaf_size << " triangle(s): " << leaf_size_histogram[leaf_size] << " leaves" << std::endl;
+}
+
 BVH::BVH() : _root(nullptr), _triangles(nullptr) {}
-BVH::BVH(std::vector<Triangle>* triangles, int max_depth, int leaf_max_obj_count) : _triangles(triangles)
+BVH::BVH(std::vector<Triangle>* triangles, const BVHBuildOptions& build_options) : _root(nullptr), _triangles(triangles), _build_options(build_options)
 {
-	BoundingVolume volume;
-	float3 minimum(INFINITY, INFINITY, INFINITY), maximum(-INFINITY, -INFINITY, -INFINITY);
+	uint64_t cache_key = 0;
+	if (!build_options.cache_file_path.empty())
+	{
+		cache_key = BVHCache::compute_key(*triangles, build_options);
+
+		// The BVH loaded from the cache only has its flattened version, _root stays nullptr
+		_flattened_bvh = BVHCache::load(build_options.cache_file_path, cache_key, triangles->size());
+		if (_flattened_bvh != nullptr)
+			std::cout << "BVH loaded from cache file \"" << build_options.cache_file_path << "\"" << std::endl;
+	}
 
-	for (const Triangle& triangle : *triangles)
+	if (_flattened_bvh == nullptr)
 	{
-		volume.extend_volume(triangle);
+		build_bvh(build_options);
 
-		for (int i = 0; i < 3; i++)
-		{
-			minimum = hippt::min(minimum, triangle[i]);
-			maximum = hippt::max(maximum, triangle[i]);
-		}
+		if (build_options.print_quality_report)
+			compute_quality_report().print();
+
+		_flattened_bvh = std::make_unique<FlattenedBVH>(flatten());
+
+		if (!build_options.cache_file_path.empty())
+			BVHCache::save(build_options.cache_file_path, cache_key, *_flattened_bvh);
 	}
 
-	//We now have a bounding volume to work with
-	build_bvh(max_depth, leaf_max_obj_count, minimum, maximum, volume);
+	build_wide_bvh(build_options);
+
+	_reference_sah_costs = _flattened_bvh->compute_subtree_sah_costs();
 }
 
 BVH::~BVH()
@@ -47,23 +77,944 @@ BVH::~BVH()
 
 void BVH::operator=(BVH&& bvh)
 {
+	delete _root;
+
 	_triangles = bvh._triangles;
+	_triangle_indices = std::move(bvh._triangle_indices);
+	// The wide BVHs reference the flattened BVH which lives on the heap
+	// so they remain valid when moved along with it
+	_flattened_bvh = std::move(bvh._flattened_bvh);
+	_wide_bvh4 = std::move(bvh._wide_bvh4);
+	_wide_bvh8 = std::move(bvh._wide_bvh8);
+	_build_options = bvh._build_options;
+	_reference_sah_costs = std::move(bvh._reference_sah_costs);
 	_root = bvh._root;
 
 	bvh._root = nullptr;
 }
 
-void BVH::build_bvh(int max_depth, int leaf_max_obj_count, float3 min, float3 max, const BoundingVolume& volume)
+void BVH::build_bvh(const BVHBuildOptions& build_options)
+{
+	const std::vector<Triangle>& triangles = *_triangles;
+	int triangle_count = triangles.size();
+	int thread_count = build_options.thread_count > 0 ? build_options.thread_count : omp_get_max_threads();
+
+	BuildPrimitives primitives;
+	primitives.boxes.resize(triangle_count);
+	primitives.centroids.resize(triangle_count);
+	_triangle_indices.resize(triangle_count);
+
+#pragma omp parallel for num_threads(thread_count)
+	for (int triangle_id = 0; triangle_id < triangle_count; triangle_id++)
+	{
+		primitives.boxes[triangle_id] = AABB(triangles[triangle_id]);
+		primitives.centroids[triangle_id] = primitives.boxes[triangle_id].centroid();
+
+		_triangle_indices[triangle_id] = triangle_id;
+	}
+
+	// The whole build runs as OpenMP tasks spawned from a single thread:
+	// the subtrees are built in parallel by the other threads of the team
+#pragma omp parallel num_threads(thread_count)
+#pragma omp single
+	{
+		_root = build_node_sah(primitives, 0, triangle_count, 0, build_options);
+		_root->compute_volume(triangles, _triangle_indices);
+	}
+}
+
+void BVH::build_wide_bvh(const BVHBuildOptions& build_options)
+{
+	_wide_bvh4 = nullptr;
+	_wide_bvh8 = nullptr;
+
+	SIMDInstructionSet instruction_set = build_options.simd_instruction_set;
+	if (!CPUFeatures::supports(instruction_set))
+		instruction_set = CPUFeatures::get_best_simd_instruction_set();
+
+	int width = build_options.traversal_width;
+	if (width == 0)
+	{
+		if (instruction_set >= SIMDInstructionSet::AVX2)
+			width = 8;
+		else if (instruction_set == SIMDInstructionSet::SSE4)
+			width = 4;
+		else
+			width = 2;
+	}
+
+	if (width == 8)
+	{
+		_wide_bvh8 = std::make_unique<WideBVH<8>>(*_flattened_bvh, instruction_set);
+		instruction_set = _wide_bvh8->get_instruction_set();
+	}
+	else if (width == 4)
+	{
+		_wide_bvh4 = std::make_unique<WideBVH<4>>(*_flattened_bvh, instruction_set);
+		instruction_set = _wide_bvh4->get_instruction_set();
+	}
+	else
+		width = 2;
+
+	if (!build_options.print_quality_report)
+		return;
+
+	if (width == 2)
+		std::cout << "CPU BVH traversal: binary BVH" << std::endl;
+	else
+	{
+		float lane_occupancy = width == 8 ? _wide_bvh8->get_lane_occupancy() : _wide_bvh4->get_lane_occupancy();
+
+		std::cout << "CPU BVH traversal: BVH" << width << " (" << CPUFeatures::to_string(instruction_set) << ")" << std::endl;
+		std::cout << "\tTriangle packet lane occupancy: " << lane_occupancy * 100.0f << "%" << std::endl;
+	}
+}
+
+/**
+ * Calls function(chunk_index, chunk_begin, chunk_end) on consecutive chunks of
+ * chunk_size elements of [begin, end[, each chunk in its own OpenMP task,
+ * and waits for all of them to complete
+ */
+template <typename Function>
+static void parallel_for_chunks(int begin, int end, int chunk_size, const Function& function)
+{
+	for (int chunk_begin = begin, chunk_index = 0; chunk_begin < end; chunk_begin += chunk_size, chunk_index++)
+	{
+		int chunk_end = std::min(end, chunk_begin + chunk_size);
+
+#pragma omp task firstprivate(chunk_index, chunk_begin, chunk_end) shared(function)
+		function(chunk_index, chunk_begin, chunk_end);
+	}
+
+#pragma omp taskwait
+}
+
+static int chunk_count(int element_count)
+{
+	return (element_count + BVHConstants::PARALLEL_BUILD_CHUNK_SIZE - 1) / BVHConstants::PARALLEL_BUILD_CHUNK_SIZE;
+}
+
+/**
+ * Builds the node containing the triangles _triangle_indices[first_triangle] to
+ * _triangle_indices[first_triangle + triangle_count - 1] by evaluating the SAH cost of
+ * build_options.bin_count candidate splits along each axis.
+ *
+ * The two children of the node are built in parallel (OpenMP tasks) if the node
+ * is large enough
+ *
+ * Reference:
+ * [1] [On fast Construction of SAH-based Bounding Volume Hierarchies, Wald, 2007]
+ */
+BVH::BVHNode* BVH::build_node_sah(const BuildPrimitives& primitives, int first_triangle, int triangle_count, int depth, const BVHBuildOptions& build_options)
+{
+	BVHNode* node = new BVHNode();
+	node->_first_triangle = first_triangle;
+	node->_triangle_count = triangle_count;
+
+	AABB centroids_box;
+	compute_bounds(primitives, first_triangle, triangle_count, node->_box, centroids_box);
+
+	if (triangle_count <= std::max(1, build_options.min_leaf_size) || depth >= BVHConstants::MAX_BUILD_DEPTH)
+		return node;
+
+	SAHBinning binning;
+	binning.bin_count = std::max(2, build_options.bin_count);
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float axis_extent = float3_component(centroids_box.m_max, axis) - float3_component(centroids_box.m_min, axis);
+
+		binning.axis_min[axis] = float3_component(centroids_box.m_min, axis);
+		binning.bin_scale[axis] = axis_extent > 0.0f ? binning.bin_count / axis_extent : 0.0f;
+	}
+
+	int bin_count = binning.bin_count;
+	std::vector<SAHBin> bins(3 * bin_count);
+	bin_triangles(primitives, first_triangle, triangle_count, binning, bins);
+
+	float node_area = node->_box.surface_area();
+	float leaf_cost = triangle_count * BVHConstants::SAH_INTERSECTION_COST;
+
+	float best_cost = INFINITY;
+	int best_axis = -1;
+	int best_split_bin = -1;
+
+	std::vector<float> right_areas(bin_count);
+	std::vector<int> right_counts(bin_count);
+	for (int axis = 0; axis < 3; axis++)
+	{
+		if (binning.bin_scale[axis] == 0.0f)
+			// All the centroids are at the same position on that axis, nothing to split
+			continue;
+
+		const SAHBin* axis_bins = &bins[axis * bin_count];
+
+		// Sweeping from the right to get the area / triangle count of
+		// all the bins on the right of each candidate split
+		AABB right_box;
+		int right_count = 0;
+		for (int bin_index = bin_count - 1; bin_index > 0; bin_index--)
+		{
+			right_box.extend(axis_bins[bin_index].box);
+			right_count += axis_bins[bin_index].triangle_count;
+
+			right_areas[bin_index] = right_box.surface_area();
+			right_counts[bin_index] = right_count;
+		}
+
+		// Sweeping from the left and evaluating the cost of splitting
+		// between bins 'split_bin - 1' and 'split_bin'
+		AABB left_box;
+		int left_count = 0;
+		for (int split_bin = 1; split_bin < bin_count; split_bin++)
+		{
+			left_box.extend(axis_bins[split_bin - 1].box);
+			left_count += axis_bins[split_bin - 1].triangle_count;
+
+			if (left_count == 0 || right_counts[split_bin] == 0)
+				continue;
+
+			float split_cost = BVHConstants::SAH_TRAVERSAL_COST + BVHConstants::SAH_INTERSECTION_COST * (left_box.surface_area() * left_count + right_areas[split_bin] * right_counts[split_bin]) / node_area;
+			if (split_cost < best_cost)
+			{
+				best_cost = split_cost;
+				best_axis = axis;
+				best_split_bin = split_bin;
+			}
+		}
+	}
+
+	bool can_be_leaf = triangle_count <= build_options.max_leaf_size;
+	if (can_be_leaf && (best_axis == -1 || best_cost >= leaf_cost))
+		// Not worth splitting
+		return node;
+
+	int left_count;
+	if (best_axis != -1)
+		left_count = partition_triangles(primitives, first_triangle, triangle_count, binning, best_axis, best_split_bin);
+	else
+		// All the centroids are at the same position, we have no choice but
+		// to split in the middle of the list of triangles
+		left_count = triangle_count / 2;
+
+	if (left_count == 0 || left_count == triangle_count)
+		left_count = triangle_count / 2;
+
+	if (triangle_count >= BVHConstants::PARALLEL_BUILD_TASK_THRESHOLD)
+	{
+#pragma omp task shared(primitives, build_options)
+		node->_children[0] = build_node_sah(primitives, first_triangle, left_count, depth + 1, build_options);
+
+		node->_children[1] = build_node_sah(primitives, first_triangle + left_count, triangle_count - left_count, depth + 1, build_options);
+#pragma omp taskwait
+	}
+	else
+	{
+		node->_children[0] = build_node_sah(primitives, first_triangle, left_count, depth + 1, build_options);
+		node->_children[1] = build_node_sah(primitives, first_triangle + left_count, triangle_count - left_count, depth + 1, build_options);
+	}
+
+	return node;
+}
+
+/**
+ * Computes the bounding box of the triangles of the node as well as
+ * the bounding box of their centroids
+ */
+void BVH::compute_bounds(const BuildPrimitives& primitives, int first_triangle, int triangle_count, AABB& out_box, AABB& out_centroids_box) const
+{
+	auto compute_range_bounds = [this, &primitives](int begin, int end, AABB& box, AABB& centroids_box)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			box.extend(primitives.boxes[_triangle_indices[i]]);
+			centroids_box.extend(primitives.centroids[_triangle_indices[i]]);
+		}
+	};
+
+	if (triangle_count < BVHConstants::PARALLEL_BINNING_THRESHOLD)
+	{
+		compute_range_bounds(first_triangle, first_triangle + triangle_count, out_box, out_centroids_box);
+
+		return;
+	}
+
+	std::vector<AABB> chunk_boxes(chunk_count(triangle_count));
+	std::vector<AABB> chunk_centroids_boxes(chunk_count(triangle_count));
+	parallel_for_chunks(first_triangle, first_triangle + triangle_count, BVHConstants::PARALLEL_BUILD_CHUNK_SIZE, [&](int chunk_index, int begin, int end)
+	{
+		compute_range_bounds(begin, end, chunk_boxes[chunk_index], chunk_centroids_boxes[chunk_index]);
+	});
+
+	for (int chunk_index = 0; chunk_index < chunk_boxes.size(); chunk_index++)
+	{
+		out_box.extend(chunk_boxes[chunk_index]);
+		out_centroids_box.extend(chunk_centroids_boxes[chunk_index]);
+	}
+}
+
+/**
+ * Bins the triangles of the node along the 3 axes at once.
+ * The bins of the axis 'axis' are out_bins[axis * bin_count] to out_bins[axis * bin_count + bin_count - 1]
+ */
+void BVH::bin_triangles(const BuildPrimitives& primitives, int first_triangle, int triangle_count, const SAHBinning& binning, std::vector<SAHBin>& out_bins) const
+{
+	auto bin_range = [this, &primitives, &binning](int begin, int end, std::vector<SAHBin>& bins)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			int triangle_id = _triangle_indices[i];
+
+			for (int axis = 0; axis < 3; axis++)
+			{
+				SAHBin& bin = bins[axis * binning.bin_count + binning.bin_index(primitives.centroids[triangle_id], axis)];
+
+				bin.box.extend(primitives.boxes[triangle_id]);
+				bin.triangle_count++;
+			}
+		}
+	};
+
+	if (triangle_count < BVHConstants::PARALLEL_BINNING_THRESHOLD)
+	{
+		bin_range(first_triangle, first_triangle + triangle_count, out_bins);
+
+		return;
+	}
+
+	// Each chunk is binned separately and the bins of all the chunks are merged afterwards
+	std::vector<std::vector<SAHBin>> chunk_bins(chunk_count(triangle_count), std::vector<SAHBin>(out_bins.size()));
+	parallel_for_chunks(first_triangle, first_triangle + triangle_count, BVHConstants::PARALLEL_BUILD_CHUNK_SIZE, [&](int chunk_index, int begin, int end)
+	{
+		bin_range(begin, end, chunk_bins[chunk_index]);
+	});
+
+	for (const std::vector<SAHBin>& bins : chunk_bins)
+	{
+		for (int i = 0; i < out_bins.size(); i++)
+		{
+			out_bins[i].box.extend(bins[i].box);
+			out_bins[i].triangle_count += bins[i].triangle_count;
+		}
+	}
+}
+
+/**
+ * Reorders the triangles of the node so that the triangles whose centroids fall
+ * in the bins on the left of 'split_bin' come first. Returns the number of these triangles.
+ *
+ * Large nodes are partitioned in parallel: each chunk counts its left triangles, an
+ * exclusive prefix sum gives the destination of the triangles of each chunk and the
+ * chunks are then scattered in parallel. This keeps the partition stable which makes the
+ * tree independent of the number of threads used
+ */
+int BVH::partition_triangles(const BuildPrimitives& primitives, int first_triangle, int triangle_count, const SAHBinning& binning, int split_axis, int split_bin)
+{
+	auto goes_left = [&primitives, &binning, split_axis, split_bin](int triangle_id)
+	{
+		return binning.bin_index(primitives.centroids[triangle_id], split_axis) < split_bin;
+	};
+
+	int* first = _triangle_indices.data() + first_triangle;
+	if (triangle_count < BVHConstants::PARALLEL_BINNING_THRESHOLD)
+		return static_cast<int>(std::partition(first, first + triangle_count, goes_left) - first);
+
+	int chunks = chunk_count(triangle_count);
+	std::vector<int> chunk_left_counts(chunks, 0);
+	parallel_for_chunks(0, triangle_count, BVHConstants::PARALLEL_BUILD_CHUNK_SIZE, [&](int chunk_index, int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+			chunk_left_counts[chunk_index] += goes_left(first[i]);
+	});
+
+	std::vector<int> chunk_left_offsets(chunks);
+	std::vector<int> chunk_right_offsets(chunks);
+	int left_count = std::accumulate(chunk_left_counts.begin(), chunk_left_counts.end(), 0);
+	int left_offset = 0;
+	int right_offset = left_count;
+	for (int chunk_index = 0; chunk_index < chunks; chunk_index++)
+	{
+		int chunk_size = std::min(BVHConstants::PARALLEL_BUILD_CHUNK_SIZE, triangle_count - chunk_index * BVHConstants::PARALLEL_BUILD_CHUNK_SIZE);
+
+		chunk_left_offsets[chunk_index] = left_offset;
+		chunk_right_offsets[chunk_index] = right_offset;
+		left_offset += chunk_left_counts[chunk_index];
+		right_offset += chunk_size - chunk_left_counts[chunk_index];
+	}
+
+	std::vector<int> partitioned(triangle_count);
+	parallel_for_chunks(0, triangle_count, BVHConstants::PARALLEL_BUILD_CHUNK_SIZE, [&](int chunk_index, int begin, int end)
+	{
+		int left_index = chunk_left_offsets[chunk_index];
+		int right_index = chunk_right_offsets[chunk_index];
+		for (int i = begin; i < end; i++)
+		{
+			if (goes_left(first[i]))
+				partitioned[left_index++] = first[i];
+			else
+				partitioned[right_index++] = first[i];
+		}
+	});
+
+	parallel_for_chunks(0, triangle_count, BVHConstants::PARALLEL_BUILD_CHUNK_SIZE, [&](int /*chunk_index*/, int begin, int end)
+	{
+		std::copy(partitioned.begin() + begin, partitioned.begin() + end, first + begin);
+	});
+
+	return left_count;
+}
+
+bool BVH::intersect(const hiprtRay& ray, HitInfo& hit_info, const BVHHitFilter& filter) const
+{
+	if (_wide_bvh8)
+		return _wide_bvh8->intersect(ray, hit_info, filter);
+	else if (_wide_bvh4)
+		return _wide_bvh4->intersect(ray, hit_info, filter);
+	else
+		return _flattened_bvh->intersect(ray, hit_info, filter);
+}
+
+bool BVH::occluded(const hiprtRay& ray, float t_max, const BVHHitFilter& filter) const
+{
+	if (_wide_bvh8)
+		return _wide_bvh8->occluded(ray, t_max, filter);
+	else if (_wide_bvh4)
+		return _wide_bvh4->occluded(ray, t_max, filter);
+	else
+		return _flattened_bvh->occluded(ray, t_max, filter);
+}
+
+unsigned int BVH::intersect_packet(const RayPacket& packet, HitInfo* hit_infos, const BVHHitFilter& filter) const
+{
+	if (packet.is_coherent())
+	{
+		if (_wide_bvh8)
+			return _wide_bvh8->intersect_packet(packet, hit_infos, filter);
+		else if (_wide_bvh4)
+			return _wide_bvh4->intersect_packet(packet, hit_infos, filter);
+		else
+			return _flattened_bvh->intersect_packet(packet, hit_infos, filter);
+	}
+
+	// The rays would not cull many nodes together, tracing them one by one
+	unsigned int hit_mask = 0;
+	for (int ray_index = 0; ray_index < packet.count; ray_index++)
+	{
+		hit_infos[ray_index].t = packet.t_max[ray_index];
+		if (intersect(packet.rays[ray_index], hit_infos[ray_index], filter))
+			hit_mask |= 1u << ray_index;
+	}
+
+	return hit_mask;
+}
+
+unsigned int BVH::occluded_packet(const RayPacket& packet, const BVHHitFilter& filter) const
+{
+	if (packet.is_coherent())
+	{
+		if (_wide_bvh8)
+			return _wide_bvh8->occluded_packet(packet, filter);
+		else if (_wide_bvh4)
+			return _wide_bvh4->occluded_packet(packet, filter);
+		else
+			return _flattened_bvh->occluded_packet(packet, filter);
+	}
+
+	unsigned int occluded_mask = 0;
+	for (int ray_index = 0; ray_index < packet.count; ray_index++)
+		if (occluded(packet.rays[ray_index], packet.t_max[ray_index], filter))
+			occluded_mask |= 1u << ray_index;
+
+	return occluded_mask;
+}
+
+AABB BVH::get_box() const
 {
-	_root = new OctreeNode(min, max);
+	if (_flattened_bvh == nullptr || _flattened_bvh->m_nodes.empty())
+		return AABB();
 
-    for (int triangle_id = 0; triangle_id < _triangles->size(); triangle_id++)
-        _root->insert(*_triangles, triangle_id, 0, max_depth, leaf_max_obj_count);
+	return _flattened_bvh->m_nodes[0].get_box();
+}
+
+FlattenedBVH BVH::flatten() const
+{
+	if (_root == nullptr)
+		return FlattenedBVH();
+
+	std::vector<Triangle> triangles(_triangle_indices.size());
+#pragma omp parallel for
+	for (int i = 0; i < _triangle_indices.size(); i++)
+		triangles[i] = (*_triangles)[_triangle_indices[i]];
+
+	std::vector<FlattenedBVH::FlattenedNode> nodes;
+	flatten_recursive(_root, nodes);
+
+	return FlattenedBVH(std::move(nodes), std::move(triangles), std::vector<int>(_triangle_indices));
+}
+
+/**
+ * Appends the node and its subtree to the flattened nodes in depth-first order.
+ * Returns the index of the node in the flattened nodes array
+ */
+int BVH::flatten_recursive(const BVHNode* node, std::vector<FlattenedBVH::FlattenedNode>& flattened_nodes) const
+{
+	int node_index = flattened_nodes.size();
+	flattened_nodes.emplace_back();
+
+	FlattenedBVH::FlattenedNode flattened_node;
+	for (int i = 0; i < BVHConstants::PLANES_COUNT; i++)
+	{
+		flattened_node.d_near[i] = node->_bounding_volume._d_near[i];
+		flattened_node.d_far[i] = node->_bounding_volume._d_far[i];
+	}
+
+	if (node->is_leaf())
+	{
+		// The triangles of the flattened BVH are in the same order as _triangle_indices
+		flattened_node.offset = node->_first_triangle;
+		flattened_node.triangle_count = node->_triangle_count;
+	}
+	else
+	{
+		// The first child is implicitly right after this node
+		flatten_recursive(node->_children[0], flattened_nodes);
+
+		flattened_node.offset = flatten_recursive(node->_children[1], flattened_nodes);
+		flattened_node.triangle_count = 0;
+	}
+
+	flattened_nodes[node_index] = flattened_node;
+
+	return node_index;
+}
 
-    _root->compute_volume(*_triangles);
+static float sah_cost_ratio(float sah_cost, float reference_sah_cost)
+{
+	return reference_sah_cost > 0.0f ? sah_cost / reference_sah_cost : 1.0f;
 }
 
-bool BVH::intersect(const hiprtRay& ray, HitInfo& hit_info) const
+static void copy_flattened_node_bounds(const FlattenedBVH::FlattenedNode& flattened_node, BVH::BVHNode* node)
 {
-    return _root->intersect(*_triangles, ray, hit_info);
+	for (int i = 0; i < BVHConstants::PLANES_COUNT; i++)
+	{
+		node->_bounding_volume._d_near[i] = flattened_node.d_near[i];
+		node->_bounding_volume._d_far[i] = flattened_node.d_far[i];
+	}
+	node->_box = flattened_node.get_box();
+}
+
+BVHRefitReport BVH::refit()
+{
+	BVHRefitReport report;
+	if (_flattened_bvh == nullptr || _flattened_bvh->m_nodes.empty())
+		return report;
+
+	int thread_count = _build_options.thread_count > 0 ? _build_options.thread_count : omp_get_max_threads();
+
+	// The flattened BVH is refit first and the other
+	// versions of the tree copy their bounds from it
+	_flattened_bvh->refit(*_triangles);
+	if (_root != nullptr)
+	{
+#pragma omp parallel num_threads(thread_count)
+#pragma omp single
+		copy_flattened_bounds_recursive(_root, 0, 0);
+	}
+	if (_wide_bvh4 != nullptr)
+		_wide_bvh4->refit();
+	if (_wide_bvh8 != nullptr)
+		_wide_bvh8->refit();
+
+	std::vector<float> sah_costs = _flattened_bvh->compute_subtree_sah_costs();
+	report.refit_sah_cost_ratio = sah_cost_ratio(sah_costs[0], _reference_sah_costs[0]);
+
+	// Looking for the degraded subtrees top-down so that only the
+	// largest degraded subtree of each branch of the tree is rebuilt
+	std::span<const FlattenedBVH::FlattenedNode> flattened_nodes = _flattened_bvh->m_nodes;
+	float root_cost = sah_costs[0] * flattened_nodes[0].get_box().surface_area();
+	std::vector<int> degraded_nodes;
+	std::vector<int> stack = { 0 };
+	while (!stack.empty())
+	{
+		int node_index = stack.back();
+		stack.pop_back();
+
+		const FlattenedBVH::FlattenedNode& node = flattened_nodes[node_index];
+		if (node.is_leaf())
+			continue;
+
+		// Rebuilding a subtree means flattening the whole BVH again, this is not
+		// worth it for the subtrees that barely contribute to the cost of the tree
+		float node_cost = sah_costs[node_index] * node.get_box().surface_area();
+		if (node_cost < root_cost * BVHConstants::REFIT_REBUILD_MIN_COST_SHARE)
+			continue;
+
+		if (sah_cost_ratio(sah_costs[node_index], _reference_sah_costs[node_index]) > _build_options.refit_rebuild_threshold)
+			degraded_nodes.push_back(node_index);
+		else
+		{
+			stack.push_back(node.offset);
+			stack.push_back(node_index + 1);
+		}
+	}
+
+	if (!degraded_nodes.empty())
+	{
+		report.rebuilt_subtree_count = degraded_nodes.size();
+		report.rebuilt_triangle_count = rebuild_subtrees(degraded_nodes);
+
+		sah_costs = _flattened_bvh->compute_subtree_sah_costs();
+	}
+	report.sah_cost_ratio = sah_cost_ratio(sah_costs[0], _reference_sah_costs[0]);
+
+	return report;
+}
+
+float BVH::compute_sah_degradation() const
+{
+	if (_flattened_bvh == nullptr || _flattened_bvh->m_nodes.empty())
+		return 1.0f;
+
+	return sah_cost_ratio(_flattened_bvh->compute_subtree_sah_costs()[0], _reference_sah_costs[0]);
+}
+
+/**
+ * Rebuilds the subtrees of the given nodes of the flattened BVH with the SAH
+ * builder and recreates the flattened BVH and the wide BVH.
+ *
+ * Returns the number of triangles in the rebuilt subtrees
+ */
+int BVH::rebuild_subtrees(const std::vector<int>& flattened_node_indices)
+{
+	const std::vector<Triangle>& triangles = *_triangles;
+	int thread_count = _build_options.thread_count > 0 ? _build_options.thread_count : omp_get_max_threads();
+
+	if (_root == nullptr)
+	{
+		// BVH loaded from a cache file, the tree is recreated from its flattened version
+		_triangle_indices.assign(_flattened_bvh->m_triangle_ids.begin(), _flattened_bvh->m_triangle_ids.end());
+		_root = unflatten_recursive(0);
+	}
+
+	// Finding the nodes of the tree that correspond to the flattened nodes. The flattened
+	// nodes are in depth-first order so all the nodes of the subtree of the first child of
+	// a node have a smaller index than its second child
+	std::vector<BVHNode*> nodes;
+	std::vector<int> depths;
+	for (int flattened_node_index : flattened_node_indices)
+	{
+		BVHNode* node = _root;
+		int node_index = 0;
+		int depth = 0;
+		while (node_index != flattened_node_index)
+		{
+			int second_child_index = _flattened_bvh->m_nodes[node_index].offset;
+			if (flattened_node_index < second_child_index)
+			{
+				node = node->_children[0];
+				node_index++;
+			}
+			else
+			{
+				node = node->_children[1];
+				node_index = second_child_index;
+			}
+
+			depth++;
+		}
+
+		nodes.push_back(node);
+		depths.push_back(depth);
+	}
+
+	// Only the triangles of the rebuilt subtrees need their build primitives
+	BuildPrimitives primitives;
+	primitives.boxes.resize(triangles.size());
+	primitives.centroids.resize(triangles.size());
+
+	int rebuilt_triangle_count = 0;
+	for (const BVHNode* node : nodes)
+	{
+#pragma omp parallel for num_threads(thread_count)
+		for (int i = node->_first_triangle; i < node->_first_triangle + node->_triangle_count; i++)
+		{
+			int triangle_id = _triangle_indices[i];
+
+			primitives.boxes[triangle_id] = AABB(triangles[triangle_id]);
+			primitives.centroids[triangle_id] = primitives.boxes[triangle_id].centroid();
+		}
+
+		rebuilt_triangle_count += node->_triangle_count;
+	}
+
+	// The subtrees cover disjoint ranges of _triangle_indices and are rebuilt in parallel
+#pragma omp parallel num_threads(thread_count)
+#pragma omp single
+	for (int i = 0; i < nodes.size(); i++)
+	{
+		BVHNode* node = nodes[i];
+		int depth = depths[i];
+
+#pragma omp task firstprivate(node, depth) shared(primitives, triangles)
+		{
+			BVHNode* subtree = build_node_sah(primitives, node->_first_triangle, node->_triangle_count, depth, _build_options);
+			subtree->compute_volume(triangles, _triangle_indices);
+
+			// The new subtree replaces the children of the node, the parent of the
+			// node keeps pointing to it
+			delete node->_children[0];
+			delete node->_children[1];
+			node->_children = subtree->_children;
+			node->_box = subtree->_box;
+			node->_bounding_volume = subtree->_bounding_volume;
+
+			subtree->_children = { nullptr, nullptr };
+			delete subtree;
+		}
+	}
+
+	std::vector<char> rebuilt(_flattened_bvh->m_nodes.size(), false);
+	for (int flattened_node_index : flattened_node_indices)
+		rebuilt[flattened_node_index] = true;
+
+	// The wide BVH references the flattened BVH, it is rebuilt below
+	_wide_bvh4 = nullptr;
+	_wide_bvh8 = nullptr;
+
+	std::unique_ptr<FlattenedBVH> old_flattened_bvh = std::move(_flattened_bvh);
+	_flattened_bvh = std::make_unique<FlattenedBVH>(flatten());
+
+	std::vector<float> sah_costs = _flattened_bvh->compute_subtree_sah_costs();
+	std::vector<float> reference_sah_costs(_flattened_bvh->m_nodes.size());
+	copy_reference_sah_costs_recursive(*old_flattened_bvh, 0, 0, rebuilt, sah_costs, reference_sah_costs);
+	_reference_sah_costs = std::move(reference_sah_costs);
+
+	BVHBuildOptions wide_build_options = _build_options;
+	wide_build_options.print_quality_report = false;
+	build_wide_bvh(wide_build_options);
+
+	return rebuilt_triangle_count;
+}
+
+/**
+ * Recreates the node (and its subtree) at the given index of the flattened BVH
+ */
+BVH::BVHNode* BVH::unflatten_recursive(int flattened_node_index) const
+{
+	const FlattenedBVH::FlattenedNode& flattened_node = _flattened_bvh->m_nodes[flattened_node_index];
+
+	BVHNode* node = new BVHNode();
+	copy_flattened_node_bounds(flattened_node, node);
+
+	if (flattened_node.is_leaf())
+	{
+		node->_first_triangle = flattened_node.offset;
+		node->_triangle_count = flattened_node.triangle_count;
+	}
+	else
+	{
+		node->_children[0] = unflatten_recursive(flattened_node_index + 1);
+		node->_children[1] = unflatten_recursive(flattened_node.offset);
+
+		node->_first_triangle = node->_children[0]->_first_triangle;
+		node->_triangle_count = node->_children[0]->_triangle_count + node->_children[1]->_triangle_count;
+	}
+
+	return node;
+}
+
+/**
+ * Copies the bounds of the refit flattened BVH into the
+ * nodes of the tree, which has the same topology
+ */
+void BVH::copy_flattened_bounds_recursive(BVHNode* node, int flattened_node_index, int depth) const
+{
+	const FlattenedBVH::FlattenedNode& flattened_node = _flattened_bvh->m_nodes[flattened_node_index];
+	copy_flattened_node_bounds(flattened_node, node);
+
+	if (node->is_leaf())
+		return;
+
+	if (depth < BVHConstants::PARALLEL_REFIT_TASK_DEPTH)
+	{
+#pragma omp task
+		copy_flattened_bounds_recursive(node->_children[0], flattened_node_index + 1, depth + 1);
+
+		copy_flattened_bounds_recursive(node->_children[1], flattened_node.offset, depth + 1);
+#pragma omp taskwait
+	}
+	else
+	{
+		copy_flattened_bounds_recursive(node->_children[0], flattened_node_index + 1, depth + 1);
+		copy_flattened_bounds_recursive(node->_children[1], flattened_node.offset, depth + 1);
+	}
+}
+
+/**
+ * Fills the reference SAH costs of the flattened BVH recreated after some subtrees were rebuilt.
+ *
+ * Outside of the rebuilt subtrees, the old and new flattened BVHs have the same topology and
+ * the nodes keep their reference cost, the degradation of the tree since it was built keeps
+ * being measured. The nodes of the rebuilt subtrees use their cost after the rebuild.
+ *
+ * old_node_index is -1 for the nodes of the rebuilt subtrees
+ */
+void BVH::copy_reference_sah_costs_recursive(const FlattenedBVH& old_flattened_bvh, int old_node_index, int new_node_index, const std::vector<char>& rebuilt, const std::vector<float>& new_sah_costs, std::vector<float>& new_reference_sah_costs) const
+{
+	if (old_node_index != -1 && rebuilt[old_node_index])
+		old_node_index = -1;
+
+	new_reference_sah_costs[new_node_index] = old_node_index == -1 ? new_sah_costs[new_node_index] : _reference_sah_costs[old_node_index];
+
+	const FlattenedBVH::FlattenedNode& new_node = _flattened_bvh->m_nodes[new_node_index];
+	if (new_node.is_leaf())
+		return;
+
+	int old_first_child = old_node_index == -1 ? -1 : old_node_index + 1;
+	int old_second_child = old_node_index == -1 ? -1 : old_flattened_bvh.m_nodes[old_node_index].offset;
+	copy_reference_sah_costs_recursive(old_flattened_bvh, old_first_child, new_node_index + 1, rebuilt, new_sah_costs, new_reference_sah_costs);
+	copy_reference_sah_costs_recursive(old_flattened_bvh, old_second_child, new_node.offset, rebuilt, new_sah_costs, new_reference_sah_costs);
+}
+
+BVHQualityReport BVH::compute_quality_report() const
+{
+	BVHQualityReport report;
+	if (_root == nullptr)
+		return report;
+
+	float root_area = _root->_box.surface_area();
+	compute_quality_report_recursive(_root, 0, root_area > 0.0f ? root_area : 1.0f, report);
+
+	if (report.leaf_count > 0)
+	{
+		report.average_leaf_depth /= report.leaf_count;
+		report.average_leaf_size /= report.leaf_count;
+	}
+
+	return report;
+}
+
+void BVH::compute_quality_report_recursive(const BVHNode* node, int depth, float root_area, BVHQualityReport& report) const
+{
+	float relative_area = node->_box.surface_area() / root_area;
+
+	report.node_count++;
+	report.max_depth = std::max(report.max_depth, depth);
+
+	if (node->is_leaf())
+	{
+		report.sah_cost += relative_area * node->_triangle_count * BVHConstants::SAH_INTERSECTION_COST;
+
+		report.leaf_count++;
+		report.average_leaf_depth += depth;
+		report.average_leaf_size += node->_triangle_count;
+
+		if (report.leaf_size_histogram.size() <= node->_triangle_count)
+			report.leaf_size_histogram.resize(node->_triangle_count + 1, 0);
+		report.leaf_size_histogram[node->_triangle_count]++;
+	}
+	else
+	{
+		report.sah_cost += relative_area * BVHConstants::SAH_TRAVERSAL_COST;
+
+		for (int i = 0; i < 2; i++)
+			compute_quality_report_recursive(node->_children[i], depth + 1, root_area, report);
+	}
+}
+
+void BVH::benchmark_build(std::vector<Triangle>* triangles, BVHBuildOptions build_options)
+{
+	build_options.print_quality_report = false;
+
+	std::cout << "BVH build benchmark (" << triangles->size() << " triangles):" << std::endl;
+
+	int max_thread_count = omp_get_max_threads();
+	float single_thread_time = 0.0f;
+	for (int thread_count = 1; ; thread_count = std::min(thread_count * 2, max_thread_count))
+	{
+		build_options.thread_count = thread_count;
+
+		auto start = std::chrono::high_resolution_clock::now();
+		BVH bvh(triangles, build_options);
+		auto stop = std::chrono::high_resolution_clock::now();
+
+		float build_time = std::chrono::duration<float, std::milli>(stop - start).count();
+		if (thread_count == 1)
+			single_thread_time = build_time;
+
+		std::cout << "\t" << thread_count << " thread(s): " << build_time << "ms, speedup x" << single_thread_time / build_time << std::endl;
+
+		if (thread_count == max_thread_count)
+			break;
+	}
+}
+
+void BVH::benchmark_refit(const std::vector<Triangle>& triangles, BVHBuildOptions build_options)
+{
+	build_options.print_quality_report = false;
+	build_options.cache_file_path = "";
+
+	constexpr int FRAME_COUNT = 8;
+	// Twist of the top of the mesh relative to its bottom at the last frame
+	constexpr float MAX_TWIST_ANGLE = 4.0f * M_PI;
+
+	AABB box;
+	for (const Triangle& triangle : triangles)
+		box.extend(AABB(triangle));
+	float3 center = box.centroid();
+	float height = hippt::max(box.extent().y, 1.0e-6f);
+
+	std::vector<Triangle> animated_triangles = triangles;
+
+	// Only ever refit
+	BVHBuildOptions refit_only_options = build_options;
+	refit_only_options.refit_rebuild_threshold = INFINITY;
+	BVH refit_only_bvh(&animated_triangles, refit_only_options);
+	// Refit and rebuild the degraded subtrees
+	BVH refit_bvh(&animated_triangles, build_options);
+
+	std::cout << "BVH refit benchmark (" << triangles.size() << " triangles, twisted over " << FRAME_COUNT << " frames):" << std::endl;
+	for (int frame = 1; frame <= FRAME_COUNT; frame++)
+	{
+		float frame_twist = MAX_TWIST_ANGLE * frame / FRAME_COUNT;
+		auto twist = [&center, &box, height, frame_twist](const float3& point)
+		{
+			float angle = frame_twist * (point.y - box.m_min.y) / height;
+			float cos_angle = std::cos(angle);
+			float sin_angle = std::sin(angle);
+			float3 relative = point - center;
+
+			return center + make_float3(relative.x * cos_angle - relative.z * sin_angle, relative.y, relative.x * sin_angle + relative.z * cos_angle);
+		};
+
+#pragma omp parallel for
+		for (int i = 0; i < triangles.size(); i++)
+			animated_triangles[i] = Triangle(twist(triangles[i].m_a), twist(triangles[i].m_b), twist(triangles[i].m_c));
+
+		auto start = std::chrono::high_resolution_clock::now();
+		BVHRefitReport refit_only_report = refit_only_bvh.refit();
+		auto stop = std::chrono::high_resolution_clock::now();
+		float refit_time = std::chrono::duration<float, std::milli>(stop - start).count();
+
+		start = std::chrono::high_resolution_clock::now();
+		BVHRefitReport refit_report = refit_bvh.refit();
+		stop = std::chrono::high_resolution_clock::now();
+		float partial_rebuild_time = std::chrono::duration<float, std::milli>(stop - start).count();
+
+		start = std::chrono::high_resolution_clock::now();
+		BVH rebuilt_bvh(&animated_triangles, build_options);
+		stop = std::chrono::high_resolution_clock::now();
+		float rebuild_time = std::chrono::duration<float, std::milli>(stop - start).count();
+
+		// The SAH costs of the refit BVHs are compared to the cost of the BVH rebuilt from scratch
+		float rebuilt_sah_cost = rebuilt_bvh._reference_sah_costs.empty() ? 0.0f : rebuilt_bvh._reference_sah_costs[0];
+		float refit_only_sah_cost = refit_only_bvh._flattened_bvh->m_nodes.empty() ? 0.0f : refit_only_bvh._flattened_bvh->compute_subtree_sah_costs()[0];
+		float refit_sah_cost = refit_bvh._flattened_bvh->m_nodes.empty() ? 0.0f : refit_bvh._flattened_bvh->compute_subtree_sah_costs()[0];
+
+		std::cout << "\tFrame " << frame << " (full rebuild: " << rebuild_time << "ms):" << std::endl;
+		std::cout << "\t\tRefit: " << refit_time << "ms, SAH cost x" << sah_cost_ratio(refit_only_sah_cost, rebuilt_sah_cost)
+			<< " of the full rebuild, degradation x" << refit_only_report.sah_cost_ratio << std::endl;
+		std::cout << "\t\tRefit + partial rebuild: " << partial_rebuild_time << "ms, SAH cost x" << sah_cost_ratio(refit_sah_cost, rebuilt_sah_cost)
+			<< " of the full rebuild, degradation x" << refit_report.refit_sah_cost_ratio << " -> x" << refit_report.sah_cost_ratio
+			<< " (" << refit_report.rebuilt_subtree_count << " subtree(s), " << refit_report.rebuilt_triangle_count << " triangles rebuilt)" << std::endl;
+	}
 }
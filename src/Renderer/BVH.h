@@ -7,249 +7,305 @@
 #define BVH_H
 
 
+#include "Renderer/AABB.h"
 #include "Renderer/BoundingVolume.h"
 #include "Renderer/BVHConstants.h"
+#include "Renderer/CPUFeatures.h"
+#include "Renderer/FlattenedBVH.h"
 #include "Renderer/Triangle.h"
 
+#include <algorithm>
 #include <array>
 #include <atomic>
 #include <cmath>
 #include <deque>
+#include <iostream>
 #include <limits>
-#include <queue>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include <hiprt/hiprt_types.h> // for hiprtRay
 
-class FlattenedBVH;
+template <int Width>
+class WideBVH;
 
-class BVH
+struct BVHBuildOptions
 {
-public:
-    struct OctreeNode
-    {
-        struct QueueElement
-        {
-            QueueElement(const BVH::OctreeNode* node, float t_near) : _node(node), _t_near(t_near) {}
+    // Maximum number of triangles in a leaf. The SAH may decide to
+    // create leaves smaller than that if it is cheaper than splitting
+    int max_leaf_size = BVHConstants::MAX_TRIANGLES_PER_LEAF;
+    // Nodes with that many triangles or fewer are leaves, without evaluating
+    // the SAH cost of splitting them
+    int min_leaf_size = BVHConstants::MIN_TRIANGLES_PER_LEAF;
+    // How many bins per axis to use when evaluating the SAH
+    // cost of the candidate splits of a node
+    int bin_count = BVHConstants::SAH_BIN_COUNT;
+
+    // Whether or not to print the BVHQualityReport (and the traversal
+    // that is going to be used) after the build
+    bool print_quality_report = true;
+
+    // Number of threads used by the build. 0 uses as many threads as OpenMP allows
+    int thread_count = 0;
+
+    // If not empty, the flattened BVH is loaded from this BVHCache file instead of being
+    // built. If the file doesn't exist or is stale, the BVH is built and saved to this file
+    std::string cache_file_path = "";
+
+    // Number of children per node of the BVH used for the traversal.
+    // 2 traverses the binary FlattenedBVH, 4 and 8 traverse a WideBVH collapsed
+    // from it. 0 picks the width that best suits simd_instruction_set
+    int traversal_width = 0;
+    // Instruction set used to intersect the children of the nodes of
+    // the WideBVH. Ignored if not supported by the CPU
+    SIMDInstructionSet simd_instruction_set = CPUFeatures::get_best_simd_instruction_set();
+
+    // BVH::refit() rebuilds the subtrees whose SAH cost grew by more than
+    // this factor since they were built. INFINITY to only ever refit
+    float refit_rebuild_threshold = BVHConstants::REFIT_REBUILD_SAH_THRESHOLD;
+};
 
-            bool operator > (const QueueElement& a) const
-            {
-                return _t_near > a._t_near;
-            }
+/**
+ * Statistics about the quality of a built BVH.
+ *
+ * Useful to compare builders / build parameters on a given scene
+ */
+struct BVHQualityReport
+{
+    void print() const;
 
-            const OctreeNode* _node;//Reference on the node
+    // SAH cost of the whole tree, normalized by the surface area of the root
+    float sah_cost = 0.0f;
 
-            float _t_near;//Intersection distance used to order the elements in the priority queue used
-            //by the OctreeNode to compute the intersection with a ray
-        };
+    int node_count = 0;
+    int leaf_count = 0;
+    int max_depth = 0;
+    float average_leaf_depth = 0.0f;
+    float average_leaf_size = 0.0f;
 
-        OctreeNode(float3 min, float3 max) : _min(min), _max(max) {}
-        ~OctreeNode()
-        {
-            if (_is_leaf)
-                return;
-            else
-            {
-                for (int i = 0; i < 8; i++)
-                    delete _children[i];
-            }
-        }
+    // leaf_size_histogram[i] is the number of leaves that contain i triangles
+    std::vector<int> leaf_size_histogram;
+};
 
-        /*
-          * Once the objects have been inserted in the hierarchy, this function computes
-          * the bounding volume of all the node in the hierarchy
-          */
-        BoundingVolume compute_volume(const std::vector<Triangle>& triangles_geometry)
-        {
-            if (_is_leaf)
-                for (int triangle_id : _triangles)
-                    _bounding_volume.extend_volume(triangles_geometry[triangle_id]);
-            else
-                for (int i = 0; i < 8; i++)
-                    _bounding_volume.extend_volume(_children[i]->compute_volume(triangles_geometry));
+/**
+ * What BVH::refit() did
+ */
+struct BVHRefitReport
+{
+    // SAH cost of the tree divided by its SAH cost when it was built, right
+    // after the refit and after the degraded subtrees have been rebuilt
+    float refit_sah_cost_ratio = 1.0f;
+    float sah_cost_ratio = 1.0f;
 
-            return _bounding_volume;
-        }
+    int rebuilt_subtree_count = 0;
+    int rebuilt_triangle_count = 0;
+};
 
-        void create_children(int max_depth, int leaf_max_obj_count)
+class BVH
+{
+public:
+    struct BVHNode
+    {
+        BVHNode() {}
+        ~BVHNode()
         {
-            float middle_x = (_min.x + _max.x) / 2;
-            float middle_y = (_min.y + _max.y) / 2;
-            float middle_z = (_min.z + _max.z) / 2;
-
-            _children[0] = new OctreeNode(_min, float3(middle_x, middle_y, middle_z));
-            _children[1] = new OctreeNode(float3(middle_x, _min.y, _min.z), float3(_max.x, middle_y, middle_z));
-            _children[2] = new OctreeNode(_min + float3(0, middle_y, 0), float3(middle_x, _max.y, middle_z));
-            _children[3] = new OctreeNode(float3(middle_x, middle_y, _min.z), float3(_max.x, _max.y, middle_z));
-            _children[4] = new OctreeNode(_min + float3(0, 0, middle_z), float3(middle_x, middle_y, _max.z));
-            _children[5] = new OctreeNode(float3(middle_x, _min.y, middle_z), float3(_max.x, middle_y, _max.z));
-            _children[6] = new OctreeNode(_min + float3(0, middle_y, middle_z), float3(middle_x, _max.y, _max.z));
-            _children[7] = new OctreeNode(float3(middle_x, middle_y, middle_z), float3(_max.x, _max.y, _max.z));
+            delete _children[0];
+            delete _children[1];
         }
 
-        void insert(const std::vector<Triangle>& triangles_geometry, int triangle_id_to_insert, int current_depth, int max_depth, int leaf_max_obj_count)
+        /*
+         * Once the hierarchy has been built, this function computes
+         * the bounding volume of all the nodes in the hierarchy
+         */
+        BoundingVolume compute_volume(const std::vector<Triangle>& triangles_geometry, const std::vector<int>& triangle_indices)
         {
-            bool depth_exceeded = max_depth != -1 && current_depth == max_depth;
-
-            if (_is_leaf || depth_exceeded)
+            if (is_leaf())
+                for (int i = _first_triangle; i < _first_triangle + _triangle_count; i++)
+                    _bounding_volume.extend_volume(triangles_geometry[triangle_indices[i]]);
+            else
             {
-                _triangles.push_back(triangle_id_to_insert);
-
-                if (_triangles.size() > leaf_max_obj_count && !depth_exceeded)
+                // Large subtrees are processed in parallel when called from within
+                // an OpenMP parallel region, serially otherwise
+                if (_triangle_count >= BVHConstants::PARALLEL_BUILD_TASK_THRESHOLD)
                 {
-                    _is_leaf = false;//This node isn't a leaf anymore
-
-                    create_children(max_depth, leaf_max_obj_count);
-
-                    for (int triangle_id : _triangles)
-                        insert_to_children(triangles_geometry, triangle_id, current_depth, max_depth, leaf_max_obj_count);
+#pragma omp task shared(triangles_geometry, triangle_indices)
+                    _children[0]->compute_volume(triangles_geometry, triangle_indices);
 
-                    _triangles.clear();
-                    _triangles.shrink_to_fit();
+                    _children[1]->compute_volume(triangles_geometry, triangle_indices);
+#pragma omp taskwait
                 }
-            }
-            else
-                insert_to_children(triangles_geometry, triangle_id_to_insert, current_depth, max_depth, leaf_max_obj_count);
-
-        }
-
-        void insert_to_children(const std::vector<Triangle>& triangles_geometry, int triangle_id_to_insert, int current_depth, int max_depth, int leaf_max_obj_count)
-        {
-            const Triangle& triangle = triangles_geometry[triangle_id_to_insert];
-            float3 bbox_centroid = triangle.bbox_centroid();
-
-            float middle_x = (_min.x + _max.x) / 2;
-            float middle_y = (_min.y + _max.y) / 2;
-            float middle_z = (_min.z + _max.z) / 2;
-
-            int octant_index = 0;
-
-            if (bbox_centroid.x > middle_x) octant_index += 1;
-            if (bbox_centroid.y > middle_y) octant_index += 2;
-            if (bbox_centroid.z > middle_z) octant_index += 4;
-
-            _children[octant_index]->insert(triangles_geometry, triangle_id_to_insert, current_depth + 1, max_depth, leaf_max_obj_count);
-        }
+                else
+                    for (int i = 0; i < 2; i++)
+                        _children[i]->compute_volume(triangles_geometry, triangle_indices);
 
-        bool intersect(const std::vector<Triangle>& triangles_geometry, const hiprtRay& ray, HitInfo& hit_info) const
-        {
-            float trash;
-
-            float denoms[BVHConstants::PLANES_COUNT];
-            float numers[BVHConstants::PLANES_COUNT];
-
-            for (int i = 0; i < BVHConstants::PLANES_COUNT; i++)
-            {
-                denoms[i] = hippt::dot(BoundingVolume::PLANE_NORMALS[i], ray.direction);
-                numers[i] = hippt::dot(BoundingVolume::PLANE_NORMALS[i], float3(ray.origin));
+                for (int i = 0; i < 2; i++)
+                    _bounding_volume.extend_volume(_children[i]->_bounding_volume);
             }
 
-            return intersect(triangles_geometry, ray, hit_info, trash, denoms, numers);
+            return _bounding_volume;
         }
 
-        bool intersect(const std::vector<Triangle>& triangles_geometry, const hiprtRay& ray, HitInfo& hit_info, float& t_near, float* denoms, float* numers) const
+        bool is_leaf() const
         {
-            float t_far, trash;
-
-            if (!_bounding_volume.intersect(trash, t_far, denoms, numers))
-                return false;
+            return _children[0] == nullptr;
+        }
 
-            if (_is_leaf)
-            {
-                for (int triangle_id : _triangles)
-                {
-                    const Triangle& triangle = triangles_geometry[triangle_id];
-
-                    HitInfo local_hit_info;
-                    if (triangle.intersect(ray, local_hit_info))
-                    {
-                        hiprtHit hit;
-                        hit.normal = local_hit_info.geometric_normal;
-                        hit.primID = triangle_id;
-                        hit.t = local_hit_info.t;
-                        hit.uv = local_hit_info.uv;
-
-                        if (local_hit_info.t < hit_info.t || hit_info.t == -1)
-                        {
-                            hit_info = local_hit_info;
-                            hit_info.primitive_index = triangle_id;
-                        }
-                    }
-                }
+        // Both children are nullptr if this node is a leaf
+        std::array<BVH::BVHNode*, 2> _children = { nullptr, nullptr };
 
-                t_near = hit_info.t;
+        // The triangles of the subtree of this node are the triangles
+        // BVH::_triangle_indices[_first_triangle] to BVH::_triangle_indices[_first_triangle + _triangle_count - 1]
+        int _first_triangle = 0;
+        int _triangle_count = 0;
 
-                return t_near > 0;
-            }
+        // Axis aligned box of the node, used for the SAH
+        AABB _box;
+        // Tighter bounding volume of the node, used for the traversal
+        BoundingVolume _bounding_volume;
+    };
 
-            std::priority_queue<QueueElement, std::vector<QueueElement>, std::greater<QueueElement>> intersection_queue;
-            for (int i = 0; i < 8; i++)
-            {
-                float inter_distance;
-                if (_children[i]->_bounding_volume.intersect(inter_distance, t_far, denoms, numers))
-                    intersection_queue.emplace(QueueElement(_children[i], inter_distance));
-            }
+public:
+    BVH();
+    BVH(std::vector<Triangle>* triangles, const BVHBuildOptions& build_options = BVHBuildOptions());
+    ~BVH();
 
-            bool intersection_found = false;
-            float closest_inter = 100000000, inter_distance = 100000000;
-            while (!intersection_queue.empty())
-            {
-                QueueElement top_element = intersection_queue.top();
-                intersection_queue.pop();
+    void operator=(BVH&& bvh);
 
-                if (top_element._node->intersect(triangles_geometry, ray, hit_info, inter_distance, denoms, numers))
-                {
-                    closest_inter = std::min(closest_inter, inter_distance);
-                    intersection_found = true;
+    /**
+     * Closest hit query. The hits rejected by the filter (if there is one) are
+     * skipped during the traversal, without having to trace a new ray past them
+     */
+    bool intersect(const hiprtRay& ray, HitInfo& hit_info, const BVHHitFilter& filter = nullptr) const;
+    /**
+     * Returns true if the ray hits anything closer than t_max. Stops at the first
+     * hit accepted by the filter (or at the first hit if there is no filter).
+     * Cheaper than intersect() as the children are not sorted and no hit attributes
+     * are computed: this is the query to use for shadow rays
+     */
+    bool occluded(const hiprtRay& ray, float t_max, const BVHHitFilter& filter = nullptr) const;
+    /**
+     * Closest hit queries of all the rays of a packet (see RayPacket). Returns the mask of
+     * the rays that hit something, their hit_info is filled like intersect() would.
+     *
+     * Coherent packets traverse the BVH together (WideBVH::intersect_packet() or
+     * FlattenedBVH::intersect_packet() if there is no wide BVH), the rays of the
+     * other packets are traced one by one with intersect()
+     */
+    unsigned int intersect_packet(const RayPacket& packet, HitInfo* hit_infos, const BVHHitFilter& filter = nullptr) const;
+    /**
+     * Occlusion queries of all the rays of a packet, up to their RayPacket::t_max.
+     * Returns the mask of the occluded rays
+     */
+    unsigned int occluded_packet(const RayPacket& packet, const BVHHitFilter& filter = nullptr) const;
+    FlattenedBVH flatten() const;
 
-                    //If we found an intersection that is closer than
-                    //the next element in the queue, we can stop intersecting further
-                    if (intersection_queue.empty() || closest_inter < intersection_queue.top()._t_near)
-                    {
-                        t_near = closest_inter;
+    /**
+     * Updates the BVH after the vertices of its triangles have moved: the vector of
+     * triangles given to the constructor must have been modified in place, with the same
+     * number of triangles.
+     *
+     * The bounds of the nodes are first recomputed bottom-up, in parallel, without changing
+     * the topology of the tree. A refit tree gets slower to traverse as the geometry deforms
+     * so the subtrees whose SAH cost grew by more than BVHBuildOptions::refit_rebuild_threshold
+     * since they were built are then rebuilt from scratch.
+     *
+     * The world space boxes of a TopLevelBVH over this BVH are not updated, the
+     * TopLevelBVH has to be recreated (cheap, there are few instances in a scene)
+     */
+    BVHRefitReport refit();
+    /**
+     * SAH cost of the tree divided by its SAH cost when it was built.
+     * Goes up as the tree is refit over deforming geometry
+     */
+    float compute_sah_degradation() const;
+
+    BVHQualityReport compute_quality_report() const;
+    /**
+     * Axis aligned box of all the triangles of the BVH.
+     * Empty if the BVH has no triangles
+     */
+    AABB get_box() const;
+
+    /**
+     * Builds a BVH over the given triangles with 1, 2, 4, ... up to the maximum
+     * number of OpenMP threads and prints the build time and speedup of each
+     */
+    static void benchmark_build(std::vector<Triangle>* triangles, BVHBuildOptions build_options = BVHBuildOptions());
+    /**
+     * Twists the given triangles a bit more at each frame of a short animation and
+     * prints the time and SAH cost of refitting the BVH compared to rebuilding it
+     * from scratch at each frame. The triangles are left untouched
+     */
+    static void benchmark_refit(const std::vector<Triangle>& triangles, BVHBuildOptions build_options = BVHBuildOptions());
 
-                        return true;
-                    }
-                }
-            }
+private:
+    struct BuildPrimitives
+    {
+        // Bounding box of each triangle
+        std::vector<AABB> boxes;
+        // Centroid of the bounding box of each triangle
+        std::vector<float3> centroids;
+    };
 
-            if (!intersection_found)
-                return false;
-            else
-            {
-                t_near = closest_inter;
+    struct SAHBin
+    {
+        AABB box;
+        int triangle_count = 0;
+    };
 
-                return true;
-            }
+    /**
+     * Bin of the triangle with the given centroid along the given axis
+     */
+    struct SAHBinning
+    {
+        int bin_index(const float3& centroid, int axis) const
+        {
+            return std::min(bin_count - 1, static_cast<int>((float3_component(centroid, axis) - axis_min[axis]) * bin_scale[axis]));
         }
 
-        //If this node has been subdivided (and thus cannot accept any triangles),
-        //this boolean will be set to false
-        bool _is_leaf = true;
-
-        std::vector<int> _triangles;
-        std::array<BVH::OctreeNode*, 8> _children;
-
-        float3 _min, _max;
-        BoundingVolume _bounding_volume;
+        int bin_count;
+        float axis_min[3];
+        float bin_scale[3];
     };
 
-public:
-    BVH();
-    BVH(std::vector<Triangle>* triangles, int max_depth = 32, int leaf_max_obj_count = 8);
-    ~BVH();
+    void build_bvh(const BVHBuildOptions& build_options);
+    void build_wide_bvh(const BVHBuildOptions& build_options);
+    int flatten_recursive(const BVHNode* node, std::vector<FlattenedBVH::FlattenedNode>& flattened_nodes) const;
+    BVHNode* build_node_sah(const BuildPrimitives& primitives, int first_triangle, int triangle_count, int depth, const BVHBuildOptions& build_options);
 
-    void operator=(BVH&& bvh);
-     
-    bool intersect(const hiprtRay& ray, HitInfo& hit_info) const;
-    FlattenedBVH flatten() const;
+    void compute_bounds(const BuildPrimitives& primitives, int first_triangle, int triangle_count, AABB& out_box, AABB& out_centroids_box) const;
+    void bin_triangles(const BuildPrimitives& primitives, int first_triangle, int triangle_count, const SAHBinning& binning, std::vector<SAHBin>& out_bins) const;
+    int partition_triangles(const BuildPrimitives& primitives, int first_triangle, int triangle_count, const SAHBinning& binning, int split_axis, int split_bin);
 
-private:
-    void build_bvh(int max_depth, int leaf_max_obj_count, float3 min, float3 max, const BoundingVolume& volume);
+    int rebuild_subtrees(const std::vector<int>& flattened_node_indices);
+    BVHNode* unflatten_recursive(int flattened_node_index) const;
+    void copy_flattened_bounds_recursive(BVHNode* node, int flattened_node_index, int depth) const;
+    void copy_reference_sah_costs_recursive(const FlattenedBVH& old_flattened_bvh, int old_node_index, int new_node_index, const std::vector<char>& rebuilt, const std::vector<float>& new_sah_costs, std::vector<float>& new_reference_sah_costs) const;
+
+    void compute_quality_report_recursive(const BVHNode* node, int depth, float root_area, BVHQualityReport& report) const;
 
 public:
-    OctreeNode* _root;
+    // nullptr if the BVH was loaded from a cache file (until
+    // refit() needs it to rebuild a part of the tree)
+    BVHNode* _root;
+    // Flattened version of the tree built from _root, used for the traversal
+    std::unique_ptr<FlattenedBVH> _flattened_bvh;
+    // At most one of these is built, collapsed from _flattened_bvh. If
+    // none of them is, the traversal is done on _flattened_bvh
+    std::unique_ptr<WideBVH<4>> _wide_bvh4;
+    std::unique_ptr<WideBVH<8>> _wide_bvh8;
 
     std::vector<Triangle>* _triangles;
+    // Indices of the triangles of the scene, reordered by the build
+    // so that the triangles of each leaf are contiguous in this buffer
+    std::vector<int> _triangle_indices;
+
+    BVHBuildOptions _build_options;
+    // Normalized SAH cost of the subtree of each node of _flattened_bvh when
+    // it was built (FlattenedBVH::compute_subtree_sah_costs()). This is
+    // what refit() measures the degradation of the tree against
+    std::vector<float> _reference_sah_costs;
 };
 
 #endif
@@ -0,0 +1,188 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#include "Renderer/BVH.h"
+#include "Renderer/BVHCache.h"
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+static constexpr char BVH_CACHE_MAGIC[8] = { 'H', 'I', 'P', 'R', 'T', 'B', 'V', 'H' };
+static constexpr uint64_t BVH_CACHE_ALIGNMENT = 64;
+
+static uint64_t align_up(uint64_t offset)
+{
+    return (offset + BVH_CACHE_ALIGNMENT - 1) / BVH_CACHE_ALIGNMENT * BVH_CACHE_ALIGNMENT;
+}
+
+/**
+ * FNV-1a applied on 64 bits words instead of bytes, with an
+ * additional shift to mix the high bits back into the low bits
+ */
+static uint64_t hash_bytes(uint64_t hash, const void* data, std::size_t size)
+{
+    constexpr uint64_t FNV_PRIME = 0x100000001b3ull;
+
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), bytes += sizeof(uint64_t))
+    {
+        uint64_t word;
+        std::memcpy(&word, bytes, sizeof(uint64_t));
+
+        hash = (hash ^ word) * FNV_PRIME;
+        hash ^= hash >> 29;
+    }
+
+    for (; size > 0; size--, bytes++)
+        hash = (hash ^ *bytes) * FNV_PRIME;
+
+    return hash;
+}
+
+template <typename T>
+static uint64_t hash_value(uint64_t hash, const T& value)
+{
+    return hash_bytes(hash, &value, sizeof(T));
+}
+
+uint64_t BVHCache::compute_key(const std::vector<Triangle>& triangles, const BVHBuildOptions& build_options)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    hash = hash_value(hash, VERSION);
+    hash = hash_value(hash, sizeof(FlattenedBVH::FlattenedNode));
+    hash = hash_value(hash, sizeof(Triangle));
+
+    // Only the options that change the tree. The number of threads doesn't,
+    // the build is deterministic, and neither does the traversal width since
+    // the wide BVH is collapsed from the cached binary BVH
+    hash = hash_value(hash, build_options.max_leaf_size);
+    hash = hash_value(hash, build_options.min_leaf_size);
+    hash = hash_value(hash, build_options.bin_count);
+    hash = hash_value(hash, BVHConstants::MAX_BUILD_DEPTH);
+    hash = hash_value(hash, BVHConstants::SAH_TRAVERSAL_COST);
+    hash = hash_value(hash, BVHConstants::SAH_INTERSECTION_COST);
+
+    hash = hash_value(hash, triangles.size());
+    hash = hash_bytes(hash, triangles.data(), triangles.size() * sizeof(Triangle));
+
+    return hash;
+}
+
+BVHCache::FileHeader BVHCache::make_header(uint64_t key, std::size_t node_count, std::size_t triangle_count)
+{
+    FileHeader header;
+    std::memset(&header, 0, sizeof(FileHeader));
+
+    std::memcpy(header.magic, BVH_CACHE_MAGIC, sizeof(BVH_CACHE_MAGIC));
+    header.version = VERSION;
+    header.header_size = sizeof(FileHeader);
+    header.key = key;
+
+    header.node_count = node_count;
+    header.node_size = sizeof(FlattenedBVH::FlattenedNode);
+    header.nodes_offset = align_up(sizeof(FileHeader));
+
+    header.triangle_count = triangle_count;
+    header.triangle_size = sizeof(Triangle);
+    header.triangles_offset = align_up(header.nodes_offset + node_count * sizeof(FlattenedBVH::FlattenedNode));
+    header.triangle_ids_offset = align_up(header.triangles_offset + triangle_count * sizeof(Triangle));
+
+    header.file_size = header.triangle_ids_offset + triangle_count * sizeof(int);
+
+    return header;
+}
+
+std::unique_ptr<FlattenedBVH> BVHCache::load(const std::string& cache_file_path, uint64_t key, std::size_t triangle_count)
+{
+    std::shared_ptr<MemoryMappedFile> mapped_file = MemoryMappedFile::open(cache_file_path);
+    if (mapped_file == nullptr)
+        return nullptr;
+
+    if (mapped_file->size() < sizeof(FileHeader))
+    {
+        std::cout << "BVH cache file \"" << cache_file_path << "\" is truncated, ignoring it" << std::endl;
+
+        return nullptr;
+    }
+
+    FileHeader header;
+    std::memcpy(&header, mapped_file->data(), sizeof(FileHeader));
+
+    // Recomputing the expected header from what is read and comparing
+    // them validates the version, sizes, offsets etc... all at once
+    FileHeader expected_header = make_header(key, header.node_count, triangle_count);
+    if (std::memcmp(&header, &expected_header, sizeof(FileHeader)) != 0 || header.file_size != mapped_file->size())
+    {
+        std::cout << "BVH cache file \"" << cache_file_path << "\" is stale or invalid, the BVH will be rebuilt" << std::endl;
+
+        return nullptr;
+    }
+
+    unsigned char* data = mapped_file->data();
+    std::span<FlattenedBVH::FlattenedNode> nodes(reinterpret_cast<FlattenedBVH::FlattenedNode*>(data + header.nodes_offset), header.node_count);
+    std::span<Triangle> triangles(reinterpret_cast<Triangle*>(data + header.triangles_offset), header.triangle_count);
+    std::span<int> triangle_ids(reinterpret_cast<int*>(data + header.triangle_ids_offset), header.triangle_count);
+
+    return std::make_unique<FlattenedBVH>(mapped_file, nodes, triangles, triangle_ids);
+}
+
+bool BVHCache::save(const std::string& cache_file_path, uint64_t key, const FlattenedBVH& flattened_bvh)
+{
+    std::filesystem::path file_path(cache_file_path);
+
+    std::error_code error;
+    if (file_path.has_parent_path())
+        std::filesystem::create_directories(file_path.parent_path(), error);
+
+    // Writing to a temporary file first so that another process loading the
+    // cache at the same time never sees a partially written file
+    std::filesystem::path temporary_file_path = file_path;
+    temporary_file_path += ".tmp";
+
+    {
+        std::ofstream file(temporary_file_path, std::ios::binary | std::ios::trunc);
+        if (!file.is_open())
+        {
+            std::cerr << "Could not open BVH cache file \"" << temporary_file_path.string() << "\" for writing" << std::endl;
+
+            return false;
+        }
+
+        FileHeader header = make_header(key, flattened_bvh.m_nodes.size(), flattened_bvh.m_triangles.size());
+        auto write_at = [&file](uint64_t offset, const void* data, std::size_t size)
+        {
+            // Padding up to the aligned offset
+            static const char zeros[BVH_CACHE_ALIGNMENT] = {};
+            file.write(zeros, offset - static_cast<uint64_t>(file.tellp()));
+
+            file.write(static_cast<const char*>(data), size);
+        };
+
+        file.write(reinterpret_cast<const char*>(&header), sizeof(FileHeader));
+        write_at(header.nodes_offset, flattened_bvh.m_nodes.data(), flattened_bvh.m_nodes.size_bytes());
+        write_at(header.triangles_offset, flattened_bvh.m_triangles.data(), flattened_bvh.m_triangles.size_bytes());
+        write_at(header.triangle_ids_offset, flattened_bvh.m_triangle_ids.data(), flattened_bvh.m_triangle_ids.size_bytes());
+
+        if (!file.good())
+        {
+            std::cerr << "Error while writing BVH cache file \"" << temporary_file_path.string() << "\"" << std::endl;
+
+            return false;
+        }
+    }
+
+    std::filesystem::rename(temporary_file_path, file_path, error);
+    if (error)
+    {
+        std::cerr << "Could not write BVH cache file \"" << cache_file_path << "\": " << error.message() << std::endl;
+        std::filesystem::remove(temporary_file_path, error);
+
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include "Renderer/FlattenedBVH.h"
+#include "Renderer/Triangle.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct BVHBuildOptions;
+
+/**
+ * Saves / loads a FlattenedBVH to / from a binary file so that the BVH
+ * of a scene that hasn't changed doesn't need to be rebuilt at each launch.
+ *
+ * The file is a header followed by the nodes, the reordered triangles and
+ * the triangle ids, each array starting at a 64 bytes aligned offset so
+ * that the file can be memory mapped and used as is: loading a cache file
+ * doesn't parse or copy anything.
+ *
+ * The header contains a key computed from the geometry of the scene and
+ * the build options. A cache file whose key (or version, or anything else
+ * in the header) doesn't match is considered stale and isn't loaded.
+ */
+class BVHCache
+{
+public:
+    // To increment whenever the layout of the file or of the
+    // structures it contains changes
+    static constexpr uint32_t VERSION = 1;
+
+    /**
+     * Hash of everything that the BVH built for these triangles with
+     * these options depends on
+     */
+    static uint64_t compute_key(const std::vector<Triangle>& triangles, const BVHBuildOptions& build_options);
+
+    /**
+     * Returns nullptr if the file doesn't exist or is not a valid
+     * cache file for the given key and number of triangles
+     */
+    static std::unique_ptr<FlattenedBVH> load(const std::string& cache_file_path, uint64_t key, std::size_t triangle_count);
+
+    /**
+     * Writes the BVH to the cache file, creating the parent directories
+     * if needed. Returns false if the file couldn't be written
+     */
+    static bool save(const std::string& cache_file_path, uint64_t key, const FlattenedBVH& flattened_bvh);
+
+private:
+    struct FileHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t header_size;
+
+        uint64_t key;
+
+        uint64_t node_count;
+        uint64_t node_size;
+        uint64_t nodes_offset;
+
+        uint64_t triangle_count;
+        uint64_t triangle_size;
+        uint64_t triangles_offset;
+        uint64_t triangle_ids_offset;
+
+        uint64_t file_size;
+    };
+
+    static FileHeader make_header(uint64_t key, std::size_t node_count, std::size_t triangle_count);
+};
+
+#endif
@@ -8,10 +8,63 @@
 
 struct BVHConstants
 {
-    static constexpr int FLATTENED_BVH_MAX_STACK_SIZE = 100000;
+    // The traversal of the flattened BVH pushes at most one node per level
+    // of the tree so the stack needs to be at least as large as the maximum
+    // depth of the BVH
+    static constexpr int FLATTENED_BVH_MAX_STACK_SIZE = 64;
+
+    // Each node of a wide BVH pushes at most (width - 1) entries more than it
+    // pops and the wide BVH is at most as deep as the binary BVH it is collapsed from
+    static constexpr int WIDE_BVH_MAX_STACK_SIZE = 512;
+
+    // The top-level BVH is split at the median instance so its depth
+    // is at most log2(instance count) + 1
+    static constexpr int TOP_LEVEL_BVH_MAX_STACK_SIZE = 64;
+
+    // Number of rays traced together by the packet traversals. A 4x4 block of pixels
+    // for the camera rays, the ray masks of the traversal are 32 bit integers
+    static constexpr int RAY_PACKET_SIZE = 16;
+    // A packet traversal goes on with single rays in the subtree of a node
+    // once fewer rays than this of the packet hit the node
+    static constexpr int RAY_PACKET_MIN_ACTIVE_RAYS = 4;
 
     static constexpr int PLANES_COUNT = 7;
+    static constexpr int MIN_TRIANGLES_PER_LEAF = 2;
     static constexpr int MAX_TRIANGLES_PER_LEAF = 8;
+
+    // Number of bins per axis used by the binned SAH builder
+    static constexpr int SAH_BIN_COUNT = 16;
+    // Relative costs of traversing a node and intersecting a triangle
+    // used by the Surface Area Heuristic. A node test is 7 slab tests
+    // against a single triangle test so with equal costs, the builder
+    // splits almost every node down to single triangles
+    static constexpr float SAH_TRAVERSAL_COST = 2.0f;
+    static constexpr float SAH_INTERSECTION_COST = 1.0f;
+    // Past that depth, the builder creates a leaf no matter how
+    // many triangles are left
+    static constexpr int MAX_BUILD_DEPTH = 64;
+
+    // Subtrees with more triangles than that are built as separate OpenMP tasks
+    static constexpr int PARALLEL_BUILD_TASK_THRESHOLD = 4096;
+    // Nodes with more triangles than that have their bounds, binning and
+    // partitioning computed in parallel, by chunks of PARALLEL_BUILD_CHUNK_SIZE triangles.
+    // This is what keeps all the threads busy near the root of the tree where there
+    // are not yet enough subtrees for the tasks alone
+    static constexpr int PARALLEL_BINNING_THRESHOLD = 65536;
+    static constexpr int PARALLEL_BUILD_CHUNK_SIZE = 16384;
+
+    // The nodes of the first levels of the tree are refit as separate OpenMP tasks
+    static constexpr int PARALLEL_REFIT_TASK_DEPTH = 10;
+    // After a refit, subtrees whose SAH cost grew by more than this factor
+    // compared to when they were built are rebuilt
+    static constexpr float REFIT_REBUILD_SAH_THRESHOLD = 1.5f;
+    // Subtrees that account for less than this fraction of the
+    // SAH cost of the whole tree are never rebuilt after a refit
+    static constexpr float REFIT_REBUILD_MIN_COST_SHARE = 0.01f;
+
+    static_assert(FLATTENED_BVH_MAX_STACK_SIZE >= MAX_BUILD_DEPTH, "The flattened BVH traversal stack must be able to hold a full path of the tree");
+    static_assert(RAY_PACKET_SIZE <= 32, "The ray masks of the packet traversals are 32 bit integers");
+    static_assert(WIDE_BVH_MAX_STACK_SIZE >= MAX_BUILD_DEPTH * 7 + 8, "The wide BVH traversal stack must be able to hold the siblings of a full path of a BVH8");
 };
 
 #endif
@@ -0,0 +1,96 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#include "Renderer/CPUFeatures.h"
+
+#if CPU_FEATURES_X86 && defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+SIMDInstructionSet CPUFeatures::get_best_simd_instruction_set()
+{
+    static const SIMDInstructionSet best_instruction_set = detect_simd_instruction_set();
+
+    return best_instruction_set;
+}
+
+bool CPUFeatures::supports(SIMDInstructionSet instruction_set)
+{
+    return static_cast<int>(instruction_set) <= static_cast<int>(get_best_simd_instruction_set());
+}
+
+const char* CPUFeatures::to_string(SIMDInstructionSet instruction_set)
+{
+    switch (instruction_set)
+    {
+    case SIMDInstructionSet::SSE4:
+        return "SSE4";
+
+    case SIMDInstructionSet::AVX2:
+        return "AVX2";
+
+    case SIMDInstructionSet::AVX512:
+        return "AVX-512";
+
+    case SIMDInstructionSet::SCALAR:
+    default:
+        return "Scalar";
+    }
+}
+
+SIMDInstructionSet CPUFeatures::detect_simd_instruction_set()
+{
+#if !CPU_FEATURES_X86
+    return SIMDInstructionSet::SCALAR;
+#elif defined(_MSC_VER) && !defined(__clang__)
+    int registers[4];
+
+    __cpuid(registers, 0);
+    int max_leaf = registers[0];
+
+    __cpuid(registers, 1);
+    bool sse4 = registers[2] & (1 << 19);
+    bool fma = registers[2] & (1 << 12);
+    bool osxsave = registers[2] & (1 << 27);
+    bool avx = registers[2] & (1 << 28);
+
+    // Checking that the OS saves the YMM / ZMM registers on context switches
+    unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+    bool os_avx = (xcr0 & 0x6) == 0x6;
+    bool os_avx512 = (xcr0 & 0xE6) == 0xE6;
+
+    bool avx2 = false;
+    bool avx512 = false;
+    if (max_leaf >= 7)
+    {
+        __cpuidex(registers, 7, 0);
+
+        avx2 = registers[1] & (1 << 5);
+        // AVX-512 F and VL
+        avx512 = (registers[1] & (1 << 16)) && (registers[1] & (1 << 31));
+    }
+
+    if (avx512 && avx2 && fma && os_avx512)
+        return SIMDInstructionSet::AVX512;
+    else if (avx2 && avx && fma && os_avx)
+        return SIMDInstructionSet::AVX2;
+    else if (sse4)
+        return SIMDInstructionSet::SSE4;
+    else
+        return SIMDInstructionSet::SCALAR;
+#else
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return SIMDInstructionSet::AVX512;
+    else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return SIMDInstructionSet::AVX2;
+    else if (__builtin_cpu_supports("sse4.1"))
+        return SIMDInstructionSet::SSE4;
+    else
+        return SIMDInstructionSet::SCALAR;
+#endif
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#ifndef CPU_FEATURES_H
+#define CPU_FEATURES_H
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CPU_FEATURES_X86 1
+#else
+#define CPU_FEATURES_X86 0
+#endif
+
+/**
+ * Functions using SIMD intrinsics of a given instruction set must be
+ * marked with these macros so that the compiler accepts the intrinsics
+ * without the whole program being compiled for that instruction set.
+ *
+ * This is what allows the same binary to run on CPUs that do not
+ * support AVX2 / AVX-512: the right code path is chosen at runtime
+ * with CPUFeatures::get_best_simd_instruction_set().
+ *
+ * MSVC accepts any intrinsic anywhere so the macros are empty
+ */
+#if defined(_MSC_VER) && !defined(__clang__)
+#define SIMD_TARGET_SSE4
+#define SIMD_TARGET_AVX2
+#define SIMD_TARGET_AVX512
+#define SIMD_FLATTEN
+#else
+#define SIMD_TARGET_SSE4 __attribute__((target("sse4.1")))
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define SIMD_TARGET_AVX512 __attribute__((target("avx512f,avx512vl,avx2,fma")))
+// A function compiled for the default instruction set cannot inline
+// a function using AVX intrinsics. Marking the entry point of a SIMD code
+// path with SIMD_FLATTEN inlines everything it calls into it so that
+// the helpers end up compiled for the right instruction set
+#define SIMD_FLATTEN __attribute__((flatten))
+#endif
+
+/**
+ * Code that is generic over the SIMD width (templates, or the same file
+ * included once per instruction set) cannot be marked with the macros
+ * above because they would apply to every instantiation. Such code is
+ * wrapped between SIMD_TARGET_REGION_XXX_BEGIN and SIMD_TARGET_REGION_END
+ * instead: every function defined in between is compiled for that
+ * instruction set
+ */
+#if defined(_MSC_VER) && !defined(__clang__)
+#define SIMD_TARGET_REGION_AVX2_BEGIN
+#define SIMD_TARGET_REGION_AVX512_BEGIN
+#define SIMD_TARGET_REGION_END
+#elif defined(__clang__)
+#define SIMD_TARGET_REGION_AVX2_BEGIN _Pragma("clang attribute push(__attribute__((target(\"avx2,fma\"))), apply_to = function)")
+#define SIMD_TARGET_REGION_AVX512_BEGIN _Pragma("clang attribute push(__attribute__((target(\"avx512f,avx512vl,avx2,fma\"))), apply_to = function)")
+#define SIMD_TARGET_REGION_END _Pragma("clang attribute pop")
+#else
+#define SIMD_TARGET_REGION_AVX2_BEGIN _Pragma("GCC push_options") _Pragma("GCC target(\"avx2,fma\")")
+#define SIMD_TARGET_REGION_AVX512_BEGIN _Pragma("GCC push_options") _Pragma("GCC target(\"avx512f,avx512vl,avx2,fma\")")
+#define SIMD_TARGET_REGION_END _Pragma("GCC pop_options")
+#endif
+
+enum class SIMDInstructionSet
+{
+    SCALAR = 0,
+    SSE4 = 1,
+    AVX2 = 2,
+    // AVX-512 F + VL
+    AVX512 = 3
+};
+
+class CPUFeatures
+{
+public:
+    /**
+     * Returns the most capable SIMD instruction set supported
+     * by the CPU the application is running on.
+     *
+     * The detection is only done once, subsequent calls are free
+     */
+    static SIMDInstructionSet get_best_simd_instruction_set();
+
+    static bool supports(SIMDInstructionSet instruction_set);
+
+    static const char* to_string(SIMDInstructionSet instruction_set);
+
+private:
+    static SIMDInstructionSet detect_simd_instruction_set();
+};
+
+#endif
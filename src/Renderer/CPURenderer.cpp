@@ -4,11 +4,15 @@
  */
 
 #include "Device/kernels/PathTracerKernel.h"
+#include "Renderer/BSDFBatch.h"
 #include "Renderer/CPURenderer.h"
+#include "Threads/ThreadManager.h"
 #include "UI/ApplicationSettings.h"
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <filesystem>
 #include <omp.h>
 
 CPURenderer::CPURenderer(int width, int height) : m_resolution(make_int2(width, height))
@@ -16,19 +20,41 @@ CPURenderer::CPURenderer(int width, int height) : m_resolution(make_int2(width,
     m_framebuffer = Image(width, height);
 
     // Resizing buffers + initial value
-    m_debug_pixel_active_buffer.resize(width * height, 0);
     m_denoiser_albedo.resize(width * height, ColorRGB(0.0f));
     m_denoiser_normals.resize(width * height, float3{ 0.0f, 0.0f, 0.0f });
     m_pixel_sample_count.resize(width * height, 0);
     m_pixel_squared_luminance.resize(width * height, 0.0f);
+#if DirectLightSamplingStrategy == LSS_RESTIR_DI
+    m_restir_di_temporal_reservoirs.resize(width * height);
+    m_restir_di_final_reservoirs.resize(width * height);
+    m_restir_di_surfaces.resize(width * height);
+    m_restir_di_previous_surfaces.resize(width * height);
+#endif
+    m_blue_noise_mask = generate_blue_noise_mask();
 }
 
 void CPURenderer::set_scene(Scene& parsed_scene)
 {
     m_render_data.geom = nullptr;
 
+    m_render_data.buffers.blue_noise_mask = m_blue_noise_mask.data();
     m_render_data.buffers.emissive_triangles_count = parsed_scene.emissive_triangle_indices.size();
     m_render_data.buffers.emissive_triangles_indices = parsed_scene.emissive_triangle_indices.data();
+    m_render_data.buffers.emissive_triangles_instances = parsed_scene.emissive_triangle_instances.data();
+    parsed_scene.compute_emissive_triangles();
+    m_render_data.buffers.emissive_triangles = parsed_scene.emissive_triangles.data();
+    m_render_data.buffers.emissive_triangles_alias_probabilities = parsed_scene.emissive_triangles_alias_probabilities.data();
+    m_render_data.buffers.emissive_triangles_aliases = parsed_scene.emissive_triangles_aliases.data();
+    m_render_data.buffers.emissive_triangles_power_sum = parsed_scene.emissive_triangles_power_sum;
+    m_light_bvh.build(parsed_scene.emissive_triangles, parsed_scene.materials, parsed_scene.emissive_triangle_indices, parsed_scene.emissive_triangle_instances);
+    bool light_bvh_built = !m_light_bvh.sorted_keys.empty();
+    m_render_data.buffers.light_bvh_nodes = light_bvh_built ? m_light_bvh.nodes.data() : nullptr;
+    m_render_data.buffers.light_bvh_emissive_indices = m_light_bvh.emissive_indices.data();
+    m_render_data.buffers.light_bvh_trails = m_light_bvh.trails.data();
+    m_render_data.buffers.light_bvh_sorted_keys = m_light_bvh.sorted_keys.data();
+    m_render_data.buffers.light_bvh_sorted_emissive_indices = m_light_bvh.sorted_emissive_indices.data();
+    m_render_data.buffers.light_bvh_light_count = m_light_bvh.sorted_keys.size();
+    m_render_data.world_settings.scene_bounding_radius = parsed_scene.compute_bounding_sphere_radius();
     m_render_data.buffers.materials_buffer = parsed_scene.materials.data();
     m_render_data.buffers.material_indices = parsed_scene.material_indices.data();
     m_render_data.buffers.has_vertex_normals = parsed_scene.has_vertex_normals.data();
@@ -47,11 +73,101 @@ void CPURenderer::set_scene(Scene& parsed_scene)
     m_render_data.aux_buffers.pixel_squared_luminance = m_pixel_squared_luminance.data();
     m_render_data.aux_buffers.still_one_ray_active = &m_still_one_ray_active;
     m_render_data.aux_buffers.stop_noise_threshold_count = &m_stop_noise_threshold_count;
+    bool restir_di_used = !m_restir_di_final_reservoirs.empty();
+    m_render_data.aux_buffers.restir_di_temporal_reservoirs = restir_di_used ? m_restir_di_temporal_reservoirs.data() : nullptr;
+    m_render_data.aux_buffers.restir_di_final_reservoirs = restir_di_used ? m_restir_di_final_reservoirs.data() : nullptr;
+    m_render_data.aux_buffers.restir_di_surfaces = restir_di_used ? m_restir_di_surfaces.data() : nullptr;
+    m_render_data.aux_buffers.restir_di_previous_surfaces = restir_di_used ? m_restir_di_previous_surfaces.data() : nullptr;
+
+    m_instance_transforms.clear();
+    m_instance_normal_transforms.clear();
+    for (const SceneInstance& instance : parsed_scene.instances)
+    {
+        m_instance_transforms.push_back(instance.transform);
+        m_instance_normal_transforms.push_back(instance.get_normal_transform());
+    }
+    m_render_data.buffers.instance_transforms = m_instance_transforms.data();
+    m_render_data.buffers.instance_normal_transforms = m_instance_normal_transforms.data();
+
+    std::cout << "Building / loading scene BVHs..." << std::endl;
+    auto start = std::chrono::high_resolution_clock::now();
+    build_acceleration_structure(parsed_scene);
+    m_render_data.cpu_only.bvh = m_tlas.get();
+    auto stop = std::chrono::high_resolution_clock::now();
+    std::cout << m_blases.size() << " BLAS, " << m_tlas->get_instance_count() << " instances, ready in " << std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count() << "ms" << std::endl;
 
-    std::cout << "Building scene BVH..." << std::endl;
-    m_triangle_buffer = parsed_scene.get_triangles();
-    m_bvh = std::make_shared<BVH>(&m_triangle_buffer);
-    m_render_data.cpu_only.bvh = m_bvh.get();
+    // The alpha masks need the textures, which were loading in the
+    // background while the BVHs were being built
+    ThreadManager::join_threads(ThreadManager::TEXTURE_THREADS_KEY);
+    parsed_scene.compute_triangle_opacities();
+    m_render_data.buffers.triangle_opacities = parsed_scene.triangle_opacities.empty() ? nullptr : parsed_scene.triangle_opacities.data();
+    m_render_data.buffers.alpha_mask_bits = parsed_scene.alpha_mask_bits.data();
+    m_render_data.buffers.alpha_mask_offsets = parsed_scene.alpha_mask_offsets.data();
+}
+
+void CPURenderer::build_acceleration_structure(const Scene& parsed_scene)
+{
+    int object_count = parsed_scene.objects.size();
+
+    // Sizing the outer vectors once and for all, the BLASes keep a
+    // pointer to their triangles which must not move
+    m_blases.clear();
+    m_blas_triangles.clear();
+    m_blas_primitive_indices.clear();
+    m_blas_triangles.resize(object_count);
+    m_blas_primitive_indices.resize(object_count);
+
+    for (int object_index = 0; object_index < object_count; object_index++)
+    {
+        std::vector<Triangle>& triangles = m_blas_triangles[object_index];
+        std::vector<int>& primitive_indices = m_blas_primitive_indices[object_index];
+
+        for (int mesh_index : parsed_scene.objects[object_index].mesh_indices)
+        {
+            const SceneMesh& mesh = parsed_scene.meshes[mesh_index];
+
+            for (int triangle_index = mesh.first_triangle; triangle_index < mesh.first_triangle + mesh.triangle_count; triangle_index++)
+            {
+                triangles.push_back(Triangle(parsed_scene.vertices_positions[parsed_scene.triangle_indices[triangle_index * 3 + 0]],
+                                             parsed_scene.vertices_positions[parsed_scene.triangle_indices[triangle_index * 3 + 1]],
+                                             parsed_scene.vertices_positions[parsed_scene.triangle_indices[triangle_index * 3 + 2]]));
+                primitive_indices.push_back(triangle_index);
+            }
+        }
+
+        BVHBuildOptions build_options = m_bvh_build_options;
+        if (object_count > 1)
+        {
+            // Reports for every BLAS would flood the output
+            build_options.print_quality_report = false;
+
+            if (!build_options.cache_file_path.empty())
+            {
+                // One cache file per BLAS: "scene.bvh" becomes "scene_12.bvh" for the object 12
+                std::filesystem::path cache_path(build_options.cache_file_path);
+                cache_path.replace_filename(cache_path.stem().string() + "_" + std::to_string(object_index) + cache_path.extension().string());
+
+                build_options.cache_file_path = cache_path.string();
+            }
+        }
+
+        m_blases.push_back(std::make_shared<BVH>(&triangles, build_options));
+    }
+
+    std::vector<BVHInstance> bvh_instances;
+    for (const SceneInstance& instance : parsed_scene.instances)
+    {
+        BVHInstance bvh_instance;
+        bvh_instance.blas = m_blases[instance.object_index].get();
+        bvh_instance.primitive_indices = &m_blas_primitive_indices[instance.object_index];
+        bvh_instance.transform = instance.transform;
+        bvh_instance.inverse_transform = instance.get_inverse_transform();
+        bvh_instance.normal_transform = instance.get_normal_transform();
+
+        bvh_instances.push_back(bvh_instance);
+    }
+
+    m_tlas = std::make_shared<TopLevelBVH>(bvh_instances);
 }
 
 void CPURenderer::set_envmap(ImageRGBA& envmap_image)
@@ -59,7 +175,14 @@ void CPURenderer::set_envmap(ImageRGBA& envmap_image)
     m_render_data.world_settings.envmap = &envmap_image;
     m_render_data.world_settings.envmap_width = envmap_image.width;
     m_render_data.world_settings.envmap_height = envmap_image.height;
-    m_render_data.world_settings.envmap_cdf = envmap_image.get_cdf().data();
+
+    const EnvmapSamplingTables& sampling_tables = envmap_image.get_envmap_sampling_tables();
+    m_render_data.world_settings.envmap_marginal_alias_probabilities = const_cast<float*>(sampling_tables.marginal_alias_probabilities.data());
+    m_render_data.world_settings.envmap_marginal_aliases = const_cast<int*>(sampling_tables.marginal_aliases.data());
+    m_render_data.world_settings.envmap_conditional_alias_probabilities = const_cast<float*>(sampling_tables.conditional_alias_probabilities.data());
+    m_render_data.world_settings.envmap_conditional_aliases = const_cast<int*>(sampling_tables.conditional_aliases.data());
+    m_render_data.world_settings.envmap_pixel_probabilities = const_cast<float*>(sampling_tables.pixel_probabilities.data());
+    m_render_data.world_settings.envmap_luminance_integral = sampling_tables.luminance_integral;
 }
 
 void CPURenderer::set_camera(Camera& camera)
@@ -77,48 +200,367 @@ HIPRTRenderSettings& CPURenderer::get_render_settings()
     return m_render_data.render_settings;
 }
 
+BVHBuildOptions& CPURenderer::get_bvh_build_options()
+{
+    return m_bvh_build_options;
+}
+
+CPURenderOptions& CPURenderer::get_render_options()
+{
+    return m_render_options;
+}
+
 Image& CPURenderer::get_framebuffer()
 {
     return m_framebuffer;
 }
 
-#define DEBUG_PIXEL 1
-#define DEBUG_EXACT_COORDINATE 0
-#define DEBUG_PIXEL_X 43
-#define DEBUG_PIXEL_Y 14
-
-void CPURenderer::render()  
+void CPURenderer::render()
 {
     std::cout << "CPU rendering..." << std::endl;
 
+    reset_render();
+
     auto start = std::chrono::high_resolution_clock::now();
-    std::atomic<int> lines_completed = 0;
-#if DEBUG_PIXEL
-#if DEBUG_EXACT_COORDINATE
-    for (int y = DEBUG_PIXEL_Y; y < m_resolution.y; y++)
+    int next_progress_percent = 10;
+    while (!is_rendering_done())
     {
-        for (int x = DEBUG_PIXEL_X; x < m_resolution.x; x++)
-#else
-    for (int y = m_resolution.y - DEBUG_PIXEL_Y - 1; y < m_resolution.y; y++)
+        render_frame();
+
+        int progress_percent = m_render_data.render_settings.sample_number * 100 / std::max(1, m_render_options.max_sample_count);
+        if (progress_percent >= next_progress_percent && progress_percent < 100)
+        {
+            std::cout << progress_percent << "%" << std::endl;
+            next_progress_percent = progress_percent / 10 * 10 + 10;
+        }
+    }
+    rescale_retired_tiles();
+    auto stop = std::chrono::high_resolution_clock::now();
+
+    if (m_render_options.wavefront)
+        std::cout << m_render_data.render_settings.sample_number << " samples (" << m_render_data.render_settings.frame_number << " wavefront frames) in " << std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count() << "ms" << std::endl;
+    else
+        std::cout << m_render_data.render_settings.sample_number << " samples (" << m_render_data.render_settings.frame_number << " frames of " << m_tile_scheduler.get_tile_count() << " tiles, " << m_tile_scheduler.get_active_tile_count() << " not converged) in " << std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count() << "ms" << std::endl;
+}
+
+void CPURenderer::reset_render()
+{
+    m_tile_scheduler.set_image(m_resolution, m_render_options.tile_size, m_render_options.tile_order);
+    m_tile_retirement_sample_numbers.assign(m_tile_scheduler.get_tile_count(), 0);
+
+    m_render_data.render_settings.frame_number = 0;
+    m_render_data.render_settings.sample_number = 0;
+    m_still_one_ray_active = true;
+    m_stop_noise_threshold_count = 0;
+}
+
+// Side of the blocks of pixels rendered by PathTracerPacketKernel
+static constexpr int PACKET_BLOCK_SIZE = 4;
+static_assert(PACKET_BLOCK_SIZE * PACKET_BLOCK_SIZE <= BVHConstants::RAY_PACKET_SIZE, "The camera rays of a block must fit in a ray packet");
+
+void CPURenderer::render_frame()
+{
+    // Same resetting of the flags as the GPU renderer before each frame, the
+    // kernel sets them back if a pixel still needs to be sampled
+    m_still_one_ray_active = false;
+    if (m_render_data.render_settings.stop_noise_threshold > 0.0f)
+        m_stop_noise_threshold_count = 0;
+
+    bool restir_di_pass = m_render_data.aux_buffers.restir_di_final_reservoirs != nullptr && !m_render_data.render_settings.render_low_resolution;
+    if (restir_di_pass)
+        render_restir_di_passes();
+
+    if (m_render_options.wavefront)
+        m_wavefront_path_tracer.render_frame(m_render_data, m_hiprt_camera, m_resolution, m_render_options.wavefront_size, m_render_options.wavefront_sorting);
+    else
     {
-        for (int x = DEBUG_PIXEL_X; x < m_resolution.x; x++)
-#endif
-#else
+        m_tile_scheduler.reset(omp_get_max_threads());
+
+        // Only the adaptive sampling stops sampling pixels for good
+        bool retire_converged_tiles = m_render_data.render_settings.enable_adaptive_sampling && !m_render_data.render_settings.render_low_resolution;
+
+#pragma omp parallel
+        {
+            int thread_index = omp_get_thread_num();
+
+            ThreadConvergenceFlags convergence_flags;
+            HIPRTRenderData thread_render_data = convergence_flags.get_render_data(m_render_data);
+
+            RenderTile tile;
+            while (m_tile_scheduler.next_tile(thread_index, tile))
+            {
+                if (m_render_data.render_settings.render_low_resolution)
+                {
+                    for (int y = tile.origin.y; y < tile.origin.y + tile.size.y; y++)
+                        for (int x = tile.origin.x; x < tile.origin.x + tile.size.x; x++)
+                            PathTracerKernel(thread_render_data, m_resolution, m_hiprt_camera, x, y);
+
+                    continue;
+                }
+
+                // The camera rays of each block of the tile are traced as a packet
+                for (int y = tile.origin.y; y < tile.origin.y + tile.size.y; y += PACKET_BLOCK_SIZE)
+                {
+                    for (int x = tile.origin.x; x < tile.origin.x + tile.size.x; x += PACKET_BLOCK_SIZE)
+                    {
+                        int2 block_origin = make_int2(x, y);
+                        int2 block_size = make_int2(std::min(PACKET_BLOCK_SIZE, tile.origin.x + tile.size.x - x), std::min(PACKET_BLOCK_SIZE, tile.origin.y + tile.size.y - y));
+
+                        PathTracerPacketKernel(thread_render_data, m_resolution, m_hiprt_camera, block_origin, block_size);
+                    }
+                }
+
+                if (retire_converged_tiles && is_tile_converged(tile))
+                    retire_tile(tile);
+            }
+
+            convergence_flags.reduce(m_render_data);
+        }
+    }
+
+    if (restir_di_pass)
+    {
+        // The surfaces and the camera of this frame are the previous ones of the next frame. The final
+        // reservoirs of this frame stay where they are for the temporal reuse of the next frame
+        std::swap(m_render_data.aux_buffers.restir_di_surfaces, m_render_data.aux_buffers.restir_di_previous_surfaces);
+        m_previous_hiprt_camera = m_hiprt_camera;
+    }
+
+    m_render_data.render_settings.sample_number += m_render_data.render_settings.samples_per_frame;
+    m_render_data.render_settings.frame_number++;
+}
+
+void CPURenderer::render_restir_di_passes()
+{
+    // The spatial reuse of a pixel reads the reservoirs of its neighbours
+    // after the temporal reuse: all of them must be done first
+#pragma omp parallel for schedule(dynamic)
+    for (int y = 0; y < m_resolution.y; y++)
+        for (int x = 0; x < m_resolution.x; x++)
+            ReSTIRDIInitialCandidatesKernel(m_render_data, m_resolution, m_hiprt_camera, m_previous_hiprt_camera, x, y);
+
+#pragma omp parallel for schedule(dynamic)
+    for (int y = 0; y < m_resolution.y; y++)
+        for (int x = 0; x < m_resolution.x; x++)
+            ReSTIRDISpatialReuseKernel(m_render_data, m_resolution, x, y);
+}
+
+bool CPURenderer::is_tile_converged(const RenderTile& tile) const
+{
+    // Same test as the adaptive sampling of the next frame: the tile is
+    // converged if none of its pixels would be sampled anymore
+    for (int y = tile.origin.y; y < tile.origin.y + tile.size.y; y++)
+        for (int x = tile.origin.x; x < tile.origin.x + tile.size.x; x++)
+            if (!adaptive_sampling_converged(m_render_data, x + y * m_resolution.x))
+                return false;
+
+    return true;
+}
+
+void CPURenderer::retire_tile(const RenderTile& tile)
+{
+    for (int y = tile.origin.y; y < tile.origin.y + tile.size.y; y++)
+    {
+        for (int x = tile.origin.x; x < tile.origin.x + tile.size.x; x++)
+        {
+            // Deactivating the pixels that the adaptive sampling of the next frame would have deactivated
+            int& pixel_sample_count = m_pixel_sample_count[x + y * m_resolution.x];
+            if (pixel_sample_count > 0)
+                pixel_sample_count = -pixel_sample_count;
+        }
+    }
+
+    // The pixels of the tile are scaled to the sample number at the end of this frame
+    m_tile_retirement_sample_numbers[tile.index] = m_render_data.render_settings.sample_number + m_render_data.render_settings.samples_per_frame;
+    m_tile_scheduler.retire_tile(tile.index);
+}
+
+void CPURenderer::rescale_retired_tiles()
+{
+    int sample_number = m_render_data.render_settings.sample_number;
+
+#pragma omp parallel for schedule(dynamic)
+    for (int tile_index = 0; tile_index < m_tile_scheduler.get_tile_count(); tile_index++)
+    {
+        int retirement_sample_number = m_tile_retirement_sample_numbers[tile_index];
+        if (retirement_sample_number == 0 || retirement_sample_number == sample_number)
+            continue;
+
+        // Same rescaling as the one of prepare_pixel_sampling() for the converged pixels, for all the frames since the retirement of the tile
+        const RenderTile& tile = m_tile_scheduler.get_tile(tile_index);
+        for (int y = tile.origin.y; y < tile.origin.y + tile.size.y; y++)
+            for (int x = tile.origin.x; x < tile.origin.x + tile.size.x; x++)
+                m_render_data.buffers.pixels[x + y * m_resolution.x] = m_render_data.buffers.pixels[x + y * m_resolution.x] / retirement_sample_number * sample_number;
+
+        m_tile_retirement_sample_numbers[tile_index] = sample_number;
+    }
+}
+
+bool CPURenderer::is_rendering_done() const
+{
+    bool rendering_done = false;
+
+    rendering_done |= m_still_one_ray_active == 0;
+    rendering_done |= m_stop_noise_threshold_count == m_resolution.x * m_resolution.y;
+    rendering_done |= m_render_data.render_settings.sample_number >= m_render_options.max_sample_count;
+
+    return rendering_done;
+}
+
+void CPURenderer::benchmark_bvh_queries()
+{
+    int pixel_count = m_resolution.x * m_resolution.y;
+
+    std::vector<hiprtRay> shadow_rays(pixel_count);
+    std::vector<float> shadow_rays_t_max(pixel_count, -1.0f);
+
+    // Same alpha testing as the path tracer
+    BVHHitFilter alpha_test_filter = make_alpha_test_filter(m_render_data);
+
+    auto start = std::chrono::high_resolution_clock::now();
 #pragma omp parallel for schedule(dynamic)
     for (int y = 0; y < m_resolution.y; y++)
     {
         for (int x = 0; x < m_resolution.x; x++)
-#endif
-            PathTracerKernel(m_render_data, m_resolution, m_hiprt_camera, x, y);
+        {
+            int index = x + y * m_resolution.x;
 
-        lines_completed++;
+            HitInfo hit_info;
+            hiprtRay camera_ray = m_hiprt_camera.get_camera_ray(x + 0.5f, y + 0.5f, m_resolution);
+            if (!m_tlas->intersect(camera_ray, hit_info, alpha_test_filter))
+                continue;
 
-        if (omp_get_thread_num() == 0)
-            if (m_resolution.y > 25 && lines_completed % (m_resolution.y / 25))
-                std::cout << lines_completed / (float)m_resolution.y * 100 << "%" << std::endl;
+            // Shadow ray towards the center of an emissive triangle or straight up if there are no lights
+            float3 shadow_ray_origin = hit_info.inter_point + hit_info.geometric_normal * 1.0e-4f * (hippt::dot(hit_info.geometric_normal, camera_ray.direction) < 0 ? 1.0f : -1.0f);
+            float3 shadow_ray_direction = make_float3(0.0f, 1.0f, 0.0f);
+            float t_max = 1.0e38f;
+            if (m_render_data.buffers.emissive_triangles_count > 0)
+            {
+                int light_index = index % m_render_data.buffers.emissive_triangles_count;
+                int light_triangle = m_render_data.buffers.emissive_triangles_indices[light_index];
+                int light_instance = m_render_data.buffers.emissive_triangles_instances[light_index];
+
+                float3 light_centroid = make_float3(0.0f, 0.0f, 0.0f);
+                for (int i = 0; i < 3; i++)
+                    light_centroid = light_centroid + instance_point_to_world(m_render_data, light_instance, m_render_data.buffers.vertices_positions[m_render_data.buffers.triangles_indices[light_triangle * 3 + i]]) / 3.0f;
+
+                float3 to_light = light_centroid - shadow_ray_origin;
+                t_max = hippt::length(to_light);
+                shadow_ray_direction = to_light / t_max;
+            }
+
+            shadow_rays[index].origin = shadow_ray_origin;
+            shadow_rays[index].direction = shadow_ray_direction;
+            shadow_rays_t_max[index] = t_max - 1.0e-4f;
+        }
     }
     auto stop = std::chrono::high_resolution_clock::now();
-    std::cout << std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count() << "ms" << std::endl;
+    float closest_hit_seconds = std::chrono::duration<float>(stop - start).count();
+
+    std::atomic<int> shadow_ray_count = 0;
+    std::atomic<int> occluded_count = 0;
+    start = std::chrono::high_resolution_clock::now();
+#pragma omp parallel for schedule(dynamic)
+    for (int y = 0; y < m_resolution.y; y++)
+    {
+        int line_shadow_rays = 0;
+        int line_occluded = 0;
+        for (int x = 0; x < m_resolution.x; x++)
+        {
+            int index = x + y * m_resolution.x;
+            if (shadow_rays_t_max[index] < 0.0f)
+                continue;
+
+            line_shadow_rays++;
+            line_occluded += m_tlas->occluded(shadow_rays[index], shadow_rays_t_max[index], alpha_test_filter);
+        }
+
+        shadow_ray_count += line_shadow_rays;
+        occluded_count += line_occluded;
+    }
+    stop = std::chrono::high_resolution_clock::now();
+    float occlusion_seconds = std::chrono::duration<float>(stop - start).count();
+
+    std::cout << "BVH closest-hit queries: " << pixel_count / closest_hit_seconds / 1.0e6f << " Mrays/s (" << pixel_count << " rays)" << std::endl;
+    std::cout << "BVH occlusion queries: " << shadow_ray_count / occlusion_seconds / 1.0e6f << " Mrays/s (" << shadow_ray_count << " rays, " << occluded_count << " occluded)" << std::endl;
+}
+
+void CPURenderer::benchmark_bvh_build()
+{
+    if (m_blas_triangles.empty())
+        return;
+
+    BVHBuildOptions build_options = m_bvh_build_options;
+    // Not reading from / writing to the cache, the point is to measure the build
+    build_options.cache_file_path = "";
+
+    // The largest BLAS is the one whose build time matters
+    auto largest_blas = std::max_element(m_blas_triangles.begin(), m_blas_triangles.end(), [](const std::vector<Triangle>& a, const std::vector<Triangle>& b)
+    {
+        return a.size() < b.size();
+    });
+
+    BVH::benchmark_build(&(*largest_blas), build_options);
+}
+
+void CPURenderer::benchmark_bvh_refit()
+{
+    if (m_blas_triangles.empty())
+        return;
+
+    auto largest_blas = std::max_element(m_blas_triangles.begin(), m_blas_triangles.end(), [](const std::vector<Triangle>& a, const std::vector<Triangle>& b)
+    {
+        return a.size() < b.size();
+    });
+
+    // The benchmark animates a copy of the triangles, the BVH of the scene is left untouched
+    BVH::benchmark_refit(*largest_blas, m_bvh_build_options);
+}
+
+void CPURenderer::benchmark_wavefront()
+{
+    // Enough frames for the average luminances of the two images to be comparable
+    const int frame_count = 8;
+
+    CPURenderOptions render_options = m_render_options;
+    int pixel_count = m_resolution.x * m_resolution.y;
+
+    float frame_seconds[2];
+    double average_luminances[2];
+    uint64_t wavefront_ray_count = 0;
+    for (int wavefront = 0; wavefront < 2; wavefront++)
+    {
+        m_render_options.wavefront = wavefront;
+        reset_render();
+
+        WavefrontRayCounts ray_counts_before = m_wavefront_path_tracer.get_ray_counts();
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int frame = 0; frame < frame_count; frame++)
+            render_frame();
+        auto stop = std::chrono::high_resolution_clock::now();
+        frame_seconds[wavefront] = std::chrono::duration<float>(stop - start).count() / frame_count;
+
+        if (wavefront)
+        {
+            const WavefrontRayCounts& ray_counts = m_wavefront_path_tracer.get_ray_counts();
+            wavefront_ray_count = ray_counts.closest_hit_rays + ray_counts.shadow_rays - ray_counts_before.closest_hit_rays - ray_counts_before.shadow_rays;
+        }
+
+        double luminance_sum = 0.0;
+        for (int pixel_index = 0; pixel_index < pixel_count; pixel_index++)
+            luminance_sum += m_render_data.buffers.pixels[pixel_index].luminance();
+        average_luminances[wavefront] = luminance_sum / pixel_count / m_render_data.render_settings.sample_number;
+    }
+    m_render_options = render_options;
+    reset_render();
+
+    // Both render the same paths on average, the rays traced by the wavefront
+    // path tracer (that it can count) give the ray throughput of both
+    float rays_per_frame = wavefront_ray_count / (float)frame_count;
+    float samples_per_frame = pixel_count * m_render_data.render_settings.samples_per_frame;
+    std::cout << "Path tracing throughput (" << frame_count << " frames, " << rays_per_frame / samples_per_frame << " rays per sample):" << std::endl;
+    std::cout << "\tMegakernel: " << frame_seconds[0] * 1000.0f << "ms per frame, " << samples_per_frame / frame_seconds[0] / 1.0e6f << " Msamples/s, " << rays_per_frame / frame_seconds[0] / 1.0e6f << " Mrays/s, average luminance " << average_luminances[0] << std::endl;
+    std::cout << "\tWavefront: " << frame_seconds[1] * 1000.0f << "ms per frame, " << samples_per_frame / frame_seconds[1] / 1.0e6f << " Msamples/s, " << rays_per_frame / frame_seconds[1] / 1.0e6f << " Mrays/s, average luminance " << average_luminances[1] << std::endl;
 }
 
 void CPURenderer::tonemap(float gamma, float exposure)
@@ -132,7 +574,7 @@ void CPURenderer::tonemap(float gamma, float exposure)
 
             ColorRGB hdr_color = m_render_data.buffers.pixels[index];
             // Scaling by sample count
-            hdr_color = hdr_color / float(m_render_data.render_settings.samples_per_frame);
+            hdr_color = hdr_color / float(m_render_data.render_settings.sample_number);
 
             ColorRGB tone_mapped = ColorRGB(1.0f) - exp(-hdr_color * exposure);
             tone_mapped = pow(tone_mapped, 1.0f / gamma);
@@ -141,3 +583,237 @@ void CPURenderer::tonemap(float gamma, float exposure)
         }
     }
 }
+
+void CPURenderer::benchmark_coherence_sorting()
+{
+    const int frame_count = 4;
+    // Sorting a small wavefront gathers less rays with the same origin, direction or material
+    const int wavefront_sizes[2] = { 1 << 12, m_render_options.wavefront_size };
+    const char* sorting_names[4] = { "No sorting", "Sorted rays", "Sorted hits", "Sorted rays & hits" };
+
+    CPURenderOptions render_options = m_render_options;
+    m_render_options.wavefront = true;
+
+    std::cout << "Coherence sorting of the secondary rays (" << frame_count << " frames, " << m_render_data.render_settings.nb_bounces << " bounces):" << std::endl;
+    for (int wavefront_size : wavefront_sizes)
+    {
+        m_render_options.wavefront_size = wavefront_size;
+
+        std::cout << "\tWavefront size " << wavefront_size << ":" << std::endl;
+        for (int sorting = 0; sorting < 4; sorting++)
+        {
+            m_render_options.wavefront_sorting.sort_rays = sorting & 1;
+            m_render_options.wavefront_sorting.sort_hits = sorting & 2;
+            reset_render();
+
+            WavefrontStageTimes times_before = m_wavefront_path_tracer.get_stage_times();
+            WavefrontRayCounts ray_counts_before = m_wavefront_path_tracer.get_ray_counts();
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int frame = 0; frame < frame_count; frame++)
+                render_frame();
+            auto stop = std::chrono::high_resolution_clock::now();
+
+            const WavefrontStageTimes& times = m_wavefront_path_tracer.get_stage_times();
+            const WavefrontRayCounts& ray_counts = m_wavefront_path_tracer.get_ray_counts();
+            float frame_ms = std::chrono::duration<float, std::milli>(stop - start).count() / frame_count;
+            float intersect_ms = (times.intersect_seconds - times_before.intersect_seconds) * 1000.0f / frame_count;
+            float bsdf_sample_ms = (times.bsdf_sample_seconds - times_before.bsdf_sample_seconds) * 1000.0f / frame_count;
+            float shade_ms = (times.shade_seconds - times_before.shade_seconds) * 1000.0f / frame_count;
+            float shadow_ray_ms = (times.shadow_ray_seconds - times_before.shadow_ray_seconds) * 1000.0f / frame_count;
+            float sort_ms = (times.ray_sort_seconds - times_before.ray_sort_seconds + times.hit_sort_seconds - times_before.hit_sort_seconds) * 1000.0f / frame_count;
+            float closest_hit_rays = (ray_counts.closest_hit_rays - ray_counts_before.closest_hit_rays) / (float)frame_count;
+
+            std::cout << "\t\t" << sorting_names[sorting] << ": " << frame_ms << "ms per frame (intersect " << intersect_ms << "ms, " << closest_hit_rays / intersect_ms / 1.0e3f << " Mrays/s, BSDF sampling " << bsdf_sample_ms << "ms, shade " << shade_ms << "ms, shadow rays " << shadow_ray_ms << "ms, sorting " << sort_ms << "ms)" << std::endl;
+        }
+    }
+
+    m_render_options = render_options;
+    reset_render();
+}
+
+void CPURenderer::benchmark_bsdf_batch()
+{
+    const int repetitions = 8;
+
+    // The hits of the camera rays give the BSDF batches the mix of materials of the scene, with the
+    // materials, texture coordinates and shading normals of the path tracer (trace_ray()).
+    // The directions towards the light are cosine distributed around the shading normal
+    std::vector<RendererMaterial> materials;
+    std::vector<RayVolumeState> ray_volume_states;
+    std::vector<float3> view_directions;
+    std::vector<float3> shading_normals;
+    std::vector<float3> geometric_normals;
+    std::vector<float3> to_light_directions;
+    std::vector<Sampler> samplers;
+
+    Sampler random_number_generator(42);
+    Xorshift32Generator seed_generator(42);
+    for (int y = 0; y < m_resolution.y; y++)
+    {
+        for (int x = 0; x < m_resolution.x; x++)
+        {
+            HitInfo hit_info;
+            RayPayload ray_payload;
+            hiprtRay camera_ray = m_hiprt_camera.get_camera_ray(x + 0.5f, y + 0.5f, m_resolution);
+            if (!trace_ray(m_render_data, camera_ray, ray_payload, hit_info))
+                continue;
+
+            if (ray_payload.material.is_emissive())
+                continue;
+
+            materials.push_back(ray_payload.material);
+            ray_volume_states.push_back(ray_payload.volume_state);
+            view_directions.push_back(-camera_ray.direction);
+            shading_normals.push_back(hit_info.shading_normal);
+            geometric_normals.push_back(hit_info.geometric_normal);
+            to_light_directions.push_back(cosine_weighted_sample(hit_info.shading_normal, random_number_generator));
+            samplers.push_back(Sampler(seed_generator.xorshift32()));
+        }
+    }
+
+    int hit_count = materials.size();
+    if (hit_count == 0)
+    {
+        std::cout << "BSDF batch benchmark: the camera doesn't see any non emissive surface" << std::endl;
+
+        return;
+    }
+
+    std::vector<SIMDInstructionSet> instruction_sets = { SIMDInstructionSet::SCALAR };
+    for (SIMDInstructionSet instruction_set : { SIMDInstructionSet::AVX2, SIMDInstructionSet::AVX512 })
+        if (CPUFeatures::supports(instruction_set))
+            instruction_sets.push_back(instruction_set);
+
+    // Results of the scalar functions that the batches are compared to
+    std::vector<ColorRGB> scalar_colors[2];
+    std::vector<float> scalar_pdfs[2];
+    float scalar_seconds[2];
+
+    std::cout << "BSDF batch evaluation / sampling of " << hit_count << " hits (" << repetitions << " repetitions):" << std::endl;
+    for (SIMDInstructionSet instruction_set : instruction_sets)
+    {
+        for (int sampling = 0; sampling < 2; sampling++)
+        {
+            std::vector<RayVolumeState> batch_ray_volume_states;
+            std::vector<float3> batch_directions;
+            std::vector<Sampler> batch_samplers;
+            std::vector<ColorRGB> colors(hit_count);
+            std::vector<float> pdfs(hit_count);
+
+            float seconds = 0.0f;
+            for (int repetition = 0; repetition < repetitions; repetition++)
+            {
+                // The sampling modifies the directions, the volume states and the samplers
+                batch_ray_volume_states = ray_volume_states;
+                batch_directions = to_light_directions;
+                batch_samplers = samplers;
+
+                BSDFBatch batch;
+                batch.count = hit_count;
+                batch.materials = materials.data();
+                batch.ray_volume_states = batch_ray_volume_states.data();
+                batch.view_directions = view_directions.data();
+                batch.shading_normals = shading_normals.data();
+                batch.geometric_normals = geometric_normals.data();
+                batch.samplers = batch_samplers.data();
+                batch.to_light_directions = batch_directions.data();
+                batch.colors = colors.data();
+                batch.pdfs = pdfs.data();
+
+                auto start = std::chrono::high_resolution_clock::now();
+                if (sampling)
+                    bsdf_dispatcher_sample_batch(m_render_data.buffers.materials_buffer, batch, instruction_set);
+                else
+                    bsdf_dispatcher_eval_batch(m_render_data.buffers.materials_buffer, batch, instruction_set);
+                auto stop = std::chrono::high_resolution_clock::now();
+
+                seconds += std::chrono::duration<float>(stop - start).count();
+            }
+
+            if (instruction_set == SIMDInstructionSet::SCALAR)
+            {
+                scalar_colors[sampling] = colors;
+                scalar_pdfs[sampling] = pdfs;
+                scalar_seconds[sampling] = seconds;
+            }
+
+            // Relative difference of the throughput (color / PDF) with the scalar function. The sampling
+            // is compared this way because around the peaks of the specular lobes, the color and the PDF
+            // both vary a lot with the last bits of the sampled direction, but not their ratio
+            float max_difference = 0.0f;
+            for (int i = 0; i < hit_count; i++)
+            {
+                if (pdfs[i] <= 0.0f || scalar_pdfs[sampling][i] <= 0.0f)
+                    continue;
+
+                float throughput = colors[i].luminance() / pdfs[i];
+                float scalar_throughput = scalar_colors[sampling][i].luminance() / scalar_pdfs[sampling][i];
+                if (!std::isfinite(throughput) || !std::isfinite(scalar_throughput))
+                    continue;
+
+                max_difference = std::max(max_difference, std::abs(throughput - scalar_throughput) / std::max(1.0f, scalar_throughput));
+            }
+
+            std::cout << "\t" << CPUFeatures::to_string(instruction_set) << (sampling ? " sample: " : " eval: ") << hit_count * repetitions / seconds / 1.0e6f << " Mhits/s (x" << scalar_seconds[sampling] / seconds << "), max throughput difference " << max_difference << std::endl;
+        }
+    }
+}
+
+void CPURenderer::benchmark_russian_roulette()
+{
+    const int frame_count = 8;
+    // The noise left in the reference adds about frame_count / reference_frame_count to the measured MSEs
+    const int reference_frame_count = 16 * frame_count;
+    const char* config_names[3] = { "Fixed depth", "Russian roulette", "Russian roulette + splitting" };
+
+    HIPRTRenderSettings render_settings = m_render_data.render_settings;
+    // All the pixels get the same number of samples
+    m_render_data.render_settings.enable_adaptive_sampling = false;
+    m_render_data.render_settings.stop_noise_threshold = 0.0f;
+
+    int pixel_count = m_resolution.x * m_resolution.y;
+
+    // The reference is rendered with the fixed depth after the sample numbers of the measured renders
+    // so that its random numbers are independent of theirs: only the samples past frame_count are kept
+    m_render_data.render_settings.do_russian_roulette = false;
+    reset_render();
+    for (int frame = 0; frame < frame_count; frame++)
+        render_frame();
+    std::vector<ColorRGB> reference(m_render_data.buffers.pixels, m_render_data.buffers.pixels + pixel_count);
+    int reference_first_sample = m_render_data.render_settings.sample_number;
+    for (int frame = 0; frame < reference_frame_count; frame++)
+        render_frame();
+    for (int pixel_index = 0; pixel_index < pixel_count; pixel_index++)
+        reference[pixel_index] = (m_render_data.buffers.pixels[pixel_index] - reference[pixel_index]) / static_cast<float>(m_render_data.render_settings.sample_number - reference_first_sample);
+
+    float frame_seconds[3];
+    double mses[3];
+    for (int config = 0; config < 3; config++)
+    {
+        m_render_data.render_settings.do_russian_roulette = config > 0;
+        m_render_data.render_settings.russian_roulette_split_threshold = config == 2 ? std::max(1.0f, render_settings.russian_roulette_split_threshold) : 0.0f;
+        reset_render();
+
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int frame = 0; frame < frame_count; frame++)
+            render_frame();
+        auto stop = std::chrono::high_resolution_clock::now();
+        frame_seconds[config] = std::chrono::duration<float>(stop - start).count() / frame_count;
+
+        double squared_error_sum = 0.0;
+        for (int pixel_index = 0; pixel_index < pixel_count; pixel_index++)
+        {
+            ColorRGB difference = m_render_data.buffers.pixels[pixel_index] / static_cast<float>(m_render_data.render_settings.sample_number) - reference[pixel_index];
+            squared_error_sum += (difference.r * difference.r + difference.g * difference.g + difference.b * difference.b) / 3.0;
+        }
+        mses[config] = squared_error_sum / pixel_count;
+    }
+    m_render_data.render_settings = render_settings;
+    reset_render();
+
+    // The MSE of an unbiased estimator decreases as 1 / time: the time to reach
+    // a given MSE is proportional to the MSE times the time per sample
+    std::cout << "Russian roulette efficiency (" << frame_count << " frames, " << m_render_data.render_settings.nb_bounces << " bounces, reference of " << reference_frame_count << " frames):" << std::endl;
+    for (int config = 0; config < 3; config++)
+        std::cout << "\t" << config_names[config] << ": " << frame_seconds[config] * 1000.0f << "ms per frame, MSE " << mses[config] << ", time to equal MSE " << mses[config] * frame_seconds[config] / (mses[0] * frame_seconds[0]) << "x" << std::endl;
+}
@@ -9,12 +9,40 @@
 #include "HostDeviceCommon/RenderData.h"
 #include "Image/Image.h"
 #include "Renderer/BVH.h"
+#include "Renderer/LightBVH.h"
+#include "Renderer/TileScheduler.h"
+#include "Renderer/TopLevelBVH.h"
+#include "Renderer/WavefrontPathTracer.h"
 #include "Scene/SceneParser.h"
 #include "Utils/CommandlineArguments.h"
 
 #include <memory>
 #include <vector>
 
+struct CPURenderOptions
+{
+    // Width and height in pixels of the tiles the image is split into.
+    // A 16x16 tile is 3KB of framebuffer and the rays of neighbouring
+    // pixels mostly traverse the same BVH nodes
+    int tile_size = 16;
+    // Order in which the tiles are rendered
+    TileOrder tile_order = TileOrder::HILBERT;
+
+    // render() stops when all the pixels have that many samples (or converged,
+    // if adaptive sampling or the stop noise threshold are enabled). Each frame
+    // renders HIPRTRenderSettings::samples_per_frame samples per pixel
+    int max_sample_count = 64;
+
+    // If true, the frames are rendered by the WavefrontPathTracer instead
+    // of calling PathTracerKernel for each pixel of the tiles
+    bool wavefront = false;
+    // How many paths the wavefront path tracer traces together. The state of a
+    // path is about 1KB (mostly its material and its nested dielectrics stack)
+    int wavefront_size = 1 << 16;
+    // Sorting of the secondary rays and of their hits of the wavefront path tracer
+    WavefrontSortingOptions wavefront_sorting;
+};
+
 class CPURenderer
 {
 public:
@@ -26,26 +54,143 @@ public:
 
     HIPRTRenderData& get_render_data();
     HIPRTRenderSettings& get_render_settings();
+    // Options used for the BVHs built by the next call to set_scene()
+    BVHBuildOptions& get_bvh_build_options();
+    CPURenderOptions& get_render_options();
     Image& get_framebuffer();
 
+    /**
+     * Renders frames of samples_per_frame samples per pixel and accumulates
+     * them in the framebuffer until max_sample_count samples are reached
+     * or until all the pixels have converged. Each frame is split in tiles that
+     * are rendered in parallel (see TileScheduler). With the adaptive sampling,
+     * the tiles whose pixels have all converged aren't rendered anymore
+     */
     void render();
+    /**
+     * Averages the samples accumulated in the framebuffer by render() and tonemaps them
+     */
     void tonemap(float gamma, float exposure);
+
+    /**
+     * Measures and prints the throughput of the BVH for closest-hit queries
+     * (one camera ray per pixel) and occlusion queries (one shadow ray towards an
+     * emissive triangle per camera ray hit). The scene and the camera must be set
+     */
+    void benchmark_bvh_queries();
+    /**
+     * Rebuilds the largest BLAS of the scene with an increasing number of
+     * threads and prints the build times. The scene must be set
+     */
+    void benchmark_bvh_build();
+    /**
+     * Animates the largest BLAS of the scene and prints the time and quality of
+     * refitting its BVH compared to rebuilding it at each frame. The scene must be set
+     */
+    void benchmark_bvh_refit();
+    /**
+     * Renders a few frames with PathTracerKernel and then with the wavefront path tracer and
+     * prints their throughput and the average luminance of their images (which should match).
+     * The scene, the camera and the envmap must be set
+     */
+    void benchmark_wavefront();
+    /**
+     * Renders a few frames with the wavefront path tracer without sorting, with the rays sorted,
+     * the hits sorted and both, for a small and the configured wavefront size, and prints the time
+     * of the intersection and shading stages compared to the time spent sorting.
+     * The scene, the camera and the envmap must be set
+     */
+    void benchmark_coherence_sorting();
+    /**
+     * Evaluates and samples the BSDF of random hits on the materials of the scene with the
+     * scalar functions of Dispatcher.h and with their batch versions for each SIMD instruction
+     * set supported by the CPU, and prints their throughput and the largest difference with the
+     * scalar results. The scene must be set
+     */
+    void benchmark_bsdf_batch();
+    /**
+     * Renders a few frames with the fixed path depth, with the Russian roulette and with the
+     * Russian roulette and the path splitting, and prints their time per frame, their MSE against
+     * a reference and their time to reach the MSE of the fixed depth relative to it.
+     * The scene, the camera and the envmap must be set
+     */
+    void benchmark_russian_roulette();
 private:
+    /**
+     * Builds (or loads from the cache) one BLAS per object of
+     * the scene and the TLAS over the instances of the scene
+     */
+    void build_acceleration_structure(const Scene& parsed_scene);
+    /**
+     * Renders one frame of samples_per_frame samples per pixel
+     * and increments the sample and frame numbers
+     */
+    void render_frame();
+    /**
+     * Per tile error estimate of the adaptive sampling, after the tile was rendered: whether
+     * all the pixels of the tile have converged (see adaptive_sampling_converged())
+     */
+    bool is_tile_converged(const RenderTile& tile) const;
+    /**
+     * Deactivates the pixels of a converged tile and removes the tile from the next frames.
+     * Called by the thread that rendered the tile
+     */
+    void retire_tile(const RenderTile& tile);
+    /**
+     * The pixels of the retired tiles aren't rescaled every frame for the division by the
+     * sample number of the display (see prepare_pixel_sampling()): scales them to the current
+     * sample number. Called at the end of render()
+     */
+    void rescale_retired_tiles();
+    /**
+     * Resamples the ReSTIR DI reservoirs of all the pixels for the frame (ReSTIRDIInitialCandidatesKernel
+     * then ReSTIRDISpatialReuseKernel), before the path tracing of the frame. Only with LSS_RESTIR_DI
+     */
+    void render_restir_di_passes();
+    bool is_rendering_done() const;
+    /**
+     * Resets the sample count and the convergence flags for a new render
+     */
+    void reset_render();
+
     int2 m_resolution;
 
     Image m_framebuffer;
-    std::vector<int> m_debug_pixel_active_buffer;
     std::vector<ColorRGB> m_denoiser_albedo;
     std::vector<float3> m_denoiser_normals;
     std::vector<int> m_pixel_sample_count;
     std::vector<float> m_pixel_squared_luminance;
+    // Per pixel reservoirs and surfaces of the ReSTIR DI, empty if LSS_RESTIR_DI isn't used
+    std::vector<Reservoir> m_restir_di_temporal_reservoirs;
+    std::vector<Reservoir> m_restir_di_final_reservoirs;
+    std::vector<ReSTIRDISurface> m_restir_di_surfaces;
+    std::vector<ReSTIRDISurface> m_restir_di_previous_surfaces;
+    // Mask of the SAMPLER_BLUE_NOISE sampler
+    std::vector<float> m_blue_noise_mask;
     unsigned char m_still_one_ray_active = true;
     AtomicType<unsigned int> m_stop_noise_threshold_count;
 
-    std::vector<Triangle> m_triangle_buffer;
-    std::shared_ptr<BVH> m_bvh;
+    // Object space triangles of each object of the scene, one BLAS is built per object
+    std::vector<std::vector<Triangle>> m_blas_triangles;
+    // Primitive index in the scene of each triangle of m_blas_triangles
+    std::vector<std::vector<int>> m_blas_primitive_indices;
+    std::vector<std::shared_ptr<BVH>> m_blases;
+    std::shared_ptr<TopLevelBVH> m_tlas;
+    BVHBuildOptions m_bvh_build_options;
+    LightBVH m_light_bvh;
+
+    CPURenderOptions m_render_options;
+    TileScheduler m_tile_scheduler;
+    // Per tile sample number that the pixels of the tile are scaled to, 0 if the tile isn't retired
+    std::vector<int> m_tile_retirement_sample_numbers;
+    WavefrontPathTracer m_wavefront_path_tracer;
+
+    std::vector<float4x4> m_instance_transforms;
+    std::vector<float4x4> m_instance_normal_transforms;
 
     HIPRTCamera m_hiprt_camera;
+    // Camera of the previous frame, for the temporal reuse of the ReSTIR DI
+    HIPRTCamera m_previous_hiprt_camera;
     HIPRTRenderData m_render_data;
 };
 
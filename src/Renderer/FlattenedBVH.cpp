@@ -0,0 +1,575 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#include "Renderer/FlattenedBVH.h"
+
+#include <bit>
+
+FlattenedBVH::FlattenedBVH(std::vector<FlattenedNode>&& nodes, std::vector<Triangle>&& triangles, std::vector<int>&& triangle_ids)
+    : m_nodes_storage(std::move(nodes)), m_triangles_storage(std::move(triangles)), m_triangle_ids_storage(std::move(triangle_ids))
+{
+    // Moving a vector keeps its buffer so these views
+    // remain valid when the FlattenedBVH is moved
+    m_nodes = m_nodes_storage;
+    m_triangles = m_triangles_storage;
+    m_triangle_ids = m_triangle_ids_storage;
+}
+
+FlattenedBVH::FlattenedBVH(std::shared_ptr<MemoryMappedFile> mapped_file, std::span<FlattenedNode> nodes, std::span<Triangle> triangles, std::span<int> triangle_ids)
+    : m_nodes(nodes), m_triangles(triangles), m_triangle_ids(triangle_ids), m_mapped_file(mapped_file) {}
+
+FlattenedBVH::RayPlanesData::RayPlanesData(const hiprtRay& ray)
+{
+    for (int i = 0; i < BVHConstants::PLANES_COUNT; i++)
+    {
+        float denom = hippt::dot(BoundingVolume::PLANE_NORMALS[i], ray.direction);
+        // A ray parallel to a plane gets a very large (but finite) inverse
+        // so that the slab test still behaves correctly without any special case
+        if (denom == 0.0f)
+            denom = 1.0e-20f;
+
+        inverse_denoms[i] = 1.0f / denom;
+        numers[i] = hippt::dot(BoundingVolume::PLANE_NORMALS[i], float3(ray.origin));
+    }
+}
+
+FlattenedBVH::PacketPlanesData::PacketPlanesData(const RayPacket& packet)
+{
+    direction_sum = make_float3(0.0f, 0.0f, 0.0f);
+    for (int ray_index = 0; ray_index < packet.count; ray_index++)
+    {
+        rays[ray_index] = RayPlanesData(packet.rays[ray_index]);
+        direction_sum = direction_sum + packet.rays[ray_index].direction;
+    }
+
+    for (int i = 0; i < BVHConstants::PLANES_COUNT; i++)
+    {
+        numers_min[i] = INFINITY;
+        numers_max[i] = -INFINITY;
+        inverse_denoms_min[i] = INFINITY;
+        inverse_denoms_max[i] = -INFINITY;
+
+        bool positive_denoms = rays[0].inverse_denoms[i] > 0.0f;
+        plane_usable[i] = true;
+        for (int ray_index = 0; ray_index < packet.count; ray_index++)
+        {
+            numers_min[i] = hippt::min(numers_min[i], rays[ray_index].numers[i]);
+            numers_max[i] = hippt::max(numers_max[i], rays[ray_index].numers[i]);
+            inverse_denoms_min[i] = hippt::min(inverse_denoms_min[i], rays[ray_index].inverse_denoms[i]);
+            inverse_denoms_max[i] = hippt::max(inverse_denoms_max[i], rays[ray_index].inverse_denoms[i]);
+
+            plane_usable[i] &= (rays[ray_index].inverse_denoms[i] > 0.0f) == positive_denoms;
+        }
+    }
+}
+
+bool FlattenedBVH::intersect_node(const FlattenedNode& node, const RayPlanesData& ray_data, float& t_near, float t_max)
+{
+    float t_far = t_max;
+    t_near = 0.0f;
+
+    for (int i = 0; i < BVHConstants::PLANES_COUNT; i++)
+    {
+        float t_plane_near = (node.d_near[i] - ray_data.numers[i]) * ray_data.inverse_denoms[i];
+        float t_plane_far = (node.d_far[i] - ray_data.numers[i]) * ray_data.inverse_denoms[i];
+
+        t_near = hippt::max(t_near, hippt::min(t_plane_near, t_plane_far));
+        t_far = hippt::min(t_far, hippt::max(t_plane_near, t_plane_far));
+    }
+
+    return t_near <= t_far;
+}
+
+/**
+ * Range of the product of a value of [a_min, a_max] with a value of [b_min, b_max]
+ */
+static void interval_product(float a_min, float a_max, float b_min, float b_max, float& product_min, float& product_max)
+{
+    float p0 = a_min * b_min;
+    float p1 = a_min * b_max;
+    float p2 = a_max * b_min;
+    float p3 = a_max * b_max;
+
+    product_min = hippt::min(hippt::min(p0, p1), hippt::min(p2, p3));
+    product_max = hippt::max(hippt::max(p0, p1), hippt::max(p2, p3));
+}
+
+bool FlattenedBVH::intersect_node_packet(const FlattenedNode& node, const PacketPlanesData& packet_data, float t_max)
+{
+    // Smallest distance at which a ray of the packet can enter the node
+    // and largest distance at which a ray of the packet can leave it
+    float t_near = 0.0f;
+    float t_far = t_max;
+
+    for (int i = 0; i < BVHConstants::PLANES_COUNT; i++)
+    {
+        if (!packet_data.plane_usable[i])
+            continue;
+
+        float t_plane_near_min, t_plane_near_max;
+        float t_plane_far_min, t_plane_far_max;
+        interval_product(node.d_near[i] - packet_data.numers_max[i], node.d_near[i] - packet_data.numers_min[i], packet_data.inverse_denoms_min[i], packet_data.inverse_denoms_max[i], t_plane_near_min, t_plane_near_max);
+        interval_product(node.d_far[i] - packet_data.numers_max[i], node.d_far[i] - packet_data.numers_min[i], packet_data.inverse_denoms_min[i], packet_data.inverse_denoms_max[i], t_plane_far_min, t_plane_far_max);
+
+        // All the rays go the same way through the slab: they enter it through the near
+        // plane if they go along the normal of the plane, through the far plane otherwise
+        if (packet_data.inverse_denoms_min[i] > 0.0f)
+        {
+            t_near = hippt::max(t_near, t_plane_near_min);
+            t_far = hippt::min(t_far, t_plane_far_max);
+        }
+        else
+        {
+            t_near = hippt::max(t_near, t_plane_far_min);
+            t_far = hippt::min(t_far, t_plane_near_max);
+        }
+    }
+
+    return t_near <= t_far;
+}
+
+void FlattenedBVH::fill_hit_info(const hiprtRay& ray, float t, int triangle_index, const float2& uv, HitInfo& hit_info) const
+{
+    // The normal of the hit is only computed for the closest triangle
+    const Triangle& triangle = m_triangles[triangle_index];
+
+    hit_info.t = t;
+    hit_info.uv = uv;
+    hit_info.inter_point = ray.origin + ray.direction * t;
+    hit_info.geometric_normal = hippt::normalize(hippt::cross(triangle.m_b - triangle.m_a, triangle.m_c - triangle.m_a));
+    hit_info.primitive_index = m_triangle_ids[triangle_index];
+}
+
+bool FlattenedBVH::intersect(const hiprtRay& ray, HitInfo& hit_info, const BVHHitFilter& filter) const
+{
+    if (m_nodes.empty())
+        return false;
+
+    RayPlanesData ray_data(ray);
+
+    // Closest intersection found so far, used to cull the nodes that are further away
+    float closest_t = hit_info.t > 0.0f ? hit_info.t : INFINITY;
+    // Index in m_triangles of the closest triangle hit so far
+    int closest_triangle = -1;
+    float2 closest_uv;
+
+    intersect_subtree(0, ray, ray_data, closest_t, closest_triangle, closest_uv, filter);
+    if (closest_triangle == -1)
+        return false;
+
+    fill_hit_info(ray, closest_t, closest_triangle, closest_uv, hit_info);
+
+    return true;
+}
+
+void FlattenedBVH::intersect_subtree(int root_node_index, const hiprtRay& ray, const RayPlanesData& ray_data, float& closest_t, int& closest_triangle, float2& closest_uv, const BVHHitFilter& filter) const
+{
+    struct StackEntry
+    {
+        int node_index;
+        float t_near;
+    };
+
+    StackEntry stack[BVHConstants::FLATTENED_BVH_MAX_STACK_SIZE];
+    int stack_size = 0;
+
+    float root_t_near;
+    if (!intersect_node(m_nodes[root_node_index], ray_data, root_t_near, closest_t))
+        return;
+    stack[stack_size++] = { root_node_index, root_t_near };
+
+    while (stack_size > 0)
+    {
+        StackEntry entry = stack[--stack_size];
+        if (entry.t_near > closest_t)
+            // An intersection closer than this node was found after the node was pushed
+            continue;
+
+        int node_index = entry.node_index;
+        while (true)
+        {
+            const FlattenedNode& node = m_nodes[node_index];
+
+            if (node.is_leaf())
+            {
+                for (int i = node.offset; i < node.offset + node.triangle_count; i++)
+                {
+                    float t;
+                    float2 uv;
+                    if (m_triangles[i].intersect_t_uv(ray, t, uv) && t < closest_t && (!filter || filter(m_triangle_ids[i], uv)))
+                    {
+                        closest_t = t;
+                        closest_triangle = i;
+                        closest_uv = uv;
+                    }
+                }
+
+                break;
+            }
+
+            int first_child = node_index + 1;
+            int second_child = node.offset;
+
+            float t_near_first, t_near_second;
+            bool hit_first = intersect_node(m_nodes[first_child], ray_data, t_near_first, closest_t);
+            bool hit_second = intersect_node(m_nodes[second_child], ray_data, t_near_second, closest_t);
+
+            if (hit_first && hit_second)
+            {
+                // Continuing with the closest child and pushing the other one
+                if (t_near_second < t_near_first)
+                {
+                    stack[stack_size++] = { first_child, t_near_first };
+                    node_index = second_child;
+                }
+                else
+                {
+                    stack[stack_size++] = { second_child, t_near_second };
+                    node_index = first_child;
+                }
+            }
+            else if (hit_first)
+                node_index = first_child;
+            else if (hit_second)
+                node_index = second_child;
+            else
+                break;
+        }
+    }
+}
+
+unsigned int FlattenedBVH::intersect_packet(const RayPacket& packet, HitInfo* hit_infos, const BVHHitFilter& filter) const
+{
+    if (m_nodes.empty() || packet.count == 0)
+        return 0;
+
+    float closest_t[BVHConstants::RAY_PACKET_SIZE];
+    int closest_triangle[BVHConstants::RAY_PACKET_SIZE];
+    float2 closest_uv[BVHConstants::RAY_PACKET_SIZE];
+    for (int ray_index = 0; ray_index < packet.count; ray_index++)
+    {
+        closest_t[ray_index] = packet.t_max[ray_index];
+        closest_triangle[ray_index] = -1;
+    }
+
+    unsigned int packet_hit_mask = traverse_packet<false>(packet, closest_t, closest_triangle, closest_uv, filter);
+    for (unsigned int mask = packet_hit_mask; mask != 0; mask &= mask - 1)
+    {
+        int ray_index = std::countr_zero(mask);
+
+        fill_hit_info(packet.rays[ray_index], closest_t[ray_index], closest_triangle[ray_index], closest_uv[ray_index], hit_infos[ray_index]);
+    }
+
+    return packet_hit_mask;
+}
+
+bool FlattenedBVH::occluded(const hiprtRay& ray, float t_max, const BVHHitFilter& filter) const
+{
+    if (m_nodes.empty())
+        return false;
+
+    return occluded_subtree(0, ray, RayPlanesData(ray), t_max, filter);
+}
+
+bool FlattenedBVH::occluded_subtree(int root_node_index, const hiprtRay& ray, const RayPlanesData& ray_data, float t_max, const BVHHitFilter& filter) const
+{
+    int stack[BVHConstants::FLATTENED_BVH_MAX_STACK_SIZE];
+    int stack_size = 0;
+
+    float t_near;
+    if (!intersect_node(m_nodes[root_node_index], ray_data, t_near, t_max))
+        return false;
+    stack[stack_size++] = root_node_index;
+
+    while (stack_size > 0)
+    {
+        int node_index = stack[--stack_size];
+        while (true)
+        {
+            const FlattenedNode& node = m_nodes[node_index];
+
+            if (node.is_leaf())
+            {
+                for (int i = node.offset; i < node.offset + node.triangle_count; i++)
+                {
+                    float t;
+                    float2 uv;
+                    if (m_triangles[i].intersect_t_uv(ray, t, uv) && t < t_max)
+                        if (!filter || filter(m_triangle_ids[i], uv))
+                            return true;
+                }
+
+                break;
+            }
+
+            int first_child = node_index + 1;
+            int second_child = node.offset;
+
+            bool hit_first = intersect_node(m_nodes[first_child], ray_data, t_near, t_max);
+            bool hit_second = intersect_node(m_nodes[second_child], ray_data, t_near, t_max);
+
+            // Any hit will do so there's no need to find which child is the closest
+            if (hit_first && hit_second)
+            {
+                stack[stack_size++] = second_child;
+                node_index = first_child;
+            }
+            else if (hit_first)
+                node_index = first_child;
+            else if (hit_second)
+                node_index = second_child;
+            else
+                break;
+        }
+    }
+
+    return false;
+}
+
+unsigned int FlattenedBVH::occluded_packet(const RayPacket& packet, const BVHHitFilter& filter) const
+{
+    if (m_nodes.empty() || packet.count == 0)
+        return 0;
+
+    // Copy of the t_max of the rays, the any hit traversal never updates it
+    float t_max[BVHConstants::RAY_PACKET_SIZE];
+    for (int ray_index = 0; ray_index < packet.count; ray_index++)
+        t_max[ray_index] = packet.t_max[ray_index];
+
+    return traverse_packet<true>(packet, t_max, nullptr, nullptr, filter);
+}
+
+template <bool AnyHit>
+unsigned int FlattenedBVH::traverse_packet(const RayPacket& packet, float* closest_t, int* closest_triangle, float2* closest_uv, const BVHHitFilter& filter) const
+{
+    struct StackEntry
+    {
+        int node_index;
+        // Rays of the packet that hit the parent of the node
+        unsigned int ray_mask;
+    };
+
+    PacketPlanesData packet_data(packet);
+
+    // Rays that still look for a hit: all the rays for the closest hit traversal,
+    // the rays that haven't found an occluder yet for the any hit traversal
+    unsigned int active_mask = packet.get_ray_mask();
+
+    StackEntry stack[BVHConstants::FLATTENED_BVH_MAX_STACK_SIZE];
+    int stack_size = 0;
+    stack[stack_size++] = { 0, active_mask };
+
+    while (stack_size > 0)
+    {
+        StackEntry entry = stack[--stack_size];
+
+        int node_index = entry.node_index;
+        unsigned int ray_mask = entry.ray_mask;
+        while (true)
+        {
+            // The rays occluded since the node was pushed are done
+            ray_mask &= active_mask;
+            if (ray_mask == 0)
+                break;
+
+            const FlattenedNode& node = m_nodes[node_index];
+
+            float packet_t_max = 0.0f;
+            for (unsigned int mask = ray_mask; mask != 0; mask &= mask - 1)
+                packet_t_max = hippt::max(packet_t_max, closest_t[std::countr_zero(mask)]);
+
+            // Cheap rejection of the nodes missed by the whole packet
+            if (!intersect_node_packet(node, packet_data, packet_t_max))
+                break;
+
+            unsigned int hit_mask = 0;
+            for (unsigned int mask = ray_mask; mask != 0; mask &= mask - 1)
+            {
+                int ray_index = std::countr_zero(mask);
+
+                float t_near;
+                if (intersect_node(node, packet_data.rays[ray_index], t_near, closest_t[ray_index]))
+                    hit_mask |= 1u << ray_index;
+            }
+
+            ray_mask = hit_mask;
+            if (ray_mask == 0)
+                break;
+
+            if (std::popcount(ray_mask) < BVHConstants::RAY_PACKET_MIN_ACTIVE_RAYS)
+            {
+                // The packet has diverged, testing the nodes once per remaining ray isn't
+                // cheaper than traversing the subtree with each ray on its own
+                for (unsigned int mask = ray_mask; mask != 0; mask &= mask - 1)
+                {
+                    int ray_index = std::countr_zero(mask);
+
+                    if constexpr (AnyHit)
+                    {
+                        if (occluded_subtree(node_index, packet.rays[ray_index], packet_data.rays[ray_index], closest_t[ray_index], filter))
+                            active_mask &= ~(1u << ray_index);
+                    }
+                    else
+                        intersect_subtree(node_index, packet.rays[ray_index], packet_data.rays[ray_index], closest_t[ray_index], closest_triangle[ray_index], closest_uv[ray_index], filter);
+                }
+
+                break;
+            }
+
+            if (node.is_leaf())
+            {
+                for (int i = node.offset; i < node.offset + node.triangle_count && ray_mask != 0; i++)
+                {
+                    for (unsigned int mask = ray_mask; mask != 0; mask &= mask - 1)
+                    {
+                        int ray_index = std::countr_zero(mask);
+
+                        float t;
+                        float2 uv;
+                        if (!m_triangles[i].intersect_t_uv(packet.rays[ray_index], t, uv) || t >= closest_t[ray_index])
+                            continue;
+                        if (filter && !filter(m_triangle_ids[i], uv))
+                            continue;
+
+                        if constexpr (AnyHit)
+                        {
+                            active_mask &= ~(1u << ray_index);
+                            ray_mask &= ~(1u << ray_index);
+                        }
+                        else
+                        {
+                            closest_t[ray_index] = t;
+                            closest_triangle[ray_index] = i;
+                            closest_uv[ray_index] = uv;
+                        }
+                    }
+                }
+
+                break;
+            }
+
+            int first_child = node_index + 1;
+            int second_child = node.offset;
+
+            if constexpr (AnyHit)
+            {
+                // Any hit will do so the order of the children doesn't matter
+                stack[stack_size++] = { second_child, ray_mask };
+                node_index = first_child;
+            }
+            else
+            {
+                // Continuing with the child that comes first along the average direction of the packet
+                float3 first_to_second = m_nodes[second_child].get_box().centroid() - m_nodes[first_child].get_box().centroid();
+                if (hippt::dot(first_to_second, packet_data.direction_sum) < 0.0f)
+                {
+                    stack[stack_size++] = { first_child, ray_mask };
+                    node_index = second_child;
+                }
+                else
+                {
+                    stack[stack_size++] = { second_child, ray_mask };
+                    node_index = first_child;
+                }
+            }
+        }
+
+        if (active_mask == 0)
+            break;
+    }
+
+    if constexpr (AnyHit)
+        return packet.get_ray_mask() & ~active_mask;
+    else
+    {
+        unsigned int hit_mask = 0;
+        for (int ray_index = 0; ray_index < packet.count; ray_index++)
+            if (closest_triangle[ray_index] != -1)
+                hit_mask |= 1u << ray_index;
+
+        return hit_mask;
+    }
+}
+
+void FlattenedBVH::refit(const std::vector<Triangle>& source_triangles)
+{
+    if (m_nodes.empty())
+        return;
+
+#pragma omp parallel for schedule(static)
+    for (int i = 0; i < static_cast<int>(m_triangles.size()); i++)
+        m_triangles[i] = source_triangles[m_triangle_ids[i]];
+
+#pragma omp parallel
+#pragma omp single
+    refit_node(0, 0);
+}
+
+void FlattenedBVH::refit_node(int node_index, int depth)
+{
+    FlattenedNode& node = m_nodes[node_index];
+
+    BoundingVolume volume;
+    if (node.is_leaf())
+        for (int i = node.offset; i < node.offset + node.triangle_count; i++)
+            volume.extend_volume(m_triangles[i]);
+    else
+    {
+        // The top of the tree is refit as OpenMP tasks, one per subtree
+        if (depth < BVHConstants::PARALLEL_REFIT_TASK_DEPTH)
+        {
+#pragma omp task
+            refit_node(node_index + 1, depth + 1);
+
+            refit_node(node.offset, depth + 1);
+#pragma omp taskwait
+        }
+        else
+        {
+            refit_node(node_index + 1, depth + 1);
+            refit_node(node.offset, depth + 1);
+        }
+
+        const FlattenedNode& first_child = m_nodes[node_index + 1];
+        const FlattenedNode& second_child = m_nodes[node.offset];
+        for (int i = 0; i < BVHConstants::PLANES_COUNT; i++)
+        {
+            volume._d_near[i] = hippt::min(first_child.d_near[i], second_child.d_near[i]);
+            volume._d_far[i] = hippt::max(first_child.d_far[i], second_child.d_far[i]);
+        }
+    }
+
+    for (int i = 0; i < BVHConstants::PLANES_COUNT; i++)
+    {
+        node.d_near[i] = volume._d_near[i];
+        node.d_far[i] = volume._d_far[i];
+    }
+}
+
+std::vector<float> FlattenedBVH::compute_subtree_sah_costs() const
+{
+    int node_count = m_nodes.size();
+
+    // Cost of each subtree, not normalized
+    std::vector<float> costs(node_count);
+    std::vector<float> normalized_costs(node_count);
+
+    // The children of a node are always after it in the array
+    // so iterating backwards visits the children first
+    for (int node_index = node_count - 1; node_index >= 0; node_index--)
+    {
+        const FlattenedNode& node = m_nodes[node_index];
+
+        float area = node.get_box().surface_area();
+        if (node.is_leaf())
+            costs[node_index] = area * node.triangle_count * BVHConstants::SAH_INTERSECTION_COST;
+        else
+            costs[node_index] = area * BVHConstants::SAH_TRAVERSAL_COST + costs[node_index + 1] + costs[node.offset];
+
+        normalized_costs[node_index] = area > 0.0f ? costs[node_index] / area : 0.0f;
+    }
+
+    return normalized_costs;
+}
@@ -0,0 +1,200 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#ifndef FLATTENED_BVH_H
+#define FLATTENED_BVH_H
+
+#include "HostDeviceCommon/AlignMacro.h"
+#include "HostDeviceCommon/HitInfo.h"
+#include "Renderer/AABB.h"
+#include "Renderer/BoundingVolume.h"
+#include "Renderer/BVHConstants.h"
+#include "Renderer/RayPacket.h"
+#include "Renderer/Triangle.h"
+#include "Utils/MemoryMappedFile.h"
+
+#include <functional>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include <hiprt/hiprt_types.h> // for hiprtRay
+
+/**
+ * Optional function called on each hit found during the traversal of a BVH.
+ * Returning false ignores the hit and the traversal goes on as if the triangle
+ * wasn't there (used to let rays through alpha-transparent surfaces for example)
+ */
+using BVHHitFilter = std::function<bool(int primitive_index, const float2& uv)>;
+
+/**
+ * Linear, pointer-free version of the BVH used for the traversal on the CPU.
+ *
+ * The nodes are stored in depth-first order: the first child of an interior
+ * node is always the node right after it in the array and only the index of the
+ * second child needs to be stored. The triangles are stored in the order
+ * in which the leaves reference them so that a leaf reads a contiguous range of
+ * triangles.
+ *
+ * The traversal uses a fixed size stack and doesn't allocate.
+ *
+ * The nodes and triangles are either owned by the FlattenedBVH (BVH built
+ * in memory) or read directly from a memory mapped BVHCache file. The rest of
+ * the code only goes through the m_nodes, m_triangles and m_triangle_ids views
+ * and doesn't need to know which one it is.
+ */
+class FlattenedBVH
+{
+public:
+    struct ALIGN(64) FlattenedNode
+    {
+        bool is_leaf() const
+        {
+            return triangle_count > 0;
+        }
+
+        AABB get_box() const
+        {
+            // The first 3 planes of the bounding volume are the X, Y and Z axes
+            return AABB(make_float3(d_near[0], d_near[1], d_near[2]), make_float3(d_far[0], d_far[1], d_far[2]));
+        }
+
+        // Bounding volume of the node (same planes as BoundingVolume::PLANE_NORMALS)
+        float d_near[BVHConstants::PLANES_COUNT];
+        float d_far[BVHConstants::PLANES_COUNT];
+
+        // If the node is a leaf, index of its first triangle in FlattenedBVH::m_triangles.
+        // If the node is an interior node, index of its second child in FlattenedBVH::m_nodes
+        int offset;
+        // Number of triangles if the node is a leaf, 0 for interior nodes
+        int triangle_count;
+    };
+
+    /**
+     * Per-ray data precomputed once before the traversal
+     * and reused for every node
+     */
+    struct RayPlanesData
+    {
+        RayPlanesData() {}
+        RayPlanesData(const hiprtRay& ray);
+
+        float inverse_denoms[BVHConstants::PLANES_COUNT];
+        float numers[BVHConstants::PLANES_COUNT];
+    };
+
+    /**
+     * Per-packet data of the packet traversals: the per-ray data of each ray and the range
+     * of the numerators and inverse denominators of the slab test over the rays of the
+     * packet for each plane (interval arithmetic). A node whose slabs are missed by all
+     * these ranges is missed by all the rays of the packet
+     */
+    struct PacketPlanesData
+    {
+        PacketPlanesData(const RayPacket& packet);
+
+        RayPlanesData rays[BVHConstants::RAY_PACKET_SIZE];
+
+        float numers_min[BVHConstants::PLANES_COUNT];
+        float numers_max[BVHConstants::PLANES_COUNT];
+        float inverse_denoms_min[BVHConstants::PLANES_COUNT];
+        float inverse_denoms_max[BVHConstants::PLANES_COUNT];
+        // False if the rays are not all on the same side of the plane, the
+        // range of the inverse denominators then contains infinities
+        bool plane_usable[BVHConstants::PLANES_COUNT];
+
+        // Sum of the directions of the rays, used to order the children of the nodes
+        float3 direction_sum;
+
+    };
+
+    FlattenedBVH() {}
+    FlattenedBVH(std::vector<FlattenedNode>&& nodes, std::vector<Triangle>&& triangles, std::vector<int>&& triangle_ids);
+    FlattenedBVH(std::shared_ptr<MemoryMappedFile> mapped_file, std::span<FlattenedNode> nodes, std::span<Triangle> triangles, std::span<int> triangle_ids);
+
+    // The views would point to the storage of the copied BVH
+    FlattenedBVH(const FlattenedBVH& other) = delete;
+    FlattenedBVH(FlattenedBVH&& other) = default;
+    FlattenedBVH& operator=(FlattenedBVH&& other) = default;
+
+    bool intersect(const hiprtRay& ray, HitInfo& hit_info, const BVHHitFilter& filter = nullptr) const;
+    /**
+     * Returns true as soon as any hit closer than t_max (and accepted by the filter
+     * if there is one) is found. The children are not visited in any particular order
+     * and no hit attribute (normal, intersection point, ...) is computed
+     */
+    bool occluded(const hiprtRay& ray, float t_max, const BVHHitFilter& filter = nullptr) const;
+
+    /**
+     * Packet version of intersect(): returns the mask of the rays of the packet that hit
+     * something and fills the hit_infos of these rays. The packet traverses the tree
+     * together until fewer than BVHConstants::RAY_PACKET_MIN_ACTIVE_RAYS of its rays hit a
+     * node, the remaining rays then traverse the subtree of that node one by one
+     */
+    unsigned int intersect_packet(const RayPacket& packet, HitInfo* hit_infos, const BVHHitFilter& filter = nullptr) const;
+    /**
+     * Packet version of occluded(): returns the mask of the rays of the packet that are occluded
+     */
+    unsigned int occluded_packet(const RayPacket& packet, const BVHHitFilter& filter = nullptr) const;
+
+    static bool intersect_node(const FlattenedNode& node, const RayPlanesData& ray_data, float& t_near, float t_max);
+    /**
+     * Conservative test of the node against all the rays of a packet
+     * at once: false only if none of the rays can hit the node before t_max
+     */
+    static bool intersect_node_packet(const FlattenedNode& node, const PacketPlanesData& packet_data, float t_max);
+
+    /**
+     * Copies the triangles from 'source_triangles' (the triangles of the scene the BVH was built
+     * over, indexed by primitive index) and recomputes the bounding volumes of all the
+     * nodes bottom-up, in parallel. The topology of the tree is unchanged.
+     *
+     * This is what keeps the BVH valid when the vertices of the triangles move
+     */
+    void refit(const std::vector<Triangle>& source_triangles);
+    /**
+     * Returns the SAH cost of the subtree of each node, normalized by the surface area of the
+     * axis-aligned box of the node: this is the expected cost of tracing a ray that hits the node.
+     *
+     * Comparing these costs before and after a refit tells which subtrees have degraded
+     */
+    std::vector<float> compute_subtree_sah_costs() const;
+
+    std::span<FlattenedNode> m_nodes;
+
+    // Triangles reordered so that the triangles of a leaf are contiguous
+    std::span<Triangle> m_triangles;
+    // Index of the triangle in the scene (primitive index) of each
+    // triangle of m_triangles
+    std::span<int> m_triangle_ids;
+
+private:
+    /**
+     * Single ray traversal of the subtree of the given node. closest_t, closest_triangle
+     * and closest_uv are updated with the hits closer than closest_t that are found
+     */
+    void intersect_subtree(int root_node_index, const hiprtRay& ray, const RayPlanesData& ray_data, float& closest_t, int& closest_triangle, float2& closest_uv, const BVHHitFilter& filter) const;
+    bool occluded_subtree(int root_node_index, const hiprtRay& ray, const RayPlanesData& ray_data, float t_max, const BVHHitFilter& filter) const;
+    void fill_hit_info(const hiprtRay& ray, float t, int triangle_index, const float2& uv, HitInfo& hit_info) const;
+
+    // Packet traversal of intersect_packet() and occluded_packet(). closest_t holds the distance up
+    // to which each ray of the packet looks for hits and is updated with the closest hits found.
+    // If AnyHit is true, the traversal is an occlusion query that returns the mask of the occluded
+    // rays, otherwise it returns the mask of the rays that hit something
+    template <bool AnyHit>
+    unsigned int traverse_packet(const RayPacket& packet, float* closest_t, int* closest_triangle, float2* closest_uv, const BVHHitFilter& filter) const;
+
+    void refit_node(int node_index, int depth);
+
+    // Storage of the views above when the BVH was built in memory...
+    std::vector<FlattenedNode> m_nodes_storage;
+    std::vector<Triangle> m_triangles_storage;
+    std::vector<int> m_triangle_ids_storage;
+
+    // ... or when it was loaded from a cache file
+    std::shared_ptr<MemoryMappedFile> m_mapped_file;
+};
+
+#endif
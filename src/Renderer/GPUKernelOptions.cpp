@@ -8,6 +8,8 @@
 
 const std::string GPUKernelOptions::INTERIOR_STACK_STRATEGY = "InteriorStackStrategy";
 const std::string GPUKernelOptions::DIRECT_LIGHT_SAMPLING_STRATEGY = "DirectLightSamplingStrategy";
+const std::string GPUKernelOptions::EMISSIVE_TRIANGLE_SAMPLING_STRATEGY = "EmissiveTriangleSamplingStrategy";
+const std::string GPUKernelOptions::DIRECT_LIGHT_SELECTION_STRATEGY = "DirectLightSelectionStrategy";
 const std::string GPUKernelOptions::ENVMAP_SAMPLING_STRATEGY = "EnvmapSamplingStrategy";
 const std::string GPUKernelOptions::RIS_USE_VISIBILITY_TARGET_FUNCTION = "RISUseVisiblityTargetFunction";
 
@@ -16,6 +18,8 @@ GPUKernelOptions::GPUKernelOptions()
 	// Adding options with their default values
 	set_option(GPUKernelOptions::INTERIOR_STACK_STRATEGY, InteriorStackStrategy);
 	set_option(GPUKernelOptions::DIRECT_LIGHT_SAMPLING_STRATEGY, DirectLightSamplingStrategy);
+	set_option(GPUKernelOptions::EMISSIVE_TRIANGLE_SAMPLING_STRATEGY, EmissiveTriangleSamplingStrategy);
+	set_option(GPUKernelOptions::DIRECT_LIGHT_SELECTION_STRATEGY, DirectLightSelectionStrategy);
 	set_option(GPUKernelOptions::ENVMAP_SAMPLING_STRATEGY, EnvmapSamplingStrategy);
 	set_option(GPUKernelOptions::RIS_USE_VISIBILITY_TARGET_FUNCTION, RISUseVisiblityTargetFunction);
 }
@@ -15,6 +15,8 @@ class GPUKernelOptions
 public:
 	static const std::string INTERIOR_STACK_STRATEGY;
 	static const std::string DIRECT_LIGHT_SAMPLING_STRATEGY;
+	static const std::string EMISSIVE_TRIANGLE_SAMPLING_STRATEGY;
+	static const std::string DIRECT_LIGHT_SELECTION_STRATEGY;
 	static const std::string ENVMAP_SAMPLING_STRATEGY;
 	static const std::string RIS_USE_VISIBILITY_TARGET_FUNCTION;
 
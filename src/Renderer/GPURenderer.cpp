@@ -4,6 +4,7 @@
  */
 
 #include "Renderer/GPURenderer.h"
+#include "Renderer/LightBVH.h"
 #include "Threads/ThreadManager.h"
 #include "UI/ApplicationSettings.h"
 
@@ -139,10 +140,27 @@ HIPRTRenderData GPURenderer::get_render_data()
 	render_data.buffers.materials_buffer = reinterpret_cast<RendererMaterial*>(m_hiprt_scene.materials_buffer.get_device_pointer());
 	render_data.buffers.emissive_triangles_count = m_hiprt_scene.emissive_triangles_count;
 	render_data.buffers.emissive_triangles_indices = reinterpret_cast<int*>(m_hiprt_scene.emissive_triangles_indices.get_device_pointer());
+	render_data.buffers.emissive_triangles = m_hiprt_scene.emissive_triangles.get_device_pointer();
+	render_data.buffers.emissive_triangles_alias_probabilities = m_hiprt_scene.emissive_triangles_alias_probabilities.get_device_pointer();
+	render_data.buffers.emissive_triangles_aliases = m_hiprt_scene.emissive_triangles_aliases.get_device_pointer();
+	render_data.buffers.emissive_triangles_power_sum = m_hiprt_scene.emissive_triangles_power_sum;
+	if (m_hiprt_scene.light_bvh_light_count > 0)
+	{
+		render_data.buffers.light_bvh_nodes = m_hiprt_scene.light_bvh_nodes.get_device_pointer();
+		render_data.buffers.light_bvh_emissive_indices = m_hiprt_scene.light_bvh_emissive_indices.get_device_pointer();
+		render_data.buffers.light_bvh_trails = m_hiprt_scene.light_bvh_trails.get_device_pointer();
+		render_data.buffers.light_bvh_sorted_keys = m_hiprt_scene.light_bvh_sorted_keys.get_device_pointer();
+		render_data.buffers.light_bvh_sorted_emissive_indices = m_hiprt_scene.light_bvh_sorted_emissive_indices.get_device_pointer();
+	}
+	render_data.buffers.light_bvh_light_count = m_hiprt_scene.light_bvh_light_count;
 
 	render_data.buffers.material_textures = reinterpret_cast<oroTextureObject_t*>(m_hiprt_scene.materials_textures.get_device_pointer());
 	render_data.buffers.texcoords = reinterpret_cast<float2*>(m_hiprt_scene.texcoords_buffer.get_device_pointer());
 	render_data.buffers.textures_dims = reinterpret_cast<int2*>(m_hiprt_scene.textures_dims.get_device_pointer());
+	render_data.buffers.triangle_opacities = m_hiprt_scene.triangle_opacities.get_device_pointer();
+	render_data.buffers.alpha_mask_bits = m_hiprt_scene.alpha_mask_bits.get_device_pointer();
+	render_data.buffers.alpha_mask_offsets = m_hiprt_scene.alpha_mask_offsets.get_device_pointer();
+	render_data.buffers.blue_noise_mask = m_blue_noise_mask.get_device_pointer();
 
 	// Uploading false to basically reset the flag
 	unsigned char false_data = false;
@@ -176,6 +194,10 @@ void GPURenderer::initialize(int device_index)
 
 	m_stop_noise_threshold_count_buffer.resize(1);
 
+	std::vector<float> blue_noise_mask = generate_blue_noise_mask();
+	m_blue_noise_mask.resize(blue_noise_mask.size());
+	m_blue_noise_mask.upload_data(blue_noise_mask);
+
 	OROCHI_CHECK_ERROR(oroEventCreate(&m_frame_start_event));
 	OROCHI_CHECK_ERROR(oroEventCreate(&m_frame_stop_event));
 }
@@ -251,7 +273,7 @@ void GPURenderer::launch_kernel(int tile_size_x, int tile_size_y, int res_x, int
 	OROCHI_CHECK_ERROR(oroModuleLaunchKernel(m_trace_kernel, nb_groups.x, nb_groups.y, 1, tile_size_x, tile_size_y, 1, 0, 0, launch_args, 0));
 }
 
-void GPURenderer::set_hiprt_scene_from_scene(const Scene& scene)
+void GPURenderer::set_hiprt_scene_from_scene(Scene& scene)
 {
 	HIPRTScene& hiprt_scene = m_hiprt_scene;
 	HIPRTGeometry& geometry = hiprt_scene.geometry;
@@ -278,6 +300,21 @@ void GPURenderer::set_hiprt_scene_from_scene(const Scene& scene)
 	{
 		hiprt_scene.emissive_triangles_indices.resize(scene.emissive_triangle_indices.size());
 		hiprt_scene.emissive_triangles_indices.upload_data(scene.emissive_triangle_indices.data());
+
+		scene.compute_emissive_triangles();
+		hiprt_scene.emissive_triangles.resize(scene.emissive_triangles.size());
+		hiprt_scene.emissive_triangles.upload_data(scene.emissive_triangles.data());
+		hiprt_scene.emissive_triangles_alias_probabilities.resize(scene.emissive_triangles_alias_probabilities.size());
+		hiprt_scene.emissive_triangles_alias_probabilities.upload_data(scene.emissive_triangles_alias_probabilities.data());
+		hiprt_scene.emissive_triangles_aliases.resize(scene.emissive_triangles_aliases.size());
+		hiprt_scene.emissive_triangles_aliases.upload_data(scene.emissive_triangles_aliases.data());
+		hiprt_scene.emissive_triangles_power_sum = scene.emissive_triangles_power_sum;
+
+		// Kept to rebuild the alias table and the light BVH when the emission of the materials is edited
+		m_emissive_triangles = scene.emissive_triangles;
+		m_emissive_triangle_indices = scene.emissive_triangle_indices;
+
+		build_light_bvh(scene.materials);
 	}
 
 	hiprt_scene.texcoords_buffer.resize(scene.texcoords.size());
@@ -307,11 +344,25 @@ void GPURenderer::set_hiprt_scene_from_scene(const Scene& scene)
 		hiprt_scene.textures_dims.resize(scene.textures_dims.size());
 		hiprt_scene.textures_dims.upload_data(scene.textures_dims.data());
 	}
+
+	scene.compute_triangle_opacities();
+	if (!scene.triangle_opacities.empty())
+	{
+		hiprt_scene.triangle_opacities.resize(scene.triangle_opacities.size());
+		hiprt_scene.triangle_opacities.upload_data(scene.triangle_opacities.data());
+
+		hiprt_scene.alpha_mask_bits.resize(scene.alpha_mask_bits.size());
+		hiprt_scene.alpha_mask_bits.upload_data(scene.alpha_mask_bits.data());
+
+		hiprt_scene.alpha_mask_offsets.resize(scene.alpha_mask_offsets.size());
+		hiprt_scene.alpha_mask_offsets.upload_data(scene.alpha_mask_offsets.data());
+	}
 }
 
-void GPURenderer::set_scene(const Scene& scene)
+void GPURenderer::set_scene(Scene& scene)
 {
 	set_hiprt_scene_from_scene(scene);
+	m_world_settings.scene_bounding_radius = scene.compute_bounding_sphere_radius();
 
 	m_materials = scene.materials;
 	m_material_names = scene.material_names;
@@ -320,12 +371,12 @@ void GPURenderer::set_scene(const Scene& scene)
 void GPURenderer::set_envmap(ImageRGBA& envmap_image)
 {
 	m_envmap.init_from_image(envmap_image);
-	m_envmap.compute_cdf(envmap_image);
+	m_envmap.upload_sampling_tables(envmap_image);
 
 	m_world_settings.envmap = m_envmap.get_device_texture();
 	m_world_settings.envmap_width = m_envmap.width;
 	m_world_settings.envmap_height = m_envmap.height;
-	m_world_settings.envmap_cdf = m_envmap.get_cdf_device_pointer();
+	m_envmap.fill_world_settings_sampling_tables(m_world_settings);
 }
 
 const std::vector<RendererMaterial>& GPURenderer::get_materials()
@@ -342,6 +393,41 @@ void GPURenderer::update_materials(std::vector<RendererMaterial>& materials)
 {
 	m_materials = materials;
 	m_hiprt_scene.materials_buffer.upload_data(materials.data());
+
+	if (m_hiprt_scene.emissive_triangles_count > 0)
+	{
+		// The emissive triangles are sampled proportionally to their emission
+		std::vector<float> alias_probabilities;
+		std::vector<int> aliases;
+		m_hiprt_scene.emissive_triangles_power_sum = build_emissive_triangles_alias_table(m_emissive_triangles, m_materials, alias_probabilities, aliases);
+		m_hiprt_scene.emissive_triangles_alias_probabilities.upload_data(alias_probabilities.data());
+		m_hiprt_scene.emissive_triangles_aliases.upload_data(aliases.data());
+
+		// The power of the nodes of the light BVH changes too
+		build_light_bvh(m_materials);
+	}
+}
+
+void GPURenderer::build_light_bvh(const std::vector<RendererMaterial>& materials)
+{
+	// The geometry isn't instanced on the GPU
+	LightBVH light_bvh;
+	light_bvh.build(m_emissive_triangles, materials, m_emissive_triangle_indices, std::vector<int>());
+
+	m_hiprt_scene.light_bvh_light_count = light_bvh.sorted_keys.size();
+	if (m_hiprt_scene.light_bvh_light_count == 0)
+		return;
+
+	m_hiprt_scene.light_bvh_nodes.resize(light_bvh.nodes.size());
+	m_hiprt_scene.light_bvh_nodes.upload_data(light_bvh.nodes.data());
+	m_hiprt_scene.light_bvh_emissive_indices.resize(light_bvh.emissive_indices.size());
+	m_hiprt_scene.light_bvh_emissive_indices.upload_data(light_bvh.emissive_indices.data());
+	m_hiprt_scene.light_bvh_trails.resize(light_bvh.trails.size());
+	m_hiprt_scene.light_bvh_trails.upload_data(light_bvh.trails.data());
+	m_hiprt_scene.light_bvh_sorted_keys.resize(light_bvh.sorted_keys.size());
+	m_hiprt_scene.light_bvh_sorted_keys.upload_data(light_bvh.sorted_keys.data());
+	m_hiprt_scene.light_bvh_sorted_emissive_indices.resize(light_bvh.sorted_emissive_indices.size());
+	m_hiprt_scene.light_bvh_sorted_emissive_indices.upload_data(light_bvh.sorted_emissive_indices.data());
 }
 
 void GPURenderer::set_camera(const Camera& camera)
@@ -46,7 +46,7 @@ public:
 	int* get_kernel_option_pointer(const std::string& name);
 	void launch_kernel(int tile_size_x, int tile_size_y, int res_x, int res_y, void** launch_args);
 
-	void set_scene(const Scene& scene);
+	void set_scene(Scene& scene);
 	void set_envmap(ImageRGBA& envmap);
 	void set_camera(const Camera& camera);
 
@@ -75,7 +75,9 @@ public:
 	Camera m_camera;
 
 private:
-	void set_hiprt_scene_from_scene(const Scene& scene);
+	void set_hiprt_scene_from_scene(Scene& scene);
+	// Builds the light BVH over m_emissive_triangles and uploads it
+	void build_light_bvh(const std::vector<RendererMaterial>& materials);
 
 	// Properties of the device
 	oroDeviceProp m_device_properties = { .gcnArchName = "" };
@@ -109,10 +111,16 @@ private:
 	OrochiBuffer<unsigned char> m_still_one_ray_active_buffer;
 	// How many pixels have reached the render_settings.stop_noise_threshold
 	OrochiBuffer<unsigned int> m_stop_noise_threshold_count_buffer;
+	// Mask of the SAMPLER_BLUE_NOISE sampler
+	OrochiBuffer<float> m_blue_noise_mask;
 
 	// The materials are also kept on the CPU side because we want to be able
 	// to modify them interactively with ImGui
 	std::vector<RendererMaterial> m_materials;
+	// The emissive triangles too, for rebuilding their alias table and
+	// the light BVH when the emission of the materials is modified
+	std::vector<EmissiveTriangle> m_emissive_triangles;
+	std::vector<int> m_emissive_triangle_indices;
 	// The material names are used for displaying in the ImGui editor
 	std::vector<std::string> m_material_names;
 	// Vector to keep the textures data alive otherwise the OrochiTexture objects would
@@ -0,0 +1,266 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#include "Renderer/LightBVH.h"
+
+#include <algorithm>
+#include <cmath>
+
+/**
+ * Bounds, orientation cone and power of a set of emissive triangles
+ */
+struct LightBounds
+{
+    float3 bounds_min = make_float3(INFINITY, INFINITY, INFINITY);
+    float3 bounds_max = make_float3(-INFINITY, -INFINITY, -INFINITY);
+    float3 cone_axis = make_float3(0.0f, 0.0f, 1.0f);
+    float cos_theta_o = 1.0f;
+    float power = 0.0f;
+
+    bool empty = true;
+
+    void extend(const float3& light_bounds_min, const float3& light_bounds_max, const float3& light_axis, float light_cos_theta_o, float light_power)
+    {
+        bounds_min = hippt::min(bounds_min, light_bounds_min);
+        bounds_max = hippt::max(bounds_max, light_bounds_max);
+        power += light_power;
+
+        if (empty)
+        {
+            cone_axis = light_axis;
+            cos_theta_o = light_cos_theta_o;
+            empty = false;
+
+            return;
+        }
+
+        // The emissive triangles are double sided: a cone and its opposite bound the same
+        // emission, the cone that is the closest to the current one gives the tightest union
+        float3 axis = hippt::dot(cone_axis, light_axis) < 0.0f ? -light_axis : light_axis;
+
+        // Union of the two cones
+        float theta_a = std::acos(hippt::clamp(-1.0f, 1.0f, cos_theta_o));
+        float theta_b = std::acos(hippt::clamp(-1.0f, 1.0f, light_cos_theta_o));
+        float theta_d = std::acos(hippt::clamp(-1.0f, 1.0f, hippt::dot(cone_axis, axis)));
+        if (std::min(theta_d + theta_b, M_PI) <= theta_a)
+            // The current cone already contains the other one
+            return;
+        if (std::min(theta_d + theta_a, M_PI) <= theta_b)
+        {
+            cone_axis = axis;
+            cos_theta_o = light_cos_theta_o;
+
+            return;
+        }
+
+        float theta_o = (theta_a + theta_d + theta_b) * 0.5f;
+        float3 rotation_axis = hippt::cross(cone_axis, axis);
+        if (theta_o >= M_PI || hippt::length(rotation_axis) == 0.0f)
+        {
+            // All the directions
+            cos_theta_o = -1.0f;
+
+            return;
+        }
+
+        // Rotating the axis of the current cone towards the other one by theta_o - theta_a (Rodrigues' formula)
+        float theta_r = theta_o - theta_a;
+        rotation_axis = hippt::normalize(rotation_axis);
+        cone_axis = cone_axis * std::cos(theta_r) + hippt::cross(rotation_axis, cone_axis) * std::sin(theta_r) + rotation_axis * hippt::dot(rotation_axis, cone_axis) * (1.0f - std::cos(theta_r));
+        cone_axis = hippt::normalize(cone_axis);
+        cos_theta_o = std::cos(theta_o);
+    }
+
+    void extend(const LightBounds& other)
+    {
+        if (!other.empty)
+            extend(other.bounds_min, other.bounds_max, other.cone_axis, other.cos_theta_o, other.power);
+    }
+
+    /**
+     * Surface area orientation heuristic of these bounds, the emissive
+     * triangles emit in the whole hemisphere around their normal
+     */
+    float cost(float axis_length_ratio) const
+    {
+        float theta_o = std::acos(hippt::clamp(-1.0f, 1.0f, cos_theta_o));
+        float theta_w = std::min(theta_o + static_cast<float>(M_PI) * 0.5f, static_cast<float>(M_PI));
+        float sin_theta_o = std::sqrt(std::max(0.0f, 1.0f - cos_theta_o * cos_theta_o));
+        float orientation_measure = 2.0f * M_PI * (1.0f - cos_theta_o) + M_PI * 0.5f * (2.0f * theta_w * sin_theta_o - std::cos(theta_o - 2.0f * theta_w) - 2.0f * theta_o * sin_theta_o + cos_theta_o);
+
+        float3 extent = bounds_max - bounds_min;
+        float surface_area = 2.0f * (extent.x * extent.y + extent.x * extent.z + extent.y * extent.z);
+
+        return power * orientation_measure * axis_length_ratio * surface_area;
+    }
+};
+
+void LightBVH::build(const std::vector<EmissiveTriangle>& emissive_triangles, const std::vector<RendererMaterial>& materials, const std::vector<int>& emissive_triangle_indices, const std::vector<int>& emissive_triangle_instances)
+{
+    nodes.clear();
+    emissive_indices.clear();
+    trails.assign(emissive_triangles.size(), 0);
+    sorted_keys.clear();
+    sorted_emissive_indices.clear();
+    max_depth = 0;
+
+    std::vector<BuildLight> lights;
+    for (int i = 0; i < emissive_triangles.size(); i++)
+    {
+        const EmissiveTriangle& triangle = emissive_triangles[i];
+
+        BuildLight light;
+        light.power = materials[triangle.material_index].emission.luminance() * triangle.area;
+        if (!(light.power > 0.0f))
+            continue;
+
+        float3 vertex_B = triangle.vertex_A + triangle.edge_AB;
+        float3 vertex_C = triangle.vertex_A + triangle.edge_AC;
+        light.bounds_min = hippt::min(triangle.vertex_A, hippt::min(vertex_B, vertex_C));
+        light.bounds_max = hippt::max(triangle.vertex_A, hippt::max(vertex_B, vertex_C));
+        light.centroid = (light.bounds_min + light.bounds_max) * 0.5f;
+        light.normal = triangle.normal;
+        light.emissive_index = i;
+
+        lights.push_back(light);
+    }
+
+    if (lights.empty())
+        return;
+
+    build_node(lights, 0, lights.size(), 0, 0);
+
+    std::vector<int> key_order(lights.size());
+    std::vector<unsigned long long> keys(lights.size());
+    for (int i = 0; i < lights.size(); i++)
+    {
+        int emissive_index = lights[i].emissive_index;
+        int instance_index = emissive_triangle_instances.empty() ? -1 : emissive_triangle_instances[emissive_index];
+
+        keys[i] = emissive_triangle_key(emissive_triangle_indices[emissive_index], instance_index);
+        key_order[i] = i;
+    }
+    std::sort(key_order.begin(), key_order.end(), [&keys](int a, int b) { return keys[a] < keys[b]; });
+
+    sorted_keys.resize(lights.size());
+    sorted_emissive_indices.resize(lights.size());
+    for (int i = 0; i < lights.size(); i++)
+    {
+        sorted_keys[i] = keys[key_order[i]];
+        sorted_emissive_indices[i] = lights[key_order[i]].emissive_index;
+    }
+}
+
+int LightBVH::build_node(std::vector<BuildLight>& lights, int begin, int end, int depth, unsigned long long trail)
+{
+    max_depth = std::max(max_depth, depth);
+
+    LightBounds node_bounds;
+    float3 centroids_min = make_float3(INFINITY, INFINITY, INFINITY);
+    float3 centroids_max = make_float3(-INFINITY, -INFINITY, -INFINITY);
+    for (int i = begin; i < end; i++)
+    {
+        node_bounds.extend(lights[i].bounds_min, lights[i].bounds_max, lights[i].normal, 1.0f, lights[i].power);
+        centroids_min = hippt::min(centroids_min, lights[i].centroid);
+        centroids_max = hippt::max(centroids_max, lights[i].centroid);
+    }
+
+    int node_index = nodes.size();
+    nodes.push_back(LightBVHNode());
+    LightBVHNode node;
+    node.center = (node_bounds.bounds_min + node_bounds.bounds_max) * 0.5f;
+    node.radius = hippt::length(node_bounds.bounds_max - node.center);
+    node.cone_axis = node_bounds.cone_axis;
+    node.cos_theta_o = node_bounds.cos_theta_o;
+    node.sin_theta_o = std::sqrt(std::max(0.0f, 1.0f - node.cos_theta_o * node.cos_theta_o));
+    node.power = node_bounds.power;
+
+    float3 centroids_extent = centroids_max - centroids_min;
+    bool same_centroids = centroids_extent.x <= 0.0f && centroids_extent.y <= 0.0f && centroids_extent.z <= 0.0f;
+    if (end - begin == 1 || depth == MAX_DEPTH)
+    {
+        node.second_child_or_first_emissive = emissive_indices.size();
+        node.emissive_count = end - begin;
+        for (int i = begin; i < end; i++)
+        {
+            emissive_indices.push_back(lights[i].emissive_index);
+            trails[lights[i].emissive_index] = trail;
+        }
+        nodes[node_index] = node;
+
+        return node_index;
+    }
+
+    // Finding the bin split of lowest SAOH over the 3 axes
+    float3 bounds_extent = node_bounds.bounds_max - node_bounds.bounds_min;
+    float max_bounds_extent = std::max(bounds_extent.x, std::max(bounds_extent.y, bounds_extent.z));
+
+    float best_cost = INFINITY;
+    int best_axis = -1;
+    int best_split_bin = 0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float axis_centroids_min = (&centroids_min.x)[axis];
+        float axis_centroids_extent = (&centroids_extent.x)[axis];
+        if (axis_centroids_extent <= 0.0f)
+            continue;
+
+        LightBounds bins[BIN_COUNT];
+        for (int i = begin; i < end; i++)
+        {
+            int bin = static_cast<int>(((&lights[i].centroid.x)[axis] - axis_centroids_min) / axis_centroids_extent * BIN_COUNT);
+            bin = std::min(std::max(bin, 0), BIN_COUNT - 1);
+            bins[bin].extend(lights[i].bounds_min, lights[i].bounds_max, lights[i].normal, 1.0f, lights[i].power);
+        }
+
+        // Elongated nodes are preferably split along their long axis
+        float axis_length_ratio = max_bounds_extent / std::max((&bounds_extent.x)[axis], 1.0e-20f);
+        for (int split_bin = 1; split_bin < BIN_COUNT; split_bin++)
+        {
+            LightBounds left, right;
+            for (int bin = 0; bin < split_bin; bin++)
+                left.extend(bins[bin]);
+            for (int bin = split_bin; bin < BIN_COUNT; bin++)
+                right.extend(bins[bin]);
+            if (left.empty || right.empty)
+                continue;
+
+            float cost = left.cost(axis_length_ratio) + right.cost(axis_length_ratio);
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                best_axis = axis;
+                best_split_bin = split_bin;
+            }
+        }
+    }
+
+    int middle;
+    if (best_axis == -1 || same_centroids)
+        // All the lights are in the same bin, splitting them in two halves
+        middle = (begin + end) / 2;
+    else
+    {
+        float axis_centroids_min = (&centroids_min.x)[best_axis];
+        float axis_centroids_extent = (&centroids_extent.x)[best_axis];
+        auto middle_iterator = std::partition(lights.begin() + begin, lights.begin() + end, [&](const BuildLight& light)
+        {
+            int bin = static_cast<int>(((&light.centroid.x)[best_axis] - axis_centroids_min) / axis_centroids_extent * BIN_COUNT);
+            bin = std::min(std::max(bin, 0), BIN_COUNT - 1);
+
+            return bin < best_split_bin;
+        });
+        middle = middle_iterator - lights.begin();
+        if (middle == begin || middle == end)
+            middle = (begin + end) / 2;
+    }
+
+    build_node(lights, begin, middle, depth + 1, trail);
+    node.second_child_or_first_emissive = build_node(lights, middle, end, depth + 1, trail | (1ull << depth));
+    node.emissive_count = 0;
+    nodes[node_index] = node;
+
+    return node_index;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#ifndef LIGHT_BVH_H
+#define LIGHT_BVH_H
+
+#include "HostDeviceCommon/EmissiveTriangle.h"
+#include "HostDeviceCommon/LightBVHNode.h"
+#include "HostDeviceCommon/Material.h"
+
+#include <vector>
+
+/**
+ * BVH over the emissive triangles of the scene whose nodes also bound the power and the
+ * orientation of their triangles ("Importance Sampling of Many Lights with Adaptive
+ * Tree Splitting", Conty & Kulla, 2018). The light sampling traverses it from the
+ * root, picking the children according to how much they may light the shading point
+ * (see Device/includes/LightBVH.h).
+ *
+ * The split of each node minimizes the surface area orientation heuristic (SAOH)
+ * of its children. The leaves have one emissive triangle, except at the maximum depth
+ */
+class LightBVH
+{
+public:
+    // The path from the root to each leaf is stored on 64 bits (see trails)
+    static constexpr int MAX_DEPTH = 63;
+    // Number of bins per axis evaluated for the splits of a node
+    static constexpr int BIN_COUNT = 12;
+
+    /**
+     * Builds the light BVH over the emissive triangles with a power > 0 (the other
+     * ones are never sampled). emissive_triangle_instances is empty if the geometry
+     * isn't instanced. Must be rebuilt when the emission of the materials changes
+     */
+    void build(const std::vector<EmissiveTriangle>& emissive_triangles, const std::vector<RendererMaterial>& materials, const std::vector<int>& emissive_triangle_indices, const std::vector<int>& emissive_triangle_instances);
+
+    std::vector<LightBVHNode> nodes;
+    // Indices of the emissive triangles (in the emissive triangles buffer) in the order of the leaves
+    std::vector<int> emissive_indices;
+    // Path from the root to the leaf of each emissive triangle: the bit i is set if
+    // the second child is taken at the depth i. Indexed by emissive triangle
+    std::vector<unsigned long long> trails;
+    // emissive_triangle_key() of the emissive triangles of the light BVH in increasing
+    // order and the index of the emissive triangle of each key. Used to find the
+    // emissive triangle hit by a ray
+    std::vector<unsigned long long> sorted_keys;
+    std::vector<int> sorted_emissive_indices;
+
+    int max_depth = 0;
+
+private:
+    struct BuildLight
+    {
+        float3 bounds_min;
+        float3 bounds_max;
+        float3 centroid;
+        float3 normal;
+        float power;
+
+        int emissive_index;
+    };
+
+    int build_node(std::vector<BuildLight>& lights, int begin, int end, int depth, unsigned long long trail);
+};
+
+#endif
@@ -0,0 +1,63 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include "HostDeviceCommon/Math.h"
+#include "Renderer/BVHConstants.h"
+
+#include <hiprt/hiprt_types.h> // for hiprtRay
+
+/**
+ * Rays traced together by the packet traversals of the BVHs (BVH::intersect_packet(), ...).
+ *
+ * The traversal of a packet visits a node once for all the rays of the packet
+ * and culls the nodes that no ray of the packet can hit with a single conservative
+ * test. This only pays off if the rays are coherent: the camera rays of neighbouring
+ * pixels or the shadow rays of neighbouring hits towards the same light
+ */
+struct RayPacket
+{
+    void add_ray(const hiprtRay& ray, float ray_t_max = INFINITY)
+    {
+        rays[count] = ray;
+        t_max[count] = ray_t_max;
+        count++;
+    }
+
+    /**
+     * True if the directions of all the rays have the same sign along
+     * each axis. The conservative culling test of the packet traversal
+     * can only bound the distances along the rays of such packets
+     */
+    bool is_coherent() const
+    {
+        if (count < 2)
+            return false;
+
+        bool positive_x = rays[0].direction.x >= 0.0f;
+        bool positive_y = rays[0].direction.y >= 0.0f;
+        bool positive_z = rays[0].direction.z >= 0.0f;
+        for (int i = 1; i < count; i++)
+            if ((rays[i].direction.x >= 0.0f) != positive_x || (rays[i].direction.y >= 0.0f) != positive_y || (rays[i].direction.z >= 0.0f) != positive_z)
+                return false;
+
+        return true;
+    }
+
+    unsigned int get_ray_mask() const
+    {
+        return count == 32 ? 0xffffffffu : (1u << count) - 1;
+    }
+
+    int count = 0;
+
+    hiprtRay rays[BVHConstants::RAY_PACKET_SIZE];
+    // Only the hits closer than this are looked for
+    float t_max[BVHConstants::RAY_PACKET_SIZE];
+};
+
+#endif
@@ -0,0 +1,238 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#include "Renderer/TileScheduler.h"
+
+#include <algorithm>
+
+void TileScheduler::set_image(int2 resolution, int tile_size, TileOrder order)
+{
+    int tile_count_x = (resolution.x + tile_size - 1) / tile_size;
+    int tile_count_y = (resolution.y + tile_size - 1) / tile_size;
+
+    // The Hilbert curve is defined on a square grid whose size is a power of 2,
+    // the cells of that grid that are outside of the image are skipped
+    uint32_t grid_size = 1;
+    while (grid_size < std::max(tile_count_x, tile_count_y))
+        grid_size *= 2;
+
+    std::vector<std::pair<uint32_t, RenderTile>> ordered_tiles;
+    for (int tile_y = 0; tile_y < tile_count_y; tile_y++)
+    {
+        for (int tile_x = 0; tile_x < tile_count_x; tile_x++)
+        {
+            RenderTile tile;
+            tile.origin = make_int2(tile_x * tile_size, tile_y * tile_size);
+            tile.size = make_int2(std::min(tile_size, resolution.x - tile.origin.x), std::min(tile_size, resolution.y - tile.origin.y));
+
+            uint32_t curve_index;
+            switch (order)
+            {
+            case TileOrder::MORTON:
+                curve_index = morton_index(tile_x, tile_y);
+                break;
+
+            case TileOrder::HILBERT:
+                curve_index = hilbert_index(grid_size, tile_x, tile_y);
+                break;
+
+            case TileOrder::SCANLINE:
+            default:
+                curve_index = tile_x + tile_y * tile_count_x;
+                break;
+            }
+
+            ordered_tiles.push_back(std::make_pair(curve_index, tile));
+        }
+    }
+
+    std::sort(ordered_tiles.begin(), ordered_tiles.end(), [](const std::pair<uint32_t, RenderTile>& a, const std::pair<uint32_t, RenderTile>& b)
+    {
+        return a.first < b.first;
+    });
+
+    m_tiles.clear();
+    m_active_tiles.clear();
+    for (const std::pair<uint32_t, RenderTile>& ordered_tile : ordered_tiles)
+    {
+        m_active_tiles.push_back(m_tiles.size());
+        m_tiles.push_back(ordered_tile.second);
+        m_tiles.back().index = m_active_tiles.back();
+    }
+    m_tile_retired.assign(m_tiles.size(), false);
+}
+
+void TileScheduler::reset(int thread_count)
+{
+    if (thread_count != m_thread_count)
+    {
+        m_thread_ranges = std::make_unique<ThreadRange[]>(thread_count);
+        m_thread_count = thread_count;
+    }
+
+    // Compacting the active tiles, in the same order
+    m_active_tiles.erase(std::remove_if(m_active_tiles.begin(), m_active_tiles.end(), [this](int tile_index)
+    {
+        return m_tile_retired[tile_index];
+    }), m_active_tiles.end());
+
+    uint32_t tile_count = m_active_tiles.size();
+    for (int thread_index = 0; thread_index < thread_count; thread_index++)
+    {
+        uint32_t begin = static_cast<uint64_t>(tile_count) * thread_index / thread_count;
+        uint32_t end = static_cast<uint64_t>(tile_count) * (thread_index + 1) / thread_count;
+
+        m_thread_ranges[thread_index].range.store(pack_range(begin, end), std::memory_order_relaxed);
+    }
+}
+
+bool TileScheduler::next_tile(int thread_index, RenderTile& tile)
+{
+    int tile_index;
+    while (!pop_tile(thread_index, tile_index))
+    {
+        if (!steal_tiles(thread_index))
+            return false;
+    }
+
+    tile = m_tiles[m_active_tiles[tile_index]];
+
+    return true;
+}
+
+void TileScheduler::retire_tile(int tile_index)
+{
+    m_tile_retired[tile_index] = true;
+}
+
+int TileScheduler::get_tile_count() const
+{
+    return m_tiles.size();
+}
+
+int TileScheduler::get_active_tile_count() const
+{
+    return m_active_tiles.size();
+}
+
+const RenderTile& TileScheduler::get_tile(int tile_index) const
+{
+    return m_tiles[tile_index];
+}
+
+uint32_t TileScheduler::morton_index(uint32_t x, uint32_t y)
+{
+    auto spread_bits = [](uint32_t value)
+    {
+        value &= 0x0000ffff;
+        value = (value | (value << 8)) & 0x00ff00ff;
+        value = (value | (value << 4)) & 0x0f0f0f0f;
+        value = (value | (value << 2)) & 0x33333333;
+        value = (value | (value << 1)) & 0x55555555;
+
+        return value;
+    };
+
+    return spread_bits(x) | (spread_bits(y) << 1);
+}
+
+uint32_t TileScheduler::hilbert_index(uint32_t grid_size, uint32_t x, uint32_t y)
+{
+    uint32_t index = 0;
+    for (uint32_t quadrant_size = grid_size / 2; quadrant_size > 0; quadrant_size /= 2)
+    {
+        uint32_t quadrant_x = (x & quadrant_size) > 0;
+        uint32_t quadrant_y = (y & quadrant_size) > 0;
+        index += quadrant_size * quadrant_size * ((3 * quadrant_x) ^ quadrant_y);
+
+        // Rotating the quadrant so that the curve inside of it
+        // starts and ends next to the neighbouring quadrants
+        if (quadrant_y == 0)
+        {
+            if (quadrant_x == 1)
+            {
+                x = grid_size - 1 - x;
+                y = grid_size - 1 - y;
+            }
+
+            std::swap(x, y);
+        }
+    }
+
+    return index;
+}
+
+uint64_t TileScheduler::pack_range(uint32_t begin, uint32_t end)
+{
+    return static_cast<uint64_t>(end) << 32 | begin;
+}
+
+bool TileScheduler::pop_tile(int thread_index, int& tile_index)
+{
+    std::atomic<uint64_t>& thread_range = m_thread_ranges[thread_index].range;
+
+    uint64_t range = thread_range.load(std::memory_order_relaxed);
+    while (true)
+    {
+        uint32_t begin = static_cast<uint32_t>(range);
+        uint32_t end = static_cast<uint32_t>(range >> 32);
+        if (begin >= end)
+            return false;
+
+        // The tiles are taken from the front of the range by the owner thread and
+        // from the back by the thieves, the compare-and-swap fails if a thief got there first
+        if (thread_range.compare_exchange_weak(range, pack_range(begin + 1, end), std::memory_order_relaxed))
+        {
+            tile_index = begin;
+
+            return true;
+        }
+    }
+}
+
+bool TileScheduler::steal_tiles(int thread_index)
+{
+    while (true)
+    {
+        // Stealing from the thread that has the most tiles left, this
+        // keeps the number of steals (and the contention) low
+        int victim_index = -1;
+        uint64_t victim_range = 0;
+        uint32_t victim_tile_count = 0;
+        for (int i = 1; i < m_thread_count; i++)
+        {
+            int other_thread_index = (thread_index + i) % m_thread_count;
+
+            uint64_t range = m_thread_ranges[other_thread_index].range.load(std::memory_order_relaxed);
+            uint32_t begin = static_cast<uint32_t>(range);
+            uint32_t end = static_cast<uint32_t>(range >> 32);
+            if (end > begin && end - begin > victim_tile_count)
+            {
+                victim_index = other_thread_index;
+                victim_range = range;
+                victim_tile_count = end - begin;
+            }
+        }
+
+        if (victim_index == -1)
+            // Every thread is out of tiles
+            return false;
+
+        uint32_t begin = static_cast<uint32_t>(victim_range);
+        uint32_t end = static_cast<uint32_t>(victim_range >> 32);
+        // Taking the second half, rounded up so that the last tile of a thread can be stolen too
+        uint32_t middle = begin + victim_tile_count / 2;
+
+        if (m_thread_ranges[victim_index].range.compare_exchange_strong(victim_range, pack_range(begin, middle), std::memory_order_relaxed))
+        {
+            // Nobody else writes to the range of this thread while it is empty
+            m_thread_ranges[thread_index].range.store(pack_range(middle, end), std::memory_order_relaxed);
+
+            return true;
+        }
+
+        // The victim or another thief modified the range in the meantime, looking for a victim again
+    }
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#ifndef TILE_SCHEDULER_H
+#define TILE_SCHEDULER_H
+
+#include "HostDeviceCommon/Math.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+enum class TileOrder
+{
+    SCANLINE,
+    MORTON,
+    HILBERT
+};
+
+struct RenderTile
+{
+    // Bottom-left pixel of the tile
+    int2 origin;
+    // Smaller than the tile size for the tiles on the right and top borders of the image
+    int2 size;
+    // Index of the tile among all the tiles of the image, see TileScheduler::retire_tile()
+    int index;
+};
+
+/**
+ * Splits an image into tiles and hands them out to the threads of a
+ * render pass.
+ *
+ * The tiles are ordered along a space-filling curve and each thread starts
+ * with a contiguous range of that order so that the tiles rendered one after
+ * the other by a thread are next to each other in the image (and access
+ * the same parts of the scene). A thread that runs out of tiles steals the
+ * second half of the remaining tiles of another thread.
+ *
+ * The tiles that don't need to be rendered anymore (converged with the adaptive
+ * sampling) can be retired: they're left out of the next render passes
+ */
+class TileScheduler
+{
+public:
+    /**
+     * Splits the image in tiles of tile_size * tile_size pixels
+     * ordered along the given curve
+     */
+    void set_image(int2 resolution, int tile_size, TileOrder order);
+
+    /**
+     * Distributes the active tiles between 'thread_count' threads, after removing the tiles retired
+     * during the previous render pass. Must be called before each render pass, outside of the parallel region
+     */
+    void reset(int thread_count);
+
+    /**
+     * Returns false when there is no tile left to render, neither in the
+     * range of the thread nor in the range of any other thread. Thread safe,
+     * as long as each thread passes its own index
+     */
+    bool next_tile(int thread_index, RenderTile& tile);
+
+    /**
+     * Leaves the tile out of the next render passes, until the next call to set_image().
+     * Thread safe, as long as a tile is only retired by the thread that renders it
+     */
+    void retire_tile(int tile_index);
+
+    int get_tile_count() const;
+    // Number of tiles of the current render pass
+    int get_active_tile_count() const;
+    const RenderTile& get_tile(int tile_index) const;
+
+    static uint32_t morton_index(uint32_t x, uint32_t y);
+    /**
+     * Index of the cell (x, y) along the Hilbert curve
+     * covering a 'grid_size' * 'grid_size' grid (power of 2)
+     */
+    static uint32_t hilbert_index(uint32_t grid_size, uint32_t x, uint32_t y);
+
+private:
+    // Remaining tiles [begin, end[ of one thread, packed in 64 bits (begin in the lower 32 bits)
+    // so that the owner thread and the thieves can update them with a single compare-and-swap.
+    // Aligned on a cache line so that the threads don't write to the same cache line
+    struct alignas(64) ThreadRange
+    {
+        std::atomic<uint64_t> range;
+    };
+
+    static uint64_t pack_range(uint32_t begin, uint32_t end);
+
+    bool pop_tile(int thread_index, int& tile_index);
+    bool steal_tiles(int thread_index);
+
+    std::vector<RenderTile> m_tiles;
+    // Indices of the tiles that aren't retired, in the order of the curve
+    std::vector<int> m_active_tiles;
+    // One byte per tile so that the threads can retire their tiles concurrently
+    std::vector<unsigned char> m_tile_retired;
+
+    std::unique_ptr<ThreadRange[]> m_thread_ranges;
+    int m_thread_count = 0;
+};
+
+#endif
@@ -0,0 +1,505 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#include "Renderer/BVHConstants.h"
+#include "Renderer/TopLevelBVH.h"
+
+#include <algorithm>
+#include <bit>
+
+static bool is_identity(const float4x4& matrix)
+{
+    for (int column = 0; column < 4; column++)
+        for (int row = 0; row < 4; row++)
+            if (matrix.m[column][row] != (column == row ? 1.0f : 0.0f))
+                return false;
+
+    return true;
+}
+
+TopLevelBVH::TopLevelBVH(const std::vector<BVHInstance>& instances)
+{
+    std::vector<AABB> boxes;
+    std::vector<int> instance_order;
+
+    for (int instance_index = 0; instance_index < instances.size(); instance_index++)
+    {
+        const BVHInstance& bvh_instance = instances[instance_index];
+
+        AABB object_box = bvh_instance.blas->get_box();
+        if (object_box.is_empty())
+            // No geometry, the instance can never be hit
+            continue;
+
+        // World space box of the instance: box of the transformed corners of the object space box
+        AABB world_box;
+        for (int corner = 0; corner < 8; corner++)
+        {
+            float3 point = make_float3(corner & 1 ? object_box.m_max.x : object_box.m_min.x,
+                                       corner & 2 ? object_box.m_max.y : object_box.m_min.y,
+                                       corner & 4 ? object_box.m_max.z : object_box.m_min.z);
+
+            world_box.extend(matrix_X_point(bvh_instance.transform, point));
+        }
+
+        Instance instance;
+        instance.blas = bvh_instance.blas;
+        instance.primitive_indices = bvh_instance.primitive_indices;
+        instance.instance_index = instance_index;
+        instance.identity_transform = is_identity(bvh_instance.transform);
+        instance.world_to_object = bvh_instance.inverse_transform;
+        instance.normal_to_world = bvh_instance.normal_transform;
+
+        instance_order.push_back(m_instances.size());
+        m_instances.push_back(instance);
+        boxes.push_back(world_box);
+    }
+
+    if (m_instances.empty())
+        return;
+
+    build_recursive(instance_order, boxes, 0, m_instances.size());
+
+    // Reordering the instances so that each leaf references its instance directly
+    std::vector<Instance> ordered_instances(m_instances.size());
+    for (int i = 0; i < instance_order.size(); i++)
+        ordered_instances[i] = m_instances[instance_order[i]];
+    m_instances = std::move(ordered_instances);
+}
+
+/**
+ * Builds the node of the instances instance_order[first_instance] to
+ * instance_order[first_instance + instance_count - 1] by splitting them
+ * at the median along the largest axis of their centroids.
+ *
+ * There are few instances compared to the number of triangles of a scene so
+ * the quality of the top-level BVH matters less than that of the BLASes
+ * and a median split is enough. Returns the index of the node created
+ */
+int TopLevelBVH::build_recursive(std::vector<int>& instance_order, const std::vector<AABB>& boxes, int first_instance, int instance_count)
+{
+    int node_index = m_nodes.size();
+    m_nodes.emplace_back();
+
+    AABB box;
+    AABB centroids_box;
+    for (int i = first_instance; i < first_instance + instance_count; i++)
+    {
+        box.extend(boxes[instance_order[i]]);
+        centroids_box.extend(boxes[instance_order[i]].centroid());
+    }
+    m_nodes[node_index].box = box;
+
+    if (instance_count == 1)
+    {
+        m_nodes[node_index].offset = first_instance;
+        m_nodes[node_index].instance_count = 1;
+
+        return node_index;
+    }
+
+    int axis = centroids_box.largest_axis();
+    int half_count = instance_count / 2;
+    std::nth_element(instance_order.begin() + first_instance, instance_order.begin() + first_instance + half_count, instance_order.begin() + first_instance + instance_count, [&boxes, axis](int a, int b)
+    {
+        return float3_component(boxes[a].centroid(), axis) < float3_component(boxes[b].centroid(), axis);
+    });
+
+    // The first child is the next node (depth-first order), only the second one needs to be stored
+    build_recursive(instance_order, boxes, first_instance, half_count);
+    int second_child = build_recursive(instance_order, boxes, first_instance + half_count, instance_count - half_count);
+
+    m_nodes[node_index].offset = second_child;
+    m_nodes[node_index].instance_count = 0;
+
+    return node_index;
+}
+
+/**
+ * The BLAS reports its own primitive indices, the filter expects those of the scene
+ */
+BVHHitFilter TopLevelBVH::make_instance_filter(const Instance& instance, const BVHHitFilter& filter)
+{
+    return [&filter, &instance](int primitive_index, const float2& uv)
+    {
+        return filter((*instance.primitive_indices)[primitive_index], uv);
+    };
+}
+
+bool TopLevelBVH::intersect_box(const AABB& box, const float3& origin, const float3& inverse_direction, float t_max, float& t_near)
+{
+    float3 t_min_planes = (box.m_min - origin) * inverse_direction;
+    float3 t_max_planes = (box.m_max - origin) * inverse_direction;
+
+    float3 t_near_planes = hippt::min(t_min_planes, t_max_planes);
+    float3 t_far_planes = hippt::max(t_min_planes, t_max_planes);
+
+    t_near = hippt::max(0.0f, hippt::max(t_near_planes.x, hippt::max(t_near_planes.y, t_near_planes.z)));
+    float t_far = hippt::min(t_max, hippt::min(t_far_planes.x, hippt::min(t_far_planes.y, t_far_planes.z)));
+
+    return t_near <= t_far;
+}
+
+/**
+ * The direction is transformed but not normalized so that the
+ * distances along the ray are the same in world and object space
+ */
+hiprtRay TopLevelBVH::to_object_space(const Instance& instance, const hiprtRay& ray)
+{
+    if (instance.identity_transform)
+        return ray;
+
+    hiprtRay object_ray = ray;
+    object_ray.origin = matrix_X_point(instance.world_to_object, ray.origin);
+    object_ray.direction = matrix_X_vec(instance.world_to_object, ray.direction);
+
+    return object_ray;
+}
+
+static float3 compute_inverse_direction(const float3& direction)
+{
+    // Same as the BLASes, a very large but finite inverse for
+    // rays parallel to an axis keeps the slab test free of NaNs
+    return make_float3(1.0f / (direction.x == 0.0f ? 1.0e-20f : direction.x),
+                       1.0f / (direction.y == 0.0f ? 1.0e-20f : direction.y),
+                       1.0f / (direction.z == 0.0f ? 1.0e-20f : direction.z));
+}
+
+bool TopLevelBVH::intersect(const hiprtRay& ray, HitInfo& hit_info, const BVHHitFilter& filter) const
+{
+    struct StackEntry
+    {
+        int node_index;
+        float t_near;
+    };
+
+    if (m_nodes.empty())
+        return false;
+
+    float3 inverse_direction = compute_inverse_direction(ray.direction);
+
+    float closest_t = hit_info.t > 0.0f ? hit_info.t : INFINITY;
+    // Hit in the object space of closest_instance
+    HitInfo closest_hit;
+    const Instance* closest_instance = nullptr;
+
+    StackEntry stack[BVHConstants::TOP_LEVEL_BVH_MAX_STACK_SIZE];
+    int stack_size = 0;
+
+    float root_t_near;
+    if (!intersect_box(m_nodes[0].box, ray.origin, inverse_direction, closest_t, root_t_near))
+        return false;
+    stack[stack_size++] = { 0, root_t_near };
+
+    while (stack_size > 0)
+    {
+        StackEntry entry = stack[--stack_size];
+        if (entry.t_near > closest_t)
+            // An intersection closer than this node was found after the node was pushed
+            continue;
+
+        const Node& node = m_nodes[entry.node_index];
+        if (node.is_leaf())
+        {
+            for (int i = node.offset; i < node.offset + node.instance_count; i++)
+            {
+                const Instance& instance = m_instances[i];
+
+                HitInfo instance_hit;
+                // Only looking for hits closer than what we already have
+                instance_hit.t = closest_t;
+
+                bool instance_hit_found;
+                if (filter)
+                    instance_hit_found = instance.blas->intersect(to_object_space(instance, ray), instance_hit, make_instance_filter(instance, filter));
+                else
+                    instance_hit_found = instance.blas->intersect(to_object_space(instance, ray), instance_hit);
+
+                if (instance_hit_found && instance_hit.t < closest_t)
+                {
+                    closest_t = instance_hit.t;
+                    closest_hit = instance_hit;
+                    closest_instance = &instance;
+                }
+            }
+
+            continue;
+        }
+
+        int first_child = entry.node_index + 1;
+        int second_child = node.offset;
+
+        float t_near_first, t_near_second;
+        bool hit_first = intersect_box(m_nodes[first_child].box, ray.origin, inverse_direction, closest_t, t_near_first);
+        bool hit_second = intersect_box(m_nodes[second_child].box, ray.origin, inverse_direction, closest_t, t_near_second);
+
+        // Pushing the farthest child first so that the closest one is popped next
+        if (hit_first && hit_second && t_near_first < t_near_second)
+        {
+            stack[stack_size++] = { second_child, t_near_second };
+            stack[stack_size++] = { first_child, t_near_first };
+        }
+        else
+        {
+            if (hit_first)
+                stack[stack_size++] = { first_child, t_near_first };
+            if (hit_second)
+                stack[stack_size++] = { second_child, t_near_second };
+        }
+    }
+
+    if (closest_instance == nullptr)
+        return false;
+
+    hit_info = closest_hit;
+    hit_info.inter_point = ray.origin + ray.direction * closest_t;
+    if (!closest_instance->identity_transform)
+        hit_info.geometric_normal = hippt::normalize(matrix_X_vec(closest_instance->normal_to_world, closest_hit.geometric_normal));
+    hit_info.primitive_index = (*closest_instance->primitive_indices)[closest_hit.primitive_index];
+    hit_info.instance_index = closest_instance->instance_index;
+
+    return true;
+}
+
+bool TopLevelBVH::occluded(const hiprtRay& ray, float t_max, const BVHHitFilter& filter) const
+{
+    if (m_nodes.empty())
+        return false;
+
+    float3 inverse_direction = compute_inverse_direction(ray.direction);
+
+    int stack[BVHConstants::TOP_LEVEL_BVH_MAX_STACK_SIZE];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+
+    while (stack_size > 0)
+    {
+        int node_index = stack[--stack_size];
+        const Node& node = m_nodes[node_index];
+
+        float t_near;
+        if (!intersect_box(node.box, ray.origin, inverse_direction, t_max, t_near))
+            continue;
+
+        if (!node.is_leaf())
+        {
+            // Any-hit, the order doesn't matter
+            stack[stack_size++] = node_index + 1;
+            stack[stack_size++] = node.offset;
+
+            continue;
+        }
+
+        for (int i = node.offset; i < node.offset + node.instance_count; i++)
+        {
+            const Instance& instance = m_instances[i];
+
+            bool instance_occluded;
+            if (filter)
+                instance_occluded = instance.blas->occluded(to_object_space(instance, ray), t_max, make_instance_filter(instance, filter));
+            else
+                instance_occluded = instance.blas->occluded(to_object_space(instance, ray), t_max);
+
+            if (instance_occluded)
+                return true;
+        }
+    }
+
+    return false;
+}
+
+unsigned int TopLevelBVH::intersect_box_packet(const AABB& box, const RayPacket& packet, const float3* inverse_directions, const float* t_max, unsigned int ray_mask)
+{
+    unsigned int hit_mask = 0;
+    for (unsigned int mask = ray_mask; mask != 0; mask &= mask - 1)
+    {
+        int ray_index = std::countr_zero(mask);
+
+        float t_near;
+        if (intersect_box(box, packet.rays[ray_index].origin, inverse_directions[ray_index], t_max[ray_index], t_near))
+            hit_mask |= 1u << ray_index;
+    }
+
+    return hit_mask;
+}
+
+unsigned int TopLevelBVH::intersect_packet(const RayPacket& packet, HitInfo* hit_infos, const BVHHitFilter& filter) const
+{
+    struct StackEntry
+    {
+        int node_index;
+        unsigned int ray_mask;
+    };
+
+    if (m_nodes.empty() || packet.count == 0)
+        return 0;
+
+    float3 inverse_directions[BVHConstants::RAY_PACKET_SIZE];
+    float closest_t[BVHConstants::RAY_PACKET_SIZE];
+    // Hits in the object space of closest_instances
+    HitInfo closest_hits[BVHConstants::RAY_PACKET_SIZE];
+    const Instance* closest_instances[BVHConstants::RAY_PACKET_SIZE];
+    for (int ray_index = 0; ray_index < packet.count; ray_index++)
+    {
+        inverse_directions[ray_index] = compute_inverse_direction(packet.rays[ray_index].direction);
+        closest_t[ray_index] = packet.t_max[ray_index];
+        closest_instances[ray_index] = nullptr;
+    }
+
+    StackEntry stack[BVHConstants::TOP_LEVEL_BVH_MAX_STACK_SIZE];
+    int stack_size = 0;
+    stack[stack_size++] = { 0, packet.get_ray_mask() };
+
+    while (stack_size > 0)
+    {
+        StackEntry entry = stack[--stack_size];
+
+        const Node& node = m_nodes[entry.node_index];
+        unsigned int ray_mask = intersect_box_packet(node.box, packet, inverse_directions, closest_t, entry.ray_mask);
+        if (ray_mask == 0)
+            continue;
+
+        if (!node.is_leaf())
+        {
+            stack[stack_size++] = { node.offset, ray_mask };
+            stack[stack_size++] = { entry.node_index + 1, ray_mask };
+
+            continue;
+        }
+
+        for (int i = node.offset; i < node.offset + node.instance_count; i++)
+        {
+            const Instance& instance = m_instances[i];
+
+            // Packet of the rays that reach the instance, in its object space
+            RayPacket object_packet;
+            int packet_ray_indices[BVHConstants::RAY_PACKET_SIZE];
+            for (unsigned int mask = ray_mask; mask != 0; mask &= mask - 1)
+            {
+                int ray_index = std::countr_zero(mask);
+
+                packet_ray_indices[object_packet.count] = ray_index;
+                // Only looking for hits closer than what we already have
+                object_packet.add_ray(to_object_space(instance, packet.rays[ray_index]), closest_t[ray_index]);
+            }
+
+            HitInfo instance_hits[BVHConstants::RAY_PACKET_SIZE];
+            unsigned int instance_hit_mask;
+            if (filter)
+                instance_hit_mask = instance.blas->intersect_packet(object_packet, instance_hits, make_instance_filter(instance, filter));
+            else
+                instance_hit_mask = instance.blas->intersect_packet(object_packet, instance_hits);
+
+            for (unsigned int mask = instance_hit_mask; mask != 0; mask &= mask - 1)
+            {
+                int object_ray_index = std::countr_zero(mask);
+                int ray_index = packet_ray_indices[object_ray_index];
+                if (instance_hits[object_ray_index].t < closest_t[ray_index])
+                {
+                    closest_t[ray_index] = instance_hits[object_ray_index].t;
+                    closest_hits[ray_index] = instance_hits[object_ray_index];
+                    closest_instances[ray_index] = &instance;
+                }
+            }
+        }
+    }
+
+    unsigned int packet_hit_mask = 0;
+    for (int ray_index = 0; ray_index < packet.count; ray_index++)
+    {
+        const Instance* closest_instance = closest_instances[ray_index];
+        if (closest_instance == nullptr)
+            continue;
+
+        const hiprtRay& ray = packet.rays[ray_index];
+        HitInfo& hit_info = hit_infos[ray_index];
+        hit_info = closest_hits[ray_index];
+        hit_info.inter_point = ray.origin + ray.direction * closest_t[ray_index];
+        if (!closest_instance->identity_transform)
+            hit_info.geometric_normal = hippt::normalize(matrix_X_vec(closest_instance->normal_to_world, closest_hits[ray_index].geometric_normal));
+        hit_info.primitive_index = (*closest_instance->primitive_indices)[closest_hits[ray_index].primitive_index];
+        hit_info.instance_index = closest_instance->instance_index;
+
+        packet_hit_mask |= 1u << ray_index;
+    }
+
+    return packet_hit_mask;
+}
+
+unsigned int TopLevelBVH::occluded_packet(const RayPacket& packet, const BVHHitFilter& filter) const
+{
+    struct StackEntry
+    {
+        int node_index;
+        unsigned int ray_mask;
+    };
+
+    if (m_nodes.empty() || packet.count == 0)
+        return 0;
+
+    float3 inverse_directions[BVHConstants::RAY_PACKET_SIZE];
+    for (int ray_index = 0; ray_index < packet.count; ray_index++)
+        inverse_directions[ray_index] = compute_inverse_direction(packet.rays[ray_index].direction);
+
+    unsigned int unoccluded_mask = packet.get_ray_mask();
+
+    StackEntry stack[BVHConstants::TOP_LEVEL_BVH_MAX_STACK_SIZE];
+    int stack_size = 0;
+    stack[stack_size++] = { 0, unoccluded_mask };
+
+    while (stack_size > 0 && unoccluded_mask != 0)
+    {
+        StackEntry entry = stack[--stack_size];
+
+        const Node& node = m_nodes[entry.node_index];
+        unsigned int ray_mask = intersect_box_packet(node.box, packet, inverse_directions, packet.t_max, entry.ray_mask & unoccluded_mask);
+        if (ray_mask == 0)
+            continue;
+
+        if (!node.is_leaf())
+        {
+            stack[stack_size++] = { node.offset, ray_mask };
+            stack[stack_size++] = { entry.node_index + 1, ray_mask };
+
+            continue;
+        }
+
+        for (int i = node.offset; i < node.offset + node.instance_count && ray_mask != 0; i++)
+        {
+            const Instance& instance = m_instances[i];
+
+            RayPacket object_packet;
+            int packet_ray_indices[BVHConstants::RAY_PACKET_SIZE];
+            for (unsigned int mask = ray_mask; mask != 0; mask &= mask - 1)
+            {
+                int ray_index = std::countr_zero(mask);
+
+                packet_ray_indices[object_packet.count] = ray_index;
+                object_packet.add_ray(to_object_space(instance, packet.rays[ray_index]), packet.t_max[ray_index]);
+            }
+
+            unsigned int instance_occluded_mask;
+            if (filter)
+                instance_occluded_mask = instance.blas->occluded_packet(object_packet, make_instance_filter(instance, filter));
+            else
+                instance_occluded_mask = instance.blas->occluded_packet(object_packet);
+
+            for (unsigned int mask = instance_occluded_mask; mask != 0; mask &= mask - 1)
+            {
+                int ray_index = packet_ray_indices[std::countr_zero(mask)];
+
+                unoccluded_mask &= ~(1u << ray_index);
+                ray_mask &= ~(1u << ray_index);
+            }
+        }
+    }
+
+    return packet.get_ray_mask() & ~unoccluded_mask;
+}
+
+int TopLevelBVH::get_instance_count() const
+{
+    return m_instances.size();
+}
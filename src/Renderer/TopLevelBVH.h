@@ -0,0 +1,121 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#ifndef TOP_LEVEL_BVH_H
+#define TOP_LEVEL_BVH_H
+
+#include "HostDeviceCommon/HitInfo.h"
+#include "HostDeviceCommon/Math.h"
+#include "Renderer/AABB.h"
+#include "Renderer/BVH.h"
+
+#include <vector>
+
+#include <hiprt/hiprt_types.h> // for hiprtRay
+
+/**
+ * One instance of a bottom-level BVH (BLAS) in a TopLevelBVH
+ */
+struct BVHInstance
+{
+    // Not owned, shared by all the instances of the same geometry
+    const BVH* blas = nullptr;
+    // Maps the primitive indices returned by the BLAS (indices in the triangles
+    // the BLAS was built from) to the primitive indices of the scene.
+    // Not owned, shared by all the instances of the BLAS
+    const std::vector<int>* primitive_indices = nullptr;
+
+    // Object space to world space
+    float4x4 transform;
+    float4x4 inverse_transform;
+    // Inverse transpose of the linear part of the transform
+    float4x4 normal_transform;
+};
+
+/**
+ * Two-level acceleration structure used for the traversal on the CPU.
+ *
+ * Each unique geometry of the scene has its own BVH (the bottom-level BVH,
+ * in object space) and the top-level BVH is a BVH over the world space boxes
+ * of the instances of these BLASes. A ray reaching an instance is brought to
+ * the object space of the instance and traverses the BLAS.
+ *
+ * The memory used by the geometry and the BLASes thus only depends on the unique
+ * geometry of the scene, not on the number of instances.
+ *
+ * The hits are returned in world space, with the primitive index of the scene
+ * and the index of the instance hit
+ */
+class TopLevelBVH
+{
+public:
+    TopLevelBVH() {}
+    TopLevelBVH(const std::vector<BVHInstance>& instances);
+
+    bool intersect(const hiprtRay& ray, HitInfo& hit_info, const BVHHitFilter& filter = nullptr) const;
+    /**
+     * Same as BVH::occluded(). The filter receives the primitive indices of the scene
+     */
+    bool occluded(const hiprtRay& ray, float t_max, const BVHHitFilter& filter = nullptr) const;
+    /**
+     * Same as BVH::intersect_packet(). The rays of the packet that reach an instance
+     * are brought to its object space together and traverse its BLAS as a packet
+     */
+    unsigned int intersect_packet(const RayPacket& packet, HitInfo* hit_infos, const BVHHitFilter& filter = nullptr) const;
+    /**
+     * Same as BVH::occluded_packet()
+     */
+    unsigned int occluded_packet(const RayPacket& packet, const BVHHitFilter& filter = nullptr) const;
+
+    int get_instance_count() const;
+
+private:
+    struct Node
+    {
+        bool is_leaf() const
+        {
+            return instance_count > 0;
+        }
+
+        AABB box;
+
+        // Same layout as FlattenedBVH::FlattenedNode: the first child of an interior
+        // node is the next node, 'offset' is the index of the second child or the index
+        // of the first instance of the leaf in m_instances
+        int offset;
+        int instance_count;
+    };
+
+    struct Instance
+    {
+        const BVH* blas;
+        const std::vector<int>* primitive_indices;
+        // Index of the instance in the array given to the constructor,
+        // this is the instance index of the hits
+        int instance_index;
+
+        // Most scenes have a lot of instances that aren't transformed (everything
+        // that was in the root node of the scene file). The rays are not
+        // transformed for these
+        bool identity_transform;
+        float4x4 world_to_object;
+        float4x4 normal_to_world;
+    };
+
+    int build_recursive(std::vector<int>& instance_order, const std::vector<AABB>& boxes, int first_instance, int instance_count);
+
+    /**
+     * Mask of the rays of 'ray_mask' that hit the box before their t_max
+     */
+    static unsigned int intersect_box_packet(const AABB& box, const RayPacket& packet, const float3* inverse_directions, const float* t_max, unsigned int ray_mask);
+    static bool intersect_box(const AABB& box, const float3& origin, const float3& inverse_direction, float t_max, float& t_near);
+    static hiprtRay to_object_space(const Instance& instance, const hiprtRay& ray);
+    static BVHHitFilter make_instance_filter(const Instance& instance, const BVHHitFilter& filter);
+
+    std::vector<Node> m_nodes;
+    std::vector<Instance> m_instances;
+};
+
+#endif
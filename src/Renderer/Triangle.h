@@ -18,6 +18,28 @@ struct Triangle
 
 	//From https://en.wikipedia.org/wiki/M%C3%B6ller%E2%80%93Trumbore_intersection_algorithm
 	inline bool intersect(const hiprtRay& ray, HitInfo& hit_info) const
+	{
+		float t;
+		float2 uv;
+		if (!intersect_t_uv(ray, t, uv))
+			return false;
+
+		hit_info.inter_point = ray.origin + ray.direction * t;
+		hit_info.geometric_normal = hippt::normalize(hippt::cross(m_b - m_a, m_c - m_a));
+
+		hit_info.t = t;
+
+		hit_info.uv = uv;
+
+		return true;
+	}
+
+	/**
+	 * Same as intersect() but only computes the distance and the barycentric
+	 * coordinates of the intersection. Used by the occlusion queries that
+	 * do not need the rest of the hit attributes
+	 */
+	inline bool intersect_t_uv(const hiprtRay& ray, float& out_t, float2& out_uv) const
 	{
 		const float EPSILON = 0.0000001f;
 		float3 edge1, edge2, h, s, q;
@@ -49,12 +71,8 @@ struct Triangle
 
 		if (t > EPSILON) // ray intersection
 		{
-			hit_info.inter_point = ray.origin + ray.direction * t;
-			hit_info.geometric_normal = hippt::normalize(hippt::cross(edge1, edge2));
-
-			hit_info.t = t;
-
-			hit_info.uv = make_float2(u, v);
+			out_t = t;
+			out_uv = make_float2(u, v);
 
 			return true;
 		}
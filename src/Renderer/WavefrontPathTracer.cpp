@@ -0,0 +1,705 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#include "Device/kernels/PathTracerKernel.h"
+#include "Renderer/BSDFBatch.h"
+#include "Renderer/WavefrontPathTracer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <omp.h>
+
+// Number of consecutive paths of the queue whose BSDFs are sampled as one batch
+static constexpr int BSDF_SAMPLE_BATCH_SIZE = 64;
+
+static double seconds_since(std::chrono::high_resolution_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+/**
+ * Inserts two zeros between each of the 10 lower bits of 'value'
+ */
+static uint32_t spread_bits_3D(uint32_t value)
+{
+    value &= 0x000003ff;
+    value = (value | (value << 16)) & 0x030000ff;
+    value = (value | (value << 8)) & 0x0300f00f;
+    value = (value | (value << 4)) & 0x030c30c3;
+    value = (value | (value << 2)) & 0x09249249;
+
+    return value;
+}
+
+/**
+ * Inserts a zero between each of the 16 lower bits of 'value'
+ */
+static uint32_t spread_bits_2D(uint32_t value)
+{
+    value &= 0x0000ffff;
+    value = (value | (value << 8)) & 0x00ff00ff;
+    value = (value | (value << 4)) & 0x0f0f0f0f;
+    value = (value | (value << 2)) & 0x33333333;
+    value = (value | (value << 1)) & 0x55555555;
+
+    return value;
+}
+
+/**
+ * Quantizes 'value' in [0, 1] on 'bit_count' bits
+ */
+static uint32_t quantize(float value, int bit_count)
+{
+    float max_value = static_cast<float>((1 << bit_count) - 1);
+
+    return static_cast<uint32_t>(hippt::clamp(0.0f, max_value, value * max_value));
+}
+
+/**
+ * Octahedral mapping of the direction to [0, 1]^2, the neighbouring
+ * directions of the sphere are neighbours in the square
+ */
+static float2 octahedral_encode(const float3& direction)
+{
+    float inverse_norm = 1.0f / (std::abs(direction.x) + std::abs(direction.y) + std::abs(direction.z));
+    float2 octahedron = make_float2(direction.x * inverse_norm, direction.y * inverse_norm);
+    if (direction.z < 0.0f)
+    {
+        // Folding the lower hemisphere onto the corners of the square
+        float2 folded = make_float2((1.0f - std::abs(octahedron.y)) * (octahedron.x < 0.0f ? -1.0f : 1.0f),
+                                    (1.0f - std::abs(octahedron.x)) * (octahedron.y < 0.0f ? -1.0f : 1.0f));
+        octahedron = folded;
+    }
+
+    return make_float2(octahedron.x * 0.5f + 0.5f, octahedron.y * 0.5f + 0.5f);
+}
+
+void WavefrontPathTracer::render_frame(const HIPRTRenderData& render_data, const HIPRTCamera& camera, int2 resolution, int wavefront_size, const WavefrontSortingOptions& sorting_options)
+{
+    int pixel_count = resolution.x * resolution.y;
+    wavefront_size = std::min(wavefront_size, pixel_count);
+    resize(pixel_count, wavefront_size);
+
+#pragma omp parallel
+    {
+        ThreadConvergenceFlags convergence_flags;
+        HIPRTRenderData thread_render_data = convergence_flags.get_render_data(render_data);
+
+#pragma omp for schedule(static)
+        for (int pixel_index = 0; pixel_index < pixel_count; pixel_index++)
+        {
+            m_pixel_sampling_needed[pixel_index] = prepare_pixel_sampling(thread_render_data, pixel_index);
+            m_pixel_valid[pixel_index] = true;
+            m_pixel_samplers[pixel_index] = get_pixel_sampler(render_data, pixel_index % resolution.x, pixel_index / resolution.x, pixel_index);
+            m_pixel_colors[pixel_index] = ColorRGB(0.0f);
+            m_pixel_squared_luminances[pixel_index] = 0.0f;
+            m_pixel_albedos[pixel_index] = ColorRGB(0.0f);
+            m_pixel_normals[pixel_index] = make_float3(0.0f, 0.0f, 0.0f);
+        }
+
+        convergence_flags.reduce(render_data);
+    }
+
+    for (int sample = 0; sample < render_data.render_settings.samples_per_frame; sample++)
+    {
+        for (int first_pixel = 0; first_pixel < pixel_count; first_pixel += wavefront_size)
+        {
+            int batch_pixel_count = std::min(wavefront_size, pixel_count - first_pixel);
+
+            generate_camera_rays(render_data, camera, resolution, first_pixel, batch_pixel_count, sample);
+            // The bounce nb_bounces is the last ray of the paths, see is_last_ray_needed()
+            for (int bounce = 0; bounce <= render_data.render_settings.nb_bounces && m_active_path_count > 0; bounce++)
+            {
+                if (bounce > 0 && sorting_options.sort_rays)
+                {
+                    auto start = std::chrono::high_resolution_clock::now();
+                    sort_rays();
+                    m_stage_times.ray_sort_seconds += seconds_since(start);
+                }
+
+                auto start = std::chrono::high_resolution_clock::now();
+                intersect_stage(render_data, bounce);
+                m_stage_times.intersect_seconds += seconds_since(start);
+
+                if (bounce > 0 && sorting_options.sort_hits)
+                {
+                    start = std::chrono::high_resolution_clock::now();
+                    sort_hits(render_data);
+                    m_stage_times.hit_sort_seconds += seconds_since(start);
+                }
+
+                start = std::chrono::high_resolution_clock::now();
+                bsdf_sample_stage(render_data, bounce);
+                m_stage_times.bsdf_sample_seconds += seconds_since(start);
+
+                start = std::chrono::high_resolution_clock::now();
+                shade_stage(render_data, bounce, sample);
+                m_stage_times.shade_seconds += seconds_since(start);
+
+                start = std::chrono::high_resolution_clock::now();
+                shadow_ray_stage(render_data, bounce);
+                m_stage_times.shadow_ray_seconds += seconds_since(start);
+
+                compact_active_paths();
+            }
+            finish_paths(render_data, resolution, first_pixel, batch_pixel_count, sample);
+        }
+    }
+
+#pragma omp parallel
+    {
+        ThreadConvergenceFlags convergence_flags;
+        HIPRTRenderData thread_render_data = convergence_flags.get_render_data(render_data);
+
+#pragma omp for schedule(static)
+        for (int pixel_index = 0; pixel_index < pixel_count; pixel_index++)
+        {
+            if (!m_pixel_sampling_needed[pixel_index] || !m_pixel_valid[pixel_index])
+                continue;
+
+            accumulate_pixel_samples(thread_render_data, pixel_index, m_pixel_colors[pixel_index], m_pixel_squared_luminances[pixel_index], m_pixel_albedos[pixel_index], m_pixel_normals[pixel_index]);
+        }
+
+        convergence_flags.reduce(render_data);
+    }
+}
+
+const WavefrontRayCounts& WavefrontPathTracer::get_ray_counts() const
+{
+    return m_ray_counts;
+}
+
+const WavefrontStageTimes& WavefrontPathTracer::get_stage_times() const
+{
+    return m_stage_times;
+}
+
+void WavefrontPathTracer::resize(int pixel_count, int wavefront_size)
+{
+    if (m_ray_origins.size() != wavefront_size)
+    {
+        m_ray_origins.resize(wavefront_size);
+        m_ray_directions.resize(wavefront_size);
+        m_throughputs.resize(wavefront_size);
+        m_radiances.resize(wavefront_size);
+        m_volume_states.resize(wavefront_size);
+        m_mis_states.resize(wavefront_size);
+        m_hits.resize(wavefront_size);
+        m_materials.resize(wavefront_size);
+        m_hit_found.resize(wavefront_size);
+        m_next_ray_traced.resize(wavefront_size);
+        m_bsdf_samples.resize(wavefront_size);
+        m_light_shadow_rays.resize(wavefront_size);
+        m_envmap_shadow_rays.resize(wavefront_size);
+        m_shading_throughputs.resize(wavefront_size);
+        m_path_active.resize(wavefront_size);
+        m_active_paths.resize(wavefront_size);
+        m_compacted_active_paths.resize(wavefront_size);
+        m_sort_keys.resize(wavefront_size);
+        m_sorted_keys.resize(wavefront_size);
+        m_batch_paths.resize(wavefront_size);
+        m_batch_materials.resize(wavefront_size);
+        m_batch_volume_states.resize(wavefront_size);
+        m_batch_view_directions.resize(wavefront_size);
+        m_batch_shading_normals.resize(wavefront_size);
+        m_batch_geometric_normals.resize(wavefront_size);
+        m_batch_samplers.resize(wavefront_size);
+        m_batch_directions.resize(wavefront_size);
+        m_batch_colors.resize(wavefront_size);
+        m_batch_pdfs.resize(wavefront_size);
+    }
+
+    if (m_pixel_sampling_needed.size() != pixel_count)
+    {
+        m_pixel_sampling_needed.resize(pixel_count);
+        m_pixel_valid.resize(pixel_count);
+        m_pixel_samplers.resize(pixel_count);
+        m_pixel_colors.resize(pixel_count);
+        m_pixel_squared_luminances.resize(pixel_count);
+        m_pixel_albedos.resize(pixel_count);
+        m_pixel_normals.resize(pixel_count);
+    }
+}
+
+void WavefrontPathTracer::generate_camera_rays(const HIPRTRenderData& render_data, const HIPRTCamera& camera, int2 resolution, int first_pixel, int pixel_count, int sample)
+{
+    m_batch_first_pixel = first_pixel;
+
+#pragma omp parallel for schedule(static)
+    for (int path_index = 0; path_index < pixel_count; path_index++)
+    {
+        int pixel_index = first_pixel + path_index;
+
+        m_radiances[path_index] = ColorRGB(0.0f);
+        m_path_active[path_index] = m_pixel_sampling_needed[pixel_index];
+        if (!m_path_active[path_index])
+            continue;
+
+        int x = pixel_index % resolution.x;
+        int y = pixel_index / resolution.x;
+
+        Sampler& random_number_generator = m_pixel_samplers[pixel_index];
+        start_pixel_sample(render_data, sample, random_number_generator);
+
+        HIPRTCamera path_camera = camera;
+        hiprtRay ray = get_jittered_camera_ray(path_camera, x, y, resolution, random_number_generator);
+
+        m_ray_origins[path_index] = ray.origin;
+        m_ray_directions[path_index] = ray.direction;
+        m_throughputs[path_index] = ColorRGB(1.0f);
+        m_volume_states[path_index] = RayVolumeState();
+        m_mis_states[path_index] = RayMISState();
+        m_next_ray_traced[path_index] = false;
+    }
+
+    // The queue starts with all the pixels of the batch that need to be sampled
+    for (int path_index = 0; path_index < pixel_count; path_index++)
+        m_active_paths[path_index] = path_index;
+    m_active_path_count = pixel_count;
+    compact_active_paths();
+}
+
+void WavefrontPathTracer::intersect_stage(const HIPRTRenderData& render_data, int bounce)
+{
+    if (bounce == 0)
+    {
+        // The camera rays of neighbouring paths of the queue (neighbouring pixels) are coherent,
+        // they're traced in packets. The paths only go through the scene again on their own if
+        // they hit a volume boundary
+#pragma omp parallel for schedule(dynamic, 4)
+        for (int first_queue_index = 0; first_queue_index < m_active_path_count; first_queue_index += BVHConstants::RAY_PACKET_SIZE)
+        {
+            int queue_end = std::min(first_queue_index + BVHConstants::RAY_PACKET_SIZE, m_active_path_count);
+
+            RayPacket camera_rays;
+            for (int queue_index = first_queue_index; queue_index < queue_end; queue_index++)
+            {
+                int path_index = m_active_paths[queue_index];
+
+                hiprtRay ray;
+                ray.origin = m_ray_origins[path_index];
+                ray.direction = m_ray_directions[path_index];
+                camera_rays.add_ray(ray);
+            }
+
+            hiprtHit camera_ray_hits[BVHConstants::RAY_PACKET_SIZE];
+            intersect_scene_cpu_packet(render_data, camera_rays, camera_ray_hits);
+
+            for (int queue_index = first_queue_index; queue_index < queue_end; queue_index++)
+                intersect_path(render_data, m_active_paths[queue_index], &camera_ray_hits[queue_index - first_queue_index]);
+        }
+    }
+    else
+    {
+#pragma omp parallel for schedule(dynamic, 64)
+        for (int queue_index = 0; queue_index < m_active_path_count; queue_index++)
+            intersect_path(render_data, m_active_paths[queue_index]);
+    }
+
+    m_ray_counts.closest_hit_rays += m_active_path_count;
+}
+
+void WavefrontPathTracer::intersect_path(const HIPRTRenderData& render_data, int path_index, const hiprtHit* first_hit)
+{
+    if (m_next_ray_traced[path_index])
+    {
+        // Already traced by the shading of the previous bounce
+        m_next_ray_traced[path_index] = false;
+
+        return;
+    }
+
+    hiprtRay ray;
+    ray.origin = m_ray_origins[path_index];
+    ray.direction = m_ray_directions[path_index];
+
+    RayPayload ray_payload;
+    ray_payload.volume_state = m_volume_states[path_index];
+
+    m_hit_found[path_index] = trace_ray(render_data, ray, ray_payload, m_hits[path_index], first_hit);
+    m_materials[path_index] = ray_payload.material;
+    m_volume_states[path_index] = ray_payload.volume_state;
+}
+
+void WavefrontPathTracer::bsdf_sample_stage(const HIPRTRenderData& render_data, int bounce)
+{
+    if (bounce == render_data.render_settings.nb_bounces)
+        // Last ray of the paths, only traced for its emission
+        return;
+
+    int batch_count = (m_active_path_count + BSDF_SAMPLE_BATCH_SIZE - 1) / BSDF_SAMPLE_BATCH_SIZE;
+#pragma omp parallel for schedule(dynamic)
+    for (int batch_index = 0; batch_index < batch_count; batch_index++)
+    {
+        int first_queue_index = batch_index * BSDF_SAMPLE_BATCH_SIZE;
+        int queue_end = std::min(first_queue_index + BSDF_SAMPLE_BATCH_SIZE, m_active_path_count);
+
+        int hit_count = 0;
+        for (int queue_index = first_queue_index; queue_index < queue_end; queue_index++)
+        {
+            int path_index = m_active_paths[queue_index];
+            if (!m_hit_found[path_index])
+                continue;
+
+            hiprtRay ray;
+            ray.origin = m_ray_origins[path_index];
+            ray.direction = m_ray_directions[path_index];
+            // The normals that shade_hit() would sample the BSDF with
+            face_emissive_hit_normals(ray, m_materials[path_index], m_hits[path_index]);
+
+            int batch_hit = first_queue_index + hit_count++;
+            m_batch_paths[batch_hit] = path_index;
+            m_batch_materials[batch_hit] = m_materials[path_index];
+            m_batch_volume_states[batch_hit] = m_volume_states[path_index];
+            m_batch_view_directions[batch_hit] = -ray.direction;
+            m_batch_shading_normals[batch_hit] = m_hits[path_index].shading_normal;
+            m_batch_geometric_normals[batch_hit] = m_hits[path_index].geometric_normal;
+            m_batch_samplers[batch_hit] = m_pixel_samplers[m_batch_first_pixel + path_index];
+        }
+
+        BSDFBatch batch;
+        batch.count = hit_count;
+        batch.materials = m_batch_materials.data() + first_queue_index;
+        batch.ray_volume_states = m_batch_volume_states.data() + first_queue_index;
+        batch.view_directions = m_batch_view_directions.data() + first_queue_index;
+        batch.shading_normals = m_batch_shading_normals.data() + first_queue_index;
+        batch.geometric_normals = m_batch_geometric_normals.data() + first_queue_index;
+        batch.samplers = m_batch_samplers.data() + first_queue_index;
+        batch.to_light_directions = m_batch_directions.data() + first_queue_index;
+        batch.colors = m_batch_colors.data() + first_queue_index;
+        batch.pdfs = m_batch_pdfs.data() + first_queue_index;
+        bsdf_dispatcher_sample_batch(render_data.buffers.materials_buffer, batch);
+
+        for (int batch_hit = first_queue_index; batch_hit < first_queue_index + hit_count; batch_hit++)
+        {
+            int path_index = m_batch_paths[batch_hit];
+
+            m_bsdf_samples[path_index].color = m_batch_colors[batch_hit];
+            m_bsdf_samples[path_index].direction = m_batch_directions[batch_hit];
+            m_bsdf_samples[path_index].pdf = m_batch_pdfs[batch_hit];
+            m_volume_states[path_index] = m_batch_volume_states[batch_hit];
+            m_pixel_samplers[m_batch_first_pixel + path_index] = m_batch_samplers[batch_hit];
+        }
+    }
+}
+
+void WavefrontPathTracer::shade_stage(const HIPRTRenderData& render_data, int bounce, int sample)
+{
+#pragma omp parallel for schedule(dynamic, 64)
+    for (int queue_index = 0; queue_index < m_active_path_count; queue_index++)
+    {
+        int path_index = m_active_paths[queue_index];
+        // The paths of a batch are indexed like its pixels
+        int pixel_index = m_batch_first_pixel + path_index;
+
+        hiprtRay ray;
+        ray.origin = m_ray_origins[path_index];
+        ray.direction = m_ray_directions[path_index];
+
+        RayPayload ray_payload;
+        ray_payload.throughput = m_throughputs[path_index];
+        ray_payload.ray_color = m_radiances[path_index];
+        ray_payload.material = m_materials[path_index];
+        ray_payload.volume_state = m_volume_states[path_index];
+        ray_payload.mis_state = m_mis_states[path_index];
+        ray_payload.restir_di_pixel_index = bounce == 0 ? restir_di_pixel_index(render_data, pixel_index, sample) : -1;
+
+        m_light_shadow_rays[path_index].count = 0;
+        m_envmap_shadow_rays[path_index].count = 0;
+
+        if (!m_hit_found[path_index])
+        {
+            shade_miss(render_data, ray, ray_payload, bounce);
+
+            m_radiances[path_index] = ray_payload.ray_color;
+            m_path_active[path_index] = false;
+
+            continue;
+        }
+
+        if (bounce == 0)
+        {
+            m_pixel_normals[pixel_index] += m_hits[path_index].shading_normal;
+            m_pixel_albedos[pixel_index] += ray_payload.material.base_color;
+        }
+
+        m_shading_throughputs[path_index] = ray_payload.throughput;
+
+        // The BSDF sample isn't used at the last bounce, the BSDF sampling stage skipped it
+        bool path_continues = shade_hit(render_data, ray, ray_payload, m_hits[path_index], bounce, m_pixel_samplers[pixel_index], &m_light_shadow_rays[path_index], &m_envmap_shadow_rays[path_index], &m_bsdf_samples[path_index]);
+
+        // The shadow rays of the hit are traced even if the path stops here
+        m_radiances[path_index] = ray_payload.ray_color;
+        if (!path_continues)
+        {
+            m_path_active[path_index] = false;
+
+            continue;
+        }
+
+        m_ray_origins[path_index] = ray.origin;
+        m_ray_directions[path_index] = ray.direction;
+        m_throughputs[path_index] = ray_payload.throughput;
+        m_volume_states[path_index] = ray_payload.volume_state;
+        m_mis_states[path_index] = ray_payload.mis_state;
+        if (ray_payload.next_ray_traced)
+        {
+            // m_hits[path_index] was overwritten with the hit of the next ray by shade_hit()
+            m_next_ray_traced[path_index] = true;
+            m_hit_found[path_index] = ray_payload.next_ray_hit_found;
+            m_materials[path_index] = ray_payload.material;
+        }
+    }
+}
+
+void WavefrontPathTracer::shadow_ray_stage(const HIPRTRenderData& render_data, int bounce)
+{
+    std::atomic<uint64_t> shadow_ray_count = 0;
+
+    // The shadow rays of neighbouring paths of the queue are traced in packets: they're coherent
+    // if they go towards the same light from neighbouring hits (camera rays of neighbouring
+    // pixels or secondary rays sorted by origin and direction). The BVH traces the rays of the
+    // packets that are not coherent one by one
+#pragma omp parallel for schedule(dynamic, 4)
+    for (int first_queue_index = 0; first_queue_index < m_active_path_count; first_queue_index += BVHConstants::RAY_PACKET_SIZE)
+    {
+        int queue_end = std::min(first_queue_index + BVHConstants::RAY_PACKET_SIZE, m_active_path_count);
+
+        ColorRGB light_sample_radiances[BVHConstants::RAY_PACKET_SIZE];
+        ColorRGB envmap_radiances[BVHConstants::RAY_PACKET_SIZE];
+
+        ShadowRayPacketBatch light_shadow_ray_batch;
+        ShadowRayPacketBatch envmap_shadow_ray_batch;
+        for (int queue_index = first_queue_index; queue_index < queue_end; queue_index++)
+        {
+            int path_index = m_active_paths[queue_index];
+
+            light_shadow_ray_batch.add(render_data, m_light_shadow_rays[path_index], &light_sample_radiances[queue_index - first_queue_index]);
+            envmap_shadow_ray_batch.add(render_data, m_envmap_shadow_rays[path_index], &envmap_radiances[queue_index - first_queue_index]);
+        }
+        light_shadow_ray_batch.flush(render_data);
+        envmap_shadow_ray_batch.flush(render_data);
+
+        for (int queue_index = first_queue_index; queue_index < queue_end; queue_index++)
+        {
+            int path_index = m_active_paths[queue_index];
+
+            const DeferredShadowRays& light_shadow_rays = m_light_shadow_rays[path_index];
+            const DeferredShadowRays& envmap_shadow_rays = m_envmap_shadow_rays[path_index];
+            if (light_shadow_rays.count == 0 && envmap_shadow_rays.count == 0)
+                continue;
+
+            m_radiances[path_index] += clamp_direct_lighting(render_data, bounce, light_sample_radiances[queue_index - first_queue_index], envmap_radiances[queue_index - first_queue_index]) * m_shading_throughputs[path_index];
+
+            shadow_ray_count += light_shadow_rays.count + envmap_shadow_rays.count;
+        }
+    }
+
+    m_ray_counts.shadow_rays += shadow_ray_count;
+}
+
+void WavefrontPathTracer::compact_active_paths()
+{
+    int thread_count = omp_get_max_threads();
+    m_thread_path_counts.resize(thread_count + 1);
+
+    // Each thread compacts a contiguous chunk of the queue, the chunks are then
+    // written one after the other at offsets given by a prefix sum of their sizes
+#pragma omp parallel num_threads(thread_count)
+    {
+        int thread_index = omp_get_thread_num();
+        int chunk_begin = static_cast<int64_t>(m_active_path_count) * thread_index / thread_count;
+        int chunk_end = static_cast<int64_t>(m_active_path_count) * (thread_index + 1) / thread_count;
+
+        int chunk_active_count = 0;
+        for (int queue_index = chunk_begin; queue_index < chunk_end; queue_index++)
+            chunk_active_count += m_path_active[m_active_paths[queue_index]];
+        m_thread_path_counts[thread_index + 1] = chunk_active_count;
+
+#pragma omp barrier
+#pragma omp single
+        {
+            m_thread_path_counts[0] = 0;
+            for (int i = 0; i < thread_count; i++)
+                m_thread_path_counts[i + 1] += m_thread_path_counts[i];
+        }
+
+        int output_index = m_thread_path_counts[thread_index];
+        for (int queue_index = chunk_begin; queue_index < chunk_end; queue_index++)
+        {
+            int path_index = m_active_paths[queue_index];
+            if (m_path_active[path_index])
+                m_compacted_active_paths[output_index++] = path_index;
+        }
+    }
+
+    m_active_path_count = m_thread_path_counts[thread_count];
+    std::swap(m_active_paths, m_compacted_active_paths);
+}
+
+void WavefrontPathTracer::sort_rays()
+{
+    // Bounds of the origins of the rays, the origins are quantized relative to them
+    float3 origins_min = make_float3(1.0e35f, 1.0e35f, 1.0e35f);
+    float3 origins_max = make_float3(-1.0e35f, -1.0e35f, -1.0e35f);
+#pragma omp parallel
+    {
+        float3 thread_min = make_float3(1.0e35f, 1.0e35f, 1.0e35f);
+        float3 thread_max = make_float3(-1.0e35f, -1.0e35f, -1.0e35f);
+
+#pragma omp for schedule(static) nowait
+        for (int queue_index = 0; queue_index < m_active_path_count; queue_index++)
+        {
+            const float3& origin = m_ray_origins[m_active_paths[queue_index]];
+
+            thread_min = hippt::min(thread_min, origin);
+            thread_max = hippt::max(thread_max, origin);
+        }
+
+#pragma omp critical
+        {
+            origins_min = hippt::min(origins_min, thread_min);
+            origins_max = hippt::max(origins_max, thread_max);
+        }
+    }
+
+    float3 origins_extent = origins_max - origins_min;
+    float3 inverse_extent = make_float3(origins_extent.x > 0.0f ? 1.0f / origins_extent.x : 0.0f,
+                                        origins_extent.y > 0.0f ? 1.0f / origins_extent.y : 0.0f,
+                                        origins_extent.z > 0.0f ? 1.0f / origins_extent.z : 0.0f);
+
+#pragma omp parallel for schedule(static)
+    for (int queue_index = 0; queue_index < m_active_path_count; queue_index++)
+    {
+        int path_index = m_active_paths[queue_index];
+
+        // 7 bits per axis for the origin and 5 bits per axis for the direction. The origin comes first:
+        // the rays that start from the same place traverse the same BVH nodes near their origin
+        float3 normalized_origin = (m_ray_origins[path_index] - origins_min) * inverse_extent;
+        uint32_t origin_key = spread_bits_3D(quantize(normalized_origin.x, 7))
+                            | spread_bits_3D(quantize(normalized_origin.y, 7)) << 1
+                            | spread_bits_3D(quantize(normalized_origin.z, 7)) << 2;
+
+        float2 octahedral_direction = octahedral_encode(m_ray_directions[path_index]);
+        uint32_t direction_key = spread_bits_2D(quantize(octahedral_direction.x, 5))
+                               | spread_bits_2D(quantize(octahedral_direction.y, 5)) << 1;
+
+        uint32_t key = origin_key << 10 | direction_key;
+        m_sort_keys[queue_index] = static_cast<uint64_t>(key) << 32 | static_cast<uint32_t>(path_index);
+    }
+
+    sort_active_paths();
+}
+
+void WavefrontPathTracer::sort_hits(const HIPRTRenderData& render_data)
+{
+#pragma omp parallel for schedule(static)
+    for (int queue_index = 0; queue_index < m_active_path_count; queue_index++)
+    {
+        int path_index = m_active_paths[queue_index];
+
+        // The misses only sample the envmap, they go at the end of the queue
+        uint32_t key = 0xffffffff;
+        if (m_hit_found[path_index])
+            key = render_data.buffers.material_indices[m_hits[path_index].primitive_index];
+
+        m_sort_keys[queue_index] = static_cast<uint64_t>(key) << 32 | static_cast<uint32_t>(path_index);
+    }
+
+    sort_active_paths();
+}
+
+void WavefrontPathTracer::sort_active_paths()
+{
+    constexpr int RADIX_BITS = 8;
+    constexpr int RADIX_SIZE = 1 << RADIX_BITS;
+
+    // Only sorting on the digits that are used by at least one key
+    uint32_t used_key_bits = 0;
+#pragma omp parallel for schedule(static) reduction(|:used_key_bits)
+    for (int queue_index = 0; queue_index < m_active_path_count; queue_index++)
+        used_key_bits |= static_cast<uint32_t>(m_sort_keys[queue_index] >> 32);
+
+    int digit_count = 0;
+    while (digit_count < 32 / RADIX_BITS && (used_key_bits >> (digit_count * RADIX_BITS)) != 0)
+        digit_count++;
+
+    int thread_count = omp_get_max_threads();
+    m_thread_digit_counts.resize(thread_count * RADIX_SIZE);
+
+    // Least significant digit first radix sort. Each thread counts the digits of a contiguous
+    // chunk of the keys and then scatters them at offsets given by a prefix sum over
+    // (digit, thread), which keeps the sort stable
+#pragma omp parallel num_threads(thread_count)
+    {
+        int thread_index = omp_get_thread_num();
+        int chunk_begin = static_cast<int64_t>(m_active_path_count) * thread_index / thread_count;
+        int chunk_end = static_cast<int64_t>(m_active_path_count) * (thread_index + 1) / thread_count;
+        int* digit_counts = &m_thread_digit_counts[thread_index * RADIX_SIZE];
+
+        for (int digit = 0; digit < digit_count; digit++)
+        {
+            int shift = 32 + digit * RADIX_BITS;
+
+            std::fill(digit_counts, digit_counts + RADIX_SIZE, 0);
+            for (int queue_index = chunk_begin; queue_index < chunk_end; queue_index++)
+                digit_counts[(m_sort_keys[queue_index] >> shift) & (RADIX_SIZE - 1)]++;
+
+#pragma omp barrier
+#pragma omp single
+            {
+                int offset = 0;
+                for (int radix = 0; radix < RADIX_SIZE; radix++)
+                {
+                    for (int i = 0; i < thread_count; i++)
+                    {
+                        int count = m_thread_digit_counts[i * RADIX_SIZE + radix];
+                        m_thread_digit_counts[i * RADIX_SIZE + radix] = offset;
+                        offset += count;
+                    }
+                }
+            }
+
+            for (int queue_index = chunk_begin; queue_index < chunk_end; queue_index++)
+            {
+                uint64_t key = m_sort_keys[queue_index];
+                m_sorted_keys[digit_counts[(key >> shift) & (RADIX_SIZE - 1)]++] = key;
+            }
+
+#pragma omp barrier
+#pragma omp single
+            std::swap(m_sort_keys, m_sorted_keys);
+        }
+
+#pragma omp for schedule(static)
+        for (int queue_index = 0; queue_index < m_active_path_count; queue_index++)
+            m_active_paths[queue_index] = static_cast<int>(static_cast<uint32_t>(m_sort_keys[queue_index]));
+    }
+}
+
+void WavefrontPathTracer::finish_paths(const HIPRTRenderData& render_data, int2 resolution, int first_pixel, int pixel_count, int sample)
+{
+#pragma omp parallel for schedule(static)
+    for (int path_index = 0; path_index < pixel_count; path_index++)
+    {
+        int pixel_index = first_pixel + path_index;
+        if (!m_pixel_sampling_needed[pixel_index] || !m_pixel_valid[pixel_index])
+            continue;
+
+        const ColorRGB& ray_color = m_radiances[path_index];
+        // Checking for NaNs / negative value samples
+        if (!sanity_check(render_data, ray_color, pixel_index % resolution.x, pixel_index / resolution.x, resolution, sample))
+        {
+            // The megakernel gives up on the pixel for this frame too
+            m_pixel_valid[pixel_index] = false;
+
+            continue;
+        }
+
+        m_pixel_squared_luminances[pixel_index] += ray_color.luminance() * ray_color.luminance();
+        m_pixel_colors[pixel_index] += ray_color;
+    }
+}
@@ -0,0 +1,200 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#ifndef WAVEFRONT_PATH_TRACER_H
+#define WAVEFRONT_PATH_TRACER_H
+
+#include "Device/includes/Dispatcher.h"
+#include "Device/includes/Intersect.h"
+#include "Device/includes/RayPayload.h"
+#include "HostDeviceCommon/Camera.h"
+#include "HostDeviceCommon/HitInfo.h"
+#include "HostDeviceCommon/RenderData.h"
+#include "HostDeviceCommon/Sampler.h"
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * Number of rays traced by the stages of the wavefront path tracer
+ */
+struct WavefrontRayCounts
+{
+    // Rays of the intersection stage, one per path per bounce. The closest-hit rays traced
+    // by the light sampling strategies (BSDF samples towards the lights) are not counted
+    uint64_t closest_hit_rays = 0;
+    uint64_t shadow_rays = 0;
+};
+
+/**
+ * Reordering of the queue of active paths so that neighbouring paths of
+ * the queue, processed one after the other by a thread, access the same
+ * BVH nodes, materials and textures. Only the secondary rays (bounce > 0)
+ * are sorted, the camera rays of a batch are already coherent
+ */
+struct WavefrontSortingOptions
+{
+    // Sorts the rays by a Morton code of their origin (in the bounds of the
+    // origins of the batch) followed by their direction before the intersection stage
+    bool sort_rays = false;
+    // Sorts the hits by material index before the shading stage, the misses are shaded last
+    bool sort_hits = false;
+};
+
+/**
+ * Time spent in each stage of the wavefront path tracer since its creation
+ */
+struct WavefrontStageTimes
+{
+    double intersect_seconds = 0.0;
+    double bsdf_sample_seconds = 0.0;
+    double shade_seconds = 0.0;
+    double shadow_ray_seconds = 0.0;
+    double ray_sort_seconds = 0.0;
+    double hit_sort_seconds = 0.0;
+};
+
+/**
+ * CPU path tracer that processes the paths of a frame in batches ('wavefronts')
+ * instead of one pixel at a time like PathTracerKernel. Each bounce of the
+ * paths of a batch goes through stages that are each a parallel loop:
+ *
+ *  - Generate the camera rays of the pixels of the batch
+ *  - Intersect the rays of the active paths with the scene
+ *  - Sample the BSDFs of the hits for the next bounce, in SIMD batches (bsdf_dispatcher_sample_batch())
+ *  - Shade the hits: direct lighting, without tracing the shadow rays, and BSDF sampling of the next bounce
+ *  - Trace the shadow rays and add the direct lighting of the unoccluded ones
+ *
+ * The state of the paths lives in structure-of-arrays buffers indexed by path
+ * and the indices of the paths that are still active are kept in a queue
+ * that is compacted after each bounce.
+ *
+ * The shading uses the same device functions as PathTracerKernel so
+ * both produce the same image, up to the noise (and the precision of the
+ * SIMD BSDF sampling)
+ */
+class WavefrontPathTracer
+{
+public:
+    /**
+     * Renders samples_per_frame samples for each pixel of the image and accumulates them
+     * in the buffers of render_data, like one call of PathTracerKernel per pixel
+     * would. 'wavefront_size' is the number of paths traced together
+     */
+    void render_frame(const HIPRTRenderData& render_data, const HIPRTCamera& camera, int2 resolution, int wavefront_size, const WavefrontSortingOptions& sorting_options = WavefrontSortingOptions());
+
+    /**
+     * Rays traced since the creation of the path tracer
+     */
+    const WavefrontRayCounts& get_ray_counts() const;
+    const WavefrontStageTimes& get_stage_times() const;
+
+private:
+    void resize(int pixel_count, int wavefront_size);
+
+    /**
+     * Starts one path for each pixel of [first_pixel, first_pixel + pixel_count[ that
+     * still needs samples and fills the queue of active paths. 'sample' is the
+     * index of the sample in the frame
+     */
+    void generate_camera_rays(const HIPRTRenderData& render_data, const HIPRTCamera& camera, int2 resolution, int first_pixel, int pixel_count, int sample);
+    /**
+     * Traces the rays of the active paths. The camera rays (bounce 0) are traced in packets
+     */
+    void intersect_stage(const HIPRTRenderData& render_data, int bounce);
+    /**
+     * Closest hit of the ray of one path, 'first_hit' is its hit if it was already
+     * found by a packet traversal (see trace_ray())
+     */
+    void intersect_path(const HIPRTRenderData& render_data, int path_index, const hiprtHit* first_hit = nullptr);
+    /**
+     * Samples the BSDF of the hits of the active paths that continue after this bounce. The paths
+     * are split in contiguous ranges of the queue, each one sampled as one batch: with hits sorted by
+     * material, the lanes of a batch mostly go through the same lobes of the BSDF
+     */
+    void bsdf_sample_stage(const HIPRTRenderData& render_data, int bounce);
+    void shade_stage(const HIPRTRenderData& render_data, int bounce, int sample);
+    void shadow_ray_stage(const HIPRTRenderData& render_data, int bounce);
+    /**
+     * Removes the paths that were terminated during this bounce from the queue
+     */
+    void compact_active_paths();
+    void sort_rays();
+    void sort_hits(const HIPRTRenderData& render_data);
+    /**
+     * Stable sort of the queue of active paths by the keys of m_sort_keys.
+     * A key is in the upper 32 bits and the index of its path in the lower 32 bits
+     */
+    void sort_active_paths();
+    /**
+     * Adds the radiance of the paths to the per-pixel sums of the frame
+     */
+    void finish_paths(const HIPRTRenderData& render_data, int2 resolution, int first_pixel, int pixel_count, int sample);
+
+    // ----- Path state, indexed by path (pixel - first pixel of the batch) ----- //
+    std::vector<float3> m_ray_origins;
+    std::vector<float3> m_ray_directions;
+    std::vector<ColorRGB> m_throughputs;
+    std::vector<ColorRGB> m_radiances;
+    std::vector<RayVolumeState> m_volume_states;
+    std::vector<RayMISState> m_mis_states;
+    // Written by the intersection stage, read by the shading stage
+    std::vector<HitInfo> m_hits;
+    std::vector<RendererMaterial> m_materials;
+    std::vector<unsigned char> m_hit_found;
+    // 1 if the shading stage already traced the ray of the next bounce
+    // (RayPayload::next_ray_traced), the intersection stage skips the path
+    std::vector<unsigned char> m_next_ray_traced;
+    // Written by the BSDF sampling stage, read by the shading stage
+    std::vector<BSDFSample> m_bsdf_samples;
+    // Written by the shading stage, read by the shadow ray stage
+    std::vector<DeferredShadowRays> m_light_shadow_rays;
+    std::vector<DeferredShadowRays> m_envmap_shadow_rays;
+    // Throughput of the path at the hit whose shadow rays are being traced
+    std::vector<ColorRGB> m_shading_throughputs;
+    // 0 if the path was terminated during the current bounce
+    std::vector<unsigned char> m_path_active;
+
+    // Pixel of the path 0 of the current batch
+    int m_batch_first_pixel = 0;
+    // Indices of the paths that are still active
+    std::vector<int> m_active_paths;
+    std::vector<int> m_compacted_active_paths;
+    int m_active_path_count = 0;
+    // Per-thread counters of the compaction
+    std::vector<int> m_thread_path_counts;
+    // Sort keys of the active paths and the buffers of the radix sort
+    std::vector<uint64_t> m_sort_keys;
+    std::vector<uint64_t> m_sorted_keys;
+    std::vector<int> m_thread_digit_counts;
+
+    // ----- BSDF sampling batches, indexed like the queue of active paths ----- //
+    // The batch of a range of the queue is stored at the start of the range
+    std::vector<int> m_batch_paths;
+    std::vector<RendererMaterial> m_batch_materials;
+    std::vector<RayVolumeState> m_batch_volume_states;
+    std::vector<float3> m_batch_view_directions;
+    std::vector<float3> m_batch_shading_normals;
+    std::vector<float3> m_batch_geometric_normals;
+    std::vector<Sampler> m_batch_samplers;
+    std::vector<float3> m_batch_directions;
+    std::vector<ColorRGB> m_batch_colors;
+    std::vector<float> m_batch_pdfs;
+
+    // ----- Per pixel sums over the samples of the frame ----- //
+    std::vector<unsigned char> m_pixel_sampling_needed;
+    // 0 if a sample of the pixel was NaN or negative, the samples of the frame are discarded
+    std::vector<unsigned char> m_pixel_valid;
+    std::vector<Sampler> m_pixel_samplers;
+    std::vector<ColorRGB> m_pixel_colors;
+    std::vector<float> m_pixel_squared_luminances;
+    std::vector<ColorRGB> m_pixel_albedos;
+    std::vector<float3> m_pixel_normals;
+
+    WavefrontRayCounts m_ray_counts;
+    WavefrontStageTimes m_stage_times;
+};
+
+#endif
@@ -0,0 +1,1350 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#include "Renderer/AABB.h"
+#include "Renderer/FlattenedBVH.h"
+#include "Renderer/WideBVH.h"
+
+#include <algorithm>
+#include <bit>
+
+#if CPU_FEATURES_X86
+#include <immintrin.h>
+#endif
+
+// Same epsilon as Triangle::intersect()
+static constexpr float TRIANGLE_EPSILON = 0.0000001f;
+
+/**
+ * The intersectors all implement the same slab and Moller-Trumbore tests
+ * and return the same results, they only differ by the instructions used.
+ *
+ * intersect_children() tests the ray against the boxes of all the children of
+ * the node and writes the t_near and the slot of the children that are hit in
+ * hit_t_near and hit_slots (compacted, in slot order). Returns the number of children hit.
+ *
+ * intersect_packet() tests the ray against all the triangles of the packet and
+ * writes the distance and barycentric coordinates of the intersection of each lane
+ * in out_t, out_u and out_v. Returns the mask of the lanes that have an intersection
+ * closer than t_max
+ */
+template <int Width>
+struct ScalarIntersector
+{
+    static int intersect_children(const WideBVHNode<Width>& node, const typename WideBVH<Width>::RayBoxData& ray_data, float t_max, float* hit_t_near, int* hit_slots)
+    {
+        int hit_count = 0;
+        for (int slot = 0; slot < Width; slot++)
+        {
+            float t_near = 0.0f;
+            float t_far = t_max;
+            for (int axis = 0; axis < 3; axis++)
+            {
+                t_near = std::max(t_near, (node.bounds[ray_data.near_plane[axis]][slot] - ray_data.origin[axis]) * ray_data.inverse_direction[axis]);
+                t_far = std::min(t_far, (node.bounds[ray_data.far_plane[axis]][slot] - ray_data.origin[axis]) * ray_data.inverse_direction[axis]);
+            }
+
+            if (t_near <= t_far)
+            {
+                hit_t_near[hit_count] = t_near;
+                hit_slots[hit_count] = slot;
+                hit_count++;
+            }
+        }
+
+        return hit_count;
+    }
+
+    static unsigned int intersect_packet(const WideBVHTrianglePacket<Width>& packet, const typename WideBVH<Width>::RayBoxData& ray_data, float t_max, float* out_t, float* out_u, float* out_v)
+    {
+        const float* o = ray_data.origin;
+        const float* d = ray_data.direction;
+
+        unsigned int hit_mask = 0;
+        for (int lane = 0; lane < Width; lane++)
+        {
+            float e1[3] = { packet.edge1[0][lane], packet.edge1[1][lane], packet.edge1[2][lane] };
+            float e2[3] = { packet.edge2[0][lane], packet.edge2[1][lane], packet.edge2[2][lane] };
+
+            float h[3] = { d[1] * e2[2] - d[2] * e2[1], d[2] * e2[0] - d[0] * e2[2], d[0] * e2[1] - d[1] * e2[0] };
+            float a = e1[0] * h[0] + e1[1] * h[1] + e1[2] * h[2];
+            if (!(std::abs(a) >= TRIANGLE_EPSILON))
+                // Ray parallel to the triangle or unused lane
+                continue;
+
+            float f = 1.0f / a;
+            float s[3] = { o[0] - packet.vertex_a[0][lane], o[1] - packet.vertex_a[1][lane], o[2] - packet.vertex_a[2][lane] };
+            float u = f * (s[0] * h[0] + s[1] * h[1] + s[2] * h[2]);
+
+            float q[3] = { s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2], s[0] * e1[1] - s[1] * e1[0] };
+            float v = f * (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]);
+            float t = f * (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]);
+
+            out_t[lane] = t;
+            out_u[lane] = u;
+            out_v[lane] = v;
+            if (u >= 0.0f && u <= 1.0f && v >= 0.0f && u + v <= 1.0f && t > TRIANGLE_EPSILON && t < t_max)
+                hit_mask |= 1u << lane;
+        }
+
+        return hit_mask;
+    }
+};
+
+#if CPU_FEATURES_X86
+/**
+ * Tests the children 4 by 4, works for both BVH4 and BVH8
+ */
+template <int Width>
+struct SSE4Intersector
+{
+    SIMD_TARGET_SSE4 static int intersect_children(const WideBVHNode<Width>& node, const typename WideBVH<Width>::RayBoxData& ray_data, float t_max, float* hit_t_near, int* hit_slots)
+    {
+        __m128 origin_x = _mm_set1_ps(ray_data.origin[0]);
+        __m128 origin_y = _mm_set1_ps(ray_data.origin[1]);
+        __m128 origin_z = _mm_set1_ps(ray_data.origin[2]);
+        __m128 inverse_x = _mm_set1_ps(ray_data.inverse_direction[0]);
+        __m128 inverse_y = _mm_set1_ps(ray_data.inverse_direction[1]);
+        __m128 inverse_z = _mm_set1_ps(ray_data.inverse_direction[2]);
+        __m128 zero = _mm_setzero_ps();
+        __m128 t_max_4 = _mm_set1_ps(t_max);
+
+        int hit_count = 0;
+        for (int first_slot = 0; first_slot < Width; first_slot += 4)
+        {
+            __m128 t_near_x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&node.bounds[ray_data.near_plane[0]][first_slot]), origin_x), inverse_x);
+            __m128 t_near_y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&node.bounds[ray_data.near_plane[1]][first_slot]), origin_y), inverse_y);
+            __m128 t_near_z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&node.bounds[ray_data.near_plane[2]][first_slot]), origin_z), inverse_z);
+            __m128 t_far_x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&node.bounds[ray_data.far_plane[0]][first_slot]), origin_x), inverse_x);
+            __m128 t_far_y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&node.bounds[ray_data.far_plane[1]][first_slot]), origin_y), inverse_y);
+            __m128 t_far_z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&node.bounds[ray_data.far_plane[2]][first_slot]), origin_z), inverse_z);
+
+            __m128 t_near = _mm_max_ps(_mm_max_ps(t_near_x, t_near_y), _mm_max_ps(t_near_z, zero));
+            __m128 t_far = _mm_min_ps(_mm_min_ps(t_far_x, t_far_y), _mm_min_ps(t_far_z, t_max_4));
+
+            unsigned int hit_mask = _mm_movemask_ps(_mm_cmple_ps(t_near, t_far));
+            if (hit_mask == 0)
+                continue;
+
+            alignas(16) float t_near_array[4];
+            _mm_store_ps(t_near_array, t_near);
+            while (hit_mask)
+            {
+                int lane = std::countr_zero(hit_mask);
+                hit_mask &= hit_mask - 1;
+
+                hit_t_near[hit_count] = t_near_array[lane];
+                hit_slots[hit_count] = first_slot + lane;
+                hit_count++;
+            }
+        }
+
+        return hit_count;
+    }
+
+    SIMD_TARGET_SSE4 static unsigned int intersect_packet(const WideBVHTrianglePacket<Width>& packet, const typename WideBVH<Width>::RayBoxData& ray_data, float t_max, float* out_t, float* out_u, float* out_v)
+    {
+        __m128 origin_x = _mm_set1_ps(ray_data.origin[0]);
+        __m128 origin_y = _mm_set1_ps(ray_data.origin[1]);
+        __m128 origin_z = _mm_set1_ps(ray_data.origin[2]);
+        __m128 direction_x = _mm_set1_ps(ray_data.direction[0]);
+        __m128 direction_y = _mm_set1_ps(ray_data.direction[1]);
+        __m128 direction_z = _mm_set1_ps(ray_data.direction[2]);
+        __m128 zero = _mm_setzero_ps();
+        __m128 one = _mm_set1_ps(1.0f);
+        __m128 epsilon = _mm_set1_ps(TRIANGLE_EPSILON);
+        __m128 t_max_4 = _mm_set1_ps(t_max);
+        __m128 sign_mask = _mm_set1_ps(-0.0f);
+
+        unsigned int hit_mask = 0;
+        for (int first_lane = 0; first_lane < Width; first_lane += 4)
+        {
+            __m128 e1_x = _mm_load_ps(&packet.edge1[0][first_lane]);
+            __m128 e1_y = _mm_load_ps(&packet.edge1[1][first_lane]);
+            __m128 e1_z = _mm_load_ps(&packet.edge1[2][first_lane]);
+            __m128 e2_x = _mm_load_ps(&packet.edge2[0][first_lane]);
+            __m128 e2_y = _mm_load_ps(&packet.edge2[1][first_lane]);
+            __m128 e2_z = _mm_load_ps(&packet.edge2[2][first_lane]);
+
+            // h = cross(direction, edge2)
+            __m128 h_x = _mm_sub_ps(_mm_mul_ps(direction_y, e2_z), _mm_mul_ps(direction_z, e2_y));
+            __m128 h_y = _mm_sub_ps(_mm_mul_ps(direction_z, e2_x), _mm_mul_ps(direction_x, e2_z));
+            __m128 h_z = _mm_sub_ps(_mm_mul_ps(direction_x, e2_y), _mm_mul_ps(direction_y, e2_x));
+            __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1_x, h_x), _mm_mul_ps(e1_y, h_y)), _mm_mul_ps(e1_z, h_z));
+            __m128 f = _mm_div_ps(one, a);
+
+            __m128 s_x = _mm_sub_ps(origin_x, _mm_load_ps(&packet.vertex_a[0][first_lane]));
+            __m128 s_y = _mm_sub_ps(origin_y, _mm_load_ps(&packet.vertex_a[1][first_lane]));
+            __m128 s_z = _mm_sub_ps(origin_z, _mm_load_ps(&packet.vertex_a[2][first_lane]));
+            __m128 u = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(s_x, h_x), _mm_mul_ps(s_y, h_y)), _mm_mul_ps(s_z, h_z)));
+
+            // q = cross(s, edge1)
+            __m128 q_x = _mm_sub_ps(_mm_mul_ps(s_y, e1_z), _mm_mul_ps(s_z, e1_y));
+            __m128 q_y = _mm_sub_ps(_mm_mul_ps(s_z, e1_x), _mm_mul_ps(s_x, e1_z));
+            __m128 q_z = _mm_sub_ps(_mm_mul_ps(s_x, e1_y), _mm_mul_ps(s_y, e1_x));
+            __m128 v = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(direction_x, q_x), _mm_mul_ps(direction_y, q_y)), _mm_mul_ps(direction_z, q_z)));
+            __m128 t = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2_x, q_x), _mm_mul_ps(e2_y, q_y)), _mm_mul_ps(e2_z, q_z)));
+
+            __m128 valid = _mm_cmpge_ps(_mm_andnot_ps(sign_mask, a), epsilon);
+            valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+            valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+            valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(t, epsilon), _mm_cmplt_ps(t, t_max_4)));
+
+            _mm_storeu_ps(out_t + first_lane, t);
+            _mm_storeu_ps(out_u + first_lane, u);
+            _mm_storeu_ps(out_v + first_lane, v);
+            hit_mask |= static_cast<unsigned int>(_mm_movemask_ps(valid)) << first_lane;
+        }
+
+        return hit_mask;
+    }
+};
+
+/**
+ * Tests the 8 children of a BVH8 node at once
+ */
+struct AVX2Intersector
+{
+    SIMD_TARGET_AVX2 static int intersect_children(const WideBVHNode<8>& node, const WideBVH<8>::RayBoxData& ray_data, float t_max, float* hit_t_near, int* hit_slots)
+    {
+        __m256 origin_x = _mm256_set1_ps(ray_data.origin[0]);
+        __m256 origin_y = _mm256_set1_ps(ray_data.origin[1]);
+        __m256 origin_z = _mm256_set1_ps(ray_data.origin[2]);
+        __m256 inverse_x = _mm256_set1_ps(ray_data.inverse_direction[0]);
+        __m256 inverse_y = _mm256_set1_ps(ray_data.inverse_direction[1]);
+        __m256 inverse_z = _mm256_set1_ps(ray_data.inverse_direction[2]);
+
+        __m256 t_near_x = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[ray_data.near_plane[0]]), origin_x), inverse_x);
+        __m256 t_near_y = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[ray_data.near_plane[1]]), origin_y), inverse_y);
+        __m256 t_near_z = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[ray_data.near_plane[2]]), origin_z), inverse_z);
+        __m256 t_far_x = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[ray_data.far_plane[0]]), origin_x), inverse_x);
+        __m256 t_far_y = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[ray_data.far_plane[1]]), origin_y), inverse_y);
+        __m256 t_far_z = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[ray_data.far_plane[2]]), origin_z), inverse_z);
+
+        __m256 t_near = _mm256_max_ps(_mm256_max_ps(t_near_x, t_near_y), _mm256_max_ps(t_near_z, _mm256_setzero_ps()));
+        __m256 t_far = _mm256_min_ps(_mm256_min_ps(t_far_x, t_far_y), _mm256_min_ps(t_far_z, _mm256_set1_ps(t_max)));
+
+        unsigned int hit_mask = _mm256_movemask_ps(_mm256_cmp_ps(t_near, t_far, _CMP_LE_OQ));
+        if (hit_mask == 0)
+            return 0;
+
+        alignas(32) float t_near_array[8];
+        _mm256_store_ps(t_near_array, t_near);
+
+        int hit_count = 0;
+        while (hit_mask)
+        {
+            int lane = std::countr_zero(hit_mask);
+            hit_mask &= hit_mask - 1;
+
+            hit_t_near[hit_count] = t_near_array[lane];
+            hit_slots[hit_count] = lane;
+            hit_count++;
+        }
+
+        return hit_count;
+    }
+
+    SIMD_TARGET_AVX2 static unsigned int intersect_packet(const WideBVHTrianglePacket<8>& packet, const WideBVH<8>::RayBoxData& ray_data, float t_max, float* out_t, float* out_u, float* out_v)
+    {
+        __m256 direction_x = _mm256_set1_ps(ray_data.direction[0]);
+        __m256 direction_y = _mm256_set1_ps(ray_data.direction[1]);
+        __m256 direction_z = _mm256_set1_ps(ray_data.direction[2]);
+        __m256 zero = _mm256_setzero_ps();
+        __m256 one = _mm256_set1_ps(1.0f);
+        __m256 epsilon = _mm256_set1_ps(TRIANGLE_EPSILON);
+
+        __m256 e1_x = _mm256_load_ps(packet.edge1[0]);
+        __m256 e1_y = _mm256_load_ps(packet.edge1[1]);
+        __m256 e1_z = _mm256_load_ps(packet.edge1[2]);
+        __m256 e2_x = _mm256_load_ps(packet.edge2[0]);
+        __m256 e2_y = _mm256_load_ps(packet.edge2[1]);
+        __m256 e2_z = _mm256_load_ps(packet.edge2[2]);
+
+        // h = cross(direction, edge2)
+        __m256 h_x = _mm256_sub_ps(_mm256_mul_ps(direction_y, e2_z), _mm256_mul_ps(direction_z, e2_y));
+        __m256 h_y = _mm256_sub_ps(_mm256_mul_ps(direction_z, e2_x), _mm256_mul_ps(direction_x, e2_z));
+        __m256 h_z = _mm256_sub_ps(_mm256_mul_ps(direction_x, e2_y), _mm256_mul_ps(direction_y, e2_x));
+        __m256 a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1_x, h_x), _mm256_mul_ps(e1_y, h_y)), _mm256_mul_ps(e1_z, h_z));
+        __m256 f = _mm256_div_ps(one, a);
+
+        __m256 s_x = _mm256_sub_ps(_mm256_set1_ps(ray_data.origin[0]), _mm256_load_ps(packet.vertex_a[0]));
+        __m256 s_y = _mm256_sub_ps(_mm256_set1_ps(ray_data.origin[1]), _mm256_load_ps(packet.vertex_a[1]));
+        __m256 s_z = _mm256_sub_ps(_mm256_set1_ps(ray_data.origin[2]), _mm256_load_ps(packet.vertex_a[2]));
+        __m256 u = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(s_x, h_x), _mm256_mul_ps(s_y, h_y)), _mm256_mul_ps(s_z, h_z)));
+
+        // q = cross(s, edge1)
+        __m256 q_x = _mm256_sub_ps(_mm256_mul_ps(s_y, e1_z), _mm256_mul_ps(s_z, e1_y));
+        __m256 q_y = _mm256_sub_ps(_mm256_mul_ps(s_z, e1_x), _mm256_mul_ps(s_x, e1_z));
+        __m256 q_z = _mm256_sub_ps(_mm256_mul_ps(s_x, e1_y), _mm256_mul_ps(s_y, e1_x));
+        __m256 v = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(direction_x, q_x), _mm256_mul_ps(direction_y, q_y)), _mm256_mul_ps(direction_z, q_z)));
+        __m256 t = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2_x, q_x), _mm256_mul_ps(e2_y, q_y)), _mm256_mul_ps(e2_z, q_z)));
+
+        __m256 valid = _mm256_cmp_ps(_mm256_andnot_ps(_mm256_set1_ps(-0.0f), a), epsilon, _CMP_GE_OQ);
+        valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(u, one, _CMP_LE_OQ)));
+        valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GE_OQ), _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ)));
+        valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, epsilon, _CMP_GT_OQ), _mm256_cmp_ps(t, _mm256_set1_ps(t_max), _CMP_LT_OQ)));
+
+        _mm256_storeu_ps(out_t, t);
+        _mm256_storeu_ps(out_u, u);
+        _mm256_storeu_ps(out_v, v);
+
+        return static_cast<unsigned int>(_mm256_movemask_ps(valid));
+    }
+};
+
+/**
+ * Same as the AVX2 version but the hit children are compacted
+ * with the AVX-512 compress instructions instead of a bit loop
+ */
+struct AVX512Intersector
+{
+    SIMD_TARGET_AVX512 static int intersect_children(const WideBVHNode<8>& node, const WideBVH<8>::RayBoxData& ray_data, float t_max, float* hit_t_near, int* hit_slots)
+    {
+        __m256 origin_x = _mm256_set1_ps(ray_data.origin[0]);
+        __m256 origin_y = _mm256_set1_ps(ray_data.origin[1]);
+        __m256 origin_z = _mm256_set1_ps(ray_data.origin[2]);
+        __m256 inverse_x = _mm256_set1_ps(ray_data.inverse_direction[0]);
+        __m256 inverse_y = _mm256_set1_ps(ray_data.inverse_direction[1]);
+        __m256 inverse_z = _mm256_set1_ps(ray_data.inverse_direction[2]);
+
+        __m256 t_near_x = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[ray_data.near_plane[0]]), origin_x), inverse_x);
+        __m256 t_near_y = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[ray_data.near_plane[1]]), origin_y), inverse_y);
+        __m256 t_near_z = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[ray_data.near_plane[2]]), origin_z), inverse_z);
+        __m256 t_far_x = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[ray_data.far_plane[0]]), origin_x), inverse_x);
+        __m256 t_far_y = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[ray_data.far_plane[1]]), origin_y), inverse_y);
+        __m256 t_far_z = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[ray_data.far_plane[2]]), origin_z), inverse_z);
+
+        __m256 t_near = _mm256_max_ps(_mm256_max_ps(t_near_x, t_near_y), _mm256_max_ps(t_near_z, _mm256_setzero_ps()));
+        __m256 t_far = _mm256_min_ps(_mm256_min_ps(t_far_x, t_far_y), _mm256_min_ps(t_far_z, _mm256_set1_ps(t_max)));
+
+        __mmask8 hit_mask = _mm256_cmp_ps_mask(t_near, t_far, _CMP_LE_OQ);
+        if (hit_mask == 0)
+            return 0;
+
+        _mm256_storeu_ps(hit_t_near, _mm256_maskz_compress_ps(hit_mask, t_near));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(hit_slots), _mm256_maskz_compress_epi32(hit_mask, _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)));
+
+        return std::popcount(static_cast<unsigned int>(hit_mask));
+    }
+
+    SIMD_TARGET_AVX512 static unsigned int intersect_packet(const WideBVHTrianglePacket<8>& packet, const WideBVH<8>::RayBoxData& ray_data, float t_max, float* out_t, float* out_u, float* out_v)
+    {
+        // Nothing to gain from AVX-512 over AVX2 on 8 triangles
+        return AVX2Intersector::intersect_packet(packet, ray_data, t_max, out_t, out_u, out_v);
+    }
+};
+#endif
+
+/**
+ * Range of the product of a value of [a_min, a_max] with a value of [b_min, b_max]
+ */
+static void interval_product(float a_min, float a_max, float b_min, float b_max, float& product_min, float& product_max)
+{
+    float p0 = a_min * b_min;
+    float p1 = a_min * b_max;
+    float p2 = a_max * b_min;
+    float p3 = a_max * b_max;
+
+    product_min = hippt::min(hippt::min(p0, p1), hippt::min(p2, p3));
+    product_max = hippt::max(hippt::max(p0, p1), hippt::max(p2, p3));
+}
+
+/**
+ * The packet intersectors are the counterpart of the intersectors above for the packet traversals,
+ * they also only differ by the instructions used.
+ *
+ * cull_children() tests all the children of the node against the whole packet with interval
+ * arithmetic: the range of the distances at which the rays of the packet enter and leave
+ * each child is computed from the range of their origins and inverse directions. Writes the
+ * lower bound of the entry distance of each child in t_enter and returns the mask of the children
+ * that may be hit by a ray of the packet before t_max.
+ *
+ * intersect_child() tests the child in the given slot of the node against all the rays of the
+ * packet, one ray per lane. Returns the mask of the rays that hit the child before their closest_t
+ */
+template <int Width>
+struct ScalarPacketIntersector
+{
+    static unsigned int cull_children(const WideBVHNode<Width>& node, const typename WideBVH<Width>::PacketBoxData& packet_data, float t_max, float* t_enter)
+    {
+        unsigned int child_mask = 0;
+        for (int slot = 0; slot < Width; slot++)
+        {
+            float t_near = 0.0f;
+            float t_far = t_max;
+            for (int axis = 0; axis < 3; axis++)
+            {
+                float near_bound = node.bounds[packet_data.near_plane[axis]][slot];
+                float far_bound = node.bounds[packet_data.far_plane[axis]][slot];
+
+                float t_plane_near_min, t_plane_near_max;
+                float t_plane_far_min, t_plane_far_max;
+                interval_product(near_bound - packet_data.origin_max[axis], near_bound - packet_data.origin_min[axis], packet_data.inverse_direction_min[axis], packet_data.inverse_direction_max[axis], t_plane_near_min, t_plane_near_max);
+                interval_product(far_bound - packet_data.origin_max[axis], far_bound - packet_data.origin_min[axis], packet_data.inverse_direction_min[axis], packet_data.inverse_direction_max[axis], t_plane_far_min, t_plane_far_max);
+
+                t_near = hippt::max(t_near, t_plane_near_min);
+                t_far = hippt::min(t_far, t_plane_far_max);
+            }
+
+            t_enter[slot] = t_near;
+            if (t_near <= t_far)
+                child_mask |= 1u << slot;
+        }
+
+        return child_mask;
+    }
+
+    static unsigned int intersect_child(const WideBVHNode<Width>& node, int slot, const typename WideBVH<Width>::PacketBoxData& packet_data, const float* closest_t)
+    {
+        unsigned int hit_mask = 0;
+        for (int lane = 0; lane < BVHConstants::RAY_PACKET_SIZE; lane++)
+        {
+            float t_near = 0.0f;
+            float t_far = closest_t[lane];
+            for (int axis = 0; axis < 3; axis++)
+            {
+                float origin = packet_data.lane_origins[axis][lane];
+                float inverse_direction = packet_data.lane_inverse_directions[axis][lane];
+
+                t_near = hippt::max(t_near, (node.bounds[packet_data.near_plane[axis]][slot] - origin) * inverse_direction);
+                t_far = hippt::min(t_far, (node.bounds[packet_data.far_plane[axis]][slot] - origin) * inverse_direction);
+            }
+
+            if (t_near <= t_far)
+                hit_mask |= 1u << lane;
+        }
+
+        return hit_mask;
+    }
+};
+
+#if CPU_FEATURES_X86
+/**
+ * The 8 children are culled at once and the rays of the packet
+ * are tested against a child 8 at a time, in two halves
+ */
+struct AVX2PacketIntersector
+{
+    SIMD_TARGET_AVX2 static unsigned int cull_children(const WideBVHNode<8>& node, const WideBVH<8>::PacketBoxData& packet_data, float t_max, float* t_enter)
+    {
+        __m256 t_near = _mm256_setzero_ps();
+        __m256 t_far = _mm256_set1_ps(t_max);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            __m256 near_bound = _mm256_load_ps(node.bounds[packet_data.near_plane[axis]]);
+            __m256 far_bound = _mm256_load_ps(node.bounds[packet_data.far_plane[axis]]);
+            __m256 origin_min = _mm256_set1_ps(packet_data.origin_min[axis]);
+            __m256 origin_max = _mm256_set1_ps(packet_data.origin_max[axis]);
+            __m256 inverse_min = _mm256_set1_ps(packet_data.inverse_direction_min[axis]);
+            __m256 inverse_max = _mm256_set1_ps(packet_data.inverse_direction_max[axis]);
+
+            // Smallest of the products of the range of (near_bound - origin) with the range of the inverse directions
+            __m256 near_a = _mm256_sub_ps(near_bound, origin_max);
+            __m256 near_b = _mm256_sub_ps(near_bound, origin_min);
+            __m256 t_plane_near_min = _mm256_min_ps(_mm256_min_ps(_mm256_mul_ps(near_a, inverse_min), _mm256_mul_ps(near_a, inverse_max)),
+                                                    _mm256_min_ps(_mm256_mul_ps(near_b, inverse_min), _mm256_mul_ps(near_b, inverse_max)));
+
+            // Largest of the products for the far bound
+            __m256 far_a = _mm256_sub_ps(far_bound, origin_max);
+            __m256 far_b = _mm256_sub_ps(far_bound, origin_min);
+            __m256 t_plane_far_max = _mm256_max_ps(_mm256_max_ps(_mm256_mul_ps(far_a, inverse_min), _mm256_mul_ps(far_a, inverse_max)),
+                                                   _mm256_max_ps(_mm256_mul_ps(far_b, inverse_min), _mm256_mul_ps(far_b, inverse_max)));
+
+            t_near = _mm256_max_ps(t_near, t_plane_near_min);
+            t_far = _mm256_min_ps(t_far, t_plane_far_max);
+        }
+
+        _mm256_storeu_ps(t_enter, t_near);
+
+        return static_cast<unsigned int>(_mm256_movemask_ps(_mm256_cmp_ps(t_near, t_far, _CMP_LE_OQ)));
+    }
+
+    SIMD_TARGET_AVX2 static unsigned int intersect_child(const WideBVHNode<8>& node, int slot, const WideBVH<8>::PacketBoxData& packet_data, const float* closest_t)
+    {
+        unsigned int hit_mask = 0;
+        for (int half = 0; half < BVHConstants::RAY_PACKET_SIZE / 8; half++)
+        {
+            int first_lane = half * 8;
+
+            __m256 t_near = _mm256_setzero_ps();
+            __m256 t_far = _mm256_loadu_ps(closest_t + first_lane);
+            for (int axis = 0; axis < 3; axis++)
+            {
+                __m256 origin = _mm256_load_ps(packet_data.lane_origins[axis] + first_lane);
+                __m256 inverse_direction = _mm256_load_ps(packet_data.lane_inverse_directions[axis] + first_lane);
+
+                t_near = _mm256_max_ps(t_near, _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.bounds[packet_data.near_plane[axis]][slot]), origin), inverse_direction));
+                t_far = _mm256_min_ps(t_far, _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.bounds[packet_data.far_plane[axis]][slot]), origin), inverse_direction));
+            }
+
+            hit_mask |= static_cast<unsigned int>(_mm256_movemask_ps(_mm256_cmp_ps(t_near, t_far, _CMP_LE_OQ))) << first_lane;
+        }
+
+        return hit_mask;
+    }
+};
+
+/**
+ * Same as the AVX2 version but the 16 rays of
+ * the packet are tested against a child at once
+ */
+struct AVX512PacketIntersector
+{
+    static_assert(BVHConstants::RAY_PACKET_SIZE == 16, "The AVX-512 packet intersector tests one ray per lane of a 16-wide register");
+
+    SIMD_TARGET_AVX512 static unsigned int cull_children(const WideBVHNode<8>& node, const WideBVH<8>::PacketBoxData& packet_data, float t_max, float* t_enter)
+    {
+        // The 8 children already fill an AVX2 register
+        return AVX2PacketIntersector::cull_children(node, packet_data, t_max, t_enter);
+    }
+
+    SIMD_TARGET_AVX512 static unsigned int intersect_child(const WideBVHNode<8>& node, int slot, const WideBVH<8>::PacketBoxData& packet_data, const float* closest_t)
+    {
+        __m512 t_near = _mm512_setzero_ps();
+        __m512 t_far = _mm512_loadu_ps(closest_t);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            __m512 origin = _mm512_load_ps(packet_data.lane_origins[axis]);
+            __m512 inverse_direction = _mm512_load_ps(packet_data.lane_inverse_directions[axis]);
+
+            t_near = _mm512_max_ps(t_near, _mm512_mul_ps(_mm512_sub_ps(_mm512_set1_ps(node.bounds[packet_data.near_plane[axis]][slot]), origin), inverse_direction));
+            t_far = _mm512_min_ps(t_far, _mm512_mul_ps(_mm512_sub_ps(_mm512_set1_ps(node.bounds[packet_data.far_plane[axis]][slot]), origin), inverse_direction));
+        }
+
+        return static_cast<unsigned int>(_mm512_cmp_ps_mask(t_near, t_far, _CMP_LE_OQ));
+    }
+};
+#endif
+
+template <int Width>
+WideBVH<Width>::RayBoxData::RayBoxData(const hiprtRay& ray)
+{
+    float direction[3] = { ray.direction.x, ray.direction.y, ray.direction.z };
+
+    origin[0] = ray.origin.x;
+    origin[1] = ray.origin.y;
+    origin[2] = ray.origin.z;
+
+    this->direction[0] = direction[0];
+    this->direction[1] = direction[1];
+    this->direction[2] = direction[2];
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        // Same as the FlattenedBVH, a very large but finite inverse for
+        // rays parallel to an axis keeps the slab test free of NaNs
+        float denom = direction[axis] == 0.0f ? 1.0e-20f : direction[axis];
+        inverse_direction[axis] = 1.0f / denom;
+
+        near_plane[axis] = inverse_direction[axis] >= 0.0f ? axis : axis + 3;
+        far_plane[axis] = inverse_direction[axis] >= 0.0f ? axis + 3 : axis;
+    }
+}
+
+template <int Width>
+WideBVH<Width>::PacketBoxData::PacketBoxData(const RayPacket& packet)
+{
+    for (int ray_index = 0; ray_index < packet.count; ray_index++)
+        rays[ray_index] = RayBoxData(packet.rays[ray_index]);
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        origin_min[axis] = INFINITY;
+        origin_max[axis] = -INFINITY;
+        inverse_direction_min[axis] = INFINITY;
+        inverse_direction_max[axis] = -INFINITY;
+        for (int ray_index = 0; ray_index < packet.count; ray_index++)
+        {
+            origin_min[axis] = hippt::min(origin_min[axis], rays[ray_index].origin[axis]);
+            origin_max[axis] = hippt::max(origin_max[axis], rays[ray_index].origin[axis]);
+            inverse_direction_min[axis] = hippt::min(inverse_direction_min[axis], rays[ray_index].inverse_direction[axis]);
+            inverse_direction_max[axis] = hippt::max(inverse_direction_max[axis], rays[ray_index].inverse_direction[axis]);
+        }
+
+        // The packet is coherent, all its rays enter the boxes through the same planes
+        near_plane[axis] = rays[0].near_plane[axis];
+        far_plane[axis] = rays[0].far_plane[axis];
+
+        for (int lane = 0; lane < BVHConstants::RAY_PACKET_SIZE; lane++)
+        {
+            const RayBoxData& ray_data = rays[lane < packet.count ? lane : 0];
+
+            lane_origins[axis][lane] = ray_data.origin[axis];
+            lane_inverse_directions[axis][lane] = ray_data.inverse_direction[axis];
+        }
+    }
+}
+
+template <int Width>
+WideBVH<Width>::WideBVH(const FlattenedBVH& flattened_bvh, SIMDInstructionSet instruction_set) : m_flattened_bvh(&flattened_bvh)
+{
+    if (!CPUFeatures::supports(instruction_set))
+        instruction_set = CPUFeatures::get_best_simd_instruction_set();
+    if (Width == 4 && instruction_set > SIMDInstructionSet::SSE4)
+        // The AVX code paths test 8 children at once, SSE is enough for a BVH4
+        instruction_set = SIMDInstructionSet::SSE4;
+#if !CPU_FEATURES_X86
+    instruction_set = SIMDInstructionSet::SCALAR;
+#endif
+    m_instruction_set = instruction_set;
+
+    if (flattened_bvh.m_nodes.empty())
+        return;
+
+    m_nodes.reserve(flattened_bvh.m_nodes.size() / (Width - 1) + 1);
+    m_child_flattened_nodes.reserve(m_nodes.capacity() * Width);
+    collapse_node(0, compute_subtree_triangles());
+}
+
+template <int Width>
+void WideBVH<Width>::refit()
+{
+    std::span<const FlattenedBVH::FlattenedNode> flattened_nodes = m_flattened_bvh->m_nodes;
+
+    // The wide nodes only store the boxes of their children, which are the
+    // (already refit) boxes of the flattened nodes they were collapsed from
+#pragma omp parallel for schedule(static)
+    for (int node_index = 0; node_index < static_cast<int>(m_nodes.size()); node_index++)
+    {
+        WideBVHNode<Width>& node = m_nodes[node_index];
+        for (int slot = 0; slot < Width; slot++)
+        {
+            int flattened_node_index = m_child_flattened_nodes[node_index * Width + slot];
+            if (flattened_node_index == -1)
+                continue;
+
+            const FlattenedBVH::FlattenedNode& child = flattened_nodes[flattened_node_index];
+            for (int axis = 0; axis < 3; axis++)
+            {
+                node.bounds[axis][slot] = child.d_near[axis];
+                node.bounds[axis + 3][slot] = child.d_far[axis];
+            }
+        }
+    }
+
+#pragma omp parallel for schedule(static)
+    for (int packet_index = 0; packet_index < static_cast<int>(m_packets.size()); packet_index++)
+    {
+        WideBVHTrianglePacket<Width>& packet = m_packets[packet_index];
+        for (int lane = 0; lane < Width; lane++)
+            if (packet.triangle_index[lane] != -1)
+                set_packet_triangle(packet, lane, packet.triangle_index[lane]);
+    }
+}
+
+/**
+ * Returns the range of triangles of the subtree of each node of the FlattenedBVH.
+ * The triangle_count of a subtree whose triangles are not contiguous is -1
+ */
+template <int Width>
+std::vector<typename WideBVH<Width>::SubtreeTriangles> WideBVH<Width>::compute_subtree_triangles() const
+{
+    std::span<const FlattenedBVH::FlattenedNode> flattened_nodes = m_flattened_bvh->m_nodes;
+    std::vector<SubtreeTriangles> subtree_triangles(flattened_nodes.size());
+
+    // The children of a node are always after it in the array
+    // so iterating backwards visits the children first
+    for (int node_index = static_cast<int>(flattened_nodes.size()) - 1; node_index >= 0; node_index--)
+    {
+        const FlattenedBVH::FlattenedNode& node = flattened_nodes[node_index];
+        if (node.is_leaf())
+        {
+            subtree_triangles[node_index] = { node.offset, node.triangle_count };
+
+            continue;
+        }
+
+        const SubtreeTriangles& first_child = subtree_triangles[node_index + 1];
+        const SubtreeTriangles& second_child = subtree_triangles[node.offset];
+        bool contiguous = first_child.triangle_count != -1 && second_child.triangle_count != -1
+            && first_child.first_triangle + first_child.triangle_count == second_child.first_triangle;
+
+        subtree_triangles[node_index] = { first_child.first_triangle, contiguous ? first_child.triangle_count + second_child.triangle_count : -1 };
+    }
+
+    return subtree_triangles;
+}
+
+/**
+ * A node of the FlattenedBVH becomes a leaf child of a wide node if it is a leaf or if all
+ * the triangles of its subtree fit in a single packet: small sibling leaves are merged
+ * instead of each filling a mostly empty packet of its own
+ */
+template <int Width>
+bool WideBVH<Width>::is_leaf_child(int flattened_node_index, std::span<const SubtreeTriangles> subtree_triangles) const
+{
+    int triangle_count = subtree_triangles[flattened_node_index].triangle_count;
+
+    return m_flattened_bvh->m_nodes[flattened_node_index].is_leaf() || (triangle_count != -1 && triangle_count <= Width);
+}
+
+/**
+ * Creates the wide node corresponding to the given node of the binary BVH (and
+ * all its subtree). Returns the index of the created node in m_nodes
+ */
+template <int Width>
+int WideBVH<Width>::collapse_node(int flattened_node_index, std::span<const SubtreeTriangles> subtree_triangles)
+{
+    std::span<const FlattenedBVH::FlattenedNode> flattened_nodes = m_flattened_bvh->m_nodes;
+    auto node_box = [&flattened_nodes](int index)
+    {
+        const FlattenedBVH::FlattenedNode& node = flattened_nodes[index];
+
+        // The first 3 planes of the bounding volume are the X, Y and Z axes
+        return AABB(make_float3(node.d_near[0], node.d_near[1], node.d_near[2]), make_float3(node.d_far[0], node.d_far[1], node.d_far[2]));
+    };
+
+    int children[Width];
+    int child_count = 0;
+    if (is_leaf_child(flattened_node_index, subtree_triangles))
+        // Can only happen for the root
+        children[child_count++] = flattened_node_index;
+    else
+    {
+        children[child_count++] = flattened_node_index + 1;
+        children[child_count++] = flattened_nodes[flattened_node_index].offset;
+    }
+
+    // Pulling up the grandchildren of the largest interior children until the node is full
+    while (child_count < Width)
+    {
+        int largest_child = -1;
+        float largest_area = -1.0f;
+        for (int i = 0; i < child_count; i++)
+        {
+            if (is_leaf_child(children[i], subtree_triangles))
+                continue;
+
+            float area = node_box(children[i]).surface_area();
+            if (area > largest_area)
+            {
+                largest_area = area;
+                largest_child = i;
+            }
+        }
+
+        if (largest_child == -1)
+            // Only leaves left
+            break;
+
+        int expanded_node_index = children[largest_child];
+        children[largest_child] = expanded_node_index + 1;
+        children[child_count++] = flattened_nodes[expanded_node_index].offset;
+    }
+
+    int node_index = m_nodes.size();
+    m_nodes.emplace_back();
+    m_child_flattened_nodes.resize(m_nodes.size() * Width, -1);
+    for (int slot = 0; slot < child_count; slot++)
+        m_child_flattened_nodes[node_index * Width + slot] = children[slot];
+
+    // Not writing into m_nodes directly because the recursive
+    // calls below may reallocate it
+    WideBVHNode<Width> wide_node;
+    for (int slot = 0; slot < Width; slot++)
+    {
+        if (slot >= child_count)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                wide_node.bounds[axis][slot] = INFINITY;
+                wide_node.bounds[axis + 3][slot] = -INFINITY;
+            }
+
+            wide_node.child_index[slot] = -1;
+            wide_node.child_packet_count[slot] = 0;
+
+            continue;
+        }
+
+        const FlattenedBVH::FlattenedNode& child = flattened_nodes[children[slot]];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            wide_node.bounds[axis][slot] = child.d_near[axis];
+            wide_node.bounds[axis + 3][slot] = child.d_far[axis];
+        }
+
+        if (is_leaf_child(children[slot], subtree_triangles))
+        {
+            const SubtreeTriangles& child_triangles = subtree_triangles[children[slot]];
+
+            wide_node.child_index[slot] = m_packets.size();
+            wide_node.child_packet_count[slot] = create_leaf_packets(child_triangles.first_triangle, child_triangles.triangle_count);
+        }
+        else
+        {
+            wide_node.child_index[slot] = collapse_node(children[slot], subtree_triangles);
+            wide_node.child_packet_count[slot] = 0;
+        }
+    }
+
+    m_nodes[node_index] = wide_node;
+
+    return node_index;
+}
+
+/**
+ * Appends the packets of the triangles of a leaf to m_packets.
+ * Returns the number of packets created
+ */
+template <int Width>
+int WideBVH<Width>::create_leaf_packets(int first_triangle, int triangle_count)
+{
+    int packet_count = (triangle_count + Width - 1) / Width;
+    for (int packet_index = 0; packet_index < packet_count; packet_index++)
+    {
+        WideBVHTrianglePacket<Width> packet;
+        for (int lane = 0; lane < Width; lane++)
+        {
+            int triangle_index = first_triangle + packet_index * Width + lane;
+            if (triangle_index >= first_triangle + triangle_count)
+            {
+                // Null edges, never intersected
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    packet.vertex_a[axis][lane] = 0.0f;
+                    packet.edge1[axis][lane] = 0.0f;
+                    packet.edge2[axis][lane] = 0.0f;
+                }
+                packet.triangle_index[lane] = -1;
+
+                continue;
+            }
+
+            set_packet_triangle(packet, lane, triangle_index);
+        }
+
+        m_packets.push_back(packet);
+    }
+
+    return packet_count;
+}
+
+/**
+ * Stores the triangle at the given index of FlattenedBVH::m_triangles in the given lane of the packet
+ */
+template <int Width>
+void WideBVH<Width>::set_packet_triangle(WideBVHTrianglePacket<Width>& packet, int lane, int triangle_index) const
+{
+    const Triangle& triangle = m_flattened_bvh->m_triangles[triangle_index];
+    float3 edge1 = triangle.m_b - triangle.m_a;
+    float3 edge2 = triangle.m_c - triangle.m_a;
+    float vertex_a[3] = { triangle.m_a.x, triangle.m_a.y, triangle.m_a.z };
+    float edge1_xyz[3] = { edge1.x, edge1.y, edge1.z };
+    float edge2_xyz[3] = { edge2.x, edge2.y, edge2.z };
+    for (int axis = 0; axis < 3; axis++)
+    {
+        packet.vertex_a[axis][lane] = vertex_a[axis];
+        packet.edge1[axis][lane] = edge1_xyz[axis];
+        packet.edge2[axis][lane] = edge2_xyz[axis];
+    }
+    packet.triangle_index[lane] = triangle_index;
+}
+
+template <int Width>
+SIMDInstructionSet WideBVH<Width>::get_instruction_set() const
+{
+    return m_instruction_set;
+}
+
+template <int Width>
+float WideBVH<Width>::get_lane_occupancy() const
+{
+    if (m_packets.empty())
+        return 0.0f;
+
+    int triangle_count = 0;
+    for (const WideBVHTrianglePacket<Width>& packet : m_packets)
+        for (int lane = 0; lane < Width; lane++)
+            triangle_count += packet.triangle_index[lane] != -1;
+
+    return triangle_count / static_cast<float>(m_packets.size() * Width);
+}
+
+template <int Width>
+bool WideBVH<Width>::intersect(const hiprtRay& ray, HitInfo& hit_info, const BVHHitFilter& filter) const
+{
+    return traverse_dispatch<false>(ray, hit_info, hit_info.t > 0.0f ? hit_info.t : INFINITY, filter ? &filter : nullptr);
+}
+
+template <int Width>
+bool WideBVH<Width>::occluded(const hiprtRay& ray, float t_max, const BVHHitFilter& filter) const
+{
+    HitInfo unused_hit_info;
+
+    return traverse_dispatch<true>(ray, unused_hit_info, t_max, filter ? &filter : nullptr);
+}
+
+template <int Width>
+unsigned int WideBVH<Width>::intersect_packet(const RayPacket& packet, HitInfo* hit_infos, const BVHHitFilter& filter) const
+{
+    if (m_nodes.empty() || packet.count == 0)
+        return 0;
+
+    // The lanes past the end of the packet are tested by the SIMD
+    // intersectors too but never hit anything before a distance of 0
+    float closest_t[BVHConstants::RAY_PACKET_SIZE];
+    int closest_triangle[BVHConstants::RAY_PACKET_SIZE];
+    float2 closest_uv[BVHConstants::RAY_PACKET_SIZE];
+    for (int ray_index = 0; ray_index < BVHConstants::RAY_PACKET_SIZE; ray_index++)
+    {
+        closest_t[ray_index] = ray_index < packet.count ? packet.t_max[ray_index] : 0.0f;
+        closest_triangle[ray_index] = -1;
+    }
+
+    unsigned int packet_hit_mask = traverse_packet_dispatch<false>(packet, closest_t, closest_triangle, closest_uv, filter ? &filter : nullptr);
+    for (unsigned int mask = packet_hit_mask; mask != 0; mask &= mask - 1)
+    {
+        int ray_index = std::countr_zero(mask);
+
+        fill_hit_info(packet.rays[ray_index], closest_t[ray_index], closest_triangle[ray_index], closest_uv[ray_index], hit_infos[ray_index]);
+    }
+
+    return packet_hit_mask;
+}
+
+template <int Width>
+unsigned int WideBVH<Width>::occluded_packet(const RayPacket& packet, const BVHHitFilter& filter) const
+{
+    if (m_nodes.empty() || packet.count == 0)
+        return 0;
+
+    float t_max[BVHConstants::RAY_PACKET_SIZE];
+    int unused_triangles[BVHConstants::RAY_PACKET_SIZE];
+    float2 unused_uvs[BVHConstants::RAY_PACKET_SIZE];
+    for (int ray_index = 0; ray_index < BVHConstants::RAY_PACKET_SIZE; ray_index++)
+        t_max[ray_index] = ray_index < packet.count ? packet.t_max[ray_index] : 0.0f;
+
+    return traverse_packet_dispatch<true>(packet, t_max, unused_triangles, unused_uvs, filter ? &filter : nullptr);
+}
+
+template <int Width>
+template <bool AnyHit>
+unsigned int WideBVH<Width>::traverse_packet_dispatch(const RayPacket& packet, float* closest_t, int* closest_triangle, float2* closest_uv, const BVHHitFilter* filter) const
+{
+    switch (m_instruction_set)
+    {
+    case SIMDInstructionSet::AVX512:
+        return traverse_packet_avx512<AnyHit>(packet, closest_t, closest_triangle, closest_uv, filter);
+
+    case SIMDInstructionSet::AVX2:
+        return traverse_packet_avx2<AnyHit>(packet, closest_t, closest_triangle, closest_uv, filter);
+
+    case SIMDInstructionSet::SSE4:
+        return traverse_packet_sse4<AnyHit>(packet, closest_t, closest_triangle, closest_uv, filter);
+
+    case SIMDInstructionSet::SCALAR:
+    default:
+        return traverse_packet_scalar<AnyHit>(packet, closest_t, closest_triangle, closest_uv, filter);
+    }
+}
+
+template <int Width>
+template <bool AnyHit>
+unsigned int WideBVH<Width>::traverse_packet_scalar(const RayPacket& packet, float* closest_t, int* closest_triangle, float2* closest_uv, const BVHHitFilter* filter) const
+{
+    return traverse_packet<ScalarIntersector<Width>, ScalarPacketIntersector<Width>, AnyHit>(packet, closest_t, closest_triangle, closest_uv, filter);
+}
+
+#if CPU_FEATURES_X86
+template <int Width>
+template <bool AnyHit>
+SIMD_TARGET_SSE4 SIMD_FLATTEN unsigned int WideBVH<Width>::traverse_packet_sse4(const RayPacket& packet, float* closest_t, int* closest_triangle, float2* closest_uv, const BVHHitFilter* filter) const
+{
+    return traverse_packet<SSE4Intersector<Width>, ScalarPacketIntersector<Width>, AnyHit>(packet, closest_t, closest_triangle, closest_uv, filter);
+}
+
+template <int Width>
+template <bool AnyHit>
+SIMD_TARGET_AVX2 SIMD_FLATTEN unsigned int WideBVH<Width>::traverse_packet_avx2(const RayPacket& packet, float* closest_t, int* closest_triangle, float2* closest_uv, const BVHHitFilter* filter) const
+{
+    if constexpr (Width == 8)
+        return traverse_packet<AVX2Intersector, AVX2PacketIntersector, AnyHit>(packet, closest_t, closest_triangle, closest_uv, filter);
+    else
+        return traverse_packet<SSE4Intersector<Width>, ScalarPacketIntersector<Width>, AnyHit>(packet, closest_t, closest_triangle, closest_uv, filter);
+}
+
+template <int Width>
+template <bool AnyHit>
+SIMD_TARGET_AVX512 SIMD_FLATTEN unsigned int WideBVH<Width>::traverse_packet_avx512(const RayPacket& packet, float* closest_t, int* closest_triangle, float2* closest_uv, const BVHHitFilter* filter) const
+{
+    if constexpr (Width == 8)
+        return traverse_packet<AVX512Intersector, AVX512PacketIntersector, AnyHit>(packet, closest_t, closest_triangle, closest_uv, filter);
+    else
+        return traverse_packet<SSE4Intersector<Width>, ScalarPacketIntersector<Width>, AnyHit>(packet, closest_t, closest_triangle, closest_uv, filter);
+}
+#else
+template <int Width>
+template <bool AnyHit>
+unsigned int WideBVH<Width>::traverse_packet_sse4(const RayPacket& packet, float* closest_t, int* closest_triangle, float2* closest_uv, const BVHHitFilter* filter) const
+{
+    return traverse_packet_scalar<AnyHit>(packet, closest_t, closest_triangle, closest_uv, filter);
+}
+
+template <int Width>
+template <bool AnyHit>
+unsigned int WideBVH<Width>::traverse_packet_avx2(const RayPacket& packet, float* closest_t, int* closest_triangle, float2* closest_uv, const BVHHitFilter* filter) const
+{
+    return traverse_packet_scalar<AnyHit>(packet, closest_t, closest_triangle, closest_uv, filter);
+}
+
+template <int Width>
+template <bool AnyHit>
+unsigned int WideBVH<Width>::traverse_packet_avx512(const RayPacket& packet, float* closest_t, int* closest_triangle, float2* closest_uv, const BVHHitFilter* filter) const
+{
+    return traverse_packet_scalar<AnyHit>(packet, closest_t, closest_triangle, closest_uv, filter);
+}
+#endif
+
+template <int Width>
+template <typename Intersector, typename PacketIntersector, bool AnyHit>
+unsigned int WideBVH<Width>::traverse_packet(const RayPacket& packet, float* closest_t, int* closest_triangle, float2* closest_uv, const BVHHitFilter* filter) const
+{
+    struct StackEntry
+    {
+        // Same meaning as WideBVHNode::child_index / child_packet_count
+        int index;
+        int packet_count;
+
+        // Rays of the packet that hit the node
+        unsigned int ray_mask;
+        // Lower bound of the distance at which these rays enter the node
+        float t_enter;
+    };
+
+    PacketBoxData packet_data(packet);
+
+    // Rays that still look for a hit: all the rays for the closest hit traversal,
+    // the rays that haven't found an occluder yet for the any hit traversal
+    unsigned int active_mask = packet.get_ray_mask();
+
+    StackEntry stack[BVHConstants::WIDE_BVH_MAX_STACK_SIZE];
+    int stack_size = 0;
+    stack[stack_size++] = { 0, 0, active_mask, 0.0f };
+
+    while (stack_size > 0)
+    {
+        StackEntry entry = stack[--stack_size];
+
+        // The rays occluded since the node was pushed are done
+        unsigned int ray_mask = entry.ray_mask & active_mask;
+        if (ray_mask == 0)
+            continue;
+
+        float packet_t_max = 0.0f;
+        for (unsigned int mask = ray_mask; mask != 0; mask &= mask - 1)
+            packet_t_max = hippt::max(packet_t_max, closest_t[std::countr_zero(mask)]);
+
+        if (entry.t_enter > packet_t_max)
+            // Intersections closer than this node were found for all the rays after the node was pushed
+            continue;
+
+        if (entry.packet_count > 0 || std::popcount(ray_mask) < BVHConstants::RAY_PACKET_MIN_ACTIVE_RAYS)
+        {
+            // The triangles of the leaves are tested ray by ray. Same for the subtrees that only
+            // a few rays of the packet reach: testing the nodes for the whole packet isn't cheaper
+            // than traversing the subtree with each ray on its own once the packet has diverged
+            for (unsigned int mask = ray_mask; mask != 0; mask &= mask - 1)
+            {
+                int ray_index = std::countr_zero(mask);
+
+                bool hit = traverse_subtree<Intersector, AnyHit>(entry.index, entry.packet_count, packet_data.rays[ray_index], closest_t[ray_index], closest_triangle[ray_index], closest_uv[ray_index], filter);
+                if (AnyHit && hit)
+                    active_mask &= ~(1u << ray_index);
+            }
+
+            if (active_mask == 0)
+                break;
+
+            continue;
+        }
+
+        const WideBVHNode<Width>& node = m_nodes[entry.index];
+
+        // Cheap rejection of the children missed by the whole packet
+        float t_enter[Width];
+        unsigned int child_mask = PacketIntersector::cull_children(node, packet_data, packet_t_max, t_enter);
+
+        float hit_t_enter[Width];
+        int hit_slots[Width];
+        unsigned int hit_ray_masks[Width];
+        int hit_count = 0;
+        for (; child_mask != 0; child_mask &= child_mask - 1)
+        {
+            int slot = std::countr_zero(child_mask);
+
+            unsigned int child_ray_mask = ray_mask & PacketIntersector::intersect_child(node, slot, packet_data, closest_t);
+            if (child_ray_mask == 0)
+                continue;
+
+            hit_t_enter[hit_count] = t_enter[slot];
+            hit_slots[hit_count] = slot;
+            hit_ray_masks[hit_count] = child_ray_mask;
+            hit_count++;
+        }
+
+        if constexpr (!AnyHit)
+        {
+            // Front to back order along the packet, same insertion sort as the single ray traversal
+            for (int i = 1; i < hit_count; i++)
+            {
+                float t = hit_t_enter[i];
+                int slot = hit_slots[i];
+                unsigned int child_ray_mask = hit_ray_masks[i];
+
+                int j = i - 1;
+                for (; j >= 0 && hit_t_enter[j] > t; j--)
+                {
+                    hit_t_enter[j + 1] = hit_t_enter[j];
+                    hit_slots[j + 1] = hit_slots[j];
+                    hit_ray_masks[j + 1] = hit_ray_masks[j];
+                }
+
+                hit_t_enter[j + 1] = t;
+                hit_slots[j + 1] = slot;
+                hit_ray_masks[j + 1] = child_ray_mask;
+            }
+        }
+
+        for (int i = hit_count - 1; i >= 0; i--)
+        {
+            int slot = hit_slots[i];
+
+            stack[stack_size++] = { node.child_index[slot], node.child_packet_count[slot], hit_ray_masks[i], hit_t_enter[i] };
+        }
+    }
+
+    if constexpr (AnyHit)
+        return packet.get_ray_mask() & ~active_mask;
+    else
+    {
+        unsigned int hit_mask = 0;
+        for (int ray_index = 0; ray_index < packet.count; ray_index++)
+            if (closest_triangle[ray_index] != -1)
+                hit_mask |= 1u << ray_index;
+
+        return hit_mask;
+    }
+}
+
+template <int Width>
+template <bool AnyHit>
+bool WideBVH<Width>::traverse_dispatch(const hiprtRay& ray, HitInfo& hit_info, float t_max, const BVHHitFilter* filter) const
+{
+    switch (m_instruction_set)
+    {
+    case SIMDInstructionSet::AVX512:
+        return traverse_avx512<AnyHit>(ray, hit_info, t_max, filter);
+
+    case SIMDInstructionSet::AVX2:
+        return traverse_avx2<AnyHit>(ray, hit_info, t_max, filter);
+
+    case SIMDInstructionSet::SSE4:
+        return traverse_sse4<AnyHit>(ray, hit_info, t_max, filter);
+
+    case SIMDInstructionSet::SCALAR:
+    default:
+        return traverse_scalar<AnyHit>(ray, hit_info, t_max, filter);
+    }
+}
+
+template <int Width>
+template <bool AnyHit>
+bool WideBVH<Width>::traverse_scalar(const hiprtRay& ray, HitInfo& hit_info, float t_max, const BVHHitFilter* filter) const
+{
+    return traverse<ScalarIntersector<Width>, AnyHit>(ray, hit_info, t_max, filter);
+}
+
+#if CPU_FEATURES_X86
+template <int Width>
+template <bool AnyHit>
+SIMD_TARGET_SSE4 SIMD_FLATTEN bool WideBVH<Width>::traverse_sse4(const hiprtRay& ray, HitInfo& hit_info, float t_max, const BVHHitFilter* filter) const
+{
+    return traverse<SSE4Intersector<Width>, AnyHit>(ray, hit_info, t_max, filter);
+}
+
+template <int Width>
+template <bool AnyHit>
+SIMD_TARGET_AVX2 SIMD_FLATTEN bool WideBVH<Width>::traverse_avx2(const hiprtRay& ray, HitInfo& hit_info, float t_max, const BVHHitFilter* filter) const
+{
+    if constexpr (Width == 8)
+        return traverse<AVX2Intersector, AnyHit>(ray, hit_info, t_max, filter);
+    else
+        return traverse<SSE4Intersector<Width>, AnyHit>(ray, hit_info, t_max, filter);
+}
+
+template <int Width>
+template <bool AnyHit>
+SIMD_TARGET_AVX512 SIMD_FLATTEN bool WideBVH<Width>::traverse_avx512(const hiprtRay& ray, HitInfo& hit_info, float t_max, const BVHHitFilter* filter) const
+{
+    if constexpr (Width == 8)
+        return traverse<AVX512Intersector, AnyHit>(ray, hit_info, t_max, filter);
+    else
+        return traverse<SSE4Intersector<Width>, AnyHit>(ray, hit_info, t_max, filter);
+}
+#else
+template <int Width>
+template <bool AnyHit>
+bool WideBVH<Width>::traverse_sse4(const hiprtRay& ray, HitInfo& hit_info, float t_max, const BVHHitFilter* filter) const
+{
+    return traverse_scalar<AnyHit>(ray, hit_info, t_max, filter);
+}
+
+template <int Width>
+template <bool AnyHit>
+bool WideBVH<Width>::traverse_avx2(const hiprtRay& ray, HitInfo& hit_info, float t_max, const BVHHitFilter* filter) const
+{
+    return traverse_scalar<AnyHit>(ray, hit_info, t_max, filter);
+}
+
+template <int Width>
+template <bool AnyHit>
+bool WideBVH<Width>::traverse_avx512(const hiprtRay& ray, HitInfo& hit_info, float t_max, const BVHHitFilter* filter) const
+{
+    return traverse_scalar<AnyHit>(ray, hit_info, t_max, filter);
+}
+#endif
+
+template <int Width>
+template <typename Intersector, bool AnyHit>
+bool WideBVH<Width>::traverse(const hiprtRay& ray, HitInfo& hit_info, float t_max, const BVHHitFilter* filter) const
+{
+    if (m_nodes.empty())
+        return false;
+
+    RayBoxData ray_data(ray);
+
+    // Closest intersection found so far, used to cull the nodes that are further away.
+    // Never updated for occlusion queries since the first hit ends the traversal
+    float closest_t = t_max;
+    // Index in FlattenedBVH::m_triangles of the closest triangle hit so far
+    int closest_triangle = -1;
+    float2 closest_uv;
+
+    bool hit = traverse_subtree<Intersector, AnyHit>(0, 0, ray_data, closest_t, closest_triangle, closest_uv, filter);
+    if constexpr (AnyHit)
+        return hit;
+
+    if (!hit)
+        return false;
+
+    fill_hit_info(ray, closest_t, closest_triangle, closest_uv, hit_info);
+
+    return true;
+}
+
+template <int Width>
+template <typename Intersector, bool AnyHit>
+bool WideBVH<Width>::traverse_subtree(int root_index, int root_packet_count, const RayBoxData& ray_data, float& closest_t, int& closest_triangle, float2& closest_uv, const BVHHitFilter* filter) const
+{
+    struct StackEntry
+    {
+        // Same meaning as WideBVHNode::child_index / child_packet_count
+        int index;
+        int packet_count;
+
+        float t_near;
+    };
+
+    bool hit = false;
+
+    StackEntry stack[BVHConstants::WIDE_BVH_MAX_STACK_SIZE];
+    int stack_size = 0;
+    stack[stack_size++] = { root_index, root_packet_count, 0.0f };
+
+    while (stack_size > 0)
+    {
+        StackEntry entry = stack[--stack_size];
+        if (entry.t_near > closest_t)
+            // An intersection closer than this node was found after the node was pushed
+            continue;
+
+        if (entry.packet_count > 0)
+        {
+            for (int packet_index = entry.index; packet_index < entry.index + entry.packet_count; packet_index++)
+            {
+                const WideBVHTrianglePacket<Width>& packet = m_packets[packet_index];
+
+                float t[Width], u[Width], v[Width];
+                unsigned int hit_mask = Intersector::intersect_packet(packet, ray_data, closest_t, t, u, v);
+                while (hit_mask)
+                {
+                    int lane = std::countr_zero(hit_mask);
+                    hit_mask &= hit_mask - 1;
+
+                    if constexpr (AnyHit)
+                    {
+                        if (filter == nullptr || (*filter)(m_flattened_bvh->m_triangle_ids[packet.triangle_index[lane]], make_float2(u[lane], v[lane])))
+                            return true;
+                    }
+                    else if (t[lane] < closest_t && (filter == nullptr || (*filter)(m_flattened_bvh->m_triangle_ids[packet.triangle_index[lane]], make_float2(u[lane], v[lane]))))
+                    {
+                        closest_t = t[lane];
+                        closest_triangle = packet.triangle_index[lane];
+                        closest_uv = make_float2(u[lane], v[lane]);
+                        hit = true;
+                    }
+                }
+            }
+
+            continue;
+        }
+
+        const WideBVHNode<Width>& node = m_nodes[entry.index];
+
+        alignas(32) float hit_t_near[Width];
+        alignas(32) int hit_slots[Width];
+        int hit_count = Intersector::intersect_children(node, ray_data, closest_t, hit_t_near, hit_slots);
+
+        if constexpr (!AnyHit)
+        {
+            // Sorting the children hit front to back. There are at most
+            // Width of them so an insertion sort is the fastest
+            for (int i = 1; i < hit_count; i++)
+            {
+                float t_near = hit_t_near[i];
+                int slot = hit_slots[i];
+
+                int j = i - 1;
+                for (; j >= 0 && hit_t_near[j] > t_near; j--)
+                {
+                    hit_t_near[j + 1] = hit_t_near[j];
+                    hit_slots[j + 1] = hit_slots[j];
+                }
+
+                hit_t_near[j + 1] = t_near;
+                hit_slots[j + 1] = slot;
+            }
+        }
+
+        // Pushing the farthest children first so that the closest one is popped next
+        for (int i = hit_count - 1; i >= 0; i--)
+        {
+            int slot = hit_slots[i];
+
+            stack[stack_size++] = { node.child_index[slot], node.child_packet_count[slot], hit_t_near[i] };
+        }
+    }
+
+    return hit;
+}
+
+template <int Width>
+void WideBVH<Width>::fill_hit_info(const hiprtRay& ray, float t, int triangle_index, const float2& uv, HitInfo& hit_info) const
+{
+    // The attributes of the hit are only computed for the closest
+    // triangle, not for every triangle hit during the traversal
+    const Triangle& triangle = m_flattened_bvh->m_triangles[triangle_index];
+
+    hit_info.t = t;
+    hit_info.uv = uv;
+    hit_info.inter_point = ray.origin + ray.direction * t;
+    hit_info.geometric_normal = hippt::normalize(hippt::cross(triangle.m_b - triangle.m_a, triangle.m_c - triangle.m_a));
+    hit_info.primitive_index = m_flattened_bvh->m_triangle_ids[triangle_index];
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
@@ -0,0 +1,236 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include "HostDeviceCommon/AlignMacro.h"
+#include "HostDeviceCommon/HitInfo.h"
+#include "Renderer/BVHConstants.h"
+#include "Renderer/CPUFeatures.h"
+#include "Renderer/FlattenedBVH.h"
+#include "Renderer/RayPacket.h"
+
+#include <span>
+#include <vector>
+
+#include <hiprt/hiprt_types.h> // for hiprtRay
+
+/**
+ * Node of a BVH with up to Width children.
+ *
+ * The axis-aligned boxes of the children are stored in a structure-of-arrays
+ * layout so that all the children of a node can be tested against a ray
+ * with a handful of SIMD instructions: bounds[0..2][i] is the min corner
+ * (x, y, z) of the box of the child i, bounds[3..5][i] is the max corner.
+ *
+ * Unused child slots have an empty box (min = +inf, max = -inf) that a ray never hits
+ */
+template <int Width>
+struct ALIGN(64) WideBVHNode
+{
+    float bounds[6][Width];
+
+    // If the child is a leaf, index of its first triangle packet in WideBVH::m_packets.
+    // If the child is an interior node, index of the child in WideBVH::m_nodes.
+    // -1 for unused slots
+    int child_index[Width];
+    // Number of triangle packets of the child if it is a leaf, 0 for interior nodes and unused slots
+    int child_packet_count[Width];
+};
+
+/**
+ * Up to Width triangles of a leaf of a WideBVH, stored in a structure-of-arrays
+ * layout with their edges precomputed so that the packet can be intersected
+ * with a single SIMD Moller-Trumbore test.
+ *
+ * Unused lanes have null edges, which the intersection test always rejects
+ */
+template <int Width>
+struct ALIGN(32) WideBVHTrianglePacket
+{
+    // First vertex (x, y, z) of each triangle
+    float vertex_a[3][Width];
+    // b - a and c - a of each triangle
+    float edge1[3][Width];
+    float edge2[3][Width];
+
+    // Index of each triangle in FlattenedBVH::m_triangles, -1 for unused lanes
+    int triangle_index[Width];
+};
+
+/**
+ * BVH4 / BVH8 used for the traversal on the CPU.
+ *
+ * It is built by collapsing the nodes of a binary FlattenedBVH: the interior
+ * child with the largest surface area is replaced by its own children until the node
+ * has Width children. This divides the depth of the tree (and the number of
+ * stack operations) by up to log2(Width) and allows the boxes of all the children
+ * of a node to be tested at once with SSE (BVH4) or AVX2 / AVX-512 (BVH8).
+ *
+ * The triangles of the leaves are repacked into WideBVHTrianglePackets for
+ * the traversal. The triangles of the FlattenedBVH the wide BVH was built from
+ * are only read once the closest hit is known, to compute its normal and
+ * primitive index. That FlattenedBVH must thus outlive the WideBVH.
+ */
+template <int Width>
+class WideBVH
+{
+public:
+    static_assert(Width == 4 || Width == 8, "Only BVH4 and BVH8 are supported");
+
+    /**
+     * Per-ray data precomputed once before the traversal
+     * and reused for every node
+     */
+    struct RayBoxData
+    {
+        RayBoxData() {}
+        RayBoxData(const hiprtRay& ray);
+
+        float origin[3];
+        float direction[3];
+        float inverse_direction[3];
+
+        // Index in WideBVHNode::bounds of the plane of each axis that the ray
+        // enters the box through (the min plane if the direction is positive
+        // on that axis, the max plane otherwise) and of the plane the ray exits through
+        int near_plane[3];
+        int far_plane[3];
+    };
+
+    /**
+     * Per-packet data of the packet traversals, for coherent packets only (RayPacket::is_coherent()):
+     * all the rays then enter the boxes through the same planes.
+     *
+     * Holds the per-ray data of each ray, the rays in structure of arrays (one lane per ray, the lanes
+     * past the end of the packet hold copies of its first ray) and the range of the origins and
+     * inverse directions of the rays along each axis for the interval arithmetic culling of the children
+     */
+    struct PacketBoxData
+    {
+        PacketBoxData(const RayPacket& packet);
+
+        RayBoxData rays[BVHConstants::RAY_PACKET_SIZE];
+
+        alignas(64) float lane_origins[3][BVHConstants::RAY_PACKET_SIZE];
+        alignas(64) float lane_inverse_directions[3][BVHConstants::RAY_PACKET_SIZE];
+
+        float origin_min[3];
+        float origin_max[3];
+        float inverse_direction_min[3];
+        float inverse_direction_max[3];
+
+        int near_plane[3];
+        int far_plane[3];
+    };
+
+    WideBVH(const FlattenedBVH& flattened_bvh, SIMDInstructionSet instruction_set = CPUFeatures::get_best_simd_instruction_set());
+
+    bool intersect(const hiprtRay& ray, HitInfo& hit_info, const BVHHitFilter& filter = nullptr) const;
+    /**
+     * Any-hit query, same as FlattenedBVH::occluded(). The children hit
+     * are not sorted and the traversal stops at the first accepted hit
+     */
+    bool occluded(const hiprtRay& ray, float t_max, const BVHHitFilter& filter = nullptr) const;
+
+    /**
+     * Packet versions of intersect() and occluded() for coherent packets (RayPacket::is_coherent()),
+     * same results as tracing the rays one by one.
+     *
+     * The children of the nodes that none of the rays can hit are culled with a single interval
+     * arithmetic test for all the rays, the remaining children are tested against all the rays of the
+     * packet at once (one ray per SIMD lane). Once fewer than BVHConstants::RAY_PACKET_MIN_ACTIVE_RAYS
+     * rays of the packet hit a node, these rays traverse the subtree of that node one by one.
+     *
+     * intersect_packet() returns the mask of the rays that hit something and fills their hit_info,
+     * occluded_packet() returns the mask of the occluded rays
+     */
+    unsigned int intersect_packet(const RayPacket& packet, HitInfo* hit_infos, const BVHHitFilter& filter = nullptr) const;
+    unsigned int occluded_packet(const RayPacket& packet, const BVHHitFilter& filter = nullptr) const;
+
+    /**
+     * Updates the boxes of the nodes and the triangle packets after the
+     * FlattenedBVH this wide BVH was built from has been refit (FlattenedBVH::refit()).
+     * The topology of the wide BVH is unchanged
+     */
+    void refit();
+
+    SIMDInstructionSet get_instruction_set() const;
+    /**
+     * Fraction of the lanes of the triangle packets that hold
+     * a triangle, between 0 and 1
+     */
+    float get_lane_occupancy() const;
+
+    std::vector<WideBVHNode<Width>> m_nodes;
+    std::vector<WideBVHTrianglePacket<Width>> m_packets;
+
+private:
+    // Range of FlattenedBVH::m_triangles covered by the subtree of a node of the FlattenedBVH
+    struct SubtreeTriangles
+    {
+        int first_triangle;
+        int triangle_count;
+    };
+
+    std::vector<SubtreeTriangles> compute_subtree_triangles() const;
+    bool is_leaf_child(int flattened_node_index, std::span<const SubtreeTriangles> subtree_triangles) const;
+    int collapse_node(int flattened_node_index, std::span<const SubtreeTriangles> subtree_triangles);
+    int create_leaf_packets(int first_triangle, int triangle_count);
+    void set_packet_triangle(WideBVHTrianglePacket<Width>& packet, int lane, int triangle_index) const;
+
+    // One entry point per instruction set so that the traversal
+    // loop gets compiled (and inlined) for each of them.
+    //
+    // If AnyHit is true, the traversal is an occlusion query that
+    // returns as soon as a hit closer than t_max is found.
+    template <bool AnyHit>
+    bool traverse_dispatch(const hiprtRay& ray, HitInfo& hit_info, float t_max, const BVHHitFilter* filter) const;
+    template <bool AnyHit>
+    bool traverse_scalar(const hiprtRay& ray, HitInfo& hit_info, float t_max, const BVHHitFilter* filter) const;
+    template <bool AnyHit>
+    bool traverse_sse4(const hiprtRay& ray, HitInfo& hit_info, float t_max, const BVHHitFilter* filter) const;
+    template <bool AnyHit>
+    bool traverse_avx2(const hiprtRay& ray, HitInfo& hit_info, float t_max, const BVHHitFilter* filter) const;
+    template <bool AnyHit>
+    bool traverse_avx512(const hiprtRay& ray, HitInfo& hit_info, float t_max, const BVHHitFilter* filter) const;
+
+    template <typename Intersector, bool AnyHit>
+    bool traverse(const hiprtRay& ray, HitInfo& hit_info, float t_max, const BVHHitFilter* filter) const;
+    // Traversal of the subtree of the given node (index and packet count as in WideBVHNode)
+    // for one ray. closest_t, closest_triangle and closest_uv are updated with the hits found.
+    // Returns true if a hit was found
+    template <typename Intersector, bool AnyHit>
+    bool traverse_subtree(int root_index, int root_packet_count, const RayBoxData& ray_data, float& closest_t, int& closest_triangle, float2& closest_uv, const BVHHitFilter* filter) const;
+
+    // Same structure as above for the packet traversals. closest_t holds the distance up to which
+    // each ray of the packet looks for hits and is updated with the closest hits found. Returns
+    // the mask of the occluded rays if AnyHit is true, of the rays that hit something otherwise
+    template <bool AnyHit>
+    unsigned int traverse_packet_dispatch(const RayPacket& packet, float* closest_t, int* closest_triangle, float2* closest_uv, const BVHHitFilter* filter) const;
+    template <bool AnyHit>
+    unsigned int traverse_packet_scalar(const RayPacket& packet, float* closest_t, int* closest_triangle, float2* closest_uv, const BVHHitFilter* filter) const;
+    template <bool AnyHit>
+    unsigned int traverse_packet_sse4(const RayPacket& packet, float* closest_t, int* closest_triangle, float2* closest_uv, const BVHHitFilter* filter) const;
+    template <bool AnyHit>
+    unsigned int traverse_packet_avx2(const RayPacket& packet, float* closest_t, int* closest_triangle, float2* closest_uv, const BVHHitFilter* filter) const;
+    template <bool AnyHit>
+    unsigned int traverse_packet_avx512(const RayPacket& packet, float* closest_t, int* closest_triangle, float2* closest_uv, const BVHHitFilter* filter) const;
+
+    template <typename Intersector, typename PacketIntersector, bool AnyHit>
+    unsigned int traverse_packet(const RayPacket& packet, float* closest_t, int* closest_triangle, float2* closest_uv, const BVHHitFilter* filter) const;
+
+    void fill_hit_info(const hiprtRay& ray, float t, int triangle_index, const float2& uv, HitInfo& hit_info) const;
+
+    // Index in the FlattenedBVH of the node that each child slot of each wide node
+    // was collapsed from (Width entries per node, -1 for unused slots). Used by refit()
+    std::vector<int> m_child_flattened_nodes;
+
+    const FlattenedBVH* m_flattened_bvh;
+    SIMDInstructionSet m_instruction_set;
+};
+
+#endif
@@ -18,9 +18,11 @@ HIPRTCamera Camera::to_hiprt()
     glm::mat4x4 view_matrix = get_view_matrix();
     glm::mat4x4 view_matrix_inv = glm::inverse(view_matrix);
     glm::mat4x4 projection_matrix_inv = glm::inverse(projection_matrix);
+    glm::mat4x4 view_projection = projection_matrix * view_matrix;
 
     hiprt_cam.inverse_view = *reinterpret_cast<float4x4*>(&view_matrix_inv);
     hiprt_cam.inverse_projection = *reinterpret_cast<float4x4*>(&projection_matrix_inv);
+    hiprt_cam.view_projection = *reinterpret_cast<float4x4*>(&view_projection);
     hiprt_cam.position = matrix_X_point(hiprt_cam.inverse_view, make_hiprtFloat3(0, 0, 0));
 
     return hiprt_cam;
@@ -3,16 +3,23 @@
  * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
  */
 
+#include "HostDeviceCommon/AlphaMask.h"
 #include "Image/Image.h"
+#include "Renderer/AABB.h"
 #include "Scene/SceneParser.h"
 #include "Threads/ThreadFunctions.h"
 #include "Threads/ThreadManager.h"
 #include "Threads/ThreadState.h"
 
 #define GLM_ENABLE_EXPERIMENTAL
+#include "glm/gtc/matrix_inverse.hpp"
+#include "glm/gtc/type_ptr.hpp"
 #include "glm/gtx/matrix_decompose.hpp"
 
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <iostream>
 #include <memory>
 
 void SceneParser::parse_scene_file(const std::string& scene_filepath, Scene& parsed_scene, SceneParserOptions& options)
@@ -20,7 +27,9 @@ void SceneParser::parse_scene_file(const std::string& scene_filepath, Scene& par
     Assimp::Importer importer;
     const aiScene* scene;
 
-    scene = importer.ReadFile(scene_filepath, aiPostProcessSteps::aiProcess_PreTransformVertices | aiPostProcessSteps::aiProcess_Triangulate);
+    // Not using aiProcess_PreTransformVertices: the transforms of the nodes are kept
+    // as instances so that instanced meshes are only stored once
+    scene = importer.ReadFile(scene_filepath, aiPostProcessSteps::aiProcess_Triangulate);
     if (scene == nullptr)
     {
         std::cerr << importer.GetErrorString() << std::endl;
@@ -72,10 +81,15 @@ void SceneParser::parse_scene_file(const std::string& scene_filepath, Scene& par
         RendererMaterial& renderer_material = parsed_scene.materials[mesh_index];
         read_material_properties(mesh_material, renderer_material);
 
-        //Adding the material to the parsed scene
-        bool is_mesh_emissive = renderer_material.is_emissive();
-
         parsed_scene.material_names[mesh_index] = material_name;
+
+        SceneMesh scene_mesh;
+        scene_mesh.first_triangle = parsed_scene.triangle_indices.size() / 3;
+        scene_mesh.triangle_count = mesh->mNumFaces;
+        scene_mesh.first_vertex = parsed_scene.vertices_positions.size();
+        scene_mesh.vertex_count = mesh->mNumVertices;
+        parsed_scene.meshes.push_back(scene_mesh);
+
         // Inserting the normals if present
         if (mesh->HasNormals())
             parsed_scene.vertex_normals.insert(parsed_scene.vertex_normals.end(),
@@ -102,7 +116,6 @@ void SceneParser::parse_scene_file(const std::string& scene_filepath, Scene& par
             reinterpret_cast<hiprtFloat3*>(&mesh->mVertices[0]), 
             reinterpret_cast<hiprtFloat3*>(&mesh->mVertices[mesh->mNumVertices]));
         
-        int max_mesh_index_offset = 0;
         for (int face_index = 0; face_index < mesh->mNumFaces; face_index++)
         {
             aiFace face = mesh->mFaces[face_index];
@@ -111,17 +124,9 @@ void SceneParser::parse_scene_file(const std::string& scene_filepath, Scene& par
             int index_2 = face.mIndices[1];
             int index_3 = face.mIndices[2];
 
-            // Accumulating the maximum index of this mesh, this is to know
-            max_mesh_index_offset = std::max(max_mesh_index_offset, std::max(index_1, std::max(index_2, index_3)));
-
             parsed_scene.triangle_indices.push_back(index_1 + global_indices_offset);
             parsed_scene.triangle_indices.push_back(index_2 + global_indices_offset);
             parsed_scene.triangle_indices.push_back(index_3 + global_indices_offset);
-
-            // If the face that we just pushed in the triangle buffer is emissive,
-            // we're going to add its index to the emissive triangles buffer
-            if (is_mesh_emissive)
-                parsed_scene.emissive_triangle_indices.push_back(parsed_scene.triangle_indices.size() / 3 - 1);
         }
 
         // We're pushing the same material index for all the faces of this mesh
@@ -132,15 +137,43 @@ void SceneParser::parse_scene_file(const std::string& scene_filepath, Scene& par
         // ASSIMP sees it as composed of as many meshes as there are different materials
         parsed_scene.material_indices.insert(parsed_scene.material_indices.end(), mesh->mNumFaces, mesh_index);
 
-        // If the max index of the mesh was 19, we want the next to start
-        // at 20, not 19, so we ++
-        max_mesh_index_offset++;
-        // Adding the maximum index of the mesh to our global indices offset 
-        global_indices_offset += max_mesh_index_offset;
+        // The next mesh starts right after all the vertices of this mesh, even the ones that
+        // no face references, so that the vertices of a mesh are at
+        // [first_vertex, first_vertex + vertex_count) in the vertex buffers
+        global_indices_offset += mesh->mNumVertices;
+    }
+
+    std::map<std::vector<int>, int> object_indices;
+    parse_instances(scene->mRootNode, aiMatrix4x4(), parsed_scene, object_indices);
+
+    // The emissive triangles are added once per instance because each
+    // instance is a different light source
+    size_t instanced_triangle_count = 0;
+    for (int instance_index = 0; instance_index < parsed_scene.instances.size(); instance_index++)
+    {
+        const SceneObject& object = parsed_scene.objects[parsed_scene.instances[instance_index].object_index];
+        for (int mesh_index : object.mesh_indices)
+        {
+            const SceneMesh& mesh = parsed_scene.meshes[mesh_index];
+            instanced_triangle_count += mesh.triangle_count;
+
+            if (!parsed_scene.materials[mesh_index].is_emissive())
+                continue;
+
+            for (int triangle_index = mesh.first_triangle; triangle_index < mesh.first_triangle + mesh.triangle_count; triangle_index++)
+            {
+                parsed_scene.emissive_triangle_indices.push_back(triangle_index);
+                parsed_scene.emissive_triangle_instances.push_back(instance_index);
+            }
+        }
     }
 
+    if (options.bake_instances)
+        parsed_scene.bake_instances();
+
     std::cout << "\t" << parsed_scene.vertices_positions.size() << " vertices" << std::endl;
-    std::cout << "\t" << parsed_scene.triangle_indices.size() / 3 << " triangles" << std::endl;
+    std::cout << "\t" << parsed_scene.triangle_indices.size() / 3 << " unique triangles, " << instanced_triangle_count << " instanced triangles" << std::endl;
+    std::cout << "\t" << parsed_scene.instances.size() << " instances of " << parsed_scene.objects.size() << " objects" << std::endl;
     std::cout << "\t" << parsed_scene.emissive_triangle_indices.size() << " emissive triangles" << std::endl;
     std::cout << "\t" << parsed_scene.materials.size() << " materials" << std::endl;
     std::cout << "\t" << parsed_scene.textures.size() << " textures" << std::endl;
@@ -153,9 +186,19 @@ void SceneParser::parse_camera(const aiScene* scene, Scene& parsed_scene, float
     {
         aiCamera* camera = scene->mCameras[0];
 
-        glm::vec3 camera_position = *reinterpret_cast<glm::vec3*>(&camera->mPosition);
-        glm::vec3 camera_lookat = *reinterpret_cast<glm::vec3*>(&camera->mLookAt);
-        glm::vec3 camera_up = *reinterpret_cast<glm::vec3*>(&camera->mUp);
+        // The camera is given in the space of its node, bringing it to world space
+        // the same way aiProcess_PreTransformVertices does
+        aiMatrix4x4 camera_transform;
+        for (const aiNode* node = scene->mRootNode->FindNode(camera->mName); node != nullptr; node = node->mParent)
+            camera_transform = node->mTransformation * camera_transform;
+
+        aiVector3D world_position = camera_transform * camera->mPosition;
+        aiVector3D world_lookat = aiMatrix3x3(camera_transform) * camera->mLookAt;
+        aiVector3D world_up = aiMatrix3x3(camera_transform) * camera->mUp;
+
+        glm::vec3 camera_position = *reinterpret_cast<glm::vec3*>(&world_position);
+        glm::vec3 camera_lookat = *reinterpret_cast<glm::vec3*>(&world_lookat);
+        glm::vec3 camera_up = *reinterpret_cast<glm::vec3*>(&world_up);
 
         glm::mat4x4 lookat = glm::inverse(glm::lookAt(camera_position, camera_lookat, camera_up));
 
@@ -196,6 +239,320 @@ void SceneParser::parse_camera(const aiScene* scene, Scene& parsed_scene, float
     }
 }
 
+void SceneParser::parse_instances(const aiNode* node, const aiMatrix4x4& parent_transform, Scene& parsed_scene, std::map<std::vector<int>, int>& object_indices)
+{
+    aiMatrix4x4 transform = parent_transform * node->mTransformation;
+
+    if (node->mNumMeshes > 0)
+    {
+        std::vector<int> mesh_indices(node->mMeshes, node->mMeshes + node->mNumMeshes);
+
+        int object_index;
+        auto find = object_indices.find(mesh_indices);
+        if (find == object_indices.end())
+        {
+            // First time we're seeing these meshes, this is a new object
+            object_index = parsed_scene.objects.size();
+            object_indices[mesh_indices] = object_index;
+
+            SceneObject object;
+            object.mesh_indices = mesh_indices;
+            parsed_scene.objects.push_back(object);
+        }
+        else
+            object_index = find->second;
+
+        SceneInstance instance;
+        instance.object_index = object_index;
+        // ASSIMP matrices are row-major, float4x4 is column-major (like glm)
+        for (int row = 0; row < 4; row++)
+            for (int column = 0; column < 4; column++)
+                instance.transform.m[column][row] = transform[row][column];
+
+        parsed_scene.instances.push_back(instance);
+    }
+
+    for (int child_index = 0; child_index < node->mNumChildren; child_index++)
+        parse_instances(node->mChildren[child_index], transform, parsed_scene, object_indices);
+}
+
+float4x4 SceneInstance::get_normal_transform() const
+{
+    // Only the linear part, the translation doesn't apply to normals and
+    // would end up in the W row of the matrix with a full 4x4 inverse transpose
+    glm::mat4 normal_transform = glm::mat4(glm::inverseTranspose(glm::mat3(glm::make_mat4(&transform.m[0][0]))));
+
+    return *reinterpret_cast<float4x4*>(&normal_transform);
+}
+
+float4x4 SceneInstance::get_inverse_transform() const
+{
+    glm::mat4 inverse_transform = glm::inverse(glm::make_mat4(&transform.m[0][0]));
+
+    return *reinterpret_cast<float4x4*>(&inverse_transform);
+}
+
+void Scene::bake_instances()
+{
+    std::vector<int> baked_triangle_indices;
+    std::vector<float3> baked_vertices_positions;
+    std::vector<unsigned char> baked_has_vertex_normals;
+    std::vector<float3> baked_vertex_normals;
+    std::vector<float2> baked_texcoords;
+    std::vector<int> baked_emissive_triangle_indices;
+    std::vector<int> baked_material_indices;
+    std::vector<SceneMesh> baked_meshes;
+    SceneObject baked_object;
+
+    for (const SceneInstance& instance : instances)
+    {
+        float4x4 normal_transform = instance.get_normal_transform();
+
+        for (int mesh_index : objects[instance.object_index].mesh_indices)
+        {
+            const SceneMesh& mesh = meshes[mesh_index];
+
+            SceneMesh baked_mesh;
+            baked_mesh.first_triangle = baked_material_indices.size();
+            baked_mesh.triangle_count = mesh.triangle_count;
+            baked_mesh.first_vertex = baked_vertices_positions.size();
+            baked_mesh.vertex_count = mesh.vertex_count;
+
+            for (int vertex_index = mesh.first_vertex; vertex_index < mesh.first_vertex + mesh.vertex_count; vertex_index++)
+            {
+                baked_vertices_positions.push_back(matrix_X_point(instance.transform, vertices_positions[vertex_index]));
+                if (has_vertex_normals[vertex_index])
+                    baked_vertex_normals.push_back(hippt::normalize(matrix_X_vec(normal_transform, vertex_normals[vertex_index])));
+                else
+                    baked_vertex_normals.push_back(vertex_normals[vertex_index]);
+                baked_has_vertex_normals.push_back(has_vertex_normals[vertex_index]);
+                baked_texcoords.push_back(texcoords[vertex_index]);
+            }
+
+            bool is_mesh_emissive = materials[mesh_index].is_emissive();
+            for (int triangle_index = mesh.first_triangle; triangle_index < mesh.first_triangle + mesh.triangle_count; triangle_index++)
+            {
+                for (int i = 0; i < 3; i++)
+                    baked_triangle_indices.push_back(triangle_indices[triangle_index * 3 + i] - mesh.first_vertex + baked_mesh.first_vertex);
+
+                if (is_mesh_emissive)
+                    baked_emissive_triangle_indices.push_back(baked_material_indices.size());
+                baked_material_indices.push_back(material_indices[triangle_index]);
+            }
+
+            baked_object.mesh_indices.push_back(baked_meshes.size());
+            baked_meshes.push_back(baked_mesh);
+        }
+    }
+
+    triangle_indices = std::move(baked_triangle_indices);
+    vertices_positions = std::move(baked_vertices_positions);
+    has_vertex_normals = std::move(baked_has_vertex_normals);
+    vertex_normals = std::move(baked_vertex_normals);
+    texcoords = std::move(baked_texcoords);
+    material_indices = std::move(baked_material_indices);
+    emissive_triangle_indices = std::move(baked_emissive_triangle_indices);
+    // Everything is in world space now, all the emissive triangles belong to the single identity instance
+    emissive_triangle_instances.assign(emissive_triangle_indices.size(), 0);
+
+    meshes = std::move(baked_meshes);
+    objects = { baked_object };
+    instances = { SceneInstance() };
+}
+
+/**
+ * First and last texel (inclusive) along one axis of a texture of the given size that
+ * are read for the texture coordinates in [uv_min, uv_max]. 'flip' is true for the V
+ * axis which is flipped by the texture addressing
+ */
+static void texel_range(float uv_min, float uv_max, int size, bool flip, int& first_texel, int& last_texel)
+{
+    // The interpolated texture coordinates may be slightly
+    // out of the range of the texture coordinates of the vertices
+    uv_min -= 1.0e-5f;
+    uv_max += 1.0e-5f;
+
+    if (std::floor(uv_min) != std::floor(uv_max))
+    {
+        // The range wraps around the texture
+        first_texel = 0;
+        last_texel = size - 1;
+
+        return;
+    }
+
+    // The texel index grows with the texture coordinate within a repeat period (and
+    // decreases for the flipped axis) so the ends of the range give the texel range
+    int2 dims = make_int2(size, size);
+    int texel_min = flip ? texel_from_uv(make_float2(0.0f, uv_max), dims).y : texel_from_uv(make_float2(uv_min, 0.0f), dims).x;
+    int texel_max = flip ? texel_from_uv(make_float2(0.0f, uv_min), dims).y : texel_from_uv(make_float2(uv_max, 0.0f), dims).x;
+
+    first_texel = std::min(texel_min, texel_max);
+    last_texel = std::max(texel_min, texel_max);
+}
+
+void Scene::compute_triangle_opacities()
+{
+    int triangle_count = triangle_indices.size() / 3;
+
+    triangle_opacities.assign(triangle_count, TRIANGLE_OPAQUE);
+    alpha_mask_bits.clear();
+    alpha_mask_offsets.assign(textures.size(), -1);
+
+    // The triangles are processed texture by texture so that only
+    // one summed area table is alive at a time
+    std::vector<std::vector<int>> texture_triangles(textures.size());
+    for (int triangle_index = 0; triangle_index < triangle_count; triangle_index++)
+    {
+        int texture_index = materials[material_indices[triangle_index]].base_color_texture_index;
+        if (texture_index != -1)
+            texture_triangles[texture_index].push_back(triangle_index);
+    }
+
+    int transparent_count = 0;
+    int masked_count = 0;
+    for (int texture_index = 0; texture_index < textures.size(); texture_index++)
+    {
+        if (texture_triangles[texture_index].empty())
+            continue;
+
+        const ImageRGBA& texture = textures[texture_index];
+        int width = texture.width;
+        int height = texture.height;
+
+        // Summed area table of the number of opaque texels. opaque_texels_sat[x + y * (width + 1)]
+        // is the number of opaque texels in the rectangle [0, x[ x [0, y[ of the texture
+        std::vector<int> opaque_texels_sat((width + 1) * (height + 1), 0);
+        std::vector<unsigned int> mask((width * height + 31) / 32, 0u);
+        for (int y = 0; y < height; y++)
+        {
+            int row_opaque_count = 0;
+            for (int x = 0; x < width; x++)
+            {
+                int texel_index = x + y * width;
+                if (texture[texel_index].a >= 1.0f)
+                {
+                    mask[texel_index / 32] |= 1u << (texel_index % 32);
+                    row_opaque_count++;
+                }
+
+                opaque_texels_sat[(x + 1) + (y + 1) * (width + 1)] = opaque_texels_sat[(x + 1) + y * (width + 1)] + row_opaque_count;
+            }
+        }
+
+        if (opaque_texels_sat.back() == width * height)
+            // Fully opaque texture, the triangles that use it stay opaque
+            continue;
+
+        alpha_mask_offsets[texture_index] = alpha_mask_bits.size();
+        alpha_mask_bits.insert(alpha_mask_bits.end(), mask.begin(), mask.end());
+
+        for (int triangle_index : texture_triangles[texture_index])
+        {
+            float2 texcoords_a = texcoords[triangle_indices[triangle_index * 3 + 0]];
+            float2 texcoords_b = texcoords[triangle_indices[triangle_index * 3 + 1]];
+            float2 texcoords_c = texcoords[triangle_indices[triangle_index * 3 + 2]];
+
+            // The texels of the bounding box of the UV footprint of the triangle. The triangle itself
+            // may cover less texels so this may classify as masked a triangle that is fully opaque or
+            // transparent but never the opposite
+            int x0, x1, y0, y1;
+            texel_range(std::min({ texcoords_a.x, texcoords_b.x, texcoords_c.x }), std::max({ texcoords_a.x, texcoords_b.x, texcoords_c.x }), width, false, x0, x1);
+            texel_range(std::min({ texcoords_a.y, texcoords_b.y, texcoords_c.y }), std::max({ texcoords_a.y, texcoords_b.y, texcoords_c.y }), height, true, y0, y1);
+
+            int opaque_count = opaque_texels_sat[(x1 + 1) + (y1 + 1) * (width + 1)] - opaque_texels_sat[x0 + (y1 + 1) * (width + 1)]
+                             - opaque_texels_sat[(x1 + 1) + y0 * (width + 1)] + opaque_texels_sat[x0 + y0 * (width + 1)];
+            int texel_count = (x1 - x0 + 1) * (y1 - y0 + 1);
+
+            if (opaque_count == 0)
+            {
+                triangle_opacities[triangle_index] = TRIANGLE_TRANSPARENT;
+                transparent_count++;
+            }
+            else if (opaque_count < texel_count)
+            {
+                triangle_opacities[triangle_index] = TRIANGLE_MASKED;
+                masked_count++;
+            }
+        }
+    }
+
+    if (transparent_count == 0 && masked_count == 0)
+    {
+        // Nothing to skip during the traversals
+        triangle_opacities.clear();
+        alpha_mask_bits.clear();
+        alpha_mask_offsets.clear();
+
+        return;
+    }
+
+    std::cout << "Alpha testing: " << transparent_count << " transparent and " << masked_count << " masked triangles, "
+        << alpha_mask_bits.size() * sizeof(unsigned int) / 1024 << "KB of alpha masks" << std::endl;
+}
+
+void Scene::compute_emissive_triangles()
+{
+    int emissive_triangle_count = emissive_triangle_indices.size();
+
+    emissive_triangles.resize(emissive_triangle_count);
+#pragma omp parallel for
+    for (int i = 0; i < emissive_triangle_count; i++)
+    {
+        int triangle_index = emissive_triangle_indices[i];
+        int instance_index = emissive_triangle_instances.empty() ? -1 : emissive_triangle_instances[i];
+
+        float3 vertices[3];
+        for (int vertex = 0; vertex < 3; vertex++)
+        {
+            vertices[vertex] = vertices_positions[triangle_indices[triangle_index * 3 + vertex]];
+            if (instance_index != -1)
+                vertices[vertex] = matrix_X_point(instances[instance_index].transform, vertices[vertex]);
+        }
+
+        emissive_triangles[i] = make_emissive_triangle(vertices[0], vertices[1], vertices[2], material_indices[triangle_index]);
+    }
+
+    emissive_triangles_power_sum = build_emissive_triangles_alias_table(emissive_triangles, materials, emissive_triangles_alias_probabilities, emissive_triangles_aliases);
+}
+
+float Scene::compute_bounding_sphere_radius() const
+{
+    if (instances.empty())
+    {
+        // The vertices are already in world space
+        AABB scene_bounds;
+        for (const float3& vertex : vertices_positions)
+            scene_bounds.extend(vertex);
+
+        return scene_bounds.is_empty() ? 0.0f : hippt::length(scene_bounds.extent()) * 0.5f;
+    }
+
+    std::vector<AABB> object_bounds(objects.size());
+    for (int object_index = 0; object_index < objects.size(); object_index++)
+        for (int mesh_index : objects[object_index].mesh_indices)
+            for (int vertex_index = meshes[mesh_index].first_vertex; vertex_index < meshes[mesh_index].first_vertex + meshes[mesh_index].vertex_count; vertex_index++)
+                object_bounds[object_index].extend(vertices_positions[vertex_index]);
+
+    AABB scene_bounds;
+    for (const SceneInstance& instance : instances)
+    {
+        const AABB& bounds = object_bounds[instance.object_index];
+        if (bounds.is_empty())
+            continue;
+
+        // Bounding box of the 8 transformed corners of the box of the object
+        for (int corner = 0; corner < 8; corner++)
+        {
+            float3 point = make_float3(corner & 1 ? bounds.m_max.x : bounds.m_min.x, corner & 2 ? bounds.m_max.y : bounds.m_min.y, corner & 4 ? bounds.m_max.z : bounds.m_min.z);
+
+            scene_bounds.extend(matrix_X_point(instance.transform, point));
+        }
+    }
+
+    return scene_bounds.is_empty() ? 0.0f : hippt::length(scene_bounds.extent()) * 0.5f;
+}
+
 void SceneParser::prepare_textures(const aiScene* scene, std::vector<std::pair<aiTextureType, std::string>>& texture_paths, std::vector<ParsedMaterialTextureIndices>& material_texture_indices, std::vector<int>& material_indices, std::vector<int>& texture_per_mesh, std::vector<int>& texture_indices_offsets, int& texture_count)
 {
     std::vector<std::pair<aiTextureType, std::string>> mesh_texture_paths;
@@ -10,12 +10,15 @@
 #include "assimp/scene.h"
 #include "assimp/postprocess.h"
 
+#include "HostDeviceCommon/EmissiveTriangle.h"
 #include "HostDeviceCommon/Material.h"
+#include "HostDeviceCommon/Math.h"
 #include "Image/Image.h"
 #include "Scene/Camera.h"
 #include "Renderer/Sphere.h"
 #include "Renderer/Triangle.h"
 
+#include <map>
 #include <thread>
 #include <vector>
 
@@ -58,6 +61,48 @@ struct SceneParserOptions
     // 16 seemed to be a good arbitrary number to avoid trashing the disks on my setup 
     // (tested on the Amazon Lumberyard Bistro on both HDD and SSD)
     int nb_texture_threads = 16;
+
+    // If true, the geometry of every instance is transformed to world space and
+    // duplicated in the buffers of the scene (Scene::bake_instances()). This is
+    // for renderers that do not support instancing (the GPU renderer at the moment)
+    bool bake_instances = false;
+};
+
+/**
+ * Range of the triangles and vertices of one ASSIMP mesh in the buffers of the scene.
+ *
+ * The vertices of a mesh are stored once, in the object space of the mesh, however
+ * many times the mesh is instanced
+ */
+struct SceneMesh
+{
+    int first_triangle = 0;
+    int triangle_count = 0;
+
+    int first_vertex = 0;
+    int vertex_count = 0;
+};
+
+/**
+ * Meshes that are always instanced together: the meshes of an ASSIMP node
+ * (ASSIMP splits a 3D model into one mesh per material).
+ *
+ * One bottom-level BVH is built per object by the CPU renderer
+ */
+struct SceneObject
+{
+    std::vector<int> mesh_indices;
+};
+
+struct SceneInstance
+{
+    // Normals have to be transformed with the inverse transpose of the transform
+    float4x4 get_normal_transform() const;
+    float4x4 get_inverse_transform() const;
+
+    int object_index = 0;
+    // Object space to world space
+    float4x4 transform = float4x4{ { {1.0f, 0.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 1.0f, 0.0f}, {0.0f, 0.0f, 0.0f, 1.0f } } };
 };
 
 struct Scene
@@ -79,9 +124,31 @@ struct Scene
     std::vector<unsigned char> has_vertex_normals;
     std::vector<float3> vertex_normals;
     std::vector<float2> texcoords;
+    // An emissive triangle appears once per instance of its mesh
     std::vector<int> emissive_triangle_indices;
+    // Index in 'instances' of each triangle of emissive_triangle_indices
+    std::vector<int> emissive_triangle_instances;
+    // World space geometry of each triangle of emissive_triangle_indices and the alias table
+    // to sample them proportionally to their power. Filled by compute_emissive_triangles()
+    std::vector<EmissiveTriangle> emissive_triangles;
+    std::vector<float> emissive_triangles_alias_probabilities;
+    std::vector<int> emissive_triangles_aliases;
+    float emissive_triangles_power_sum = 0.0f;
     std::vector<int> material_indices;
 
+    // TriangleOpacity of each triangle, empty if all the triangles are opaque.
+    // Filled by compute_triangle_opacities() along with the alpha masks
+    std::vector<unsigned char> triangle_opacities;
+    // Alpha masks of the textures used as base color that have transparent texels,
+    // one bit per texel. alpha_mask_offsets has one entry per texture: the index of the
+    // first word of its mask in alpha_mask_bits or -1 if the texture has no mask
+    std::vector<unsigned int> alpha_mask_bits;
+    std::vector<int> alpha_mask_offsets;
+
+    std::vector<SceneMesh> meshes;
+    std::vector<SceneObject> objects;
+    std::vector<SceneInstance> instances;
+
     bool has_camera = false;
     Camera camera;
 
@@ -97,6 +164,42 @@ struct Scene
         return sphere;
     }
 
+    /**
+     * Transforms the geometry of every instance to world space and replaces
+     * the buffers of the scene with it. The scene is left with one object
+     * (all the baked meshes) and a single instance with an identity transform.
+     *
+     * This is what ASSIMP's aiProcess_PreTransformVertices does and this multiplies
+     * the memory used by the geometry by the number of instances
+     */
+    void bake_instances();
+
+    /**
+     * Classifies each triangle as opaque, transparent or partly transparent (masked)
+     * based on the alpha of its base color texture over the UV footprint of the triangle
+     * and builds the 1-bit alpha masks of the base color textures.
+     *
+     * This lets the renderers skip the alpha-transparent hits during the traversal
+     * without sampling the textures. The textures must be loaded
+     */
+    void compute_triangle_opacities();
+
+    /**
+     * Computes the world space geometry of the emissive triangles (in parallel)
+     * and the alias table that the light sampling picks them with
+     */
+    void compute_emissive_triangles();
+
+    /**
+     * Radius of the bounding sphere of the world space bounding box of the scene,
+     * from the bounding boxes of the objects transformed by their instances
+     */
+    float compute_bounding_sphere_radius() const;
+
+    /**
+     * Returns the triangles of the meshes in object space,
+     * one per triangle of 'triangle_indices'
+     */
     std::vector<Triangle> get_triangles()
     {
         std::vector<Triangle> triangles;
@@ -130,6 +233,11 @@ public:
 private:
 
     static void parse_camera(const aiScene* scene, Scene& parsed_scene, float frame_aspect_override);
+    /**
+     * Walks the node hierarchy of the scene and adds one instance per node that
+     * references meshes. Nodes that reference the same meshes share the same object
+     */
+    static void parse_instances(const aiNode* node, const aiMatrix4x4& parent_transform, Scene& parsed_scene, std::map<std::vector<int>, int>& object_indices);
     /** 
      * Prepares all the necessary data for multithreaded texture-loading
      */
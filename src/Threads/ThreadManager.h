@@ -50,7 +50,9 @@ public:
 		auto find = threads_map.find(key);
 		if (find != threads_map.end())
 			for (std::thread& thread : find->second)
-				thread.join();
+				// The threads may already have been joined by a previous call
+				if (thread.joinable())
+					thread.join();
 	}
 
 private:
@@ -194,6 +194,34 @@ void ImGuiRenderer::draw_render_settings_panel()
 		ImGui::TreePop();
 	}
 
+	if (ImGui::CollapsingHeader("Russian roulette"))
+	{
+		ImGui::TreePush("Russian roulette tree");
+
+		if (ImGui::Checkbox("Enable Russian roulette", (bool*)&render_settings.do_russian_roulette))
+			m_render_window->set_render_dirty(true);
+
+		ImGui::BeginDisabled(!render_settings.do_russian_roulette);
+		if (ImGui::InputInt("Russian roulette minimum bounce", &render_settings.russian_roulette_min_bounce))
+		{
+			render_settings.russian_roulette_min_bounce = std::max(0, render_settings.russian_roulette_min_bounce);
+			m_render_window->set_render_dirty(true);
+		}
+		if (ImGui::SliderFloat("Minimum survival probability", &render_settings.russian_roulette_min_survival_probability, 0.01f, 1.0f))
+		{
+			render_settings.russian_roulette_min_survival_probability = std::min(1.0f, std::max(0.01f, render_settings.russian_roulette_min_survival_probability));
+			m_render_window->set_render_dirty(true);
+		}
+		if (ImGui::SliderFloat("Path splitting threshold", &render_settings.russian_roulette_split_threshold, 0.0f, 2.0f))
+		{
+			render_settings.russian_roulette_split_threshold = std::max(0.0f, render_settings.russian_roulette_split_threshold);
+			m_render_window->set_render_dirty(true);
+		}
+		ImGui::EndDisabled();
+
+		ImGui::TreePop();
+	}
+
 	if (ImGui::CollapsingHeader("Nested dielectrics"))
 	{
 		ImGui::TreePush("Nested dielectrics tree");
@@ -288,6 +316,10 @@ void ImGuiRenderer::draw_sampling_panel()
 	{
 		ImGui::TreePush("Sampling tree");
 
+		const char* sampler_items[] = { "- Independent", "- Owen scrambled Sobol", "- Blue noise dithered Sobol" };
+		if (ImGui::Combo("Sampler", &render_settings.sampler_type, sampler_items, IM_ARRAYSIZE(sampler_items)))
+			m_render_window->set_render_dirty(true);
+
 		if (ImGui::CollapsingHeader("Direct lighting"))
 		{
 			ImGui::TreePush("Direct lighting sampling tree");
@@ -300,6 +332,22 @@ void ImGuiRenderer::draw_sampling_panel()
 				m_render_window->set_render_dirty(true);
 			}
 
+			const char* emissive_triangle_items[] = { "- Power (alias table)", "- Light BVH" };
+			if (ImGui::Combo("Emissive triangle sampling", m_renderer->get_kernel_option_pointer(GPUKernelOptions::EMISSIVE_TRIANGLE_SAMPLING_STRATEGY), emissive_triangle_items, IM_ARRAYSIZE(emissive_triangle_items)))
+			{
+				m_renderer->compile_trace_kernel(m_application_settings->kernel_files[m_application_settings->selected_kernel].c_str(), m_application_settings->kernel_functions[m_application_settings->selected_kernel].c_str());
+
+				m_render_window->set_render_dirty(true);
+			}
+
+			const char* light_selection_items[] = { "- Emissive triangles and envmap", "- One of them, by power" };
+			if (ImGui::Combo("Direct light selection", m_renderer->get_kernel_option_pointer(GPUKernelOptions::DIRECT_LIGHT_SELECTION_STRATEGY), light_selection_items, IM_ARRAYSIZE(light_selection_items)))
+			{
+				m_renderer->compile_trace_kernel(m_application_settings->kernel_files[m_application_settings->selected_kernel].c_str(), m_application_settings->kernel_functions[m_application_settings->selected_kernel].c_str());
+
+				m_render_window->set_render_dirty(true);
+			}
+
 			// Display additional widgets to control the parameters of the direct light
 			// sampling strategy chosen (the number of candidates for RIS for example)
 			switch (m_renderer->get_kernel_option_value(GPUKernelOptions::DIRECT_LIGHT_SAMPLING_STRATEGY))
@@ -353,7 +401,7 @@ void ImGuiRenderer::draw_sampling_panel()
 		{
 			ImGui::TreePush("Envmap sampling tree");
 
-			const char* items[] = { "- No envmap sampling", "- Envmap Sampling - Binary Search" };
+			const char* items[] = { "- No envmap sampling", "- Envmap Sampling - Alias Table" };
 			if (ImGui::Combo("Envmap sampling strategy", m_renderer->get_kernel_option_pointer(GPUKernelOptions::ENVMAP_SAMPLING_STRATEGY), items, IM_ARRAYSIZE(items)))
 			{
 				m_renderer->compile_trace_kernel(m_application_settings->kernel_files[m_application_settings->selected_kernel].c_str(), m_application_settings->kernel_functions[m_application_settings->selected_kernel].c_str());
@@ -7,6 +7,7 @@
 #define COMMANDLINE_ARGUMENTS_H
 
 #include <iostream>
+#include <string>
 
 struct CommandLineArguments
 {
@@ -21,6 +22,13 @@ struct CommandLineArguments
                 arguments.skysphere_file_path = string_argv.substr(6);
             else if (string_argv.starts_with("--samples="))
                 arguments.render_samples = std::atoi(string_argv.substr(10).c_str());
+            else if (string_argv.starts_with("--first-sample="))
+            {
+                arguments.first_sample = std::atoi(string_argv.substr(15).c_str());
+                arguments.write_sample_average = true;
+            }
+            else if (string_argv == "--write-sample-average")
+                arguments.write_sample_average = true;
             else if (string_argv.starts_with("--bounces="))
                 arguments.bounces = std::atoi(string_argv.substr(10).c_str());
             else if (string_argv.starts_with("--w="))
@@ -31,6 +39,28 @@ struct CommandLineArguments
                 arguments.render_height = std::atoi(string_argv.substr(4).c_str());
             else if (string_argv.starts_with("--height="))
                 arguments.render_height = std::atoi(string_argv.substr(9).c_str());
+            else if (string_argv.starts_with("--bvh-cache-dir="))
+                arguments.bvh_cache_directory = string_argv.substr(16);
+            else if (string_argv == "--benchmark-bvh-queries")
+                arguments.benchmark_bvh_queries = true;
+            else if (string_argv == "--benchmark-bvh-build")
+                arguments.benchmark_bvh_build = true;
+            else if (string_argv == "--benchmark-bvh-refit")
+                arguments.benchmark_bvh_refit = true;
+            else if (string_argv == "--wavefront")
+                arguments.wavefront = true;
+            else if (string_argv == "--benchmark-wavefront")
+                arguments.benchmark_wavefront = true;
+            else if (string_argv == "--sort-rays")
+                arguments.sort_rays = true;
+            else if (string_argv == "--sort-hits")
+                arguments.sort_hits = true;
+            else if (string_argv == "--benchmark-coherence-sorting")
+                arguments.benchmark_coherence_sorting = true;
+            else if (string_argv == "--benchmark-bsdf-batch")
+                arguments.benchmark_bsdf_batch = true;
+            else if (string_argv == "--benchmark-russian-roulette")
+                arguments.benchmark_russian_roulette = true;
             else
                 //Assuming scene file path
                 arguments.scene_file_path = string_argv;
@@ -49,6 +79,49 @@ struct CommandLineArguments
 
     int render_samples = 64;
     int bounces = 8;
+
+    // CPU rendering only. Index of the first sample rendered in the sequences of the pixels:
+    // renders of the samples [0, N[, [N, 2N[, ... can be merged (see write_sample_average)
+    int first_sample = 0;
+    // CPU rendering only. Writes the average of the samples before tonemapping in
+    // CPU_RT_output_average.pfm (32-bit floats) and the first sample / sample count
+    // in CPU_RT_output_average.txt, for merging renders of different sample ranges.
+    // Implied by --first-sample=
+    bool write_sample_average = false;
+
+    // CPU rendering only. Directory where the BVH of the scenes are cached
+    // between runs. An empty directory ("--bvh-cache-dir=") disables the cache
+    std::string bvh_cache_directory = "BVHCache";
+
+    // CPU rendering only. Compares the throughput of the closest-hit
+    // queries of the camera rays and of the occlusion queries of the shadow rays
+    bool benchmark_bvh_queries = false;
+    // CPU rendering only. Benchmarks the construction of the BVH
+    // of the scene with an increasing number of threads
+    bool benchmark_bvh_build = false;
+    // CPU rendering only. Compares refitting the BVH of the scene
+    // to rebuilding it while the geometry is being deformed
+    bool benchmark_bvh_refit = false;
+
+    // CPU rendering only. Renders with the wavefront path tracer
+    // instead of one path tracing kernel call per pixel
+    bool wavefront = false;
+    // CPU rendering only. Compares the throughput of the
+    // wavefront path tracer to the per-pixel kernel
+    bool benchmark_wavefront = false;
+    // CPU rendering only. Sorts the secondary rays / their hits of
+    // the wavefront path tracer to make them more coherent
+    bool sort_rays = false;
+    bool sort_hits = false;
+    // CPU rendering only. Compares the wavefront path tracer
+    // with and without sorting the secondary rays and hits
+    bool benchmark_coherence_sorting = false;
+    // CPU rendering only. Compares the SIMD batch evaluation
+    // and sampling of the BSDF to the scalar functions
+    bool benchmark_bsdf_batch = false;
+    // CPU rendering only. Compares the efficiency of the Russian
+    // roulette and path splitting to the fixed path depth
+    bool benchmark_russian_roulette = false;
 };
 
 #endif
@@ -0,0 +1,92 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#include "Utils/MemoryMappedFile.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+std::shared_ptr<MemoryMappedFile> MemoryMappedFile::open(const std::string& file_path)
+{
+    std::shared_ptr<MemoryMappedFile> mapped_file(new MemoryMappedFile());
+
+#ifdef _WIN32
+    HANDLE file_handle = CreateFileA(file_path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file_handle == INVALID_HANDLE_VALUE)
+        return nullptr;
+    mapped_file->m_file_handle = file_handle;
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file_handle, &file_size) || file_size.QuadPart == 0)
+        return nullptr;
+
+    HANDLE mapping_handle = CreateFileMappingA(file_handle, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+    if (mapping_handle == nullptr)
+        return nullptr;
+    mapped_file->m_mapping_handle = mapping_handle;
+
+    void* data = MapViewOfFile(mapping_handle, FILE_MAP_COPY, 0, 0, 0);
+    if (data == nullptr)
+        return nullptr;
+
+    mapped_file->m_data = static_cast<unsigned char*>(data);
+    mapped_file->m_size = static_cast<std::size_t>(file_size.QuadPart);
+#else
+    int file_descriptor = ::open(file_path.c_str(), O_RDONLY);
+    if (file_descriptor == -1)
+        return nullptr;
+
+    struct stat file_stats;
+    if (fstat(file_descriptor, &file_stats) == -1 || file_stats.st_size == 0)
+    {
+        close(file_descriptor);
+
+        return nullptr;
+    }
+
+    void* data = mmap(nullptr, file_stats.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file_descriptor, 0);
+    // The mapping stays valid after the file is closed
+    close(file_descriptor);
+    if (data == MAP_FAILED)
+        return nullptr;
+
+    mapped_file->m_data = static_cast<unsigned char*>(data);
+    mapped_file->m_size = file_stats.st_size;
+#endif
+
+    return mapped_file;
+}
+
+MemoryMappedFile::~MemoryMappedFile()
+{
+#ifdef _WIN32
+    if (m_data != nullptr)
+        UnmapViewOfFile(m_data);
+    if (m_mapping_handle != nullptr)
+        CloseHandle(m_mapping_handle);
+    if (m_file_handle != nullptr)
+        CloseHandle(m_file_handle);
+#else
+    if (m_data != nullptr)
+        munmap(m_data, m_size);
+#endif
+}
+
+unsigned char* MemoryMappedFile::data() const
+{
+    return m_data;
+}
+
+std::size_t MemoryMappedFile::size() const
+{
+    return m_size;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright 2024 Tom Clabault. GNU GPL3 license.
+ * GNU GPL3 license copy: https://www.gnu.org/licenses/gpl-3.0.txt
+ */
+
+#ifndef MEMORY_MAPPED_FILE_H
+#define MEMORY_MAPPED_FILE_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+/**
+ * Maps a whole file in memory.
+ *
+ * The mapping is copy-on-write: the mapped memory can be modified (to refit
+ * a BVH loaded from a cache file for example) without the modifications
+ * ever being written back to the file
+ */
+class MemoryMappedFile
+{
+public:
+    /**
+     * Returns nullptr if the file doesn't exist or couldn't be mapped
+     */
+    static std::shared_ptr<MemoryMappedFile> open(const std::string& file_path);
+
+    MemoryMappedFile(const MemoryMappedFile& other) = delete;
+    MemoryMappedFile& operator=(const MemoryMappedFile& other) = delete;
+    ~MemoryMappedFile();
+
+    unsigned char* data() const;
+    std::size_t size() const;
+
+private:
+    MemoryMappedFile() {}
+
+    unsigned char* m_data = nullptr;
+    std::size_t m_size = 0;
+
+#ifdef _WIN32
+    void* m_file_handle = nullptr;
+    void* m_mapping_handle = nullptr;
+#endif
+};
+
+#endif
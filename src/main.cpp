@@ -20,6 +20,8 @@
 #include "stb_image_write.h"
 
 #include <chrono>
+#include <filesystem>
+#include <fstream>
 #include <cmath>
 #include <iostream>
 
@@ -41,6 +43,10 @@ int main(int argc, char* argv[])
 
     options.nb_texture_threads = 16;
     options.override_aspect_ratio = (float)width / height;
+#if GPU_RENDER
+    // The GPU renderer doesn't support instancing yet
+    options.bake_instances = true;
+#endif
     start = std::chrono::high_resolution_clock::now();
     start_full = std::chrono::high_resolution_clock::now();
     SceneParser::parse_scene_file(cmd_arguments.scene_file_path, parsed_scene, options);
@@ -71,16 +77,58 @@ int main(int argc, char* argv[])
     std::cout << "[" << width << "x" << height << "]: " << cmd_arguments.render_samples << " samples ; " << cmd_arguments.bounces << " bounces" << std::endl << std::endl;
 
     CPURenderer cpu_renderer(width, height);
+    if (!cmd_arguments.bvh_cache_directory.empty())
+    {
+        // One cache file per scene file, overwritten if the scene changes
+        std::filesystem::path scene_path(cmd_arguments.scene_file_path);
+        std::filesystem::path cache_path = std::filesystem::path(cmd_arguments.bvh_cache_directory) / (scene_path.stem().string() + ".bvh");
+
+        cpu_renderer.get_bvh_build_options().cache_file_path = cache_path.string();
+    }
     cpu_renderer.set_scene(parsed_scene);
     cpu_renderer.set_envmap(envmap_image);
     cpu_renderer.set_camera(parsed_scene.camera);
     cpu_renderer.get_render_settings().nb_bounces = cmd_arguments.bounces;
-    cpu_renderer.get_render_settings().samples_per_frame = cmd_arguments.render_samples;
+    cpu_renderer.get_render_settings().first_sample_index = cmd_arguments.first_sample;
+    cpu_renderer.get_render_options().max_sample_count = cmd_arguments.render_samples;
+    cpu_renderer.get_render_options().wavefront = cmd_arguments.wavefront;
+    cpu_renderer.get_render_options().wavefront_sorting.sort_rays = cmd_arguments.sort_rays;
+    cpu_renderer.get_render_options().wavefront_sorting.sort_hits = cmd_arguments.sort_hits;
 
     ThreadManager::join_threads(ThreadManager::TEXTURE_THREADS_KEY);
     stop_full = std::chrono::high_resolution_clock::now();
     std::cout << "Full scene & textures parsed in " << std::chrono::duration_cast<std::chrono::milliseconds>(stop_full - start_full).count() << "ms" << std::endl;
+    if (cmd_arguments.benchmark_bvh_build)
+        cpu_renderer.benchmark_bvh_build();
+    if (cmd_arguments.benchmark_bvh_refit)
+        cpu_renderer.benchmark_bvh_refit();
+    if (cmd_arguments.benchmark_wavefront)
+        cpu_renderer.benchmark_wavefront();
+    if (cmd_arguments.benchmark_coherence_sorting)
+        cpu_renderer.benchmark_coherence_sorting();
+    if (cmd_arguments.benchmark_bsdf_batch)
+        cpu_renderer.benchmark_bsdf_batch();
+    if (cmd_arguments.benchmark_russian_roulette)
+        cpu_renderer.benchmark_russian_roulette();
+    if (cmd_arguments.benchmark_bvh_queries)
+        cpu_renderer.benchmark_bvh_queries();
     cpu_renderer.render();
+
+    if (cmd_arguments.write_sample_average)
+    {
+        // Average of the samples before tonemapping, for merging the renders of other sample
+        // ranges: the merged image is the average of the images weighted by their sample count
+        int sample_count = cpu_renderer.get_render_settings().sample_number;
+        Image average_image = cpu_renderer.get_framebuffer();
+        for (ColorRGB& pixel : average_image.data())
+            pixel = pixel / static_cast<float>(sample_count);
+        average_image.write_image_pfm("CPU_RT_output_average.pfm");
+
+        std::ofstream sample_range_file("CPU_RT_output_average.txt");
+        sample_range_file << "first_sample " << cmd_arguments.first_sample << std::endl;
+        sample_range_file << "sample_count " << sample_count << std::endl;
+    }
+
     cpu_renderer.tonemap(2.2f, 1.0f);
 
     Image image_denoised_1 = Utils::OIDN_denoise(cpu_renderer.get_framebuffer(), width, height, 1.0f);